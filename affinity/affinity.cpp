@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+#include "../config/config.h"
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+//读取sysfs中的一个小文件,成功返回true
+static bool read_sysfs( const char* path, char* buf, int len )
+{
+    FILE* fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        return false;
+    }
+    bool ok = fgets( buf, len, fp ) != NULL;
+    fclose( fp );
+    return ok;
+}
+
+bool parse_cpu_list( const char* text, std::vector< int >& cpus )
+{
+    const char* p = text;
+    while( *p && *p != '\n' )
+    {
+        char* end = NULL;
+        long first = strtol( p, &end, 10 );
+        if( end == p || first < 0 )
+        {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if( *p == '-' )
+        {
+            last = strtol( p + 1, &end, 10 );
+            if( end == p + 1 || last < first )
+            {
+                return false;
+            }
+            p = end;
+        }
+        for( long cpu = first; cpu <= last; ++cpu )
+        {
+            cpus.push_back( cpu );
+        }
+        if( *p == ',' )
+        {
+            ++p;
+        }
+        else if( *p && *p != '\n' )
+        {
+            return false;
+        }
+    }
+    return ! cpus.empty();
+}
+
+bool cpu_topology::load()
+{
+    char buf[ 4096 ];
+    m_online.clear();
+    m_node_cpus.clear();
+    m_cpu_node.clear();
+
+    if( ! read_sysfs( "/sys/devices/system/cpu/online", buf, sizeof( buf ) )
+            || ! parse_cpu_list( buf, m_online ) )
+    {
+        //没有sysfs时退化为0~n-1
+        long n = sysconf( _SC_NPROCESSORS_ONLN );
+        for( long i = 0; i < n; ++i )
+        {
+            m_online.push_back( i );
+        }
+    }
+
+    int max_cpu = 0;
+    for( size_t i = 0; i < m_online.size(); ++i )
+    {
+        max_cpu = m_online[ i ] > max_cpu ? m_online[ i ] : max_cpu;
+    }
+    m_cpu_node.assign( max_cpu + 1, -1 );
+
+    //节点编号可能不连续,逐个尝试,直到找到全部在线的CPU
+    bool has_numa = access( "/sys/devices/system/node", F_OK ) == 0;
+    int found = 0;
+    for( int node = 0; has_numa && node < 1024 && found < ( int )m_online.size(); ++node )
+    {
+        char path[ 128 ];
+        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", node );
+        std::vector< int > cpus;
+        if( ! read_sysfs( path, buf, sizeof( buf ) ) )
+        {
+            continue;
+        }
+        parse_cpu_list( buf, cpus );
+
+        std::vector< int > online;
+        for( size_t i = 0; i < cpus.size(); ++i )
+        {
+            if( cpus[ i ] <= max_cpu && m_cpu_node[ cpus[ i ] ] == -1 )
+            {
+                m_cpu_node[ cpus[ i ] ] = node;
+                online.push_back( cpus[ i ] );
+                ++found;
+            }
+        }
+        m_node_cpus.resize( node + 1 );
+        m_node_cpus[ node ] = online;
+    }
+
+    if( m_node_cpus.empty() )
+    {
+        m_node_cpus.push_back( m_online );
+        for( size_t i = 0; i < m_online.size(); ++i )
+        {
+            m_cpu_node[ m_online[ i ] ] = 0;
+        }
+    }
+    return true;
+}
+
+int cpu_topology::node_of( int cpu ) const
+{
+    if( cpu < 0 || cpu >= ( int )m_cpu_node.size() )
+    {
+        return -1;
+    }
+    return m_cpu_node[ cpu ];
+}
+
+bool pin_thread( pthread_t thread, const std::vector< int >& cpus )
+{
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    for( size_t i = 0; i < cpus.size(); ++i )
+    {
+        if( cpus[ i ] >= 0 && cpus[ i ] < CPU_SETSIZE )
+        {
+            CPU_SET( cpus[ i ], &set );
+        }
+    }
+    return pthread_setaffinity_np( thread, sizeof( set ), &set ) == 0;
+}
+
+bool pin_thread( pthread_t thread, int cpu )
+{
+    return pin_thread( thread, std::vector< int >( 1, cpu ) );
+}
+
+bool prefer_node( int node )
+{
+    if( node < 0 || node >= ( int )( sizeof( unsigned long ) * 8 ) )
+    {
+        return false;
+    }
+    unsigned long mask = 1UL << node;
+    return syscall( SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof( mask ) * 8 ) == 0;
+}
+
+int incoming_cpu( int sockfd )
+{
+    int cpu = -1;
+    socklen_t len = sizeof( cpu );
+    if( getsockopt( sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len ) < 0 )
+    {
+        return -1;
+    }
+    return cpu;
+}
+
+bool make_affinity_plan( const config& conf, const cpu_topology& topo, affinity_plan& plan )
+{
+    plan.reactor_cpu = -1;
+    plan.worker_cpus.clear();
+    plan.node = -1;
+    plan.irq_align = false;
+
+    std::string mode = conf.get( "affinity", "off" );
+    if( mode == "off" )
+    {
+        return true;
+    }
+    else if( mode == "manual" )
+    {
+        plan.reactor_cpu = conf.get_int( "reactor_cpu", -1 );
+        const char* workers = conf.get( "worker_cpus" );
+        if( workers && ! parse_cpu_list( workers, plan.worker_cpus ) )
+        {
+            printf( "bad worker_cpus %s\n", workers );
+            return false;
+        }
+        return true;
+    }
+    else if( mode != "auto" )
+    {
+        printf( "bad affinity mode %s, expect off, manual or auto\n", mode.c_str() );
+        return false;
+    }
+
+    int node = conf.get_int( "numa_node", 0 );
+    if( node < 0 || node >= topo.node_count() || topo.cpus_of_node( node ).empty() )
+    {
+        printf( "numa node %d has no online cpu\n", node );
+        return false;
+    }
+    plan_node( topo, node, plan );
+    plan.irq_align = conf.get_bool( "irq_align", false );
+    return true;
+}
+
+void plan_node( const cpu_topology& topo, int node, affinity_plan& plan )
+{
+    const std::vector< int >& cpus = topo.cpus_of_node( node );
+    plan.node = node;
+    plan.reactor_cpu = cpus[ 0 ];
+    //反应堆独占节点上的第一个CPU,工作线程使用其余的CPU;节点上只有一个CPU时共用
+    plan.worker_cpus.assign( cpus.size() > 1 ? cpus.begin() + 1 : cpus.begin(), cpus.end() );
+}
+
+bool irq_aligner::sample( int sockfd, int& node )
+{
+    if( m_done )
+    {
+        return false;
+    }
+    int n = m_topo.node_of( incoming_cpu( sockfd ) );
+    if( n < 0 )
+    {
+        return false;
+    }
+    if( n >= ( int )m_counts.size() )
+    {
+        m_counts.resize( n + 1, 0 );
+    }
+    ++m_counts[ n ];
+    if( ++m_samples < IRQ_SAMPLES )
+    {
+        return false;
+    }
+
+    m_done = true;
+    int best = 0;
+    for( size_t i = 1; i < m_counts.size(); ++i )
+    {
+        best = m_counts[ i ] > m_counts[ best ] ? i : best;
+    }
+    printf( "%d of %d sampled connections arrived on numa node %d\n", m_counts[ best ], m_samples, best );
+    node = best;
+    return true;
+}
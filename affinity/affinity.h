@@ -0,0 +1,81 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <vector>
+
+class config;
+
+//CPU和NUMA拓扑,从/sys/devices/system读取
+class cpu_topology
+{
+public:
+    cpu_topology() {}
+    ~cpu_topology() {}
+
+    //读取在线CPU列表和每个NUMA节点的CPU列表,没有NUMA信息时所有CPU视为节点0
+    bool load();
+
+    int node_count() const { return m_node_cpus.size(); }
+    //cpu所在的NUMA节点,未知时返回-1
+    int node_of( int cpu ) const;
+    const std::vector< int >& cpus_of_node( int node ) const { return m_node_cpus[ node ]; }
+    const std::vector< int >& online() const { return m_online; }
+
+private:
+    std::vector< int > m_online;
+    std::vector< std::vector< int > > m_node_cpus;
+    std::vector< int > m_cpu_node;
+};
+
+//解析形如"0-3,8,10-11"的CPU列表
+bool parse_cpu_list( const char* text, std::vector< int >& cpus );
+
+//把线程绑定到一组CPU上
+bool pin_thread( pthread_t thread, const std::vector< int >& cpus );
+bool pin_thread( pthread_t thread, int cpu );
+
+//把之后分配的内存优先放在node节点上(首次访问时分配物理页)
+bool prefer_node( int node );
+
+//读取socket的SO_INCOMING_CPU,即处理该连接收包软中断的CPU,失败时返回-1
+int incoming_cpu( int sockfd );
+
+//反应堆线程和工作线程的CPU分配方案
+struct affinity_plan
+{
+    //-1表示不绑定
+    int reactor_cpu;
+    //为空表示不绑定,工作线程i绑定到worker_cpus[i % size]
+    std::vector< int > worker_cpus;
+    //auto模式下选定的NUMA节点,连接缓冲区也在这个节点上分配
+    int node;
+    //是否根据SO_INCOMING_CPU把线程迁移到网卡中断所在的节点
+    bool irq_align;
+};
+
+//根据配置生成分配方案:affinity off(默认)|manual|auto
+//。manual使用reactor_cpu和worker_cpus,auto在numa_node节点(默认0)上自动分配
+bool make_affinity_plan( const config& conf, const cpu_topology& topo, affinity_plan& plan );
+//把反应堆和工作线程都放在node节点上
+void plan_node( const cpu_topology& topo, int node, affinity_plan& plan );
+
+//统计最先接受的若干个连接的SO_INCOMING_CPU,找出收包软中断最集中的NUMA节点
+class irq_aligner
+{
+public:
+    static const int IRQ_SAMPLES = 256;
+
+    irq_aligner( const cpu_topology& topo ) : m_topo( topo ), m_samples( 0 ), m_done( false ) {}
+
+    //采样结束时返回true,node为软中断最集中的节点
+    bool sample( int sockfd, int& node );
+
+private:
+    const cpu_topology& m_topo;
+    std::vector< int > m_counts;
+    int m_samples;
+    bool m_done;
+};
+
+#endif
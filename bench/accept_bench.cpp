@@ -0,0 +1,238 @@
+//建立连接的速率测试:若干个线程各自不断地新建连接、发送一个带Connection: close的请求、读到连接关闭,持续指定的时间
+//。输出每秒完成的连接数、从connect到读完响应的p50/p99/最大延迟、失败的连接数(超时或被拒绝)
+//、服务器进程每个连接消耗的CPU时间,以及测试期间内核统计的监听队列溢出次数(/proc/net/netstat中的ListenOverflows和ListenDrops)
+//。监听队列满时内核丢弃SYN,客户端1秒后重传,这类连接表现为1秒以上的延迟
+//用法: accept_bench ip port server_pid [线程数] [秒数] [url]
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include "../metrics/metrics.h"
+#include "bench.h"
+
+//单个连接等待服务器的最长时间(毫秒),超过后计为失败
+static const int CONN_TIMEOUT_MS = 5000;
+
+static sockaddr_in server;
+static char request[ 512 ];
+static int request_len;
+static long long deadline_ns;
+
+struct worker
+{
+    pthread_t tid;
+    long conns;
+    long errors;
+    std::vector< long long > latencies;
+};
+
+//在until_ns之前等待fd上的events,返回false表示超时或出错
+static bool wait_fd( int fd, short events, long long until_ns )
+{
+    while( true )
+    {
+        long long left = ( until_ns - monotonic_ns() ) / 1000000;
+        if( left <= 0 )
+        {
+            return false;
+        }
+        struct pollfd p;
+        p.fd = fd;
+        p.events = events;
+        int n = poll( &p, 1, left );
+        if( n > 0 )
+        {
+            return true;
+        }
+        if( n < 0 && errno != EINTR )
+        {
+            return false;
+        }
+    }
+}
+
+//完成一个连接:非阻塞connect,发送请求,读到服务器关闭连接
+static bool one_conn()
+{
+    long long until = monotonic_ns() + CONN_TIMEOUT_MS * 1000000LL;
+    int fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    bool ok = false;
+    int err = 0;
+    socklen_t len = sizeof( err );
+    if( connect( fd, ( sockaddr* )&server, sizeof( server ) ) < 0 && errno != EINPROGRESS )
+    {
+        close( fd );
+        return false;
+    }
+    if( wait_fd( fd, POLLOUT, until ) && getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) == 0 && err == 0
+        && send( fd, request, request_len, MSG_NOSIGNAL ) == request_len )
+    {
+        char buf[ 4096 ];
+        long got = 0;
+        while( wait_fd( fd, POLLIN, until ) )
+        {
+            ssize_t n = recv( fd, buf, sizeof( buf ), 0 );
+            if( n > 0 )
+            {
+                got += n;
+                continue;
+            }
+            if( n < 0 && ( errno == EAGAIN || errno == EINTR ) )
+            {
+                continue;
+            }
+            //服务器关闭连接(FIN或RST)时已经收到的响应算作成功
+            ok = got > 0 && ( n == 0 || errno == ECONNRESET );
+            break;
+        }
+    }
+    //客户端后关闭,不留下TIME_WAIT,长时间测试不会用完临时端口
+    struct linger lg = { 1, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_LINGER, &lg, sizeof( lg ) );
+    close( fd );
+    return ok;
+}
+
+static void* run( void* arg )
+{
+    worker* w = ( worker* )arg;
+    while( monotonic_ns() < deadline_ns )
+    {
+        long long start = monotonic_ns();
+        if( one_conn() )
+        {
+            w->conns++;
+            w->latencies.push_back( monotonic_ns() - start );
+        }
+        else
+        {
+            w->errors++;
+        }
+    }
+    return NULL;
+}
+
+static long long cpu_ticks( int pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
+    FILE* f = fopen( path, "r" );
+    if( ! f )
+    {
+        return -1;
+    }
+    char line[ 1024 ];
+    long long ticks = -1;
+    if( fgets( line, sizeof( line ), f ) )
+    {
+        char* p = strrchr( line, ')' );
+        unsigned long long utime, stime;
+        if( p && sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime ) == 2 )
+        {
+            ticks = utime + stime;
+        }
+    }
+    fclose( f );
+    return ticks;
+}
+
+//从/proc/net/netstat读取TcpExt中名为name的计数器:第一行是名称,第二行是对应的值
+static long long tcp_ext( const char* name )
+{
+    FILE* f = fopen( "/proc/net/netstat", "r" );
+    if( ! f )
+    {
+        return -1;
+    }
+    char names[ 8192 ], values[ 8192 ];
+    long long ret = -1;
+    while( ret < 0 && fgets( names, sizeof( names ), f ) && fgets( values, sizeof( values ), f ) )
+    {
+        if( strncmp( names, "TcpExt:", 7 ) != 0 )
+        {
+            continue;
+        }
+        char* save_n = NULL;
+        char* save_v = NULL;
+        char* n = strtok_r( names, " \n", &save_n );
+        char* v = strtok_r( values, " \n", &save_v );
+        while( n && v )
+        {
+            if( strcmp( n, name ) == 0 )
+            {
+                ret = atoll( v );
+                break;
+            }
+            n = strtok_r( NULL, " \n", &save_n );
+            v = strtok_r( NULL, " \n", &save_v );
+        }
+    }
+    fclose( f );
+    return ret;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 4 )
+    {
+        printf( "usage: %s ip port server_pid [threads] [seconds] [url]\n", argv[0] );
+        return 1;
+    }
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[1], &server.sin_addr );
+    server.sin_port = htons( atoi( argv[2] ) );
+    int pid = atoi( argv[3] );
+    int threads = argc > 4 ? atoi( argv[4] ) : 64;
+    int seconds = argc > 5 ? atoi( argv[5] ) : 5;
+    const char* url = argc > 6 ? argv[6] : "/index.html";
+    request_len = snprintf( request, sizeof( request ),
+                            "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", url, argv[1] );
+
+    long long overflows = tcp_ext( "ListenOverflows" );
+    long long drops = tcp_ext( "ListenDrops" );
+    long long cpu_start = cpu_ticks( pid );
+    long long start = monotonic_ns();
+    deadline_ns = start + seconds * 1000000000LL;
+    std::vector< worker > workers( threads );
+    for( int i = 0; i < threads; ++i )
+    {
+        workers[i].conns = workers[i].errors = 0;
+        pthread_create( &workers[i].tid, NULL, run, &workers[i] );
+    }
+    long conns = 0, errors = 0;
+    std::vector< long long > latencies;
+    for( int i = 0; i < threads; ++i )
+    {
+        pthread_join( workers[i].tid, NULL );
+        conns += workers[i].conns;
+        errors += workers[i].errors;
+        latencies.insert( latencies.end(), workers[i].latencies.begin(), workers[i].latencies.end() );
+    }
+    double secs = ( monotonic_ns() - start ) / 1e9;
+    long long cpu_end = cpu_ticks( pid );
+    double cpu_us = ( cpu_start >= 0 && cpu_end >= 0 && conns > 0 )
+                    ? ( cpu_end - cpu_start ) * 1e6 / sysconf( _SC_CLK_TCK ) / conns : 0;
+    long long max = latencies.empty() ? 0 : *std::max_element( latencies.begin(), latencies.end() );
+
+    printf( "%8s %10s %10s %10s %10s %12s %8s %10s %10s\n", "threads", "conns/s", "p50_us", "p99_us", "max_us",
+            "cpu_us/conn", "errors", "overflows", "drops" );
+    printf( "%8d %10.0f %10lld %10lld %10lld %12.1f %8ld %10lld %10lld\n", threads, conns / secs,
+            percentile( latencies, 0.5 ) / 1000, percentile( latencies, 0.99 ) / 1000, max / 1000, cpu_us, errors,
+            tcp_ext( "ListenOverflows" ) - overflows, tcp_ext( "ListenDrops" ) - drops );
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+//测试程序共用的工具,只有头文件,每个测试程序仍然可以用一条g++命令单独编译
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "../upload/body.h"
+
+//v中排在p(0~1)处的值,会打乱v的顺序
+static inline long long percentile( std::vector< long long >& v, double p )
+{
+    if( v.empty() )
+    {
+        return 0;
+    }
+    size_t idx = ( size_t )( p * ( v.size() - 1 ) );
+    std::nth_element( v.begin(), v.begin() + idx, v.end() );
+    return v[ idx ];
+}
+
+//读取keep-alive连接上的一个响应,只关心响应何时完整和状态码,响应体直接丢弃。每个响应开始之前调用reset
+//。响应体按Content-Length或chunked(例如目录列表的流式响应)确定边界,两者都没有时为空
+struct response_reader
+{
+    char head[ 2048 ];
+    int head_len;
+    long body_left;//-1表示响应头部还没有读完
+    int status;
+    bool chunked;
+    chunked_decoder chunks;
+
+    void reset()
+    {
+        head_len = 0;
+        body_left = -1;
+        status = 0;
+        chunked = false;
+        chunks.reset();
+    }
+
+    //处理收到的n个字节,used为属于这个响应的字节数,其后的数据属于下一个响应
+    //。返回1表示响应完整,0表示还需要更多数据,-1表示响应有误
+    int feed( char* buf, int n, int* used )
+    {
+        *used = 0;
+        if( body_left < 0 )
+        {
+            int take = std::min( n, ( int )sizeof( head ) - 1 - head_len );
+            memcpy( head + head_len, buf, take );
+            head_len += take;
+            head[ head_len ] = '\0';
+            char* end = strstr( head, "\r\n\r\n" );
+            if( ! end )
+            {
+                *used = take;
+                return head_len >= ( int )sizeof( head ) - 1 ? -1 : 0;
+            }
+            int head_size = end + 4 - head;
+            *used = take - ( head_len - head_size );
+            const char* cl = strcasestr( head, "Content-Length:" );
+            body_left = cl ? atol( cl + 15 ) : 0;
+            status = strncmp( head, "HTTP/", 5 ) == 0 ? atoi( head + 9 ) : 0;
+            chunked = strcasestr( head, "Transfer-Encoding: chunked" ) != NULL;
+        }
+        if( chunked )
+        {
+            //块的内容被原地移动到buf + *used处,调用者不再使用这部分数据
+            int consumed = 0;
+            int out = 0;
+            chunked_decoder::RESULT ret = chunks.decode( buf + *used, n - *used, &consumed, &out );
+            *used += consumed;
+            return ret == chunked_decoder::CHUNK_ERROR ? -1 : ( ret == chunked_decoder::CHUNK_DONE ? 1 : 0 );
+        }
+        long take = std::min( ( long )( n - *used ), body_left );
+        *used += take;
+        body_left -= take;
+        return body_left == 0 ? 1 : 0;
+    }
+};
+
+#endif
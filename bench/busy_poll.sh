@@ -0,0 +1,76 @@
+#!/bin/sh
+# 在回环地址上比较阻塞等待和忙轮询模式:分别启动busy_poll_us为0和BUSY_US的两个服务器
+# ,用tls_bench以少量keep-alive连接一问一答地请求一个小文件,输出p50/p99延迟和每个请求消耗的服务器CPU时间
+# ,再统计两个服务器空闲时每秒消耗的CPU时间。忙轮询的线程(反应堆和自旋的工作线程)应当各占一个CPU
+# ,AFFINITY为manual时反应堆绑定到CPU 0、工作线程绑定到1-WORKERS,tls_bench应运行在其余的CPU上
+#
+# 用法: bench/busy_poll.sh [构建目录]
+# 环境变量:
+#   OUT      工作目录,默认/tmp/busy_poll
+#   PORT     第一个服务器的端口,另一个加1,默认9460
+#   BUSY_US  忙轮询模式的预算(微秒),默认50
+#   WORKERS  工作线程数,默认2
+#   AFFINITY off或manual,默认off
+#   CONNS    并发连接数,默认1
+#   DURATION 每项测试的秒数,默认5
+set -e
+
+SRC=$( cd "$( dirname "$0" )/.." && pwd )
+BUILD=${1:-$SRC/build}
+OUT=${OUT:-/tmp/busy_poll}
+PORT=${PORT:-9460}
+BUSY_US=${BUSY_US:-50}
+WORKERS=${WORKERS:-2}
+AFFINITY=${AFFINITY:-off}
+CONNS=${CONNS:-1}
+DURATION=${DURATION:-5}
+
+mkdir -p "$OUT/www"
+head -c 256 /dev/urandom > "$OUT/www/256.bin"
+head -c 4096 /dev/urandom > "$OUT/www/4k.bin"
+
+write_conf()
+{
+    {
+        printf "root %s\n" "$OUT/www"
+        printf "pool_min_threads %s\npool_max_threads %s\n" "$WORKERS" "$WORKERS"
+        printf "busy_poll_us %s\n" "$2"
+        if [ "$AFFINITY" = manual ]; then
+            printf "affinity manual\nreactor_cpu 0\nworker_cpus 1-%s\n" "$WORKERS"
+        fi
+        printf "location /__metrics handler=metrics\n"
+    } > "$OUT/$1.conf"
+}
+write_conf blocking 0
+write_conf busy "$BUSY_US"
+
+PIDS=
+trap 'kill $PIDS 2> /dev/null || true' EXIT
+start_server()
+{
+    "$BUILD/server" 127.0.0.1 "$1" "$OUT/$2.conf" > "$OUT/$2.log" 2>&1 &
+    PIDS="$PIDS $!"
+    eval "PID_$2=$!"
+}
+start_server "$PORT" blocking
+start_server $(( PORT + 1 )) busy
+sleep 0.5
+
+# 空闲时每秒消耗的CPU时间(毫秒),忙轮询的代价在没有请求时最明显
+idle_cpu_ms()
+{
+    t0=$( awk '{ print $14 + $15 }' "/proc/$1/stat" )
+    sleep 2
+    t1=$( awk '{ print $14 + $15 }' "/proc/$1/stat" )
+    echo $(( ( t1 - t0 ) * 1000 / $( getconf CLK_TCK ) / 2 ))
+}
+
+printf "%-10s %-6s %-20s %10s %10s %10s %10s %12s %8s\n" "server" "proto" "url" "req/s" "MB/s" "p50_us" "p99_us" \
+    "cpu_us/req" "errors"
+for url in /256.bin /4k.bin; do
+    printf "%-10s " blocking
+    "$BUILD/tls_bench" 127.0.0.1 "$PORT" "$PID_blocking" http "$url" "$CONNS" "$DURATION"
+    printf "%-10s " busy
+    "$BUILD/tls_bench" 127.0.0.1 $(( PORT + 1 )) "$PID_busy" http "$url" "$CONNS" "$DURATION"
+done
+printf "idle cpu ms/s: blocking %s, busy %s\n" "$( idle_cpu_ms "$PID_blocking" )" "$( idle_cpu_ms "$PID_busy" )"
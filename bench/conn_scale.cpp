@@ -0,0 +1,327 @@
+//连接规模测试:逐步增加空闲的keep-alive连接,观察服务器内存和活跃请求延迟随连接数的变化
+//。每条空闲连接先完成一个请求(确认已被服务器accept),之后保持空闲;另有一组活跃连接在每个阶段持续地一问一答
+//,记录请求延迟。每个阶段输出服务器的RSS、每条连接平均占用的内存、建立连接的速率和活跃请求的各百分位延迟
+//。单个源地址最多只有约28000个临时端口,空闲连接轮流绑定127.0.1.1、127.0.1.2...等多个回环源地址
+//用法: conn_scale ip port server_pid [最大空闲连接数] [每阶段增加的连接数] [活跃连接数] [url]
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+#include "../metrics/metrics.h"
+#include "bench.h"
+
+//每个源地址分配的连接数,小于默认的临时端口范围(32768~60999)
+static const int CONNS_PER_SOURCE = 20000;
+//一批同时发起的连接数
+static const int BATCH = 500;
+//一批连接等待响应的最长时间
+static const int BATCH_TIMEOUT_MS = 5000;
+//每个阶段测量活跃请求延迟的时长
+static const int MEASURE_MS = 2000;
+
+//一条测试连接,读取响应时只关心响应何时完整,响应体直接丢弃
+struct bench_conn
+{
+    int fd;
+    bool active;
+    bool connected;
+    bool waiting;//已发出请求,尚未收到完整的响应
+    long responses;
+    long long sent_ns;
+    response_reader reader;
+};
+
+static char request[ 512 ];
+static int request_len;
+static std::vector< long long > latencies;
+//空闲连接中完成了第一个请求的数量和失败的数量
+static long established = 0;
+static long failed = 0;
+
+static long rss_kb( int pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/status", pid );
+    FILE* f = fopen( path, "r" );
+    if( ! f )
+    {
+        return -1;
+    }
+    char line[ 256 ];
+    long kb = -1;
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        if( strncmp( line, "VmRSS:", 6 ) == 0 )
+        {
+            kb = atol( line + 6 );
+            break;
+        }
+    }
+    fclose( f );
+    return kb;
+}
+
+static int open_conn( int epollfd, const sockaddr_in& server, int source, bench_conn* c )
+{
+    int fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    //源地址127.0.1.source,端口推迟到connect时按四元组分配
+    sockaddr_in local;
+    memset( &local, 0, sizeof( local ) );
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl( ( 127 << 24 ) | ( 1 << 8 ) | source );
+    int on = 1;
+    setsockopt( fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof( on ) );
+    if( bind( fd, ( sockaddr* )&local, sizeof( local ) ) < 0
+        || ( connect( fd, ( const sockaddr* )&server, sizeof( server ) ) < 0 && errno != EINPROGRESS ) )
+    {
+        close( fd );
+        return -1;
+    }
+
+    c->fd = fd;
+    c->connected = false;
+    c->waiting = false;
+    c->responses = 0;
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    return fd;
+}
+
+static void send_request( bench_conn* c )
+{
+    c->reader.reset();
+    c->sent_ns = monotonic_ns();
+    //请求只有几十个字节,一次就能写进空的发送缓冲区
+    if( send( c->fd, request, request_len, MSG_NOSIGNAL ) == request_len )
+    {
+        c->waiting = true;
+    }
+}
+
+//读取响应,返回1表示响应完整,0表示还需要等待,-1表示连接出错或被关闭
+static int read_response( bench_conn* c )
+{
+    char buf[ 16384 ];
+    while( true )
+    {
+        int n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if( n < 0 )
+        {
+            return ( errno == EAGAIN ) ? 0 : -1;
+        }
+        if( n == 0 )
+        {
+            return -1;
+        }
+
+        int used = 0;
+        int ret = c->reader.feed( buf, n, &used );
+        if( ret < 0 )
+        {
+            return -1;
+        }
+        if( ret == 1 )
+        {
+            c->waiting = false;
+            return 1;
+        }
+    }
+}
+
+static void drop_conn( int epollfd, bench_conn* c )
+{
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, NULL );
+    close( c->fd );
+    c->fd = -1;
+    c->waiting = false;
+}
+
+//处理一轮epoll事件,活跃连接收到响应后立即发出下一个请求
+static void poll_once( int epollfd, int timeout_ms, bool measure )
+{
+    epoll_event events[ 1024 ];
+    int number = epoll_wait( epollfd, events, 1024, timeout_ms );
+    for( int i = 0; i < number; ++i )
+    {
+        bench_conn* c = ( bench_conn* )events[i].data.ptr;
+        if( c->fd < 0 )
+        {
+            continue;
+        }
+        //连接建立完成,发出第一个请求,之后只关心可读事件
+        if( ! c->connected )
+        {
+            c->connected = true;
+            epoll_event event;
+            event.data.ptr = c;
+            event.events = EPOLLIN | EPOLLRDHUP;
+            epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &event );
+            send_request( c );
+            continue;
+        }
+        if( ! ( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) )
+        {
+            continue;
+        }
+        int ret = read_response( c );
+        if( ret < 0 )
+        {
+            //已经建立的空闲连接被服务器关闭
+            if( ! c->active && c->responses > 0 )
+            {
+                established--;
+            }
+            drop_conn( epollfd, c );
+            failed++;
+        }
+        else if( ret > 0 && c->responses++ == 0 && ! c->active )
+        {
+            established++;
+        }
+        else if( ret > 0 && c->active )
+        {
+            if( measure )
+            {
+                latencies.push_back( monotonic_ns() - c->sent_ns );
+            }
+            send_request( c );
+        }
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 4 )
+    {
+        printf( "usage: %s ip port server_pid [max_idle] [step] [active] [url]\n", argv[0] );
+        return 1;
+    }
+    sockaddr_in server;
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[1], &server.sin_addr );
+    server.sin_port = htons( atoi( argv[2] ) );
+    int pid = atoi( argv[3] );
+    int max_idle = argc > 4 ? atoi( argv[4] ) : 100000;
+    int step = argc > 5 ? atoi( argv[5] ) : 10000;
+    int active = argc > 6 ? atoi( argv[6] ) : 32;
+    const char* url = argc > 7 ? argv[7] : "/index.html";
+    request_len = snprintf( request, sizeof( request ),
+                            "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", url, argv[1] );
+
+    //每条连接占用一个文件描述符
+    struct rlimit limit;
+    getrlimit( RLIMIT_NOFILE, &limit );
+    rlim_t want = max_idle + active + 64;
+    if( limit.rlim_cur < want )
+    {
+        limit.rlim_cur = std::min( want, limit.rlim_max );
+        setrlimit( RLIMIT_NOFILE, &limit );
+        if( limit.rlim_cur < want )
+        {
+            printf( "warning: open file limit is %lu, raise it with ulimit -n %lu\n",
+                    ( unsigned long )limit.rlim_cur, ( unsigned long )want );
+        }
+    }
+
+    int epollfd = epoll_create( 5 );
+    //值初始化,所有成员为0
+    std::vector< bench_conn > conns( max_idle + active );
+
+    long base_rss = rss_kb( pid );
+    if( base_rss < 0 )
+    {
+        printf( "cannot read /proc/%d/status\n", pid );
+        return 1;
+    }
+
+    //活跃连接使用127.0.1.1
+    for( int i = 0; i < active; ++i )
+    {
+        conns[ max_idle + i ].active = true;
+        if( open_conn( epollfd, server, 1, &conns[ max_idle + i ] ) < 0 )
+        {
+            printf( "cannot open active connection: %s\n", strerror( errno ) );
+            return 1;
+        }
+    }
+
+    printf( "%10s %10s %10s %12s %8s %10s %10s %10s %8s\n", "idle", "rss_mb", "kb/conn", "conn/s", "failed",
+            "p50_us", "p99_us", "max_us", "req/s" );
+    int opened = 0;
+    for( int target = 0; target <= max_idle; target += step )
+    {
+        //分批建立空闲连接,每批等待所有连接完成第一个请求或超时
+        long long open_start = monotonic_ns();
+        int opened_before = opened;
+        long failed_before = failed;
+        while( opened < target )
+        {
+            int batch = std::min( BATCH, target - opened );
+            long done_before = established;
+            int started = 0;
+            for( int i = 0; i < batch; ++i )
+            {
+                bench_conn* c = &conns[ opened + i ];
+                if( open_conn( epollfd, server, 1 + ( opened + i ) / CONNS_PER_SOURCE, c ) >= 0 )
+                {
+                    started++;
+                }
+                else
+                {
+                    c->fd = -1;
+                    failed++;
+                }
+            }
+            long long deadline = monotonic_ns() + BATCH_TIMEOUT_MS * 1000000LL;
+            while( established - done_before < started && monotonic_ns() < deadline )
+            {
+                poll_once( epollfd, 10, false );
+            }
+            //超时仍未完成的连接视为失败
+            for( int i = 0; i < batch; ++i )
+            {
+                bench_conn* c = &conns[ opened + i ];
+                if( c->fd >= 0 && c->responses == 0 )
+                {
+                    drop_conn( epollfd, c );
+                    failed++;
+                }
+            }
+            opened += batch;
+        }
+        double open_secs = ( monotonic_ns() - open_start ) / 1e9;
+
+        //测量活跃连接的请求延迟
+        latencies.clear();
+        long long measure_end = monotonic_ns() + MEASURE_MS * 1000000LL;
+        while( monotonic_ns() < measure_end )
+        {
+            poll_once( epollfd, 10, true );
+        }
+
+        long rss = rss_kb( pid );
+        printf( "%10ld %10.1f %10.2f %12.0f %8ld %10lld %10lld %10lld %8.0f\n", established, rss / 1024.0,
+                established > 0 ? ( double )( rss - base_rss ) / established : 0.0,
+                opened > opened_before ? ( opened - opened_before ) / open_secs : 0.0, failed - failed_before,
+                percentile( latencies, 0.5 ) / 1000, percentile( latencies, 0.99 ) / 1000,
+                percentile( latencies, 1.0 ) / 1000, latencies.size() * 1000.0 / MEASURE_MS );
+        fflush( stdout );
+    }
+    return 0;
+}
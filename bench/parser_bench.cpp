@@ -0,0 +1,190 @@
+//HTTP解析和响应生成的微基准测试:不经过socket,直接把内存中的请求交给http_conn的状态机
+//,每个完整的请求再生成一个404响应(状态行、头部和消息体),测量每个请求的耗时和每个时钟周期处理的字节数
+//。语料:
+//  minimal    只有请求行和Host头部的最小请求
+//  browser    带有浏览器常见头部的请求
+//  split      browser请求逐字节地分多次到达
+//  pipelined  16个minimal请求在一次读取中到达
+//用法: parser_bench [重复次数] [每次重复的最短时间(毫秒)] [语料名]
+//。每个语料先预热一次,再重复测量若干次,输出最快一次和中位数;解析过程中的调试输出被重定向到/dev/null
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../http_conn/http_conn.h"
+#include "../metrics/metrics.h"
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#endif
+
+//时间戳计数器,在恒定频率TSC的处理器上按标称频率计数,非x86平台上以纳秒代替
+static inline unsigned long long cycles()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
+static const char* MINIMAL = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static const char* BROWSER =
+    "GET /images/logo.png?v=20231012 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+    "\r\n";
+
+static const int PIPELINE_DEPTH = 16;
+
+//一个语料:data按chunk字节一段地交给parse,其中包含requests个完整的请求
+struct corpus
+{
+    const char* name;
+    std::string data;
+    int chunk;
+    int requests;
+};
+
+static http_conn conn;
+
+//处理一遍语料,返回false表示解析结果和预期不符
+static bool run_once( const corpus& c )
+{
+    int done = 0;
+    const char* p = c.data.data();
+    const char* end = p + c.data.size();
+    while( p < end )
+    {
+        int len = std::min( ( long )c.chunk, ( long )( end - p ) );
+        http_conn::HTTP_CODE ret = conn.parse( p, len );
+        p += len;
+        //一次读取中可能有多个完整的请求
+        while( ret == http_conn::GET_REQUEST )
+        {
+            if( conn.build_response( http_conn::NO_RESOURCE ) < 0 )
+            {
+                return false;
+            }
+            done++;
+            conn.next_request();
+            ret = conn.parse( p, 0 );
+        }
+        if( ret != http_conn::NO_REQUEST )
+        {
+            return false;
+        }
+    }
+    return done == c.requests;
+}
+
+struct sample
+{
+    double ns_per_request;
+    double bytes_per_cycle;
+};
+
+static bool by_speed( const sample& a, const sample& b )
+{
+    return a.ns_per_request < b.ns_per_request;
+}
+
+int main( int argc, char* argv[] )
+{
+    int reps = argc > 1 ? atoi( argv[1] ) : 7;
+    int min_ms = argc > 2 ? atoi( argv[2] ) : 200;
+    const char* only = argc > 3 ? argv[3] : NULL;
+
+    std::vector< corpus > corpora;
+    corpus minimal = { "minimal", MINIMAL, ( int )strlen( MINIMAL ), 1 };
+    corpus browser = { "browser", BROWSER, ( int )strlen( BROWSER ), 1 };
+    corpus split = { "split", BROWSER, 1, 1 };
+    corpus pipelined = { "pipelined", "", 0, PIPELINE_DEPTH };
+    for( int i = 0; i < PIPELINE_DEPTH; ++i )
+    {
+        pipelined.data += MINIMAL;
+    }
+    pipelined.chunk = pipelined.data.size();
+    corpora.push_back( minimal );
+    corpora.push_back( browser );
+    corpora.push_back( split );
+    corpora.push_back( pipelined );
+
+    //http_conn的解析过程会打印每一行,测量期间把标准输出重定向到/dev/null
+    fflush( stdout );
+    int saved_stdout = dup( STDOUT_FILENO );
+    int devnull = open( "/dev/null", O_WRONLY );
+
+    printf( "%-10s %8s %10s %12s %12s %10s\n", "corpus", "bytes", "iters", "ns/req(min)", "ns/req(med)", "bytes/cyc" );
+    for( size_t i = 0; i < corpora.size(); ++i )
+    {
+        const corpus& c = corpora[i];
+        if( only && strcmp( only, c.name ) != 0 )
+        {
+            continue;
+        }
+        fflush( stdout );
+        dup2( devnull, STDOUT_FILENO );
+        conn.next_request();
+
+        //预热,同时按最短时间估算每次重复的迭代次数
+        bool ok = run_once( c );
+        long iters = 1;
+        long long start = monotonic_ns();
+        while( ok && monotonic_ns() - start < min_ms * 1000000LL / 4 )
+        {
+            ok = run_once( c );
+            iters++;
+        }
+        iters *= 4;
+
+        std::vector< sample > samples;
+        for( int r = 0; ok && r < reps; ++r )
+        {
+            long long t0 = monotonic_ns();
+            unsigned long long c0 = cycles();
+            for( long n = 0; n < iters && ok; ++n )
+            {
+                ok = run_once( c );
+            }
+            unsigned long long c1 = cycles();
+            long long t1 = monotonic_ns();
+            sample s;
+            s.ns_per_request = ( double )( t1 - t0 ) / ( iters * c.requests );
+            s.bytes_per_cycle = ( double )c.data.size() * iters / ( c1 - c0 );
+            samples.push_back( s );
+        }
+
+        fflush( stdout );
+        dup2( saved_stdout, STDOUT_FILENO );
+        if( ! ok || samples.empty() )
+        {
+            printf( "%-10s parse result mismatch\n", c.name );
+            return 1;
+        }
+        std::sort( samples.begin(), samples.end(), by_speed );
+        const sample& best = samples.front();
+        const sample& median = samples[ samples.size() / 2 ];
+        printf( "%-10s %8zu %10ld %12.1f %12.1f %10.3f\n", c.name, c.data.size(), iters,
+                best.ns_per_request, median.ns_per_request, best.bytes_per_cycle );
+    }
+    close( devnull );
+    close( saved_stdout );
+    return 0;
+}
@@ -0,0 +1,151 @@
+#!/bin/sh
+# PGO+LTO构建流程:编译插桩版本的服务器,用conn_scale(和可选的抓包重放)在回环地址上施加训练负载
+# ,合并profile后以PGO+LTO重新编译,可选地再用llvm-bolt做链接后优化,最后与普通-O2版本比较吞吐量和延迟
+#
+# 用法: bench/pgo.sh
+# 环境变量:
+#   OUT      输出目录,默认为源码目录下的build-pgo
+#   CXX      编译器,g++或clang++,默认由CMake选择
+#   PORT     测试端口,默认9180
+#   CAPTURE  抓包文件,训练时额外以2倍速重放一遍
+#   BOLT     为1时额外生成BOLT优化的版本,需要llvm-bolt
+#   RUNS     比较时每个版本的测量次数,取中位数,默认5
+set -e
+
+SRC=$( cd "$( dirname "$0" )/.." && pwd )
+OUT=${OUT:-$SRC/build-pgo}
+PORT=${PORT:-9180}
+BOLT=${BOLT:-0}
+RUNS=${RUNS:-5}
+PROFILE=$OUT/profile
+REPORT=$OUT/report.txt
+
+CMAKE_ARGS="-DCMAKE_BUILD_TYPE=RelWithDebInfo"
+if [ -n "$CXX" ]; then
+    CMAKE_ARGS="$CMAKE_ARGS -DCMAKE_CXX_COMPILER=$CXX"
+fi
+if ${CXX:-c++} --version | grep -q clang; then
+    CLANG=1
+else
+    CLANG=0
+fi
+
+# 编译一个版本: build <目录> <CMake参数...>
+build()
+{
+    dir=$1
+    shift
+    cmake -S "$SRC" -B "$dir" $CMAKE_ARGS -DWEBSERVER_PGO_DIR="$PROFILE" "$@" > "$dir.log"
+    cmake --build "$dir" --target server -j "$( nproc )" >> "$dir.log"
+}
+
+# 网站根目录:首页、几个不同大小的文件
+mkdir -p "$OUT/www/static"
+echo '<html><body>index</body></html>' > "$OUT/www/index.html"
+head -c 4096 /dev/urandom > "$OUT/www/static/4k.bin"
+head -c 65536 /dev/urandom > "$OUT/www/static/64k.bin"
+head -c 1048576 /dev/urandom > "$OUT/www/static/1m.bin"
+cat > "$OUT/server.conf" << EOF
+root $OUT/www
+location /__metrics handler=metrics
+EOF
+
+SERVER_PID=
+start_server()
+{
+    "$1" 127.0.0.1 "$PORT" "$OUT/server.conf" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+}
+
+# SIGTERM让服务器正常退出,插桩版本在退出时写出profile
+stop_server()
+{
+    kill -TERM "$SERVER_PID"
+    wait "$SERVER_PID" || true
+}
+
+trap 'if [ -n "$SERVER_PID" ]; then kill -9 "$SERVER_PID" 2> /dev/null || true; fi' EXIT
+
+# 训练负载:不同大小的文件、404、keep-alive的活跃连接和一批空闲连接
+train()
+{
+    start_server "$1"
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 32 /index.html > /dev/null
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 8 /static/4k.bin > /dev/null
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 8 /static/64k.bin > /dev/null
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 4 /static/1m.bin > /dev/null
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 8 /missing.html > /dev/null
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 2000 1000 16 /index.html > /dev/null
+    if [ -n "$CAPTURE" ]; then
+        "$OUT/bench/replay" 127.0.0.1 "$PORT" "$CAPTURE" 2 > /dev/null
+    fi
+    stop_server
+}
+
+# 文件中第$1列的中位数
+median()
+{
+    awk -v col="$1" '{ print $col }' "$2" | sort -n | awk '{ v[NR] = $1 } END { print v[int( ( NR + 1 ) / 2 )] }'
+}
+
+# 测量一个版本RUNS次,输出req/s、p50和p99的中位数
+measure()
+{
+    start_server "$2"
+    "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 32 /index.html > /dev/null
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        "$OUT/bench/conn_scale" 127.0.0.1 "$PORT" "$SERVER_PID" 0 1 32 /index.html | tail -1
+        i=$(( i + 1 ))
+    done > "$OUT/$1.runs"
+    stop_server
+    # conn_scale的列: idle rss_mb kb/conn conn/s failed p50_us p99_us max_us req/s
+    printf "%-10s %10s %10s %10s\n" "$1" "$( median 9 "$OUT/$1.runs" )" "$( median 6 "$OUT/$1.runs" )" \
+        "$( median 7 "$OUT/$1.runs" )" >> "$REPORT"
+}
+
+rm -rf "$PROFILE"
+mkdir -p "$PROFILE"
+
+echo "building load generator"
+cmake -S "$SRC" -B "$OUT/bench" $CMAKE_ARGS > "$OUT/bench.log"
+cmake --build "$OUT/bench" --target conn_scale replay -j "$( nproc )" >> "$OUT/bench.log"
+
+echo "building plain -O2 server"
+build "$OUT/plain"
+
+echo "building instrumented server"
+build "$OUT/instr" -DWEBSERVER_PGO=GENERATE
+
+echo "training"
+train "$OUT/instr/server"
+if [ "$CLANG" = 1 ]; then
+    llvm-profdata merge -o "$PROFILE/merged.profdata" "$PROFILE"/*.profraw
+fi
+
+echo "building PGO+LTO server"
+if [ "$BOLT" = 1 ]; then
+    build "$OUT/pgo" -DWEBSERVER_PGO=USE -DWEBSERVER_LTO=ON -DWEBSERVER_BOLT=ON
+else
+    build "$OUT/pgo" -DWEBSERVER_PGO=USE -DWEBSERVER_LTO=ON
+fi
+
+if [ "$BOLT" = 1 ]; then
+    echo "building BOLT server"
+    llvm-bolt "$OUT/pgo/server" -instrument -instrumentation-file="$PROFILE/bolt.fdata" \
+        -o "$OUT/pgo/server.bolt-instr" > "$OUT/bolt.log" 2>&1
+    train "$OUT/pgo/server.bolt-instr"
+    llvm-bolt "$OUT/pgo/server" -o "$OUT/pgo/server.bolt" -data="$PROFILE/bolt.fdata" \
+        -reorder-blocks=ext-tsp -reorder-functions=hfsort -split-functions -split-all-cold \
+        -icf=1 -dyno-stats >> "$OUT/bolt.log" 2>&1
+fi
+
+echo "comparing"
+printf "%-10s %10s %10s %10s\n" "build" "req/s" "p50_us" "p99_us" > "$REPORT"
+measure plain "$OUT/plain/server"
+measure pgo-lto "$OUT/pgo/server"
+if [ "$BOLT" = 1 ]; then
+    measure bolt "$OUT/pgo/server.bolt"
+fi
+cat "$REPORT"
@@ -0,0 +1,490 @@
+//抓包重放:按服务器capture指令记录的抓包文件,以原来的节奏(或按倍速)把请求重新发送给服务器
+//。每条抓到的连接对应一条重放连接,连接内的数据按原来的顺序、原来的间隔发送;同一连接上一个请求的响应
+//还没有收完时,下一个请求推迟到响应收完后再发送(服务器不支持流水线),推迟的次数和时长会单独统计
+//。延迟从请求的最后一个字节发出开始计算,到响应的最后一个字节收到为止,按URL的类别分别输出各百分位延迟
+//用法: replay ip port capture_file [倍速] [ext|prefix]
+//  倍速为2表示以两倍的速度重放,类别ext按扩展名分类,prefix按URL的第一级目录分类
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "../capture/capture.h"
+#include "../metrics/metrics.h"
+#include "bench.h"
+
+//最后一条记录之后等待未完成响应的最长时间
+static const long long FINISH_TIMEOUT_NS = 10000000000LL;
+
+//一段待发送的数据,due_ns为按抓包时间换算出的发送时间
+struct chunk
+{
+    long long due_ns;
+    const char* data;
+    int len;
+};
+
+//一个已经完整发出、正在等待响应的请求
+struct pending_request
+{
+    long long sent_ns;
+    std::string url_class;
+};
+
+struct replay_conn
+{
+    int fd;
+    bool connected;
+    bool closing;//抓包中该连接已经关闭,发送完剩余数据并收完响应后关闭
+    bool done;
+    std::deque< chunk > queue;
+    std::deque< pending_request > pending;
+    //正在发送的请求的头部,用于识别请求边界和URL
+    std::string request_head;
+    long body_skip;//正在发送的请求还剩多少字节的消息体
+    //正在发送的请求的消息体是chunked编码的,由request_chunks找到它的结尾
+    bool body_chunked;
+    chunked_decoder request_chunks;
+    //正在接收的响应
+    response_reader reader;
+};
+
+struct class_stats
+{
+    std::vector< long long > latencies;
+    long errors;
+    class_stats() : errors( 0 ) {}
+};
+
+static std::map< std::string, class_stats > stats;
+static bool by_prefix = false;
+static long delayed = 0;
+static long long delayed_ns = 0;
+static long dropped = 0;
+static long unfinished = 0;
+static int live = 0;
+
+static std::string url_class( const std::string& url )
+{
+    std::string path = url.substr( 0, url.find_first_of( "?#" ) );
+    if( by_prefix )
+    {
+        size_t slash = path.find( '/', 1 );
+        return slash == std::string::npos ? "/" : path.substr( 0, slash + 1 );
+    }
+    size_t last = path.rfind( '/' );
+    size_t dot = path.rfind( '.' );
+    if( dot == std::string::npos || ( last != std::string::npos && dot < last ) )
+    {
+        return path.empty() || path[ path.size() - 1 ] == '/' ? "/" : "(none)";
+    }
+    return path.substr( dot );
+}
+
+static void finish_conn( int epollfd, replay_conn* c )
+{
+    if( c->fd >= 0 )
+    {
+        epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, NULL );
+        close( c->fd );
+        c->fd = -1;
+        live--;
+    }
+    //连接被关闭时还没有收到响应的请求和还没有发出的数据
+    for( size_t i = 0; i < c->pending.size(); ++i )
+    {
+        stats[ c->pending[i].url_class ].errors++;
+    }
+    dropped += c->queue.size();
+    c->pending.clear();
+    c->queue.clear();
+    c->done = true;
+}
+
+static bool open_conn( int epollfd, const sockaddr_in& server, replay_conn* c )
+{
+    c->fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if( c->fd < 0 )
+    {
+        return false;
+    }
+    if( connect( c->fd, ( const sockaddr* )&server, sizeof( server ) ) < 0 && errno != EINPROGRESS )
+    {
+        close( c->fd );
+        c->fd = -1;
+        return false;
+    }
+    live++;
+    c->reader.reset();
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, c->fd, &event );
+    return true;
+}
+
+//记录发出的字节,每遇到一个完整的请求头部(以及其消息体)就登记一个等待响应的请求
+static void track_sent( replay_conn* c, const char* data, int len, long long now )
+{
+    for( int i = 0; i < len; ++i )
+    {
+        if( c->body_chunked )
+        {
+            //decode会改写输入,逐字节复制出来
+            char ch = data[i];
+            int consumed = 0;
+            int out = 0;
+            if( c->request_chunks.decode( &ch, 1, &consumed, &out ) != chunked_decoder::CHUNK_MORE )
+            {
+                c->body_chunked = false;
+                pending_request r = { now, url_class( c->request_head ) };
+                c->pending.push_back( r );
+                c->request_head.clear();
+            }
+            continue;
+        }
+        if( c->body_skip > 0 )
+        {
+            c->body_skip--;
+            if( c->body_skip == 0 )
+            {
+                pending_request r = { now, url_class( c->request_head ) };
+                c->pending.push_back( r );
+                c->request_head.clear();
+            }
+            continue;
+        }
+        c->request_head += data[i];
+        size_t n = c->request_head.size();
+        if( n < 4 || c->request_head.compare( n - 4, 4, "\r\n\r\n" ) != 0 )
+        {
+            continue;
+        }
+
+        //头部结束,request_head替换为URL
+        std::string& h = c->request_head;
+        size_t sp = h.find( ' ' );
+        size_t sp2 = sp == std::string::npos ? sp : h.find( ' ', sp + 1 );
+        std::string url = sp2 == std::string::npos ? "" : h.substr( sp + 1, sp2 - sp - 1 );
+        long body = 0;
+        bool chunked = false;
+        for( size_t pos = h.find( "\r\n" ); pos != std::string::npos; pos = h.find( "\r\n", pos + 2 ) )
+        {
+            if( strncasecmp( h.c_str() + pos + 2, "Content-Length:", 15 ) == 0 )
+            {
+                body = atol( h.c_str() + pos + 17 );
+            }
+            else if( strncasecmp( h.c_str() + pos + 2, "Transfer-Encoding: chunked", 26 ) == 0 )
+            {
+                chunked = true;
+            }
+        }
+        h = url;
+        //和服务器一样,chunked优先于Content-Length
+        if( chunked )
+        {
+            c->body_chunked = true;
+            c->request_chunks.reset();
+        }
+        else if( body > 0 )
+        {
+            c->body_skip = body;
+        }
+        else
+        {
+            pending_request r = { now, url_class( url ) };
+            c->pending.push_back( r );
+            h.clear();
+        }
+    }
+}
+
+//发送已经到期的数据,上一个请求的响应还没有收完时等待
+static void try_send( int epollfd, replay_conn* c, long long now )
+{
+    while( c->fd >= 0 && c->connected && ! c->queue.empty() && c->pending.empty() && c->queue.front().due_ns <= now )
+    {
+        chunk& ch = c->queue.front();
+        int n = send( c->fd, ch.data, ch.len, MSG_NOSIGNAL );
+        if( n < 0 )
+        {
+            if( errno == EAGAIN )
+            {
+                epoll_event event;
+                event.data.ptr = c;
+                event.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+                epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &event );
+                return;
+            }
+            finish_conn( epollfd, c );
+            return;
+        }
+        //因为等待前一个响应而晚于计划发送
+        if( now - ch.due_ns > 1000000 )
+        {
+            delayed++;
+            delayed_ns += now - ch.due_ns;
+        }
+        track_sent( c, ch.data, n, now );
+        ch.data += n;
+        ch.len -= n;
+        //只发出一部分时,剩余部分视为立即到期
+        ch.due_ns = now;
+        if( ch.len == 0 )
+        {
+            c->queue.pop_front();
+        }
+    }
+    if( c->fd >= 0 && c->closing && c->queue.empty() && c->pending.empty() )
+    {
+        finish_conn( epollfd, c );
+    }
+}
+
+//读取响应,每收完一个响应就结算最早的一个等待中的请求,返回false表示连接已关闭
+static bool read_responses( replay_conn* c, long long now )
+{
+    char buf[ 16384 ];
+    while( true )
+    {
+        int n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if( n < 0 )
+        {
+            return errno == EAGAIN;
+        }
+        if( n == 0 )
+        {
+            return false;
+        }
+
+        int used = 0;
+        while( used < n )
+        {
+            int took = 0;
+            int ret = c->reader.feed( buf + used, n - used, &took );
+            used += took;
+            if( ret < 0 )
+            {
+                return false;
+            }
+            if( ret == 1 )
+            {
+                if( ! c->pending.empty() )
+                {
+                    class_stats& s = stats[ c->pending.front().url_class ];
+                    s.latencies.push_back( now - c->pending.front().sent_ns );
+                    if( c->reader.status < 200 || c->reader.status >= 400 )
+                    {
+                        s.errors++;
+                    }
+                    c->pending.pop_front();
+                }
+                c->reader.reset();
+            }
+        }
+    }
+}
+
+static void print_row( const char* name, class_stats& s )
+{
+    printf( "%-16s %8zu %7ld %10lld %10lld %10lld %10lld\n", name, s.latencies.size(), s.errors,
+            percentile( s.latencies, 0.5 ) / 1000, percentile( s.latencies, 0.9 ) / 1000,
+            percentile( s.latencies, 0.99 ) / 1000, percentile( s.latencies, 1.0 ) / 1000 );
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 4 )
+    {
+        printf( "usage: %s ip port capture_file [speed] [ext|prefix]\n", argv[0] );
+        return 1;
+    }
+    sockaddr_in server;
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[1], &server.sin_addr );
+    server.sin_port = htons( atoi( argv[2] ) );
+    double speed = argc > 4 ? atof( argv[4] ) : 1.0;
+    by_prefix = argc > 5 && strcmp( argv[5], "prefix" ) == 0;
+    if( speed <= 0 )
+    {
+        printf( "speed must be positive\n" );
+        return 1;
+    }
+
+    //整个抓包文件读入内存,待发送的数据直接指向其中
+    int fd = open( argv[3], O_RDONLY );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        printf( "cannot open %s\n", argv[3] );
+        return 1;
+    }
+    std::vector< char > file( st.st_size );
+    long got = 0;
+    while( got < st.st_size )
+    {
+        int n = read( fd, &file[ got ], st.st_size - got );
+        if( n <= 0 )
+        {
+            break;
+        }
+        got += n;
+    }
+    close( fd );
+    if( got < ( long )sizeof( capture_header ) || memcmp( &file[0], CAPTURE_MAGIC, sizeof( CAPTURE_MAGIC ) ) != 0 )
+    {
+        printf( "%s is not a capture file\n", argv[3] );
+        return 1;
+    }
+
+    //解析所有记录,不完整的最后一条记录被忽略
+    std::vector< const capture_record* > records;
+    std::map< uint32_t, replay_conn* > conns;
+    long pos = sizeof( capture_header );
+    while( pos + ( long )sizeof( capture_record ) <= got )
+    {
+        const capture_record* r = ( const capture_record* )&file[ pos ];
+        if( pos + ( long )sizeof( capture_record ) + r->len > got )
+        {
+            break;
+        }
+        records.push_back( r );
+        if( conns.find( r->conn_id ) == conns.end() )
+        {
+            replay_conn* c = new replay_conn;
+            c->fd = -1;
+            c->connected = c->closing = c->done = false;
+            c->body_skip = 0;
+            c->body_chunked = false;
+            conns[ r->conn_id ] = c;
+        }
+        pos += sizeof( capture_record ) + r->len;
+    }
+    printf( "%zu records on %zu connections, replay at %.2fx\n", records.size(), conns.size(), speed );
+
+    int epollfd = epoll_create( 5 );
+    epoll_event events[ 1024 ];
+    long long start = monotonic_ns();
+    size_t next = 0;
+    long long finish_deadline = 0;
+    while( true )
+    {
+        long long now = monotonic_ns();
+        //分发所有已经到期的记录
+        while( next < records.size() && start + ( long long )( records[ next ]->offset_ns / speed ) <= now )
+        {
+            const capture_record* r = records[ next++ ];
+            replay_conn* c = conns[ r->conn_id ];
+            if( c->done )
+            {
+                continue;
+            }
+            if( c->fd < 0 && ! open_conn( epollfd, server, c ) )
+            {
+                printf( "connect failed: %s\n", strerror( errno ) );
+                c->done = true;
+                continue;
+            }
+            if( r->type == CAPTURE_CLOSE )
+            {
+                c->closing = true;
+            }
+            else
+            {
+                chunk ch = { start + ( long long )( r->offset_ns / speed ), ( const char* )( r + 1 ), ( int )r->len };
+                c->queue.push_back( ch );
+            }
+            try_send( epollfd, c, now );
+        }
+
+        if( next == records.size() )
+        {
+            if( finish_deadline == 0 )
+            {
+                finish_deadline = now + FINISH_TIMEOUT_NS;
+            }
+            //抓包结束时仍然打开的连接,收完响应即可结束
+            bool busy = false;
+            for( std::map< uint32_t, replay_conn* >::iterator it = conns.begin(); it != conns.end(); ++it )
+            {
+                replay_conn* c = it->second;
+                if( ! c->done && ( ! c->queue.empty() || ! c->pending.empty() ) )
+                {
+                    busy = true;
+                    break;
+                }
+            }
+            if( ! busy || now >= finish_deadline )
+            {
+                break;
+            }
+        }
+
+        int timeout = 10;
+        if( next < records.size() )
+        {
+            long long wait = start + ( long long )( records[ next ]->offset_ns / speed ) - now;
+            timeout = ( int )std::max( 0LL, std::min( wait / 1000000, 10LL ) );
+        }
+        int number = epoll_wait( epollfd, events, 1024, timeout );
+        now = monotonic_ns();
+        for( int i = 0; i < number; ++i )
+        {
+            replay_conn* c = ( replay_conn* )events[i].data.ptr;
+            if( c->fd < 0 )
+            {
+                continue;
+            }
+            if( events[i].events & EPOLLOUT )
+            {
+                c->connected = true;
+                epoll_event event;
+                event.data.ptr = c;
+                event.events = EPOLLIN | EPOLLRDHUP;
+                epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &event );
+            }
+            if( ( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) && ! read_responses( c, now ) )
+            {
+                finish_conn( epollfd, c );
+                continue;
+            }
+            try_send( epollfd, c, now );
+        }
+    }
+    double secs = ( monotonic_ns() - start ) / 1e9;
+
+    for( std::map< uint32_t, replay_conn* >::iterator it = conns.begin(); it != conns.end(); ++it )
+    {
+        if( ! it->second->pending.empty() )
+        {
+            unfinished += it->second->pending.size();
+        }
+        finish_conn( epollfd, it->second );
+        delete it->second;
+    }
+
+    printf( "%-16s %8s %7s %10s %10s %10s %10s\n", "class", "requests", "errors", "p50_us", "p90_us", "p99_us", "max_us" );
+    class_stats total;
+    for( std::map< std::string, class_stats >::iterator it = stats.begin(); it != stats.end(); ++it )
+    {
+        total.latencies.insert( total.latencies.end(), it->second.latencies.begin(), it->second.latencies.end() );
+        total.errors += it->second.errors;
+        print_row( it->first.c_str(), it->second );
+    }
+    print_row( "total", total );
+    printf( "%.2fs, %.0f req/s, %ld sends delayed behind a response (avg %.2fms), %ld unanswered, %ld chunks dropped\n",
+            secs, total.latencies.size() / secs, delayed, delayed ? delayed_ns / 1e6 / delayed : 0.0, unfinished, dropped );
+    return 0;
+}
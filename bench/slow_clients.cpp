@@ -0,0 +1,550 @@
+//慢客户端测试:一批读得很慢的客户端下载大文件,同时一组快客户端一问一答地请求小文件
+//,观察服务器在慢客户端拖住发送缓冲区和文件映射时的表现。不需要流量整形的权限,慢速全部由客户端自己制造:
+//  throttle 按固定速率读取(每条连接THROTTLE_BPS字节/秒),接收缓冲区由内核自动调整,填满后服务器的写被阻塞
+//  rcvbuf   同样按固定速率读取,但接收缓冲区设为最小(SO_RCVBUF),TCP窗口只有几KB
+//,服务器每次只能写出很少的数据,发送同样多的字节需要更多次EPOLLOUT和writev
+//  stall    发出请求后不再读取,连接一直占着,直到测试结束
+//  mixed    以上三种各占三分之一
+//  none     没有慢客户端,作为对照
+//。每秒采样服务器的RSS(匿名内存和文件映射分开)、打开的文件描述符数、服务器端socket发送队列中的字节数
+//,以及慢客户端收到的字节数;结束时输出快客户端每秒的请求数和p99延迟、总体的p50/p99/最大延迟
+//、快客户端之间的公平性(Jain指数,1表示完全均等),给出指标的URL时再输出反应堆处理一批事件的耗时分布
+//。最后关闭所有慢连接,2秒后再采样一次,检查服务器是否释放了它们占用的描述符和内存
+//用法: slow_clients ip port server_pid scenario [慢连接数] [快连接数] [秒数] [慢url] [快url] [指标url]
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../metrics/metrics.h"
+#include "bench.h"
+
+//rcvbuf场景的接收缓冲区,内核会把它翻倍并提高到下限
+static const int TINY_RCVBUF = 4096;
+//throttle和rcvbuf场景每条连接每秒读取的字节数,模拟256kbit/s的移动网络
+//。回环地址上没有往返时延,只缩小接收缓冲区并不会让连接变慢,所以rcvbuf场景同样限速
+static const long THROTTLE_BPS = 32 * 1024;
+//限速读取的时间片
+static const int TICK_MS = 10;
+//快客户端等待一个响应的最长时间,超过后重新连接并计为错误
+static const int FAST_TIMEOUT_S = 5;
+
+enum SLOW_MODE { SLOW_RCVBUF, SLOW_THROTTLE, SLOW_STALL };
+
+struct slow_conn
+{
+    int fd;
+    SLOW_MODE mode;
+    bool connected;
+    //限速读取时当前还可以读取的字节数
+    long tokens;
+    response_reader reader;
+};
+
+struct fast_worker
+{
+    pthread_t tid;
+    long requests;
+    long errors;
+    //(完成时刻, 延迟)
+    std::vector< std::pair< long long, long long > > samples;
+};
+
+//每秒一次的服务器状态
+struct sample
+{
+    long rss_anon_kb;
+    long rss_file_kb;
+    int fds;
+    long sndq_kb;
+    long long slow_bytes;
+};
+
+static sockaddr_in server;
+static char slow_request[ 512 ];
+static int slow_request_len;
+static char fast_request[ 512 ];
+static int fast_request_len;
+static long long start_ns;
+static long long deadline_ns;
+static long long slow_bytes = 0;
+static long slow_responses = 0;
+static long slow_reconnects = 0;
+
+//从/proc/pid/status读取RssAnon和RssFile(映射的文件中驻留在内存的部分)
+static void rss_kb( int pid, long* anon, long* file )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/status", pid );
+    *anon = *file = -1;
+    FILE* f = fopen( path, "r" );
+    if( ! f )
+    {
+        return;
+    }
+    char line[ 256 ];
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        if( strncmp( line, "RssAnon:", 8 ) == 0 )
+        {
+            *anon = atol( line + 8 );
+        }
+        else if( strncmp( line, "RssFile:", 8 ) == 0 )
+        {
+            *file = atol( line + 8 );
+        }
+    }
+    fclose( f );
+}
+
+static int count_fds( int pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/fd", pid );
+    DIR* d = opendir( path );
+    if( ! d )
+    {
+        return -1;
+    }
+    int n = 0;
+    while( struct dirent* ent = readdir( d ) )
+    {
+        if( ent->d_name[ 0 ] != '.' )
+        {
+            ++n;
+        }
+    }
+    closedir( d );
+    return n;
+}
+
+//服务器端口上所有socket发送队列中的字节数之和(/proc/net/tcp的tx_queue),即被慢客户端堵在内核里的数据
+static long sndq_kb( int port )
+{
+    FILE* f = fopen( "/proc/net/tcp", "r" );
+    if( ! f )
+    {
+        return -1;
+    }
+    char line[ 512 ];
+    long long bytes = 0;
+    fgets( line, sizeof( line ), f );
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        unsigned int local_port, tx_queue, rx_queue;
+        if( sscanf( line, " %*d: %*8x:%x %*8x:%*x %*x %x:%x", &local_port, &tx_queue, &rx_queue ) == 3
+            && ( int )local_port == port )
+        {
+            bytes += tx_queue;
+        }
+    }
+    fclose( f );
+    return bytes / 1024;
+}
+
+//阻塞地请求一次url,返回完整的响应,失败时返回空字符串
+static std::string fetch( const char* url )
+{
+    std::string out;
+    int fd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( fd < 0 )
+    {
+        return out;
+    }
+    char req[ 512 ];
+    int len = snprintf( req, sizeof( req ), "GET %s HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n", url );
+    if( connect( fd, ( sockaddr* )&server, sizeof( server ) ) == 0 && send( fd, req, len, MSG_NOSIGNAL ) == len )
+    {
+        char buf[ 16384 ];
+        int n;
+        while( ( n = recv( fd, buf, sizeof( buf ), 0 ) ) > 0 )
+        {
+            out.append( buf, n );
+        }
+    }
+    close( fd );
+    return out;
+}
+
+//从Prometheus文本中取出直方图name各个桶的累积计数,按桶的上界排列,最后一项为+Inf
+static std::vector< long > histogram_buckets( const std::string& text, const char* name )
+{
+    std::vector< long > counts;
+    std::string prefix = std::string( name ) + "_bucket{le=\"";
+    size_t pos = 0;
+    while( ( pos = text.find( prefix, pos ) ) != std::string::npos )
+    {
+        size_t value = text.find( "} ", pos );
+        if( value == std::string::npos )
+        {
+            break;
+        }
+        counts.push_back( atol( text.c_str() + value + 2 ) );
+        pos = value;
+    }
+    return counts;
+}
+
+//累积计数的差中第p分位所在的桶的上界(微秒),桶按2的幂划分,见metrics.h
+static long long bucket_percentile( const std::vector< long >& before, const std::vector< long >& after, double p )
+{
+    if( after.empty() || before.size() != after.size() )
+    {
+        return -1;
+    }
+    long total = after.back() - before.back();
+    if( total <= 0 )
+    {
+        return 0;
+    }
+    for( size_t b = 0; b < after.size(); ++b )
+    {
+        if( after[ b ] - before[ b ] >= p * total )
+        {
+            return 1LL << b;
+        }
+    }
+    return 1LL << ( after.size() - 1 );
+}
+
+static int open_slow( int epollfd, slow_conn* c )
+{
+    int fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    //接收缓冲区必须在connect之前设置,握手时通告的窗口扩大因子由它决定
+    if( c->mode == SLOW_RCVBUF )
+    {
+        int size = TINY_RCVBUF;
+        setsockopt( fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+    }
+    if( connect( fd, ( sockaddr* )&server, sizeof( server ) ) < 0 && errno != EINPROGRESS )
+    {
+        close( fd );
+        return -1;
+    }
+    c->fd = fd;
+    c->connected = false;
+    c->tokens = 0;
+    c->reader.reset();
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLOUT;
+    epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
+    return fd;
+}
+
+static void reopen_slow( int epollfd, slow_conn* c )
+{
+    epoll_ctl( epollfd, EPOLL_CTL_DEL, c->fd, NULL );
+    close( c->fd );
+    c->fd = -1;
+    c->connected = false;
+    ++slow_reconnects;
+    open_slow( epollfd, c );
+}
+
+//连接建立后发出请求,之后由时间片驱动读取(stall场景什么都不做),epoll只报告连接出错
+static void slow_connected( int epollfd, slow_conn* c )
+{
+    c->connected = true;
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = 0;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, c->fd, &event );
+    if( send( c->fd, slow_request, slow_request_len, MSG_NOSIGNAL ) != slow_request_len )
+    {
+        reopen_slow( epollfd, c );
+    }
+}
+
+//最多读取limit字节,响应完整时在同一条连接上发出下一个请求
+static void slow_read( int epollfd, slow_conn* c, long limit )
+{
+    char buf[ 65536 ];
+    while( limit > 0 )
+    {
+        int n = recv( c->fd, buf, std::min( limit, ( long )sizeof( buf ) ), 0 );
+        if( n < 0 && errno == EAGAIN )
+        {
+            return;
+        }
+        if( n <= 0 )
+        {
+            reopen_slow( epollfd, c );
+            return;
+        }
+        limit -= n;
+        slow_bytes += n;
+        c->tokens -= n;
+        int used = 0;
+        int ret = c->reader.feed( buf, n, &used );
+        if( ret < 0 )
+        {
+            reopen_slow( epollfd, c );
+            return;
+        }
+        if( ret == 1 )
+        {
+            ++slow_responses;
+            c->reader.reset();
+            if( send( c->fd, slow_request, slow_request_len, MSG_NOSIGNAL ) != slow_request_len )
+            {
+                reopen_slow( epollfd, c );
+                return;
+            }
+        }
+    }
+}
+
+static int connect_blocking()
+{
+    int fd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    struct timeval tv = { FAST_TIMEOUT_S, 0 };
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+    if( connect( fd, ( sockaddr* )&server, sizeof( server ) ) < 0 )
+    {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+//快客户端:一条keep-alive连接上一问一答,记录每个请求的延迟
+static void* run_fast( void* arg )
+{
+    fast_worker* w = ( fast_worker* )arg;
+    int fd = connect_blocking();
+    response_reader reader;
+    char buf[ 65536 ];
+    while( monotonic_ns() < deadline_ns )
+    {
+        if( fd < 0 )
+        {
+            ++w->errors;
+            usleep( 100000 );
+            fd = connect_blocking();
+            continue;
+        }
+        long long sent = monotonic_ns();
+        reader.reset();
+        int ret = send( fd, fast_request, fast_request_len, MSG_NOSIGNAL ) == fast_request_len ? 0 : -1;
+        while( ret == 0 )
+        {
+            int n = recv( fd, buf, sizeof( buf ), 0 );
+            int used = 0;
+            ret = n > 0 ? reader.feed( buf, n, &used ) : -1;
+        }
+        if( ret < 0 )
+        {
+            ++w->errors;
+            close( fd );
+            fd = connect_blocking();
+            continue;
+        }
+        long long now = monotonic_ns();
+        ++w->requests;
+        w->samples.push_back( std::make_pair( now - start_ns, now - sent ) );
+    }
+    if( fd >= 0 )
+    {
+        close( fd );
+    }
+    return NULL;
+}
+
+static sample take_sample( int pid, int port )
+{
+    sample s;
+    rss_kb( pid, &s.rss_anon_kb, &s.rss_file_kb );
+    s.fds = count_fds( pid );
+    s.sndq_kb = sndq_kb( port );
+    s.slow_bytes = slow_bytes;
+    return s;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 5 )
+    {
+        printf( "usage: %s ip port server_pid none|rcvbuf|throttle|stall|mixed [slow_conns] [fast_conns] [seconds]"
+                " [slow_url] [fast_url] [metrics_url]\n", argv[0] );
+        return 1;
+    }
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[1], &server.sin_addr );
+    int port = atoi( argv[2] );
+    server.sin_port = htons( port );
+    int pid = atoi( argv[3] );
+    const char* scenario = argv[4];
+    int slow_count = argc > 5 ? atoi( argv[5] ) : 200;
+    int fast_count = argc > 6 ? atoi( argv[6] ) : 4;
+    int seconds = argc > 7 ? atoi( argv[7] ) : 10;
+    const char* slow_url = argc > 8 ? argv[8] : "/big.bin";
+    const char* fast_url = argc > 9 ? argv[9] : "/index.html";
+    const char* metrics_url = argc > 10 ? argv[10] : NULL;
+    if( strcmp( scenario, "none" ) == 0 )
+    {
+        slow_count = 0;
+    }
+    else if( strcmp( scenario, "rcvbuf" ) != 0 && strcmp( scenario, "throttle" ) != 0
+             && strcmp( scenario, "stall" ) != 0 && strcmp( scenario, "mixed" ) != 0 )
+    {
+        printf( "unknown scenario %s\n", scenario );
+        return 1;
+    }
+    slow_request_len = snprintf( slow_request, sizeof( slow_request ),
+                                 "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", slow_url, argv[1] );
+    fast_request_len = snprintf( fast_request, sizeof( fast_request ),
+                                 "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", fast_url, argv[1] );
+
+    std::vector< long > loop_before;
+    if( metrics_url )
+    {
+        loop_before = histogram_buckets( fetch( metrics_url ), "webserver_reactor_loop_us" );
+    }
+    sample idle = take_sample( pid, port );
+
+    int epollfd = epoll_create( 5 );
+    std::vector< slow_conn > slow( slow_count );
+    for( int i = 0; i < slow_count; ++i )
+    {
+        if( strcmp( scenario, "mixed" ) == 0 )
+        {
+            slow[ i ].mode = ( SLOW_MODE )( i % 3 );
+        }
+        else
+        {
+            slow[ i ].mode = strcmp( scenario, "rcvbuf" ) == 0 ? SLOW_RCVBUF
+                             : strcmp( scenario, "throttle" ) == 0 ? SLOW_THROTTLE : SLOW_STALL;
+        }
+        slow[ i ].fd = -1;
+        open_slow( epollfd, &slow[ i ] );
+    }
+
+    start_ns = monotonic_ns();
+    deadline_ns = start_ns + seconds * 1000000000LL;
+    std::vector< fast_worker > fast( fast_count );
+    for( int i = 0; i < fast_count; ++i )
+    {
+        fast[ i ].requests = fast[ i ].errors = 0;
+        pthread_create( &fast[ i ].tid, NULL, run_fast, &fast[ i ] );
+    }
+
+    //慢客户端在主线程中处理;每个时间片给限速读取的连接补充令牌,最多积攒一个时间片的量
+    std::vector< sample > samples;
+    long long next_sample = start_ns + 1000000000LL;
+    long tick_bytes = THROTTLE_BPS * TICK_MS / 1000;
+    epoll_event events[ 1024 ];
+    while( monotonic_ns() < deadline_ns )
+    {
+        int number = epoll_wait( epollfd, events, 1024, TICK_MS );
+        for( int i = 0; i < number; ++i )
+        {
+            slow_conn* c = ( slow_conn* )events[i].data.ptr;
+            if( ! c->connected )
+            {
+                slow_connected( epollfd, c );
+            }
+            else
+            {
+                reopen_slow( epollfd, c );
+            }
+        }
+        for( int i = 0; i < slow_count; ++i )
+        {
+            slow_conn* c = &slow[ i ];
+            if( c->mode != SLOW_STALL && c->fd >= 0 && c->connected )
+            {
+                c->tokens = std::min( c->tokens + tick_bytes, tick_bytes );
+                slow_read( epollfd, c, c->tokens );
+            }
+        }
+        if( monotonic_ns() >= next_sample )
+        {
+            samples.push_back( take_sample( pid, port ) );
+            next_sample += 1000000000LL;
+        }
+    }
+
+    long fast_requests = 0, fast_errors = 0;
+    double sum = 0, sum_sq = 0;
+    std::vector< long long > latencies;
+    std::vector< std::vector< long long > > per_second( seconds + 1 );
+    for( int i = 0; i < fast_count; ++i )
+    {
+        pthread_join( fast[ i ].tid, NULL );
+        fast_requests += fast[ i ].requests;
+        fast_errors += fast[ i ].errors;
+        sum += fast[ i ].requests;
+        sum_sq += ( double )fast[ i ].requests * fast[ i ].requests;
+        for( size_t j = 0; j < fast[ i ].samples.size(); ++j )
+        {
+            size_t sec = std::min( ( size_t )( fast[ i ].samples[ j ].first / 1000000000LL ), ( size_t )seconds );
+            per_second[ sec ].push_back( fast[ i ].samples[ j ].second );
+            latencies.push_back( fast[ i ].samples[ j ].second );
+        }
+    }
+    std::vector< long > loop_after;
+    if( metrics_url )
+    {
+        loop_after = histogram_buckets( fetch( metrics_url ), "webserver_reactor_loop_us" );
+    }
+
+    printf( "scenario %s: %d slow, %d fast connections, %d seconds\n", scenario, slow_count, fast_count, seconds );
+    printf( "%4s %12s %12s %6s %10s %12s %10s %10s\n", "sec", "rss_anon_kb", "rss_file_kb", "fds", "sndq_kb",
+            "slow_kB/s", "fast_req/s", "fast_p99_us" );
+    printf( "%4s %12ld %12ld %6d %10ld %12s %10s %10s\n", "idle", idle.rss_anon_kb, idle.rss_file_kb, idle.fds,
+            idle.sndq_kb, "-", "-", "-" );
+    long long prev_bytes = 0;
+    for( size_t i = 0; i < samples.size(); ++i )
+    {
+        const sample& s = samples[ i ];
+        printf( "%4zu %12ld %12ld %6d %10ld %12lld %10zu %10lld\n", i + 1, s.rss_anon_kb, s.rss_file_kb, s.fds, s.sndq_kb,
+                ( s.slow_bytes - prev_bytes ) / 1024, per_second[ i ].size(), percentile( per_second[ i ], 0.99 ) / 1000 );
+        prev_bytes = s.slow_bytes;
+    }
+    printf( "fast: %.0f req/s, p50 %lld us, p99 %lld us, max %lld us, errors %ld, fairness %.3f\n",
+            fast_requests / ( double )seconds, percentile( latencies, 0.5 ) / 1000, percentile( latencies, 0.99 ) / 1000,
+            latencies.empty() ? 0 : *std::max_element( latencies.begin(), latencies.end() ) / 1000, fast_errors,
+            sum_sq > 0 ? sum * sum / ( fast_count * sum_sq ) : 0.0 );
+    printf( "slow: %lld kB received, %ld responses completed, %ld reconnects\n", slow_bytes / 1024, slow_responses,
+            slow_reconnects );
+    if( metrics_url )
+    {
+        printf( "reactor loop: p50 <= %lld us, p99 <= %lld us, max <= %lld us\n",
+                bucket_percentile( loop_before, loop_after, 0.5 ), bucket_percentile( loop_before, loop_after, 0.99 ),
+                bucket_percentile( loop_before, loop_after, 1.0 ) );
+    }
+
+    //慢客户端全部断开后,服务器应当释放它们的连接、文件映射和发送队列
+    for( int i = 0; i < slow_count; ++i )
+    {
+        if( slow[ i ].fd >= 0 )
+        {
+            close( slow[ i ].fd );
+        }
+    }
+    sleep( 2 );
+    sample after = take_sample( pid, port );
+    printf( "2s after closing slow clients: rss_anon_kb %ld, rss_file_kb %ld, fds %d, sndq_kb %ld\n",
+            after.rss_anon_kb, after.rss_file_kb, after.fds, after.sndq_kb );
+    close( epollfd );
+    return 0;
+}
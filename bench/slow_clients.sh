@@ -0,0 +1,47 @@
+#!/bin/sh
+# 依次运行slow_clients的各个场景:none(对照)、throttle、rcvbuf、stall、mixed
+# ,每个场景启动一个新的服务器,保证RSS、描述符数和指标从干净的状态开始。结果同时写入$OUT/report.txt
+#
+# 用法: bench/slow_clients.sh [构建目录]
+# 环境变量:
+#   OUT       工作目录,默认/tmp/slow_clients
+#   PORT      服务器端口,默认9470,每个场景加1
+#   SLOW      慢连接数,默认200
+#   FAST      快连接数,默认4
+#   DURATION  每个场景的秒数,默认10
+#   SIZE_MB   慢客户端下载的文件大小,默认8
+#   SCENARIOS 要运行的场景,默认"none throttle rcvbuf stall mixed"
+set -e
+
+SRC=$( cd "$( dirname "$0" )/.." && pwd )
+BUILD=${1:-$SRC/build}
+OUT=${OUT:-/tmp/slow_clients}
+PORT=${PORT:-9470}
+SLOW=${SLOW:-200}
+FAST=${FAST:-4}
+DURATION=${DURATION:-10}
+SIZE_MB=${SIZE_MB:-8}
+SCENARIOS=${SCENARIOS:-none throttle rcvbuf stall mixed}
+
+mkdir -p "$OUT/www"
+head -c $(( SIZE_MB * 1024 * 1024 )) /dev/urandom > "$OUT/www/big.bin"
+head -c 1024 /dev/urandom > "$OUT/www/1k.bin"
+{
+    printf "root %s\n" "$OUT/www"
+    printf "location /__metrics handler=metrics\n"
+} > "$OUT/server.conf"
+
+PID=
+trap 'kill $PID 2> /dev/null || true' EXIT
+: > "$OUT/report.txt"
+for scenario in $SCENARIOS; do
+    "$BUILD/server" 127.0.0.1 "$PORT" "$OUT/server.conf" > "$OUT/$scenario.log" 2>&1 &
+    PID=$!
+    sleep 0.5
+    "$BUILD/slow_clients" 127.0.0.1 "$PORT" "$PID" "$scenario" "$SLOW" "$FAST" "$DURATION" /big.bin /1k.bin /__metrics \
+        | tee -a "$OUT/report.txt"
+    echo | tee -a "$OUT/report.txt"
+    kill "$PID"
+    wait "$PID" 2> /dev/null || true
+    PORT=$(( PORT + 1 ))
+done
@@ -0,0 +1,252 @@
+//HTTPS和明文HTTP的吞吐量比较:若干条keep-alive连接各自在一个线程中一问一答地请求同一个URL
+//,持续指定的时间,输出每秒请求数、每秒传输的MB数、请求延迟的p50/p99,以及服务器进程每个请求消耗的CPU时间
+//(用户态+内核态,从/proc/<pid>/stat读取)。kTLS把加密移到了内核,只看吞吐量看不出差别时,CPU时间能反映出来
+//。客户端不校验服务器证书
+//用法: tls_bench ip port server_pid [http|https] [url] [连接数] [秒数]
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "../metrics/metrics.h"
+#include "bench.h"
+
+static sockaddr_in server;
+static bool use_tls = false;
+static SSL_CTX* ctx = NULL;
+static char request[ 512 ];
+static int request_len;
+static long long deadline_ns;
+
+//一条连接,明文时ssl为NULL
+struct bench_conn
+{
+    int fd;
+    SSL* ssl;
+};
+
+struct worker
+{
+    pthread_t tid;
+    bench_conn conn;
+    bool connected;
+    long requests;
+    long errors;
+    long long bytes;
+    std::vector< long long > latencies;
+};
+
+static bool open_conn( bench_conn& c )
+{
+    c.ssl = NULL;
+    c.fd = socket( PF_INET, SOCK_STREAM, 0 );
+    if( c.fd < 0 )
+    {
+        return false;
+    }
+    int on = 1;
+    setsockopt( c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    if( connect( c.fd, ( sockaddr* )&server, sizeof( server ) ) < 0 )
+    {
+        close( c.fd );
+        return false;
+    }
+    if( use_tls )
+    {
+        c.ssl = SSL_new( ctx );
+        SSL_set_fd( c.ssl, c.fd );
+        if( SSL_connect( c.ssl ) != 1 )
+        {
+            SSL_free( c.ssl );
+            close( c.fd );
+            return false;
+        }
+    }
+    return true;
+}
+
+static void close_conn( bench_conn& c )
+{
+    if( c.ssl )
+    {
+        SSL_free( c.ssl );
+    }
+    close( c.fd );
+}
+
+static int conn_send( bench_conn& c, const char* buf, int len )
+{
+    return c.ssl ? SSL_write( c.ssl, buf, len ) : send( c.fd, buf, len, MSG_NOSIGNAL );
+}
+
+static int conn_recv( bench_conn& c, char* buf, int len )
+{
+    return c.ssl ? SSL_read( c.ssl, buf, len ) : recv( c.fd, buf, len, 0 );
+}
+
+//读取一个完整的响应,返回响应的总字节数,出错时返回-1
+static long long read_response( bench_conn& c )
+{
+    static const int BUF_SIZE = 65536;
+    char buf[ BUF_SIZE ];
+    response_reader reader;
+    reader.reset();
+    long long total = 0;
+    int ret = 0;
+    while( ret == 0 )
+    {
+        int n = conn_recv( c, buf, BUF_SIZE );
+        if( n <= 0 )
+        {
+            return -1;
+        }
+        total += n;
+        int used = 0;
+        ret = reader.feed( buf, n, &used );
+    }
+    return ret < 0 ? -1 : total;
+}
+
+static void* run( void* arg )
+{
+    worker* w = ( worker* )arg;
+    bench_conn& c = w->conn;
+    bool& connected = w->connected;
+    while( monotonic_ns() < deadline_ns )
+    {
+        if( ! connected && ! ( connected = open_conn( c ) ) )
+        {
+            w->errors++;
+            usleep( 1000 );
+            continue;
+        }
+        long long start = monotonic_ns();
+        long long n = -1;
+        if( conn_send( c, request, request_len ) == request_len )
+        {
+            n = read_response( c );
+        }
+        if( n < 0 )
+        {
+            w->errors++;
+            close_conn( c );
+            connected = false;
+            continue;
+        }
+        w->latencies.push_back( monotonic_ns() - start );
+        w->requests++;
+        w->bytes += n;
+    }
+    if( connected )
+    {
+        close_conn( c );
+    }
+    return NULL;
+}
+
+//进程消耗的CPU时间(用户态+内核态),单位为时钟滴答
+static long long cpu_ticks( int pid )
+{
+    char path[ 64 ];
+    snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
+    FILE* f = fopen( path, "r" );
+    if( ! f )
+    {
+        return -1;
+    }
+    char line[ 1024 ];
+    long long ticks = -1;
+    if( fgets( line, sizeof( line ), f ) )
+    {
+        //进程名可能包含空格,从最后一个')'之后开始数:第12、13个字段是utime和stime
+        char* p = strrchr( line, ')' );
+        unsigned long long utime, stime;
+        if( p && sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime ) == 2 )
+        {
+            ticks = utime + stime;
+        }
+    }
+    fclose( f );
+    return ticks;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 4 )
+    {
+        printf( "usage: %s ip port server_pid [http|https] [url] [conns] [seconds]\n", argv[0] );
+        return 1;
+    }
+    memset( &server, 0, sizeof( server ) );
+    server.sin_family = AF_INET;
+    inet_pton( AF_INET, argv[1], &server.sin_addr );
+    server.sin_port = htons( atoi( argv[2] ) );
+    int pid = atoi( argv[3] );
+    use_tls = argc > 4 && strcmp( argv[4], "https" ) == 0;
+    const char* url = argc > 5 ? argv[5] : "/index.html";
+    int conns = argc > 6 ? atoi( argv[6] ) : 4;
+    int seconds = argc > 7 ? atoi( argv[7] ) : 5;
+    request_len = snprintf( request, sizeof( request ),
+                            "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", url, argv[1] );
+
+    if( use_tls )
+    {
+        ctx = SSL_CTX_new( TLS_client_method() );
+        SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+    }
+
+    //连接在计时前逐条建立,每条先完成一个请求(确认已被服务器accept)再建立下一条,握手不计入结果
+    std::vector< worker > workers( conns );
+    for( int i = 0; i < conns; ++i )
+    {
+        bench_conn& c = workers[i].conn;
+        workers[i].connected = open_conn( c );
+        if( workers[i].connected
+            && ( conn_send( c, request, request_len ) != request_len || read_response( c ) < 0 ) )
+        {
+            close_conn( c );
+            workers[i].connected = false;
+        }
+    }
+    long long cpu_start = cpu_ticks( pid );
+    long long start = monotonic_ns();
+    deadline_ns = start + seconds * 1000000000LL;
+    for( int i = 0; i < conns; ++i )
+    {
+        workers[i].requests = workers[i].errors = workers[i].bytes = 0;
+        pthread_create( &workers[i].tid, NULL, run, &workers[i] );
+    }
+    long requests = 0, errors = 0;
+    long long bytes = 0;
+    std::vector< long long > latencies;
+    for( int i = 0; i < conns; ++i )
+    {
+        pthread_join( workers[i].tid, NULL );
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        latencies.insert( latencies.end(), workers[i].latencies.begin(), workers[i].latencies.end() );
+    }
+    double secs = ( monotonic_ns() - start ) / 1e9;
+    long long cpu_end = cpu_ticks( pid );
+    double cpu_us = ( cpu_start >= 0 && cpu_end >= 0 && requests > 0 )
+                    ? ( cpu_end - cpu_start ) * 1e6 / sysconf( _SC_CLK_TCK ) / requests : 0;
+
+    printf( "%-6s %-20s %10.0f %10.1f %10lld %10lld %12.1f %8ld\n", use_tls ? "https" : "http", url,
+            requests / secs, bytes / secs / 1048576, percentile( latencies, 0.5 ) / 1000,
+            percentile( latencies, 0.99 ) / 1000, cpu_us, errors );
+    if( ctx )
+    {
+        SSL_CTX_free( ctx );
+    }
+    return 0;
+}
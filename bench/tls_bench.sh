@@ -0,0 +1,65 @@
+#!/bin/sh
+# 在回环地址上比较明文HTTP、kTLS和用户态加密的HTTPS:生成自签名证书和几个不同大小的文件
+# ,分别启动明文、HTTPS(ktls on)和HTTPS(ktls off)三个服务器,用tls_bench对每个文件各测一遍
+# 。内核没有加载tls模块(modprobe tls)时ktls on也会退回到用户态加密,最后一行输出服务器统计的kTLS连接数
+#
+# 用法: bench/tls_bench.sh [构建目录]
+# 环境变量:
+#   OUT      工作目录,默认/tmp/tls_bench
+#   PORT     第一个服务器的端口,另外两个依次加1,默认9440
+#   CONNS    并发连接数,默认4
+#   DURATION 每项测试的秒数,默认5
+set -e
+
+SRC=$( cd "$( dirname "$0" )/.." && pwd )
+BUILD=${1:-$SRC/build}
+OUT=${OUT:-/tmp/tls_bench}
+PORT=${PORT:-9440}
+CONNS=${CONNS:-4}
+DURATION=${DURATION:-5}
+
+mkdir -p "$OUT/www"
+head -c 1024 /dev/urandom > "$OUT/www/1k.bin"
+head -c 65536 /dev/urandom > "$OUT/www/64k.bin"
+head -c 1048576 /dev/urandom > "$OUT/www/1m.bin"
+head -c 16777216 /dev/urandom > "$OUT/www/16m.bin"
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes -days 30 -subj /CN=localhost \
+    -keyout "$OUT/key.pem" -out "$OUT/cert.pem" > /dev/null 2>&1
+
+printf "root %s\nlocation /__metrics handler=metrics\n" "$OUT/www" > "$OUT/plain.conf"
+cp "$OUT/plain.conf" "$OUT/ktls.conf"
+printf "tls_cert %s\ntls_key %s\n" "$OUT/cert.pem" "$OUT/key.pem" >> "$OUT/ktls.conf"
+cp "$OUT/ktls.conf" "$OUT/userspace.conf"
+echo "ktls off" >> "$OUT/userspace.conf"
+
+PIDS=
+trap 'kill $PIDS 2> /dev/null || true' EXIT
+start_server()
+{
+    "$BUILD/server" 127.0.0.1 "$1" "$OUT/$2.conf" > "$OUT/$2.log" 2>&1 &
+    PIDS="$PIDS $!"
+    eval "PID_$2=$!"
+}
+start_server "$PORT" plain
+start_server $(( PORT + 1 )) ktls
+start_server $(( PORT + 2 )) userspace
+sleep 0.5
+
+printf "%-10s %-6s %-20s %10s %10s %10s %10s %12s %8s\n" "server" "proto" "url" "req/s" "MB/s" "p50_us" "p99_us" \
+    "cpu_us/req" "errors"
+for url in /1k.bin /64k.bin /1m.bin /16m.bin; do
+    printf "%-10s " plain
+    "$BUILD/tls_bench" 127.0.0.1 "$PORT" "$PID_plain" http "$url" "$CONNS" "$DURATION"
+    printf "%-10s " ktls
+    "$BUILD/tls_bench" 127.0.0.1 $(( PORT + 1 )) "$PID_ktls" https "$url" "$CONNS" "$DURATION"
+    printf "%-10s " userspace
+    "$BUILD/tls_bench" 127.0.0.1 $(( PORT + 2 )) "$PID_userspace" https "$url" "$CONNS" "$DURATION"
+done
+
+# 只有服务器在握手后确认发送方向交给了内核,ktls一行的结果才是kTLS的
+printf "ktls connections: "
+openssl s_client -quiet -crlf -connect "127.0.0.1:$(( PORT + 1 ))" 2> /dev/null << EOF | grep "^webserver_tls_ktls_total" || echo unknown
+GET /__metrics HTTP/1.1
+Host: localhost
+
+EOF
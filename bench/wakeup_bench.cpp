@@ -0,0 +1,145 @@
+//线程池唤醒延迟测试:比较原来的sem+locker线程池与自旋后休眠(futex)的线程池
+//。生产者按固定间隔逐个提交任务,记录从append到工作线程开始执行任务的时间,输出各百分位延迟
+//用法: wakeup_bench [线程数] [每组任务数]
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "../threadpool/threadpool.h"
+#include "bench.h"
+
+//原来的线程池:每次append都sem_post,工作线程阻塞在sem_wait上
+template< typename T >
+class legacy_threadpool
+{
+public:
+    legacy_threadpool( int thread_number ) : m_stop( false ), m_threads( thread_number )
+    {
+        for ( int i = 0; i < thread_number; ++i )
+        {
+            if( pthread_create( &m_threads[i], NULL, worker, this ) != 0 )
+            {
+                throw std::exception();
+            }
+        }
+    }
+    ~legacy_threadpool()
+    {
+        __atomic_store_n( &m_stop, true, __ATOMIC_RELEASE );
+        for ( size_t i = 0; i < m_threads.size(); ++i )
+        {
+            m_queuestat.post();
+        }
+        for ( size_t i = 0; i < m_threads.size(); ++i )
+        {
+            pthread_join( m_threads[i], NULL );
+        }
+    }
+    bool append( T* request )
+    {
+        m_queuelocker.lock();
+        m_workqueue.push_back( request );
+        m_queuelocker.unlock();
+        m_queuestat.post();
+        return true;
+    }
+
+private:
+    static void* worker( void* arg )
+    {
+        legacy_threadpool* pool = ( legacy_threadpool* )arg;
+        while ( ! __atomic_load_n( &pool->m_stop, __ATOMIC_ACQUIRE ) )
+        {
+            pool->m_queuestat.wait();
+            pool->m_queuelocker.lock();
+            if ( pool->m_workqueue.empty() )
+            {
+                pool->m_queuelocker.unlock();
+                continue;
+            }
+            T* request = pool->m_workqueue.front();
+            pool->m_workqueue.pop_front();
+            pool->m_queuelocker.unlock();
+            request->process();
+        }
+        return NULL;
+    }
+
+    bool m_stop;
+    std::vector< pthread_t > m_threads;
+    std::list< T* > m_workqueue;
+    locker m_queuelocker;
+    sem m_queuestat;
+};
+
+//一个任务:记录被执行时距离提交的时间,然后模拟少量处理工作
+struct job
+{
+    long long submit_ns;
+    long long latency_ns;
+    int* done;
+
+    void process()
+    {
+        latency_ns = monotonic_ns() - submit_ns;
+        long long end = monotonic_ns() + 2000;
+        while( monotonic_ns() < end )
+        {
+            cpu_relax();
+        }
+        __atomic_add_fetch( done, 1, __ATOMIC_RELEASE );
+    }
+};
+
+template< typename POOL >
+static void run( const char* name, POOL& pool, int count, int interval_ns )
+{
+    std::vector< job > jobs( count );
+    int done = 0;
+    long long next = monotonic_ns();
+    for( int i = 0; i < count; ++i )
+    {
+        //忙等到下一个提交时间点,保证负载稳定
+        while( monotonic_ns() < next )
+        {
+            cpu_relax();
+        }
+        jobs[i].done = &done;
+        jobs[i].submit_ns = monotonic_ns();
+        pool.append( &jobs[i] );
+        next += interval_ns;
+    }
+    while( __atomic_load_n( &done, __ATOMIC_ACQUIRE ) < count )
+    {
+        usleep( 100 );
+    }
+
+    std::vector< long long > lat( count );
+    for( int i = 0; i < count; ++i )
+    {
+        lat[i] = jobs[i].latency_ns;
+    }
+    printf( "%-10s interval %6dns  p50 %7lldns  p90 %7lldns  p99 %8lldns  max %8lldns\n", name, interval_ns,
+            percentile( lat, 0.5 ), percentile( lat, 0.9 ), percentile( lat, 0.99 ), percentile( lat, 1.0 ) );
+}
+
+int main( int argc, char* argv[] )
+{
+    int threads = argc > 1 ? atoi( argv[1] ) : 4;
+    int count = argc > 2 ? atoi( argv[2] ) : 20000;
+    int intervals[] = { 5000, 20000, 100000, 1000000 };
+
+    for( size_t i = 0; i < sizeof( intervals ) / sizeof( intervals[0] ); ++i )
+    {
+        int n = intervals[i] >= 1000000 ? count / 20 : count;
+        {
+            legacy_threadpool< job > pool( threads );
+            run( "sem", pool, n, intervals[i] );
+        }
+        {
+            threadpool< job > pool( threads, threads, n + 1 );
+            run( "spin-park", pool, n, intervals[i] );
+        }
+    }
+    return 0;
+}
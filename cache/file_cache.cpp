@@ -0,0 +1,400 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "file_cache.h"
+#include "file_watcher.h"
+#include "../metrics/metrics.h"
+
+locker file_cache::s_lock;
+std::unordered_map< std::string, cached_file* > file_cache::s_files;
+std::list< cached_file* > file_cache::s_lru;
+long file_cache::s_bytes = 0;
+long file_cache::s_max_bytes = 64L * 1024 * 1024;
+long file_cache::s_limit = 64L * 1024 * 1024;
+int file_cache::s_percent = 100;
+long file_cache::s_max_file = 1024L * 1024;
+unsigned long file_cache::s_generation = 0;
+
+//缓存中的文件与新的stat结果是否为同一个版本
+static bool same_version( const struct stat& a, const struct stat& b )
+{
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+           && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+//path中最后一个'/'之前的部分,和file_watcher记录的目录比较
+static std::string parent_dir( const std::string& path )
+{
+    size_t slash = path.rfind( '/' );
+    return slash == std::string::npos ? std::string() : path.substr( 0, slash );
+}
+
+void file_cache::configure( long max_bytes, long max_file )
+{
+    std::vector< cached_file* > dead;
+    s_lock.lock();
+    s_max_bytes = max_bytes;
+    s_max_file = max_file;
+    s_limit = s_max_bytes / 100 * s_percent;
+    //缩小上限时立即淘汰多出的文件
+    evict( dead );
+    metrics::set( FILE_CACHE_BYTES, s_bytes );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_file( dead[i] );
+    }
+}
+
+void file_cache::shrink( int percent )
+{
+    std::vector< cached_file* > dead;
+    s_lock.lock();
+    s_percent = percent;
+    s_limit = s_max_bytes / 100 * s_percent;
+    evict( dead );
+    metrics::set( FILE_CACHE_BYTES, s_bytes );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_file( dead[i] );
+    }
+}
+
+file_cache::RESULT file_cache::lookup( const char* path, cached_file** f )
+{
+    s_lock.lock();
+    std::unordered_map< std::string, cached_file* >::iterator it = s_files.find( path );
+    if( it == s_files.end() )
+    {
+        s_lock.unlock();
+        return FILE_MISS;
+    }
+    cached_file* cur = it->second;
+    //正在加载的条目在插入散列表之后才open,比调用者能stat到的任何版本都新
+    RESULT ret = FILE_WAIT;
+    if( cur->ready )
+    {
+        if( ! cur->watched || cur->generation != s_generation )
+        {
+            s_lock.unlock();
+            return FILE_MISS;
+        }
+        if( cur->in_lru )
+        {
+            s_lru.splice( s_lru.begin(), s_lru, cur->lru );
+        }
+        ret = FILE_HIT;
+    }
+    ++cur->refs;
+    s_lock.unlock();
+    if( ret == FILE_HIT )
+    {
+        metrics::add( cur->err ? FILE_CACHE_NEGATIVE_HITS : FILE_CACHE_HITS, 1 );
+    }
+    else
+    {
+        metrics::add( FILE_CACHE_COALESCED, 1 );
+    }
+    *f = cur;
+    return ret;
+}
+
+file_cache::RESULT file_cache::acquire( const char* path, const struct stat& st, cached_file** f )
+{
+    cached_file* stale = NULL;
+    s_lock.lock();
+    std::unordered_map< std::string, cached_file* >::iterator it = s_files.find( path );
+    if( it != s_files.end() )
+    {
+        cached_file* cur = it->second;
+        if( cur->err == 0 && cur->generation == s_generation && same_version( cur->st, st ) )
+        {
+            ++cur->refs;
+            RESULT ret = FILE_WAIT;
+            if( cur->ready )
+            {
+                if( cur->in_lru )
+                {
+                    s_lru.splice( s_lru.begin(), s_lru, cur->lru );
+                }
+                ret = FILE_HIT;
+            }
+            s_lock.unlock();
+            metrics::add( ret == FILE_HIT ? FILE_CACHE_HITS : FILE_CACHE_COALESCED, 1 );
+            *f = cur;
+            return ret;
+        }
+        //文件已被修改:旧的条目等正在使用它的请求结束后释放,新的请求加载新的版本
+        if( unlink( cur ) )
+        {
+            stale = cur;
+        }
+    }
+
+    cached_file* load = new cached_file;
+    load->path = path;
+    load->st = st;
+    load->data = NULL;
+    load->err = 0;
+    load->ready = false;
+    //散列表一个,加载者一个
+    load->refs = 2;
+    load->in_table = true;
+    load->in_lru = false;
+    load->watched = false;
+    load->generation = s_generation;
+    load->cost = st.st_size;
+    s_files[ load->path ] = load;
+    s_lock.unlock();
+    if( stale )
+    {
+        free_file( stale );
+    }
+    *f = load;
+    return FILE_LOAD;
+}
+
+void file_cache::load( cached_file* f, std::vector< void* >& waiters )
+{
+    //留在缓存中的文件在加载时一次性预读并建立页表(MAP_POPULATE),之后的请求不再缺页
+    //;大文件只在使用期间共享,保持按需缺页
+    bool keep = f->st.st_size <= s_max_file && f->st.st_size <= s_limit;
+    int fd = open( f->path.c_str(), O_RDONLY | O_CLOEXEC );
+    //条目在open之前已经在散列表中,此后文件的修改都会使它失效;映射的大小以打开的文件为准
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        f->err = errno;
+    }
+    else if( st.st_size == 0 )
+    {
+        //stat之后文件被清空,调用者按空文件回复
+        f->err = EAGAIN;
+    }
+    else
+    {
+        void* addr = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE | ( keep ? MAP_POPULATE : 0 ), fd, 0 );
+        if( addr == MAP_FAILED )
+        {
+            f->err = errno;
+        }
+        else
+        {
+            f->st = st;
+            f->cost = st.st_size;
+            f->data = ( char* )addr;
+        }
+    }
+    if( fd >= 0 )
+    {
+        close( fd );
+    }
+    //符号链接指向的文件可能在受监视的目录之外
+    struct stat lst;
+    f->watched = f->data && lstat( f->path.c_str(), &lst ) == 0 && ! S_ISLNK( lst.st_mode )
+                 && file_watcher::covers( parent_dir( f->path ) );
+    metrics::add( FILE_CACHE_LOADS, 1 );
+
+    std::vector< cached_file* > dead;
+    s_lock.lock();
+    f->ready = true;
+    waiters.swap( f->waiters );
+    if( f->in_table )
+    {
+        if( f->err || f->generation != s_generation )
+        {
+            //加载失败的条目不缓存,下一个请求重新尝试;加载期间所有条目失效时也不保留
+            unlink( f );
+        }
+        else if( keep )
+        {
+            retain( f, dead );
+        }
+    }
+    metrics::set( FILE_CACHE_BYTES, s_bytes );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_file( dead[i] );
+    }
+}
+
+bool file_cache::park( cached_file* f, void* waiter )
+{
+    s_lock.lock();
+    bool parked = ! f->ready;
+    if( parked )
+    {
+        f->waiters.push_back( waiter );
+    }
+    s_lock.unlock();
+    return parked;
+}
+
+void file_cache::release( cached_file* f )
+{
+    s_lock.lock();
+    --f->refs;
+    //不留在缓存中的大文件:最后一个使用它的请求结束时从散列表中去掉
+    if( f->refs == 1 && f->in_table && f->ready && ! f->in_lru )
+    {
+        unlink( f );
+    }
+    bool last = f->refs == 0;
+    s_lock.unlock();
+    if( last )
+    {
+        free_file( f );
+    }
+}
+
+void file_cache::remember_missing( const char* path )
+{
+    if( s_limit == 0 || ! file_watcher::covers( parent_dir( path ) ) )
+    {
+        return;
+    }
+    std::vector< cached_file* > dead;
+    s_lock.lock();
+    std::unordered_map< std::string, cached_file* >::iterator it = s_files.find( path );
+    if( it != s_files.end() )
+    {
+        //已有的条目属于旧的一代时换成新的条目,否则保留
+        cached_file* cur = it->second;
+        if( ! cur->ready || cur->generation == s_generation )
+        {
+            s_lock.unlock();
+            return;
+        }
+        if( unlink( cur ) )
+        {
+            dead.push_back( cur );
+        }
+    }
+    cached_file* f = new cached_file;
+    f->path = path;
+    f->data = NULL;
+    f->err = ENOENT;
+    f->ready = true;
+    f->refs = 1;
+    f->in_table = true;
+    f->in_lru = false;
+    f->watched = true;
+    f->generation = s_generation;
+    f->cost = sizeof( cached_file ) + f->path.size();
+    s_files[ f->path ] = f;
+    retain( f, dead );
+    metrics::set( FILE_CACHE_BYTES, s_bytes );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_file( dead[i] );
+    }
+
+    //调用者stat之后、条目插入之前文件可能已经被创建,它的事件找不到这个条目:插入之后再检查一次
+    struct stat st;
+    if( stat( path, &st ) == 0 )
+    {
+        invalidate( std::vector< std::string >( 1, path ), std::vector< std::string >() );
+    }
+}
+
+void file_cache::invalidate( const std::vector< std::string >& files, const std::vector< std::string >& dirs )
+{
+    std::vector< cached_file* > dead;
+    long count = 0;
+    s_lock.lock();
+    for( size_t i = 0; i < files.size(); ++i )
+    {
+        std::unordered_map< std::string, cached_file* >::iterator it = s_files.find( files[i] );
+        if( it != s_files.end() )
+        {
+            cached_file* f = it->second;
+            ++count;
+            if( unlink( f ) )
+            {
+                dead.push_back( f );
+            }
+        }
+    }
+    //目录被删除、移动或新建时,其下的所有条目(包括不存在的路径)都失效,需要遍历整个散列表
+    for( size_t i = 0; i < dirs.size(); ++i )
+    {
+        std::string prefix = dirs[i] + "/";
+        for( std::unordered_map< std::string, cached_file* >::iterator it = s_files.begin(); it != s_files.end(); )
+        {
+            cached_file* f = it->second;
+            ++it;
+            if( f->path.compare( 0, prefix.size(), prefix ) == 0 )
+            {
+                ++count;
+                if( unlink( f ) )
+                {
+                    dead.push_back( f );
+                }
+            }
+        }
+    }
+    metrics::set( FILE_CACHE_BYTES, s_bytes );
+    s_lock.unlock();
+    metrics::add( FILE_CACHE_INVALIDATIONS, count );
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_file( dead[i] );
+    }
+}
+
+void file_cache::invalidate_all()
+{
+    //不遍历散列表:旧一代的条目在下次被访问或被淘汰时才释放
+    s_lock.lock();
+    ++s_generation;
+    s_lock.unlock();
+    metrics::add( FILE_CACHE_FLUSHES, 1 );
+}
+
+void file_cache::retain( cached_file* f, std::vector< cached_file* >& dead )
+{
+    s_lru.push_front( f );
+    f->lru = s_lru.begin();
+    f->in_lru = true;
+    s_bytes += f->cost;
+    evict( dead );
+}
+
+void file_cache::evict( std::vector< cached_file* >& dead )
+{
+    while( s_bytes > s_limit && ! s_lru.empty() )
+    {
+        cached_file* victim = s_lru.back();
+        metrics::add( FILE_CACHE_EVICTIONS, 1 );
+        if( unlink( victim ) )
+        {
+            dead.push_back( victim );
+        }
+    }
+}
+
+bool file_cache::unlink( cached_file* f )
+{
+    if( f->in_lru )
+    {
+        s_lru.erase( f->lru );
+        f->in_lru = false;
+        s_bytes -= f->cost;
+    }
+    s_files.erase( f->path );
+    f->in_table = false;
+    return --f->refs == 0;
+}
+
+void file_cache::free_file( cached_file* f )
+{
+    if( f->data )
+    {
+        munmap( f->data, f->st.st_size );
+    }
+    delete f;
+}
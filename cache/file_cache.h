@@ -0,0 +1,96 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../locker/locker.h"
+
+//缓存中的一个文件:整个文件以只读方式mmap到内存,同时请求它的所有连接共享这一个映射
+struct cached_file
+{
+    std::string path;
+    //加载者stat得到的状态,之后的请求据此判断文件是否已经被修改
+    struct stat st;
+    char* data;
+    //加载失败时的errno,0表示成功
+    int err;
+    //加载是否已经结束,结束之前到达的请求挂在waiters上,加载者负责恢复它们
+    bool ready;
+    std::vector< void* > waiters;
+    //引用计数:散列表持有一个,每个正在使用它的请求各持有一个,降为0时munmap
+    int refs;
+    bool in_table;
+    //加载完毕并留在缓存中的文件在LRU链表中的位置
+    bool in_lru;
+    std::list< cached_file* >::iterator lru;
+    //父目录受file_watcher监视且文件本身不是符号链接:文件的修改一定会使条目失效,命中时不需要stat
+    bool watched;
+    //插入时缓存的代数,invalidate_all之后旧的条目全部失效
+    unsigned long generation;
+    //计入缓存总大小的字节数:文件的大小,不存在的路径按条目本身的开销计算
+    long cost;
+};
+
+//按完整路径缓存文件的映射,并合并同一个文件的并发加载(single-flight)
+//。第一个请求冷文件的工作线程负责open和mmap,同时到达的其他请求不占用工作线程,而是把连接挂在这个条目上
+//,加载完成后由加载者逐个恢复,N个请求只加载一次、缺页一次
+//。留在缓存中的文件的总大小受max_bytes限制,按LRU淘汰;超过max_file的文件只在有请求使用它期间共享,不留在缓存中
+//。受file_watcher监视的条目(包括记录"文件不存在"的条目)由inotify事件使其失效,其余的条目每次命中时由调用者stat验证
+//。所有函数都可以由任意线程调用
+class file_cache
+{
+public:
+    //查找的结果:缓存命中、调用者负责加载、其他请求正在加载、没有可以不经stat直接使用的条目
+    enum RESULT { FILE_HIT, FILE_LOAD, FILE_WAIT, FILE_MISS };
+
+    //缓存的总字节数和单个文件的上限,max_bytes为0时不保留任何文件,但仍然合并并发加载
+    static void configure( long max_bytes, long max_file );
+    //内存压力时把上限临时降为max_bytes的percent%并立即淘汰多出的文件,100恢复原来的上限
+    static void shrink( int percent );
+
+    //不stat直接查找path:受监视的条目返回FILE_HIT(err为ENOENT时表示文件不存在),正在加载时返回FILE_WAIT
+    //,都带有一个引用;其他情况返回FILE_MISS,调用者应stat后调用acquire
+    static RESULT lookup( const char* path, cached_file** f );
+    //查找path,st为调用者刚刚stat得到的状态,缓存中的文件与之不符时视为已被修改,换成新的条目
+    //。三种结果*f都带有一个引用,用完后调用release:FILE_HIT时*f已经加载完毕;FILE_LOAD时调用者应调用load
+    //;FILE_WAIT时调用者应调用park挂起请求
+    static RESULT acquire( const char* path, const struct stat& st, cached_file** f );
+    //加载f,结束后把挂起的请求移到waiters中,由调用者恢复
+    static void load( cached_file* f, std::vector< void* >& waiters );
+    //把waiter挂在正在加载的f上,返回false表示f已经加载完毕,调用者直接使用它
+    static bool park( cached_file* f, void* waiter );
+    static void release( cached_file* f );
+    //记住stat得到ENOENT的path,之后的请求不需要stat就能返回404。只记录受监视的目录中的路径
+    static void remember_missing( const char* path );
+
+    //file_watcher调用:files中的文件和dirs中的目录下的所有条目失效
+    static void invalidate( const std::vector< std::string >& files, const std::vector< std::string >& dirs );
+    //增加代数,所有条目失效
+    static void invalidate_all();
+
+private:
+    //把条目加入LRU链表并淘汰超出上限的条目,被淘汰且引用降为0的条目加入dead
+    static void retain( cached_file* f, std::vector< cached_file* >& dead );
+    //按LRU淘汰超出s_limit的条目
+    static void evict( std::vector< cached_file* >& dead );
+    //把f从散列表中去掉并释放表持有的引用,返回true表示引用已降为0,调用者应在解锁后free_file
+    static bool unlink( cached_file* f );
+    static void free_file( cached_file* f );
+
+    static locker s_lock;
+    static std::unordered_map< std::string, cached_file* > s_files;
+    //最近使用的在前
+    static std::list< cached_file* > s_lru;
+    static long s_bytes;
+    static long s_max_bytes;
+    //实际生效的上限:s_max_bytes的s_percent%
+    static long s_limit;
+    static int s_percent;
+    static long s_max_file;
+    static unsigned long s_generation;
+};
+
+#endif
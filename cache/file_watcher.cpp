@@ -0,0 +1,342 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "file_watcher.h"
+#include "file_cache.h"
+#include "../metrics/metrics.h"
+
+int file_watcher::s_inotify = -1;
+int file_watcher::s_wake = -1;
+pthread_t file_watcher::s_thread;
+bool file_watcher::s_started = false;
+locker file_watcher::s_lock;
+std::vector< std::string > file_watcher::s_roots;
+std::vector< std::string > file_watcher::s_pending;
+bool file_watcher::s_has_pending = false;
+bool file_watcher::s_stop = false;
+std::unordered_map< int, std::string > file_watcher::s_wds;
+std::unordered_map< std::string, int > file_watcher::s_dirs;
+
+//目录中的文件被写入、改变属性、创建、删除、移入移出,以及目录本身被删除或移走
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE
+                                   | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+                                   | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+bool file_watcher::watch( const std::vector< std::string >& roots )
+{
+    if( ! s_started )
+    {
+        s_inotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+        if( s_inotify < 0 )
+        {
+            printf( "inotify unavailable, errno is: %d\n", errno );
+            return false;
+        }
+        s_wake = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        if( s_wake < 0 || pthread_create( &s_thread, NULL, run, NULL ) != 0 )
+        {
+            close( s_inotify );
+            s_inotify = -1;
+            if( s_wake >= 0 )
+            {
+                close( s_wake );
+                s_wake = -1;
+            }
+            return false;
+        }
+        s_started = true;
+    }
+    //根目录末尾的'/'去掉,和缓存条目的路径中的目录部分一致
+    std::vector< std::string > dirs;
+    for( size_t i = 0; i < roots.size(); ++i )
+    {
+        std::string dir = roots[i];
+        while( dir.size() > 1 && dir[ dir.size() - 1 ] == '/' )
+        {
+            dir.erase( dir.size() - 1 );
+        }
+        if( std::find( dirs.begin(), dirs.end(), dir ) == dirs.end() )
+        {
+            dirs.push_back( dir );
+        }
+    }
+    s_lock.lock();
+    s_pending = dirs;
+    s_has_pending = true;
+    s_lock.unlock();
+    uint64_t one = 1;
+    ::write( s_wake, &one, sizeof( one ) );
+    return true;
+}
+
+void file_watcher::stop()
+{
+    if( ! s_started )
+    {
+        return;
+    }
+    s_lock.lock();
+    s_stop = true;
+    s_lock.unlock();
+    uint64_t one = 1;
+    ::write( s_wake, &one, sizeof( one ) );
+    pthread_join( s_thread, NULL );
+    close( s_inotify );
+    close( s_wake );
+    s_inotify = s_wake = -1;
+    s_wds.clear();
+    s_dirs.clear();
+    s_roots.clear();
+    s_stop = false;
+    s_started = false;
+    metrics::set( FILE_WATCHES, 0 );
+    //此后的修改不再有通知,原来受监视的条目不能再不经stat直接使用
+    file_cache::invalidate_all();
+}
+
+bool file_watcher::covers( const std::string& dir )
+{
+    s_lock.lock();
+    bool ret = s_dirs.find( dir ) != s_dirs.end();
+    s_lock.unlock();
+    return ret;
+}
+
+void* file_watcher::run( void* arg )
+{
+    //一次读取尽量多的事件,一批事件只调用一次file_cache::invalidate
+    static const int EVENT_BUF_SIZE = 64 * 1024;
+    char* buf = new char[ EVENT_BUF_SIZE ];
+    std::vector< std::string > files;
+    std::vector< std::string > dirs;
+    while( true )
+    {
+        struct pollfd fds[ 2 ];
+        fds[ 0 ].fd = s_wake;
+        fds[ 0 ].events = POLLIN;
+        fds[ 1 ].fd = s_inotify;
+        fds[ 1 ].events = POLLIN;
+        if( poll( fds, 2, -1 ) < 0 )
+        {
+            continue;
+        }
+        if( fds[ 0 ].revents & POLLIN )
+        {
+            uint64_t n;
+            ::read( s_wake, &n, sizeof( n ) );
+            s_lock.lock();
+            bool stop = s_stop;
+            bool changed = s_has_pending && s_pending != s_roots;
+            if( changed )
+            {
+                s_roots = s_pending;
+            }
+            s_has_pending = false;
+            s_lock.unlock();
+            if( stop )
+            {
+                break;
+            }
+            if( changed )
+            {
+                rebuild();
+            }
+        }
+        if( ! ( fds[ 1 ].revents & POLLIN ) )
+        {
+            continue;
+        }
+
+        bool ok = true;
+        while( true )
+        {
+            ssize_t len = ::read( s_inotify, buf, EVENT_BUF_SIZE );
+            if( len <= 0 )
+            {
+                break;
+            }
+            ok = handle( buf, len, files, dirs ) && ok;
+        }
+        if( ! ok )
+        {
+            rebuild();
+        }
+        else if( ! files.empty() || ! dirs.empty() )
+        {
+            file_cache::invalidate( files, dirs );
+        }
+        files.clear();
+        dirs.clear();
+    }
+    delete [] buf;
+    return NULL;
+}
+
+void file_watcher::rebuild()
+{
+    s_lock.lock();
+    std::vector< std::string > roots = s_roots;
+    for( std::unordered_map< int, std::string >::iterator it = s_wds.begin(); it != s_wds.end(); ++it )
+    {
+        inotify_rm_watch( s_inotify, it->first );
+    }
+    s_wds.clear();
+    s_dirs.clear();
+    s_lock.unlock();
+
+    for( size_t i = 0; i < roots.size(); ++i )
+    {
+        add_tree( roots[i] );
+    }
+    //原来受监视的条目可能已不再受监视,修改也可能已经丢失:之前的所有条目失效
+    file_cache::invalidate_all();
+    s_lock.lock();
+    printf( "watching %zu directories under %zu document roots\n", s_dirs.size(), roots.size() );
+    s_lock.unlock();
+}
+
+void file_watcher::add_tree( const std::string& root )
+{
+    //深度优先,不跟随符号链接:经过符号链接的路径不受监视,其中的文件每次命中都stat
+    std::vector< std::string > stack( 1, root );
+    while( ! stack.empty() )
+    {
+        std::string dir = stack.back();
+        stack.pop_back();
+        int wd = inotify_add_watch( s_inotify, dir.c_str(), WATCH_MASK );
+        if( wd < 0 )
+        {
+            if( errno == ENOSPC )
+            {
+                printf( "inotify watch limit reached at %s, files there are checked with stat\n", dir.c_str() );
+            }
+            continue;
+        }
+        s_lock.lock();
+        s_wds[ wd ] = dir;
+        s_dirs[ dir ] = wd;
+        metrics::set( FILE_WATCHES, s_wds.size() );
+        s_lock.unlock();
+
+        DIR* d = opendir( dir.c_str() );
+        if( ! d )
+        {
+            continue;
+        }
+        while( struct dirent* ent = readdir( d ) )
+        {
+            if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+            {
+                continue;
+            }
+            bool is_dir = ent->d_type == DT_DIR;
+            if( ent->d_type == DT_UNKNOWN )
+            {
+                struct stat st;
+                is_dir = fstatat( dirfd( d ), ent->d_name, &st, AT_SYMLINK_NOFOLLOW ) == 0 && S_ISDIR( st.st_mode );
+            }
+            if( is_dir )
+            {
+                stack.push_back( dir + "/" + ent->d_name );
+            }
+        }
+        closedir( d );
+    }
+}
+
+void file_watcher::remove_tree( const std::string& dir )
+{
+    std::string prefix = dir + "/";
+    s_lock.lock();
+    for( std::unordered_map< std::string, int >::iterator it = s_dirs.begin(); it != s_dirs.end(); )
+    {
+        if( it->first == dir || it->first.compare( 0, prefix.size(), prefix ) == 0 )
+        {
+            inotify_rm_watch( s_inotify, it->second );
+            s_wds.erase( it->second );
+            it = s_dirs.erase( it );
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    metrics::set( FILE_WATCHES, s_wds.size() );
+    s_lock.unlock();
+}
+
+bool file_watcher::handle( const char* buf, long len, std::vector< std::string >& files, std::vector< std::string >& dirs )
+{
+    bool ok = true;
+    for( const char* p = buf; p < buf + len; )
+    {
+        const struct inotify_event* ev = ( const struct inotify_event* )p;
+        p += sizeof( struct inotify_event ) + ev->len;
+        if( ev->mask & IN_Q_OVERFLOW )
+        {
+            printf( "inotify queue overflow, invalidate the whole file cache\n" );
+            ok = false;
+            continue;
+        }
+
+        s_lock.lock();
+        std::unordered_map< int, std::string >::iterator it = s_wds.find( ev->wd );
+        if( it == s_wds.end() )
+        {
+            s_lock.unlock();
+            continue;
+        }
+        std::string dir = it->second;
+        if( ev->mask & IN_IGNORED )
+        {
+            //目录已被删除或移出文件系统,监视被内核自动移除
+            s_dirs.erase( dir );
+            s_wds.erase( it );
+            metrics::set( FILE_WATCHES, s_wds.size() );
+        }
+        s_lock.unlock();
+
+        if( ev->mask & ( IN_DELETE_SELF | IN_MOVE_SELF ) )
+        {
+            //其他目录的删除和移动在父目录的事件中处理,根目录本身没有受监视的父目录
+            for( size_t i = 0; i < s_roots.size(); ++i )
+            {
+                if( s_roots[i] == dir )
+                {
+                    ok = false;
+                }
+            }
+            continue;
+        }
+        if( ev->len == 0 )
+        {
+            continue;
+        }
+
+        std::string path = dir + "/" + ev->name;
+        if( ! ( ev->mask & IN_ISDIR ) )
+        {
+            files.push_back( path );
+            continue;
+        }
+        //目录下的所有条目失效,移入或新建的目录开始受监视,移出或删除的目录不再受监视
+        dirs.push_back( path );
+        if( ev->mask & ( IN_MOVED_FROM | IN_DELETE ) )
+        {
+            remove_tree( path );
+        }
+        else if( ev->mask & ( IN_MOVED_TO | IN_CREATE ) )
+        {
+            add_tree( path );
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,53 @@
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <pthread.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../locker/locker.h"
+
+//用inotify监视网站根目录下的所有目录,把文件的修改、移动、删除成批地转换为文件缓存条目的失效
+//。父目录受监视的缓存条目命中时不再stat;监视不到的目录(超过max_user_watches、没有权限、经过符号链接)
+//中的文件仍然每次命中都stat。事件队列溢出(IN_Q_OVERFLOW)时丢失了哪些修改已经无从得知
+//,增加缓存的代数使所有条目失效,并重新建立所有监视
+class file_watcher
+{
+public:
+    //监视roots及其下的所有目录,在后台线程中进行。重新加载配置时再次调用,roots不变时什么也不做
+    //。只能由主线程调用,inotify不可用时返回false,缓存退回到每次命中都stat
+    static bool watch( const std::vector< std::string >& roots );
+    //停止后台线程并移除所有监视,只能由主线程调用
+    static void stop();
+
+    //目录dir(末尾不带'/')是否受监视,dir中文件的修改一定会通知缓存
+    static bool covers( const std::string& dir );
+
+private:
+    static void* run( void* arg );
+    //下面的函数只在后台线程中调用
+    //移除所有监视,重新监视s_roots
+    static void rebuild();
+    static void add_tree( const std::string& dir );
+    static void remove_tree( const std::string& dir );
+    //处理读到的一批事件,把受影响的文件和目录分别加入files和dirs,返回false表示队列溢出或根目录本身被移走
+    static bool handle( const char* buf, long len, std::vector< std::string >& files, std::vector< std::string >& dirs );
+
+    static int s_inotify;
+    //主线程通过它通知后台线程:根目录有变化或应当退出
+    static int s_wake;
+    static pthread_t s_thread;
+    static bool s_started;
+
+    //保护下面的成员
+    static locker s_lock;
+    static std::vector< std::string > s_roots;
+    static std::vector< std::string > s_pending;
+    static bool s_has_pending;
+    static bool s_stop;
+    //监视描述符和目录的对应关系
+    static std::unordered_map< int, std::string > s_wds;
+    static std::unordered_map< std::string, int > s_dirs;
+};
+
+#endif
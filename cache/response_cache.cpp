@@ -0,0 +1,449 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "response_cache.h"
+#include "../metrics/metrics.h"
+
+locker response_cache::s_lock;
+std::unordered_map< std::string, cached_response* > response_cache::s_responses;
+std::list< cached_response* > response_cache::s_segments[ 2 ];
+long response_cache::s_segment_bytes[ 2 ] = { 0, 0 };
+long response_cache::s_max_bytes = 16L * 1024 * 1024;
+long response_cache::s_limit = 16L * 1024 * 1024;
+int response_cache::s_percent = 100;
+long response_cache::s_max_entry = 1024L * 1024;
+
+//Cache-Control没有给出新鲜期时缓存的秒数
+static const long DEFAULT_TTL_SEC = 1;
+//保护段最多占总大小的百分比,其余留给新进入的条目
+static const long PROTECTED_PERCENT = 80;
+static const long long NS_PER_SEC = 1000000000LL;
+
+void response_cache::configure( long max_bytes, long max_entry )
+{
+    std::vector< cached_response* > dead;
+    s_lock.lock();
+    s_max_bytes = max_bytes;
+    s_max_entry = max_entry;
+    s_limit = s_max_bytes / 100 * s_percent;
+    //缩小上限时立即淘汰多出的条目
+    evict( dead );
+    metrics::set( MICROCACHE_BYTES, s_segment_bytes[ 0 ] + s_segment_bytes[ 1 ] );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_response( dead[i] );
+    }
+}
+
+void response_cache::shrink( int percent )
+{
+    std::vector< cached_response* > dead;
+    s_lock.lock();
+    s_percent = percent;
+    s_limit = s_max_bytes / 100 * s_percent;
+    evict( dead );
+    metrics::set( MICROCACHE_BYTES, s_segment_bytes[ 0 ] + s_segment_bytes[ 1 ] );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_response( dead[i] );
+    }
+}
+
+response_cache::RESULT response_cache::acquire( const std::string& key, long long now, cached_response** r )
+{
+    cached_response* backup = NULL;
+    cached_response* dead = NULL;
+    s_lock.lock();
+    std::unordered_map< std::string, cached_response* >::iterator it = s_responses.find( key );
+    if( it != s_responses.end() )
+    {
+        cached_response* cur = it->second;
+        if( ! cur->ready )
+        {
+            ++cur->refs;
+            s_lock.unlock();
+            metrics::add( MICROCACHE_COALESCED, 1 );
+            *r = cur;
+            return RESP_WAIT;
+        }
+        if( now < cur->fresh_until )
+        {
+            if( cur->pass )
+            {
+                s_lock.unlock();
+                metrics::add( MICROCACHE_PASSES, 1 );
+                *r = NULL;
+                return RESP_PASS;
+            }
+            touch( cur );
+            ++cur->refs;
+            s_lock.unlock();
+            metrics::add( MICROCACHE_HITS, 1 );
+            *r = cur;
+            return RESP_HIT;
+        }
+        //stale-while-revalidate:第一个请求重新生成,新的条目生成完毕才放进散列表,其他请求继续使用旧的条目
+        if( ! cur->pass && now < cur->stale_until )
+        {
+            if( cur->refreshing )
+            {
+                touch( cur );
+                ++cur->refs;
+                s_lock.unlock();
+                metrics::add( MICROCACHE_STALE_HITS, 1 );
+                *r = cur;
+                return RESP_STALE;
+            }
+            cur->refreshing = true;
+            cached_response* fill = create( key, false );
+            fill->fallback = cur;
+            ++cur->refs;
+            s_lock.unlock();
+            metrics::add( MICROCACHE_FILLS, 1 );
+            *r = fill;
+            return RESP_FILL;
+        }
+        //宽限期已过:新的条目立即替换它,之后的请求合并到新的条目上
+        //。旧条目在stale-if-error期限内留作新条目的后备,否则在unlink之后可能就已经没有引用
+        if( ! cur->pass && now < cur->error_until )
+        {
+            ++cur->refs;
+            backup = cur;
+        }
+        if( unlink( cur ) )
+        {
+            dead = cur;
+        }
+    }
+
+    cached_response* fill = create( key, true );
+    fill->fallback = backup;
+    s_lock.unlock();
+    if( dead )
+    {
+        free_response( dead );
+    }
+    metrics::add( MICROCACHE_FILLS, 1 );
+    *r = fill;
+    return RESP_FILL;
+}
+
+bool response_cache::park( cached_response* r, void* waiter )
+{
+    s_lock.lock();
+    bool parked = ! r->ready;
+    if( parked )
+    {
+        r->waiters.push_back( waiter );
+    }
+    s_lock.unlock();
+    return parked;
+}
+
+void response_cache::complete( cached_response* r, char* body, long len, const std::string& headers,
+                               const std::string& policy, long long now, std::vector< void* >& waiters )
+{
+    //响应体和头部在加锁之前填好,条目在finish中标记为ready之后才被其他线程读取
+    r->body = body;
+    r->len = len;
+    r->headers = headers;
+    r->cost = sizeof( cached_response ) + r->key.size() + headers.size() + len;
+    std::vector< cached_response* > dead;
+    s_lock.lock();
+    finish( r, policy, now, len <= s_max_entry, waiters, dead );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_response( dead[i] );
+    }
+}
+
+void response_cache::pass( cached_response* r, const std::string& policy, long long now, std::vector< void* >& waiters )
+{
+    //只记住这个键不可缓存,不保存响应体
+    r->pass = true;
+    r->cost = sizeof( cached_response ) + r->key.size();
+    std::vector< cached_response* > dead;
+    s_lock.lock();
+    finish( r, policy, now, true, waiters, dead );
+    s_lock.unlock();
+    metrics::add( MICROCACHE_PASSES, 1 );
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_response( dead[i] );
+    }
+}
+
+void response_cache::fail( cached_response* r, int err, long long now, std::vector< void* >& waiters )
+{
+    std::vector< cached_response* > dead;
+    s_lock.lock();
+    r->err = err;
+    r->born = now;
+    r->ready = true;
+    waiters.swap( r->waiters );
+    cached_response* old = r->fallback;
+    //没有权限不是暂时的错误,不用旧的响应掩盖它
+    if( old && ( err == EACCES || now >= old->error_until ) )
+    {
+        r->fallback = NULL;
+    }
+    if( r->in_table )
+    {
+        //失败的条目不缓存;旧条目放回散列表,之后的请求照常尝试重新生成,失败时继续用它作后备
+        unlink( r );
+        if( r->fallback && s_responses.find( r->key ) == s_responses.end() )
+        {
+            s_responses[ r->key ] = old;
+            old->in_table = true;
+            ++old->refs;
+            retain( old, dead );
+        }
+    }
+    else if( old && old->in_table )
+    {
+        //stale-while-revalidate期间的刷新失败:旧条目仍在散列表中,下一个过期的请求再次尝试
+        old->refreshing = false;
+    }
+    if( old && ! r->fallback && --old->refs == 0 )
+    {
+        dead.push_back( old );
+    }
+    metrics::set( MICROCACHE_BYTES, s_segment_bytes[ 0 ] + s_segment_bytes[ 1 ] );
+    s_lock.unlock();
+    for( size_t i = 0; i < dead.size(); ++i )
+    {
+        free_response( dead[i] );
+    }
+}
+
+void response_cache::release( cached_response* r )
+{
+    s_lock.lock();
+    bool last = --r->refs == 0;
+    s_lock.unlock();
+    if( last )
+    {
+        free_response( r );
+    }
+}
+
+//不区分大小写地比较Cache-Control中的一个指令名,name以'='结尾时返回值的起始位置
+static const char* directive_value( const char* token, size_t len, const char* name )
+{
+    size_t n = strlen( name );
+    if( len < n || strncasecmp( token, name, n ) != 0 )
+    {
+        return NULL;
+    }
+    if( name[ n - 1 ] == '=' )
+    {
+        return token + n;
+    }
+    return len == n ? token + n : NULL;
+}
+
+bool response_cache::parse_policy( const std::string& policy, long long* ttl, long long* swr, long long* sie )
+{
+    long max_age = -1;
+    long s_maxage = -1;
+    long while_revalidate = 0;
+    long if_error = 0;
+    const char* p = policy.c_str();
+    while( *p )
+    {
+        p += strspn( p, " \t," );
+        size_t len = strcspn( p, "," );
+        while( len > 0 && ( p[ len - 1 ] == ' ' || p[ len - 1 ] == '\t' ) )
+        {
+            --len;
+        }
+        const char* value = NULL;
+        if( directive_value( p, len, "no-store" ) || directive_value( p, len, "no-cache" )
+            || directive_value( p, len, "private" ) )
+        {
+            return false;
+        }
+        else if( ( value = directive_value( p, len, "s-maxage=" ) ) )
+        {
+            s_maxage = atol( value );
+        }
+        else if( ( value = directive_value( p, len, "max-age=" ) ) )
+        {
+            max_age = atol( value );
+        }
+        else if( ( value = directive_value( p, len, "stale-while-revalidate=" ) ) )
+        {
+            while_revalidate = atol( value );
+        }
+        else if( ( value = directive_value( p, len, "stale-if-error=" ) ) )
+        {
+            if_error = atol( value );
+        }
+        p += strcspn( p, "," );
+    }
+    long fresh = s_maxage >= 0 ? s_maxage : ( max_age >= 0 ? max_age : DEFAULT_TTL_SEC );
+    if( fresh <= 0 )
+    {
+        return false;
+    }
+    *ttl = fresh * NS_PER_SEC;
+    *swr = while_revalidate > 0 ? while_revalidate * NS_PER_SEC : 0;
+    *sie = if_error > 0 ? if_error * NS_PER_SEC : 0;
+    return true;
+}
+
+cached_response* response_cache::create( const std::string& key, bool in_table )
+{
+    cached_response* r = new cached_response;
+    r->key = key;
+    r->body = NULL;
+    r->len = 0;
+    r->err = 0;
+    r->born = r->fresh_until = r->stale_until = r->error_until = 0;
+    r->ready = false;
+    r->refreshing = false;
+    r->pass = false;
+    r->fallback = NULL;
+    //散列表一个(不在表中时没有),生成者一个
+    r->refs = in_table ? 2 : 1;
+    r->in_table = in_table;
+    r->segment = -1;
+    r->cost = 0;
+    if( in_table )
+    {
+        s_responses[ key ] = r;
+    }
+    return r;
+}
+
+void response_cache::finish( cached_response* r, const std::string& policy, long long now, bool keep,
+                             std::vector< void* >& waiters, std::vector< cached_response* >& dead )
+{
+    long long ttl = 0, swr = 0, sie = 0;
+    keep = parse_policy( policy, &ttl, &swr, &sie ) && keep && r->cost <= s_limit;
+    r->born = now;
+    r->fresh_until = now + ttl;
+    r->stale_until = r->fresh_until + swr;
+    r->error_until = r->fresh_until + sie;
+    r->ready = true;
+    waiters.swap( r->waiters );
+    //生成成功,不再需要后备的旧条目
+    if( r->fallback )
+    {
+        if( --r->fallback->refs == 0 )
+        {
+            dead.push_back( r->fallback );
+        }
+        r->fallback = NULL;
+    }
+    //替换同一个键的旧条目;其他请求正在生成的条目保留,这次的响应不放进散列表
+    std::unordered_map< std::string, cached_response* >::iterator it = s_responses.find( r->key );
+    if( it != s_responses.end() && it->second != r )
+    {
+        cached_response* cur = it->second;
+        if( ! cur->ready )
+        {
+            keep = false;
+        }
+        else if( unlink( cur ) )
+        {
+            dead.push_back( cur );
+        }
+    }
+    if( keep )
+    {
+        if( ! r->in_table )
+        {
+            s_responses[ r->key ] = r;
+            r->in_table = true;
+            ++r->refs;
+        }
+        retain( r, dead );
+    }
+    else if( r->in_table )
+    {
+        //生成者还持有引用,这里不会降为0
+        unlink( r );
+    }
+    metrics::set( MICROCACHE_BYTES, s_segment_bytes[ 0 ] + s_segment_bytes[ 1 ] );
+}
+
+void response_cache::retain( cached_response* r, std::vector< cached_response* >& dead )
+{
+    s_segments[ 0 ].push_front( r );
+    r->lru = s_segments[ 0 ].begin();
+    r->segment = 0;
+    s_segment_bytes[ 0 ] += r->cost;
+    evict( dead );
+}
+
+void response_cache::touch( cached_response* r )
+{
+    if( r->segment == 1 )
+    {
+        s_segments[ 1 ].splice( s_segments[ 1 ].begin(), s_segments[ 1 ], r->lru );
+        return;
+    }
+    if( r->segment != 0 )
+    {
+        return;
+    }
+    s_segments[ 1 ].splice( s_segments[ 1 ].begin(), s_segments[ 0 ], r->lru );
+    r->segment = 1;
+    s_segment_bytes[ 0 ] -= r->cost;
+    s_segment_bytes[ 1 ] += r->cost;
+    //保护段超出份额:最久未用的条目回到试用段的头部,还有一次命中的机会
+    while( s_segment_bytes[ 1 ] > s_limit / 100 * PROTECTED_PERCENT && s_segments[ 1 ].size() > 1 )
+    {
+        cached_response* demoted = s_segments[ 1 ].back();
+        s_segments[ 0 ].splice( s_segments[ 0 ].begin(), s_segments[ 1 ], demoted->lru );
+        demoted->segment = 0;
+        s_segment_bytes[ 1 ] -= demoted->cost;
+        s_segment_bytes[ 0 ] += demoted->cost;
+    }
+}
+
+void response_cache::evict( std::vector< cached_response* >& dead )
+{
+    //先淘汰试用段中只被访问过一次的条目,试用段为空时才动保护段
+    while( s_segment_bytes[ 0 ] + s_segment_bytes[ 1 ] > s_limit )
+    {
+        int seg = s_segments[ 0 ].empty() ? 1 : 0;
+        if( s_segments[ seg ].empty() )
+        {
+            break;
+        }
+        cached_response* victim = s_segments[ seg ].back();
+        metrics::add( MICROCACHE_EVICTIONS, 1 );
+        if( unlink( victim ) )
+        {
+            dead.push_back( victim );
+        }
+    }
+}
+
+bool response_cache::unlink( cached_response* r )
+{
+    if( r->segment >= 0 )
+    {
+        s_segments[ r->segment ].erase( r->lru );
+        s_segment_bytes[ r->segment ] -= r->cost;
+        r->segment = -1;
+    }
+    s_responses.erase( r->key );
+    r->in_table = false;
+    return --r->refs == 0;
+}
+
+void response_cache::free_response( cached_response* r )
+{
+    if( r->fallback )
+    {
+        release( r->fallback );
+    }
+    free( r->body );
+    delete r;
+}
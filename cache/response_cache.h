@@ -0,0 +1,110 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../locker/locker.h"
+
+//微缓存中的一个动态响应:头部和响应体生成一次,命中的所有连接共享同一块内存
+struct cached_response
+{
+    //方法、Host和URL
+    std::string key;
+    //Content-Type和Cache-Control头部,每行以\r\n结尾,发送时直接复制
+    std::string headers;
+    //malloc分配的响应体,命中的连接直接writev它,不复制
+    char* body;
+    long len;
+    //生成失败时的errno,0表示成功
+    int err;
+    //生成完毕的时刻,以及新鲜期、过期后仍可返回并由一个请求重新生成(stale-while-revalidate)
+    //、重新生成失败时仍可返回(stale-if-error)的期限,都是单调时钟的纳秒
+    long long born;
+    long long fresh_until;
+    long long stale_until;
+    long long error_until;
+    //生成是否已经结束,结束之前到达的请求挂在waiters上,生成者负责恢复它们
+    bool ready;
+    std::vector< void* > waiters;
+    //过期后已经有一个请求在重新生成,其他请求在stale_until之前继续使用这个条目
+    bool refreshing;
+    //响应太大不能缓存:新鲜期内的请求不再等待其他请求,各自生成(hit-for-pass)
+    bool pass;
+    //重新生成这个键时被替换的旧条目,生成失败时在stale-if-error期限内代替它返回,持有一个引用
+    cached_response* fallback;
+    //引用计数:散列表持有一个,每个正在使用它的请求各持有一个,降为0时释放响应体
+    int refs;
+    bool in_table;
+    //分段LRU中所在的段(0试用段,1保护段),不在链表中时为-1
+    int segment;
+    std::list< cached_response* >::iterator lru;
+    //计入缓存总大小的字节数
+    long cost;
+};
+
+//动态响应的微缓存:按方法、Host和URL缓存生成的响应,新鲜期和过期后的两个宽限期由响应的Cache-Control决定
+//。同一个键的并发未命中只生成一次,其他请求挂在条目上,生成完毕后由生成者恢复(请求合并)
+//;过期后stale-while-revalidate期限内由第一个请求重新生成,其他请求继续得到旧的响应
+//;重新生成失败时stale-if-error期限内返回旧的响应
+//。总大小受max_bytes限制,按分段LRU淘汰:新条目进入试用段,再次命中才升入保护段,一次性的扫描不会冲掉热点条目
+//。所有函数都可以由任意线程调用
+class response_cache
+{
+public:
+    //查找的结果:新鲜的条目、过期但可以返回的条目、调用者负责生成、其他请求正在生成、调用者自己生成且不缓存
+    enum RESULT { RESP_HIT, RESP_STALE, RESP_FILL, RESP_WAIT, RESP_PASS };
+
+    //缓存的总字节数和单个响应的上限,max_bytes为0时不保留任何响应,但仍然合并并发的生成
+    static void configure( long max_bytes, long max_entry );
+    static long max_entry() { return s_max_entry; }
+    //内存压力时把上限临时降为max_bytes的percent%并立即淘汰多出的条目,100恢复原来的上限
+    static void shrink( int percent );
+
+    //查找key,now为单调时钟。RESP_HIT、RESP_STALE和RESP_WAIT时*r带有一个引用,用完后调用release
+    //;RESP_FILL时*r是一个新的条目,调用者生成响应后调用complete、pass或fail;RESP_PASS时*r为NULL
+    static RESULT acquire( const std::string& key, long long now, cached_response** r );
+    //把waiter挂在正在生成的r上,返回false表示r已经生成完毕,调用者直接使用它
+    static bool park( cached_response* r, void* waiter );
+    //生成成功:接管malloc分配的body,policy是响应的Cache-Control,决定新鲜期和两个宽限期
+    //。挂起的请求移到waiters中,由调用者恢复
+    static void complete( cached_response* r, char* body, long len, const std::string& headers,
+                          const std::string& policy, long long now, std::vector< void* >& waiters );
+    //响应超过了max_entry:新鲜期内的请求各自生成,挂起的请求同样如此
+    static void pass( cached_response* r, const std::string& policy, long long now, std::vector< void* >& waiters );
+    //生成失败,err为errno。EACCES之外的错误在旧条目的stale-if-error期限内由r->fallback代替返回
+    static void fail( cached_response* r, int err, long long now, std::vector< void* >& waiters );
+    static void release( cached_response* r );
+
+    //解析Cache-Control:新鲜期取s-maxage,没有时取max-age,都没有时为1秒;no-store、no-cache、private不缓存
+    //。返回false表示不缓存,时间都是纳秒
+    static bool parse_policy( const std::string& policy, long long* ttl, long long* swr, long long* sie );
+
+private:
+    static cached_response* create( const std::string& key, bool in_table );
+    //生成结束:记录期限,把条目放进散列表和LRU(替换同一个键的旧条目),被替换或淘汰且引用降为0的条目加入dead
+    static void finish( cached_response* r, const std::string& policy, long long now, bool keep,
+                        std::vector< void* >& waiters, std::vector< cached_response* >& dead );
+    //把条目加入试用段并淘汰超出上限的条目
+    static void retain( cached_response* r, std::vector< cached_response* >& dead );
+    //命中:试用段的条目升入保护段,保护段超出份额时把最久未用的条目降回试用段
+    static void touch( cached_response* r );
+    static void evict( std::vector< cached_response* >& dead );
+    //把r从LRU和散列表中去掉并释放表持有的引用,返回true表示引用已降为0,调用者应在解锁后free_response
+    static bool unlink( cached_response* r );
+    static void free_response( cached_response* r );
+
+    static locker s_lock;
+    static std::unordered_map< std::string, cached_response* > s_responses;
+    //两个段,最近使用的在前
+    static std::list< cached_response* > s_segments[ 2 ];
+    static long s_segment_bytes[ 2 ];
+    static long s_max_bytes;
+    //实际生效的上限:s_max_bytes的s_percent%
+    static long s_limit;
+    static int s_percent;
+    static long s_max_entry;
+};
+
+#endif
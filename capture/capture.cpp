@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "capture.h"
+#include "../metrics/metrics.h"
+
+bool traffic_capture::s_enabled = false;
+uint32_t traffic_capture::s_conn_ids = 0;
+locker traffic_capture::s_lock;
+int traffic_capture::s_fd = -1;
+char traffic_capture::s_path[ 256 ];
+long traffic_capture::s_max_bytes = 0;
+long traffic_capture::s_written = 0;
+long long traffic_capture::s_start = 0;
+long long traffic_capture::s_last_flush = 0;
+char traffic_capture::s_buf[ BUFFER_SIZE ];
+int traffic_capture::s_used = 0;
+
+static void write_all( int fd, const char* buf, int len )
+{
+    while( len > 0 )
+    {
+        int n = write( fd, buf, len );
+        if( n <= 0 )
+        {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+bool traffic_capture::configure( const char* path, long max_bytes )
+{
+    s_lock.lock();
+    if( s_fd != -1 && path && strcmp( path, s_path ) == 0 )
+    {
+        s_max_bytes = max_bytes;
+        s_lock.unlock();
+        return true;
+    }
+    stop();
+    if( ! path || ! path[0] )
+    {
+        s_lock.unlock();
+        return true;
+    }
+
+    if( strlen( path ) >= sizeof( s_path ) || ( s_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 )
+    {
+        printf( "cannot open capture file %s\n", path );
+        s_fd = -1;
+        s_lock.unlock();
+        return false;
+    }
+    strcpy( s_path, path );
+    s_max_bytes = max_bytes;
+    s_start = s_last_flush = monotonic_ns();
+
+    capture_header header;
+    memcpy( header.magic, CAPTURE_MAGIC, sizeof( header.magic ) );
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME, &ts );
+    header.start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    memcpy( s_buf, &header, sizeof( header ) );
+    s_used = sizeof( header );
+    s_written = sizeof( header );
+    __atomic_store_n( &s_enabled, true, __ATOMIC_RELAXED );
+    printf( "capturing requests to %s\n", path );
+    s_lock.unlock();
+    return true;
+}
+
+void traffic_capture::data( uint32_t conn_id, const char* buf, int len )
+{
+    append( conn_id, CAPTURE_DATA, buf, len );
+}
+
+void traffic_capture::close( uint32_t conn_id )
+{
+    append( conn_id, CAPTURE_CLOSE, NULL, 0 );
+}
+
+void traffic_capture::append( uint32_t conn_id, CAPTURE_TYPE type, const char* buf, int len )
+{
+    s_lock.lock();
+    if( s_fd == -1 )
+    {
+        s_lock.unlock();
+        return;
+    }
+
+    capture_record r;
+    long long now = monotonic_ns();
+    r.offset_ns = now - s_start;
+    r.conn_id = conn_id;
+    r.type = type;
+    r.reserved = 0;
+    r.len = len;
+    //达到文件大小上限后停止抓取,不写入不完整的记录
+    if( s_max_bytes > 0 && s_written + ( long )sizeof( r ) + len > s_max_bytes )
+    {
+        printf( "capture file %s reached %ld bytes, stop capturing\n", s_path, s_max_bytes );
+        stop();
+        s_lock.unlock();
+        return;
+    }
+
+    if( s_used + ( int )sizeof( r ) + len > BUFFER_SIZE )
+    {
+        flush();
+    }
+    if( ( int )sizeof( r ) + len > BUFFER_SIZE )
+    {
+        //超过缓冲区的大记录直接写入文件
+        write_all( s_fd, ( const char* )&r, sizeof( r ) );
+        write_all( s_fd, buf, len );
+    }
+    else
+    {
+        memcpy( s_buf + s_used, &r, sizeof( r ) );
+        memcpy( s_buf + s_used + sizeof( r ), buf, len );
+        s_used += sizeof( r ) + len;
+    }
+    s_written += sizeof( r ) + len;
+    if( now - s_last_flush > 1000000000LL )
+    {
+        flush();
+    }
+    s_lock.unlock();
+}
+
+void traffic_capture::tick()
+{
+    if( ! enabled() )
+    {
+        return;
+    }
+    s_lock.lock();
+    if( s_fd != -1 && s_used > 0 && monotonic_ns() - s_last_flush > 1000000000LL )
+    {
+        flush();
+    }
+    s_lock.unlock();
+}
+
+//调用者必须持有s_lock
+void traffic_capture::flush()
+{
+    write_all( s_fd, s_buf, s_used );
+    s_used = 0;
+    s_last_flush = monotonic_ns();
+}
+
+//调用者必须持有s_lock
+void traffic_capture::stop()
+{
+    if( s_fd == -1 )
+    {
+        return;
+    }
+    __atomic_store_n( &s_enabled, false, __ATOMIC_RELAXED );
+    flush();
+    ::close( s_fd );
+    s_fd = -1;
+    s_path[0] = '\0';
+}
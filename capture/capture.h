@@ -0,0 +1,76 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include "../locker/locker.h"
+
+//抓包文件的格式:文件头之后是一条条记录,每条记录是一个固定长度的记录头加上len字节的原始请求数据
+//,所有整数均为本机字节序
+//  文件头: magic[8] = "WSCAP\0\0\1", start_ns(抓取开始时的CLOCK_REALTIME,单位纳秒)
+//  记录头: offset_ns(距抓取开始的单调时间), conn_id, type, len
+static const char CAPTURE_MAGIC[ 8 ] = { 'W', 'S', 'C', 'A', 'P', 0, 0, 1 };
+
+enum CAPTURE_TYPE { CAPTURE_DATA = 0, CAPTURE_CLOSE };
+
+struct capture_header
+{
+    char magic[ 8 ];
+    uint64_t start_ns;
+};
+
+struct capture_record
+{
+    uint64_t offset_ns;
+    uint32_t conn_id;//连接编号,在一次抓取中唯一,不会像文件描述符那样被复用
+    uint16_t type;//CAPTURE_TYPE
+    uint16_t reserved;
+    uint32_t len;//CAPTURE_DATA之后紧跟的数据长度,CAPTURE_CLOSE为0
+} __attribute__( ( packed ) );
+
+//把服务器收到的请求按到达时间写入抓包文件,供replay工具按原来的节奏重放
+//。写入经过一个缓冲区,缓冲区满或距上次写盘超过1秒时写入文件,关闭时写入剩余数据
+//。data和close可由任意线程调用,内部加锁;没有在抓取时只检查一个标志
+class traffic_capture
+{
+public:
+    //开始抓取到path,max_bytes为文件大小上限(0表示不限),path为NULL或空时停止抓取
+    //。path和正在抓取的文件相同时继续写入原来的文件
+    static bool configure( const char* path, long max_bytes );
+
+    static bool enabled()
+    {
+        return __atomic_load_n( &s_enabled, __ATOMIC_RELAXED );
+    }
+
+    //分配一个连接编号
+    static uint32_t next_conn_id()
+    {
+        return __atomic_add_fetch( &s_conn_ids, 1, __ATOMIC_RELAXED );
+    }
+
+    static void data( uint32_t conn_id, const char* buf, int len );
+    static void close( uint32_t conn_id );
+    //由主线程定期调用,把缓冲了1秒以上的数据写入文件
+    static void tick();
+
+private:
+    static void append( uint32_t conn_id, CAPTURE_TYPE type, const char* buf, int len );
+    static void flush();
+    static void stop();
+
+    static const int BUFFER_SIZE = 65536;
+
+    static bool s_enabled;
+    static uint32_t s_conn_ids;
+    static locker s_lock;
+    static int s_fd;
+    static char s_path[ 256 ];
+    static long s_max_bytes;
+    static long s_written;
+    static long long s_start;
+    static long long s_last_flush;
+    static char s_buf[ BUFFER_SIZE ];
+    static int s_used;
+};
+
+#endif
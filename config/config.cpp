@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "config.h"
+
+//把一行拆分为若干个词,双引号内的空白不作为分隔符
+static bool split_line( const char* text, std::vector< std::string >& words )
+{
+    const char* p = text;
+    while( *p )
+    {
+        p += strspn( p, " \t\r\n" );
+        if( *p == '\0' || *p == '#' )
+        {
+            break;
+        }
+
+        std::string word;
+        bool quoted = false;
+        while( *p && ( quoted || ! strchr( " \t\r\n#", *p ) ) )
+        {
+            if( *p == '"' )
+            {
+                quoted = ! quoted;
+            }
+            else
+            {
+                word += *p;
+            }
+            ++p;
+        }
+        if( quoted )
+        {
+            return false;
+        }
+        words.push_back( word );
+    }
+    return true;
+}
+
+bool config::load( const char* path )
+{
+    FILE* fp = fopen( path, "r" );
+    if( ! fp )
+    {
+        printf( "can not open config file %s\n", path );
+        return false;
+    }
+
+    m_path = path;
+    m_directives.clear();
+
+    char buf[ 4096 ];
+    int line = 0;
+    bool ok = true;
+    while( fgets( buf, sizeof( buf ), fp ) )
+    {
+        ++line;
+        std::vector< std::string > words;
+        if( ! split_line( buf, words ) )
+        {
+            printf( "%s:%d: unterminated quote\n", path, line );
+            ok = false;
+            break;
+        }
+        if( words.empty() )
+        {
+            continue;
+        }
+
+        directive d;
+        d.name = words[ 0 ];
+        d.args.assign( words.begin() + 1, words.end() );
+        d.line = line;
+        m_directives.push_back( d );
+    }
+
+    fclose( fp );
+    return ok;
+}
+
+const directive* config::find_global( const char* name ) const
+{
+    for( size_t i = 0; i < m_directives.size(); ++i )
+    {
+        //server之后的指令都属于虚拟主机
+        if( m_directives[ i ].name == "server" )
+        {
+            break;
+        }
+        if( m_directives[ i ].name == name )
+        {
+            return &m_directives[ i ];
+        }
+    }
+    return NULL;
+}
+
+const char* config::get( const char* name, const char* def ) const
+{
+    const directive* d = find_global( name );
+    if( ! d || d->args.empty() )
+    {
+        return def;
+    }
+    return d->args[ 0 ].c_str();
+}
+
+int config::get_int( const char* name, int def ) const
+{
+    const char* value = get( name );
+    return value ? atoi( value ) : def;
+}
+
+bool config::get_bool( const char* name, bool def ) const
+{
+    const char* value = get( name );
+    if( ! value )
+    {
+        return def;
+    }
+    return strcasecmp( value, "on" ) == 0 || strcasecmp( value, "true" ) == 0
+            || strcmp( value, "1" ) == 0;
+}
+
+bool parse_option( const std::string& arg, const char* key, std::string& value )
+{
+    size_t len = strlen( key );
+    if( arg.size() <= len || arg.compare( 0, len, key ) != 0 || arg[ len ] != '=' )
+    {
+        return false;
+    }
+    value = arg.substr( len + 1 );
+    return true;
+}
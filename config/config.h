@@ -0,0 +1,45 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+//配置文件中的一条指令,例如 "location /static/ root=/var/www cache=max-age=60"
+//,name为"location",args为其后以空白分隔的参数,参数可用双引号包含空白字符
+struct directive
+{
+    std::string name;
+    std::vector< std::string > args;
+    int line;//所在行号,用于报错
+};
+
+//服务器配置文件,按行解析,#之后的内容为注释
+//。配置文件只负责词法层面的解析,各条指令的含义由使用它的模块(路由、主循环等)自行解释
+class config
+{
+public:
+    config(){}
+    ~config(){}
+
+    //从文件path中读取配置,失败时返回false并打印出错的行号
+    bool load( const char* path );
+
+    //返回第一条名为name的全局指令(出现在任何server块之前)的第一个参数,没有则返回def
+    const char* get( const char* name, const char* def = NULL ) const;
+    int get_int( const char* name, int def ) const;
+    bool get_bool( const char* name, bool def ) const;
+
+    const std::vector< directive >& directives() const { return m_directives; }
+    const std::string& path() const { return m_path; }
+
+private:
+    const directive* find_global( const char* name ) const;
+
+    std::string m_path;
+    std::vector< directive > m_directives;
+};
+
+//解析形如"key=value"的参数,参数以key=开头时返回true并将value写入value
+bool parse_option( const std::string& arg, const char* key, std::string& value );
+
+#endif
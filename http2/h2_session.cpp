@@ -0,0 +1,1013 @@
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "h2_session.h"
+#include "../router/router.h"
+#include "../mime/mime.h"
+#include "../metrics/metrics.h"
+#include "../trace/trace.h"
+#include "../pack/asset_pack.h"
+
+//HTTP/1.1响应使用的错误页面,定义在http_conn.cpp中
+extern const char* error_400_form;
+extern const char* error_403_form;
+extern const char* error_404_form;
+extern const char* error_500_form;
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const int PREFACE_LEN = 24;
+
+//帧类型
+enum { FRAME_DATA = 0, FRAME_HEADERS, FRAME_PRIORITY, FRAME_RST_STREAM, FRAME_SETTINGS, FRAME_PUSH_PROMISE
+, FRAME_PING, FRAME_GOAWAY, FRAME_WINDOW_UPDATE, FRAME_CONTINUATION };
+
+//帧标志
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+//错误码
+enum { NO_ERROR = 0, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR, SETTINGS_TIMEOUT, STREAM_CLOSED
+, FRAME_SIZE_ERROR, REFUSED_STREAM, CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM };
+
+//SETTINGS参数
+enum { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH, SETTINGS_MAX_CONCURRENT_STREAMS
+, SETTINGS_INITIAL_WINDOW_SIZE, SETTINGS_MAX_FRAME_SIZE };
+
+static const int FRAME_HEADER_LEN = 9;
+//我们接受的最大帧长度,即SETTINGS_MAX_FRAME_SIZE的默认值,没有在SETTINGS中修改
+static const size_t MAX_FRAME = 16384;
+static const uint32_t MAX_CONCURRENT_STREAMS = 100;
+static const long DEFAULT_WINDOW = 65535;
+static const long MAX_WINDOW = 0x7fffffff;
+//一次pump最多生成的DATA帧内容,限制每个会话排队的输出
+static const size_t PUMP_BYTES = 128 * 1024;
+//待发送的输出(不含文件内容)超过此值说明对端只发不收,例如不停地发送PING
+static const size_t MAX_OUT_BYTES = 1024 * 1024;
+//一个头部块的最大长度
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+
+static uint32_t get32( const uint8_t* p )
+{
+    return ( ( uint32_t )p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3];
+}
+
+static void put32( char* p, uint32_t v )
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+h2_session::h2_session()
+    : m_preface_left( PREFACE_LEN ), m_out_sent( 0 ), m_out_bytes( 0 ), m_header_stream( 0 ), m_last_stream_id( 0 )
+    , m_send_window( DEFAULT_WINDOW ), m_peer_initial_window( DEFAULT_WINDOW ), m_peer_max_frame( MAX_FRAME )
+    , m_closing( false ), m_goaway_sent( false ), m_goaway_received( false )
+{
+    metrics::add( H2_SESSIONS, 1 );
+}
+
+h2_session::~h2_session()
+{
+    while( ! m_streams.empty() )
+    {
+        close_stream( m_streams.front() );
+    }
+    while( ! m_out.empty() )
+    {
+        if( m_out.front().file )
+        {
+            release( m_out.front().file );
+        }
+        m_out.pop_front();
+    }
+}
+
+int h2_session::match_preface( const char* buf, int len )
+{
+    int n = len < PREFACE_LEN ? len : PREFACE_LEN;
+    if( memcmp( buf, PREFACE, n ) != 0 )
+    {
+        return -1;
+    }
+    return n == PREFACE_LEN ? 1 : 0;
+}
+
+void h2_session::start()
+{
+    settings_frame();
+}
+
+//base64url(可以没有填充)解码,HTTP2-Settings头部的值就是SETTINGS帧的内容
+static bool base64url_decode( const char* in, std::string& out )
+{
+    unsigned int bits = 0;
+    int count = 0;
+    for( ; *in && *in != '='; ++in )
+    {
+        char c = *in;
+        int v;
+        if( c >= 'A' && c <= 'Z' ) v = c - 'A';
+        else if( c >= 'a' && c <= 'z' ) v = c - 'a' + 26;
+        else if( c >= '0' && c <= '9' ) v = c - '0' + 52;
+        else if( c == '-' || c == '+' ) v = 62;
+        else if( c == '_' || c == '/' ) v = 63;
+        else return false;
+        bits = ( bits << 6 ) | v;
+        count += 6;
+        if( count >= 8 )
+        {
+            count -= 8;
+            out += ( char )( ( bits >> count ) & 0xff );
+        }
+    }
+    return true;
+}
+
+bool h2_session::upgrade( const char* settings, const char* path, const char* authority )
+{
+    std::string payload;
+    if( ! base64url_decode( settings, payload ) || payload.size() % 6 != 0 )
+    {
+        return false;
+    }
+    //HTTP2-Settings相当于客户端的第一个SETTINGS帧,不需要确认
+    const uint8_t* p = ( const uint8_t* )payload.data();
+    for( size_t i = 0; i < payload.size(); i += 6 )
+    {
+        if( ! apply_setting( ( p[i] << 8 ) | p[i + 1], get32( p + i + 2 ) ) )
+        {
+            return false;
+        }
+    }
+
+    out_buffer() += "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    settings_frame();
+    //升级前的请求是流1,处于半关闭(远端)状态
+    std::vector< hpack_header > headers( 3 );
+    headers[0].name = ":method";
+    headers[0].value = "GET";
+    headers[1].name = ":path";
+    headers[1].value = path;
+    headers[2].name = ":authority";
+    headers[2].value = authority ? authority : "";
+    m_last_stream_id = 1;
+    respond( 1, headers );
+    return true;
+}
+
+void h2_session::settings_frame()
+{
+    char payload[ 6 ];
+    payload[0] = 0;
+    payload[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32( payload + 2, MAX_CONCURRENT_STREAMS );
+    frame( FRAME_SETTINGS, 0, 0, payload, sizeof( payload ) );
+}
+
+//输出末尾的内存段,连续的帧合并在同一段中,一次send发出
+std::string& h2_session::out_buffer()
+{
+    if( m_out.empty() || m_out.back().file )
+    {
+        segment seg;
+        seg.file = NULL;
+        seg.offset = 0;
+        seg.len = 0;
+        m_out.push_back( seg );
+    }
+    return m_out.back().data;
+}
+
+void h2_session::frame( uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len )
+{
+    char header[ FRAME_HEADER_LEN ];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    put32( header + 5, stream_id & 0x7fffffff );
+    std::string& out = out_buffer();
+    out.append( header, FRAME_HEADER_LEN );
+    if( len > 0 )
+    {
+        out.append( payload, len );
+    }
+    m_out_bytes += FRAME_HEADER_LEN + len;
+}
+
+void h2_session::release( file_ref* file )
+{
+    if( --file->refs == 0 )
+    {
+        if( file->pack )
+        {
+            file->pack->release();
+        }
+        else
+        {
+            close( file->fd );
+        }
+        delete file;
+    }
+}
+
+void h2_session::close_stream( stream* s )
+{
+    m_streams.remove( s );
+    if( s->file )
+    {
+        release( s->file );
+    }
+    delete s;
+}
+
+h2_session::stream* h2_session::find_stream( uint32_t id )
+{
+    for( std::list< stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+    {
+        if( ( *it )->id == id )
+        {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+void h2_session::connection_error( uint32_t code )
+{
+    if( m_closing )
+    {
+        return;
+    }
+    char payload[ 8 ];
+    put32( payload, m_last_stream_id );
+    put32( payload + 4, code );
+    frame( FRAME_GOAWAY, 0, 0, payload, sizeof( payload ) );
+    m_closing = true;
+    m_goaway_sent = true;
+    while( ! m_streams.empty() )
+    {
+        close_stream( m_streams.front() );
+    }
+}
+
+void h2_session::stream_error( uint32_t stream_id, uint32_t code )
+{
+    char payload[ 4 ];
+    put32( payload, code );
+    frame( FRAME_RST_STREAM, 0, stream_id, payload, sizeof( payload ) );
+    stream* s = find_stream( stream_id );
+    if( s )
+    {
+        close_stream( s );
+    }
+}
+
+void h2_session::go_away()
+{
+    if( m_goaway_sent )
+    {
+        return;
+    }
+    char payload[ 8 ];
+    put32( payload, m_last_stream_id );
+    put32( payload + 4, NO_ERROR );
+    frame( FRAME_GOAWAY, 0, 0, payload, sizeof( payload ) );
+    m_goaway_sent = true;
+}
+
+bool h2_session::finished() const
+{
+    return m_out.empty() && ( m_closing || ( ( m_goaway_sent || m_goaway_received ) && m_streams.empty() ) );
+}
+
+bool h2_session::idle() const
+{
+    return m_streams.empty() && m_out.empty() && m_in.empty() && m_header_stream == 0;
+}
+
+void h2_session::feed( const char* data, int len )
+{
+    if( m_closing )
+    {
+        return;
+    }
+    //连接前言
+    if( m_preface_left > 0 )
+    {
+        int n = len < m_preface_left ? len : m_preface_left;
+        if( memcmp( data, PREFACE + PREFACE_LEN - m_preface_left, n ) != 0 )
+        {
+            connection_error( PROTOCOL_ERROR );
+            return;
+        }
+        m_preface_left -= n;
+        data += n;
+        len -= n;
+    }
+
+    m_in.append( data, len );
+    size_t pos = 0;
+    while( ! m_closing && m_in.size() - pos >= ( size_t )FRAME_HEADER_LEN )
+    {
+        const uint8_t* p = ( const uint8_t* )m_in.data() + pos;
+        size_t length = ( p[0] << 16 ) | ( p[1] << 8 ) | p[2];
+        if( length > MAX_FRAME )
+        {
+            connection_error( FRAME_SIZE_ERROR );
+            break;
+        }
+        if( m_in.size() - pos < FRAME_HEADER_LEN + length )
+        {
+            break;
+        }
+        if( ! on_frame( p[3], p[4], get32( p + 5 ) & 0x7fffffff, p + FRAME_HEADER_LEN, length ) )
+        {
+            break;
+        }
+        pos += FRAME_HEADER_LEN + length;
+    }
+    m_in.erase( 0, pos );
+    if( m_out_bytes > MAX_OUT_BYTES )
+    {
+        connection_error( ENHANCE_YOUR_CALM );
+    }
+}
+
+bool h2_session::on_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len )
+{
+    //头部块必须连续,中间只能是同一个流的CONTINUATION帧
+    if( m_header_stream && ( type != FRAME_CONTINUATION || stream_id != m_header_stream ) )
+    {
+        connection_error( PROTOCOL_ERROR );
+        return false;
+    }
+
+    switch( type )
+    {
+        case FRAME_DATA:
+        {
+            if( stream_id == 0 )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            //请求体被丢弃,立即归还连接级的接收窗口;流级的窗口足够容纳GET请求可能携带的少量数据
+            if( len > 0 )
+            {
+                char increment[ 4 ];
+                put32( increment, len );
+                frame( FRAME_WINDOW_UPDATE, 0, 0, increment, sizeof( increment ) );
+            }
+            return true;
+        }
+        case FRAME_HEADERS:
+        {
+            return on_headers( flags, stream_id, payload, len );
+        }
+        case FRAME_CONTINUATION:
+        {
+            if( ! m_header_stream )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            m_header_block.append( ( const char* )payload, len );
+            if( m_header_block.size() > MAX_HEADER_BLOCK )
+            {
+                connection_error( ENHANCE_YOUR_CALM );
+                return false;
+            }
+            return ( flags & FLAG_END_HEADERS ) ? end_headers() : true;
+        }
+        case FRAME_PRIORITY:
+        {
+            if( stream_id == 0 || len != 5 )
+            {
+                connection_error( stream_id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                return false;
+            }
+            return true;
+        }
+        case FRAME_RST_STREAM:
+        {
+            if( stream_id == 0 || len != 4 )
+            {
+                connection_error( stream_id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                return false;
+            }
+            stream* s = find_stream( stream_id );
+            if( s )
+            {
+                close_stream( s );
+            }
+            return true;
+        }
+        case FRAME_SETTINGS:
+        {
+            return on_settings( flags, stream_id, payload, len );
+        }
+        case FRAME_PUSH_PROMISE:
+        {
+            //客户端不能推送
+            connection_error( PROTOCOL_ERROR );
+            return false;
+        }
+        case FRAME_PING:
+        {
+            if( stream_id != 0 || len != 8 )
+            {
+                connection_error( stream_id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR );
+                return false;
+            }
+            if( ! ( flags & FLAG_ACK ) )
+            {
+                frame( FRAME_PING, FLAG_ACK, 0, ( const char* )payload, len );
+            }
+            return true;
+        }
+        case FRAME_GOAWAY:
+        {
+            if( stream_id != 0 || len < 8 )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            m_goaway_received = true;
+            return true;
+        }
+        case FRAME_WINDOW_UPDATE:
+        {
+            return on_window_update( stream_id, payload, len );
+        }
+        default:
+        {
+            //未知类型的帧必须忽略
+            return true;
+        }
+    }
+}
+
+bool h2_session::on_headers( uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len )
+{
+    if( stream_id == 0 || ! ( stream_id & 1 ) )
+    {
+        connection_error( PROTOCOL_ERROR );
+        return false;
+    }
+    size_t pad = 0;
+    if( flags & FLAG_PADDED )
+    {
+        if( len < 1 )
+        {
+            connection_error( PROTOCOL_ERROR );
+            return false;
+        }
+        pad = payload[0];
+        payload++;
+        len--;
+    }
+    //不支持优先级,跳过流依赖和权重
+    if( flags & FLAG_PRIORITY )
+    {
+        if( len < 5 )
+        {
+            connection_error( PROTOCOL_ERROR );
+            return false;
+        }
+        payload += 5;
+        len -= 5;
+    }
+    if( pad > len )
+    {
+        connection_error( PROTOCOL_ERROR );
+        return false;
+    }
+    m_header_stream = stream_id;
+    m_header_block.assign( ( const char* )payload, len - pad );
+    return ( flags & FLAG_END_HEADERS ) ? end_headers() : true;
+}
+
+bool h2_session::end_headers()
+{
+    uint32_t stream_id = m_header_stream;
+    m_header_stream = 0;
+    //即使不处理这个请求也必须解码,否则动态表会和客户端不一致
+    std::vector< hpack_header > headers;
+    bool ok = m_decoder.decode( ( const uint8_t* )m_header_block.data(), m_header_block.size(), headers );
+    m_header_block.clear();
+    if( ! ok )
+    {
+        connection_error( COMPRESSION_ERROR );
+        return false;
+    }
+
+    //编号不大于已有最大编号的是请求尾部(trailers)或已关闭的流,忽略
+    if( stream_id <= m_last_stream_id )
+    {
+        return true;
+    }
+    m_last_stream_id = stream_id;
+    if( m_goaway_sent || m_goaway_received )
+    {
+        return true;
+    }
+    if( m_streams.size() >= MAX_CONCURRENT_STREAMS )
+    {
+        stream_error( stream_id, REFUSED_STREAM );
+        return true;
+    }
+    respond( stream_id, headers );
+    return true;
+}
+
+bool h2_session::on_settings( uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len )
+{
+    if( stream_id != 0 )
+    {
+        connection_error( PROTOCOL_ERROR );
+        return false;
+    }
+    if( flags & FLAG_ACK )
+    {
+        if( len != 0 )
+        {
+            connection_error( FRAME_SIZE_ERROR );
+            return false;
+        }
+        return true;
+    }
+    if( len % 6 != 0 )
+    {
+        connection_error( FRAME_SIZE_ERROR );
+        return false;
+    }
+    for( size_t i = 0; i < len; i += 6 )
+    {
+        if( ! apply_setting( ( payload[i] << 8 ) | payload[i + 1], get32( payload + i + 2 ) ) )
+        {
+            return false;
+        }
+    }
+    frame( FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0 );
+    return true;
+}
+
+bool h2_session::apply_setting( uint16_t id, uint32_t value )
+{
+    switch( id )
+    {
+        case SETTINGS_HEADER_TABLE_SIZE:
+        {
+            m_encoder.set_limit( value );
+            break;
+        }
+        case SETTINGS_ENABLE_PUSH:
+        {
+            if( value > 1 )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            break;
+        }
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if( value > ( uint32_t )MAX_WINDOW )
+            {
+                connection_error( FLOW_CONTROL_ERROR );
+                return false;
+            }
+            //所有流的发送窗口按新旧初始值之差调整
+            long delta = ( long )value - m_peer_initial_window;
+            m_peer_initial_window = value;
+            for( std::list< stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+            {
+                ( *it )->window += delta;
+                if( ( *it )->window > MAX_WINDOW )
+                {
+                    connection_error( FLOW_CONTROL_ERROR );
+                    return false;
+                }
+            }
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+        {
+            if( value < MAX_FRAME || value > 0xffffff )
+            {
+                connection_error( PROTOCOL_ERROR );
+                return false;
+            }
+            m_peer_max_frame = value;
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+bool h2_session::on_window_update( uint32_t stream_id, const uint8_t* payload, size_t len )
+{
+    if( len != 4 )
+    {
+        connection_error( FRAME_SIZE_ERROR );
+        return false;
+    }
+    long increment = get32( payload ) & 0x7fffffff;
+    if( stream_id == 0 )
+    {
+        if( increment == 0 || m_send_window + increment > MAX_WINDOW )
+        {
+            connection_error( increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR );
+            return false;
+        }
+        m_send_window += increment;
+        return true;
+    }
+    stream* s = find_stream( stream_id );
+    if( increment == 0 )
+    {
+        stream_error( stream_id, PROTOCOL_ERROR );
+    }
+    else if( s && s->window + increment > MAX_WINDOW )
+    {
+        stream_error( stream_id, FLOW_CONTROL_ERROR );
+    }
+    else if( s )
+    {
+        s->window += increment;
+    }
+    return true;
+}
+
+//和HTTP/1.1的do_request相同:按:authority和:path选择路由,返回运行指标、追踪记录或网站根目录下的文件
+void h2_session::respond( uint32_t stream_id, const std::vector< hpack_header >& headers )
+{
+    metrics::add( H2_STREAMS, 1 );
+    std::string method, path, authority, accept_encoding, if_none_match;
+    for( size_t i = 0; i < headers.size(); ++i )
+    {
+        const hpack_header& h = headers[i];
+        if( h.name == ":method" )
+        {
+            method = h.value;
+        }
+        else if( h.name == ":path" )
+        {
+            path = h.value;
+        }
+        else if( h.name == ":authority" || ( h.name == "host" && authority.empty() ) )
+        {
+            authority = h.value;
+        }
+        else if( h.name == "accept-encoding" )
+        {
+            accept_encoding = h.value;
+        }
+        else if( h.name == "if-none-match" )
+        {
+            if_none_match = h.value;
+        }
+    }
+
+    std::string body;
+    std::string no_cache;
+    //和HTTP/1.1一样仅支持GET
+    if( method != "GET" || path.empty() || path[0] != '/' )
+    {
+        body = error_400_form;
+        send_response( stream_id, 400, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    //查询字符串不参与文件查找
+    size_t query = path.find( '?' );
+    if( query != std::string::npos )
+    {
+        path.erase( query );
+    }
+
+    const route* rt = router::current()->match( authority.empty() ? NULL : authority.c_str(), path.c_str() );
+    if( rt->handler == HANDLER_METRICS || rt->handler == HANDLER_TRACE )
+    {
+        int len = 0;
+        char* rendered = ( rt->handler == HANDLER_METRICS ) ? metrics::render( &len ) : request_tracer::render( &len );
+        if( ! rendered )
+        {
+            body = error_500_form;
+            send_response( stream_id, 500, NULL, no_cache, body, NULL, 0 );
+            return;
+        }
+        body.assign( rendered, len );
+        free( rendered );
+        send_response( stream_id, 200, "text/plain; version=0.0.4", "no-store", body, NULL, 0 );
+        return;
+    }
+
+    if( rt->pack )
+    {
+        respond_pack( stream_id, rt, path, accept_encoding.empty() ? NULL : accept_encoding.c_str(),
+                      if_none_match.empty() ? NULL : if_none_match.c_str() );
+        return;
+    }
+    //和HTTP/1.1一样不允许通过..访问网站根目录之外的文件
+    if( router::escapes_root( path.c_str() ) )
+    {
+        body = error_403_form;
+        send_response( stream_id, 403, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    std::string real_file = rt->doc_root + path;
+    struct stat st;
+    if( stat( real_file.c_str(), &st ) < 0 )
+    {
+        body = error_404_form;
+        send_response( stream_id, 404, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    if( ! ( st.st_mode & S_IROTH ) )
+    {
+        body = error_403_form;
+        send_response( stream_id, 403, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    if( S_ISDIR( st.st_mode ) )
+    {
+        body = error_400_form;
+        send_response( stream_id, 400, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    //Content-Type和Cache-Control与HTTP/1.1相同,按扩展名的类型决定
+    int type = mime::classify( path.c_str() );
+    //空文件返回空的响应体,和HTTP/1.1相同
+    if( st.st_size == 0 )
+    {
+        send_response( stream_id, 200, mime::type( type ), rt->type_cache[ type ], body, NULL, 0 );
+        return;
+    }
+    int fd = open( real_file.c_str(), O_RDONLY );
+    if( fd < 0 )
+    {
+        body = error_500_form;
+        send_response( stream_id, 500, NULL, no_cache, body, NULL, 0 );
+        return;
+    }
+    file_ref* file = new file_ref;
+    file->fd = fd;
+    file->refs = 1;
+    file->pack = NULL;
+    file->data = NULL;
+    send_response( stream_id, 200, mime::type( type ), rt->type_cache[ type ], body, file, st.st_size );
+}
+
+//和HTTP/1.1的pack_request相同:Content-Type和ETag来自包,客户端接受gzip且有压缩版本时发送压缩版本
+void h2_session::respond_pack( uint32_t stream_id, const route* rt, const std::string& path,
+                               const char* accept_encoding, const char* if_none_match )
+{
+    std::string body;
+    pack_asset asset;
+    if( ! rt->pack->find( path.data(), path.size(), &asset ) )
+    {
+        metrics::add( PACK_MISSES, 1 );
+        body = error_404_form;
+        send_response( stream_id, 404, NULL, std::string(), body, NULL, 0 );
+        return;
+    }
+    bool gzip = accept_encoding && asset.gzip && asset_pack::accepts_gzip( accept_encoding );
+    std::vector< hpack_header > extra( 1 );
+    extra[0].name = "etag";
+    extra[0].value = "\"" + std::string( asset.etag, asset.etag_len ) + ( gzip ? "-gz\"" : "\"" );
+    if( asset.gzip )
+    {
+        extra.push_back( hpack_header() );
+        extra.back().name = "vary";
+        extra.back().value = "Accept-Encoding";
+    }
+    const std::string& cache_control = rt->type_cache[ mime::classify( path.c_str() ) ];
+    std::string mime( asset.mime, asset.mime_len );
+    if( if_none_match && asset_pack::etag_matches( if_none_match, asset.etag, asset.etag_len ) )
+    {
+        metrics::add( PACK_NOT_MODIFIED, 1 );
+        send_response( stream_id, 304, NULL, cache_control, body, NULL, 0, extra );
+        return;
+    }
+    if( gzip )
+    {
+        extra.push_back( hpack_header() );
+        extra.back().name = "content-encoding";
+        extra.back().value = "gzip";
+    }
+    metrics::add( gzip ? PACK_GZIP_HITS : PACK_HITS, 1 );
+    long len = gzip ? asset.gzip_len : asset.body_len;
+    file_ref* file = NULL;
+    if( len > 0 )
+    {
+        //流持有包的一个引用,发送期间重新加载配置也不会释放包
+        file = new file_ref;
+        file->fd = -1;
+        file->refs = 1;
+        file->pack = rt->pack;
+        file->data = gzip ? asset.gzip : asset.body;
+        rt->pack->acquire();
+    }
+    send_response( stream_id, 200, mime.c_str(), cache_control, body, file, len, extra );
+}
+
+//排入HEADERS帧,有响应体时创建流,由pump生成DATA帧
+void h2_session::send_response( uint32_t stream_id, int status, const char* content_type,
+                                const std::string& cache_control, std::string& body, file_ref* file, size_t file_size,
+                                const std::vector< hpack_header >& extra )
+{
+    size_t length = file ? file_size : body.size();
+    char content_length[ 24 ];
+    snprintf( content_length, sizeof( content_length ), "%zu", length );
+
+    std::string block;
+    m_encoder.begin( block );
+    m_encoder.status( status, block );
+    if( content_type )
+    {
+        m_encoder.header( "content-type", content_type, true, block );
+    }
+    if( ! cache_control.empty() )
+    {
+        m_encoder.header( "cache-control", cache_control, true, block );
+    }
+    for( size_t i = 0; i < extra.size(); ++i )
+    {
+        m_encoder.header( extra[i].name, extra[i].value, false, block );
+    }
+    //304没有响应体,Content-Length只能是原响应体的长度,不发送
+    if( status != 304 )
+    {
+        m_encoder.header( "content-length", content_length, false, block );
+    }
+    //响应头部只有几十个字节,不会超过最小的帧长度上限,不需要CONTINUATION
+    frame( FRAME_HEADERS, FLAG_END_HEADERS | ( length == 0 ? FLAG_END_STREAM : 0 ), stream_id, block.data(), block.size() );
+    if( length == 0 )
+    {
+        return;
+    }
+
+    stream* s = new stream;
+    s->id = stream_id;
+    s->window = m_peer_initial_window;
+    s->body.swap( body );
+    s->file = file;
+    s->offset = 0;
+    s->remaining = length;
+    m_streams.push_back( s );
+}
+
+void h2_session::pump()
+{
+    //升级后在收到客户端的连接前言之前只发送101、SETTINGS和流1的HEADERS
+    //,有的客户端(如curl)在处理101响应的那次读取中放不下更多的数据
+    if( m_preface_left > 0 )
+    {
+        return;
+    }
+    size_t budget = PUMP_BYTES;
+    bool progress = true;
+    //每一轮给每个有窗口的流发送一个DATA帧,直到预算或连接窗口用完
+    while( progress && budget > 0 && m_send_window > 0 )
+    {
+        progress = false;
+        std::list< stream* >::iterator it = m_streams.begin();
+        while( it != m_streams.end() && budget > 0 && m_send_window > 0 )
+        {
+            stream* s = *it++;
+            if( s->window <= 0 )
+            {
+                continue;
+            }
+            size_t n = s->remaining;
+            n = std::min( n, ( size_t )s->window );
+            n = std::min( n, ( size_t )m_send_window );
+            n = std::min( n, m_peer_max_frame );
+            n = std::min( n, budget );
+            bool last = ( n == s->remaining );
+
+            char header[ FRAME_HEADER_LEN ];
+            header[0] = n >> 16;
+            header[1] = n >> 8;
+            header[2] = n;
+            header[3] = FRAME_DATA;
+            header[4] = last ? FLAG_END_STREAM : 0;
+            put32( header + 5, s->id );
+            out_buffer().append( header, FRAME_HEADER_LEN );
+            m_out_bytes += FRAME_HEADER_LEN;
+            if( s->file )
+            {
+                segment seg;
+                seg.file = s->file;
+                seg.offset = s->offset;
+                seg.len = n;
+                s->file->refs++;
+                m_out.push_back( seg );
+            }
+            else
+            {
+                out_buffer().append( s->body, s->offset, n );
+                m_out_bytes += n;
+            }
+
+            s->offset += n;
+            s->remaining -= n;
+            s->window -= n;
+            m_send_window -= n;
+            budget -= n;
+            progress = true;
+            if( last )
+            {
+                close_stream( s );
+            }
+        }
+    }
+}
+
+h2_session::FLUSH_RESULT h2_session::flush( int sockfd )
+{
+    while( true )
+    {
+        if( m_out.empty() )
+        {
+            if( m_closing )
+            {
+                return FLUSH_DONE;
+            }
+            pump();
+            if( m_out.empty() )
+            {
+                return FLUSH_DONE;
+            }
+        }
+
+        segment& seg = m_out.front();
+        if( ! seg.file )
+        {
+            //后面紧跟文件内容时用MSG_MORE,让帧头和内容合并成完整的报文段
+            int flags = MSG_NOSIGNAL;
+            if( m_out.size() > 1 )
+            {
+                flags |= MSG_MORE;
+            }
+            ssize_t n = send( sockfd, seg.data.data() + m_out_sent, seg.data.size() - m_out_sent, flags );
+            if( n < 0 )
+            {
+                return ( errno == EAGAIN ) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            m_out_sent += n;
+            if( m_out_sent == seg.data.size() )
+            {
+                m_out_bytes -= std::min( m_out_bytes, seg.data.size() );
+                m_out_sent = 0;
+                m_out.pop_front();
+            }
+        }
+        else
+        {
+            //资源包的内容已经在内存中,直接send;文件用sendfile
+            ssize_t n = 0;
+            if( seg.file->pack )
+            {
+                n = send( sockfd, seg.file->data + seg.offset, seg.len, MSG_NOSIGNAL );
+                seg.offset += n > 0 ? n : 0;
+            }
+            else
+            {
+                n = sendfile( sockfd, seg.file->fd, &seg.offset, seg.len );
+            }
+            if( n < 0 )
+            {
+                return ( errno == EAGAIN ) ? FLUSH_AGAIN : FLUSH_ERROR;
+            }
+            //文件在发送过程中被截断,DATA帧的长度已经发出,只能关闭连接
+            if( n == 0 )
+            {
+                return FLUSH_ERROR;
+            }
+            seg.len -= n;
+            if( seg.len == 0 )
+            {
+                release( seg.file );
+                m_out.pop_front();
+            }
+        }
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef H2_SESSION_H
+#define H2_SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+#include "hpack.h"
+
+class asset_pack;
+struct route;
+
+//明文HTTP/2(h2c,RFC 7540)的一条连接
+//。支持两种建立方式:客户端直接发送连接前言(prior knowledge),或在HTTP/1.1的GET请求中带Upgrade: h2c
+//。多个流的响应按轮转方式交错成DATA帧,受每个流和整个连接的发送窗口约束;静态文件的DATA帧只在内存中生成9字节的帧头
+//,帧的内容直接从文件描述符sendfile出去
+//。一个会话同一时刻只被一个线程访问:feed在工作线程中调用,flush在工作线程或反应堆中调用,由EPOLLONESHOT保证互斥
+class h2_session
+{
+public:
+    //flush的结果:输出已全部写出、发送缓冲区已满需要等待EPOLLOUT、连接出错
+    enum FLUSH_RESULT { FLUSH_DONE, FLUSH_AGAIN, FLUSH_ERROR };
+
+    h2_session();
+    ~h2_session();
+
+    //buf开头是否为客户端的连接前言:1表示是,0表示数据还不够判断,-1表示不是
+    static int match_preface( const char* buf, int len );
+
+    //以prior knowledge方式开始会话,发送服务器的SETTINGS
+    void start();
+    //以Upgrade: h2c方式开始会话:settings为HTTP2-Settings头部的值,升级前的请求成为流1
+    //,先发送101响应,再发送SETTINGS和流1的响应。调用者必须处于rcu读侧临界区内
+    bool upgrade( const char* settings, const char* path, const char* authority );
+
+    //处理客户端发来的数据,调用者必须处于rcu读侧临界区内
+    //。协议错误时排入GOAWAY并停止处理后续数据,待GOAWAY发送完毕后finished()为true
+    void feed( const char* data, int len );
+    //把待发送的帧写到socket,输出为空时继续从各个流生成DATA帧
+    FLUSH_RESULT flush( int sockfd );
+
+    //平滑重启时调用:发送GOAWAY,不再接受新的流,已有的流发送完毕后finished()为true
+    void go_away();
+    //会话已经结束,可以关闭连接
+    bool finished() const;
+    //没有进行中的流,也没有待发送的数据
+    bool idle() const;
+
+private:
+    //被一个或多个DATA帧引用的文件,最后一个引用释放时关闭
+    //。资源包中的资源没有文件描述符(fd为-1),内容在包的映射中从data开始,最后一个引用释放时释放包
+    struct file_ref
+    {
+        int fd;
+        int refs;
+        asset_pack* pack;
+        const char* data;
+    };
+
+    //待发送的一段数据:内存中的字节(帧头、HEADERS帧、控制帧、动态响应体),或文件中的一段
+    struct segment
+    {
+        std::string data;
+        file_ref* file;
+        off_t offset;
+        size_t len;
+    };
+
+    //一个正在发送响应体的流,响应头部在收到请求时就已排入输出
+    struct stream
+    {
+        uint32_t id;
+        //发送窗口,对端减小SETTINGS_INITIAL_WINDOW_SIZE时可以为负
+        long window;
+        std::string body;
+        file_ref* file;
+        off_t offset;
+        size_t remaining;
+    };
+
+    void settings_frame();
+    void frame( uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, size_t len );
+    std::string& out_buffer();
+    void release( file_ref* file );
+    void close_stream( stream* s );
+    stream* find_stream( uint32_t id );
+    void connection_error( uint32_t code );
+    void stream_error( uint32_t stream_id, uint32_t code );
+
+    //处理一个完整的帧,返回false表示连接出错
+    bool on_frame( uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len );
+    bool on_headers( uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len );
+    bool on_settings( uint8_t flags, uint32_t stream_id, const uint8_t* payload, size_t len );
+    bool on_window_update( uint32_t stream_id, const uint8_t* payload, size_t len );
+    bool apply_setting( uint16_t id, uint32_t value );
+    //一个头部块接收完整,解码并生成响应
+    bool end_headers();
+    void respond( uint32_t stream_id, const std::vector< hpack_header >& headers );
+    void send_response( uint32_t stream_id, int status, const char* content_type, const std::string& cache_control,
+                        std::string& body, file_ref* file, size_t file_size,
+                        const std::vector< hpack_header >& extra = std::vector< hpack_header >() );
+    //资源包路由:按:path在包中查找,处理If-None-Match和Accept-Encoding,不需要文件系统的系统调用
+    void respond_pack( uint32_t stream_id, const route* rt, const std::string& path,
+                       const char* accept_encoding, const char* if_none_match );
+    //按轮转方式从各个流生成DATA帧,直到输出达到PUMP_BYTES或所有窗口都已用完
+    void pump();
+
+    //客户端连接前言中还没有收到的字节数
+    int m_preface_left;
+    //收到的不完整的帧
+    std::string m_in;
+
+    std::deque< segment > m_out;
+    //m_out中第一段已经发送的字节数
+    size_t m_out_sent;
+    size_t m_out_bytes;
+
+    //正在接收的头部块(HEADERS加上若干CONTINUATION)所属的流,0表示没有
+    uint32_t m_header_stream;
+    std::string m_header_block;
+
+    std::list< stream* > m_streams;
+    uint32_t m_last_stream_id;
+
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    //连接级的发送窗口,对端的初始流窗口和最大帧长度
+    long m_send_window;
+    long m_peer_initial_window;
+    size_t m_peer_max_frame;
+
+    //因协议错误发送了GOAWAY,不再处理任何输入
+    bool m_closing;
+    bool m_goaway_sent;
+    bool m_goaway_received;
+};
+
+#endif
@@ -0,0 +1,501 @@
+#include <stdio.h>
+#include <string.h>
+#include "hpack.h"
+
+//RFC 7541附录A的静态表,编号从1开始
+static const char* STATIC_TABLE[ hpack_table::STATIC_COUNT ][ 2 ] =
+{
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+//RFC 7541附录B的Huffman编码表,下标为符号(256为EOS),依次为编码和位数
+static const unsigned int HUFFMAN_CODES[ 257 ] =
+{
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const unsigned char HUFFMAN_BITS[ 257 ] =
+{
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+//由编码表构建的Huffman解码树,节点0为根
+struct huffman_tree
+{
+    struct node
+    {
+        short child[ 2 ];
+        short symbol;//叶子节点的符号,内部节点为-1
+    };
+    node nodes[ 513 ];
+    int count;
+
+    huffman_tree() : count( 1 )
+    {
+        memset( nodes, -1, sizeof( nodes ) );
+        for( int sym = 0; sym < 257; ++sym )
+        {
+            int n = 0;
+            for( int bit = HUFFMAN_BITS[ sym ] - 1; bit >= 0; --bit )
+            {
+                int b = ( HUFFMAN_CODES[ sym ] >> bit ) & 1;
+                if( nodes[ n ].child[ b ] < 0 )
+                {
+                    nodes[ n ].child[ b ] = count++;
+                }
+                n = nodes[ n ].child[ b ];
+            }
+            nodes[ n ].symbol = sym;
+        }
+    }
+};
+
+static const huffman_tree& tree()
+{
+    static const huffman_tree t;
+    return t;
+}
+
+//逐位地沿解码树解码,结尾的填充必须是EOS编码的前缀(全1)且不超过7位
+static bool huffman_decode( const uint8_t* p, size_t len, std::string& out )
+{
+    const huffman_tree& t = tree();
+    int n = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for( size_t i = 0; i < len; ++i )
+    {
+        for( int bit = 7; bit >= 0; --bit )
+        {
+            int b = ( p[i] >> bit ) & 1;
+            n = t.nodes[ n ].child[ b ];
+            if( n < 0 )
+            {
+                return false;
+            }
+            depth++;
+            all_ones = all_ones && b;
+            if( t.nodes[ n ].symbol >= 0 )
+            {
+                if( t.nodes[ n ].symbol == 256 )
+                {
+                    return false;
+                }
+                out += ( char )t.nodes[ n ].symbol;
+                n = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    return depth < 8 && all_ones;
+}
+
+//带prefix位前缀的整数
+static bool decode_int( const uint8_t*& p, const uint8_t* end, int prefix, size_t& value )
+{
+    if( p >= end )
+    {
+        return false;
+    }
+    size_t max = ( 1u << prefix ) - 1;
+    value = *p++ & max;
+    if( value < max )
+    {
+        return true;
+    }
+    for( int shift = 0; p < end && shift <= 28; shift += 7 )
+    {
+        uint8_t b = *p++;
+        value += ( size_t )( b & 0x7f ) << shift;
+        if( ! ( b & 0x80 ) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void encode_int( std::string& out, uint8_t flags, int prefix, size_t value )
+{
+    size_t max = ( 1u << prefix ) - 1;
+    if( value < max )
+    {
+        out += ( char )( flags | value );
+        return;
+    }
+    out += ( char )( flags | max );
+    value -= max;
+    while( value >= 0x80 )
+    {
+        out += ( char )( ( value & 0x7f ) | 0x80 );
+        value >>= 7;
+    }
+    out += ( char )value;
+}
+
+static bool decode_string( const uint8_t*& p, const uint8_t* end, std::string& out )
+{
+    if( p >= end )
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    size_t len;
+    if( ! decode_int( p, end, 7, len ) || len > ( size_t )( end - p ) )
+    {
+        return false;
+    }
+    out.clear();
+    if( huffman )
+    {
+        if( ! huffman_decode( p, len, out ) )
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign( ( const char* )p, len );
+    }
+    p += len;
+    return true;
+}
+
+//不使用Huffman编码的字符串
+static void encode_string( std::string& out, const std::string& s )
+{
+    encode_int( out, 0, 7, s.size() );
+    out += s;
+}
+
+static std::vector< hpack_header > build_static_table()
+{
+    std::vector< hpack_header > t( hpack_table::STATIC_COUNT );
+    for( int i = 0; i < hpack_table::STATIC_COUNT; ++i )
+    {
+        t[i].name = STATIC_TABLE[i][0];
+        t[i].value = STATIC_TABLE[i][1];
+    }
+    return t;
+}
+
+//多个工作线程可能同时第一次调用,和tree()一样由局部静态变量的初始化保证只构造一次
+static const std::vector< hpack_header >& static_table()
+{
+    static const std::vector< hpack_header > table = build_static_table();
+    return table;
+}
+
+const hpack_header* hpack_table::get( size_t index ) const
+{
+    if( index == 0 )
+    {
+        return NULL;
+    }
+    if( index <= ( size_t )STATIC_COUNT )
+    {
+        return &static_table()[ index - 1 ];
+    }
+    index -= STATIC_COUNT + 1;
+    return index < m_entries.size() ? &m_entries[ index ] : NULL;
+}
+
+void hpack_table::add( const std::string& name, const std::string& value )
+{
+    size_t size = name.size() + value.size() + 32;
+    //比整个表还大的条目会清空动态表,自身也不加入
+    evict( size <= m_max_size ? m_max_size - size : 0 );
+    if( size <= m_max_size )
+    {
+        hpack_header h = { name, value };
+        m_entries.push_front( h );
+        m_size += size;
+    }
+}
+
+void hpack_table::set_max_size( size_t max_size )
+{
+    m_max_size = max_size;
+    evict( max_size );
+}
+
+void hpack_table::evict( size_t limit )
+{
+    while( m_size > limit && ! m_entries.empty() )
+    {
+        m_size -= m_entries.back().name.size() + m_entries.back().value.size() + 32;
+        m_entries.pop_back();
+    }
+}
+
+size_t hpack_table::find( const std::string& name, const std::string& value, bool& value_match ) const
+{
+    size_t name_index = 0;
+    const std::vector< hpack_header >& st = static_table();
+    for( int i = 0; i < STATIC_COUNT; ++i )
+    {
+        if( st[i].name == name )
+        {
+            if( st[i].value == value )
+            {
+                value_match = true;
+                return i + 1;
+            }
+            if( ! name_index )
+            {
+                name_index = i + 1;
+            }
+        }
+    }
+    for( size_t i = 0; i < m_entries.size(); ++i )
+    {
+        if( m_entries[i].name == name )
+        {
+            if( m_entries[i].value == value )
+            {
+                value_match = true;
+                return STATIC_COUNT + 1 + i;
+            }
+            if( ! name_index )
+            {
+                name_index = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+    value_match = false;
+    return name_index;
+}
+
+bool hpack_decoder::decode( const uint8_t* data, size_t len, std::vector< hpack_header >& headers )
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    while( p < end )
+    {
+        uint8_t b = *p;
+        size_t index;
+        //索引表示:1xxxxxxx
+        if( b & 0x80 )
+        {
+            const hpack_header* h;
+            if( ! decode_int( p, end, 7, index ) || ! ( h = m_table.get( index ) ) )
+            {
+                return false;
+            }
+            headers.push_back( *h );
+            continue;
+        }
+        //动态表大小更新:001xxxxx
+        if( ( b & 0xe0 ) == 0x20 )
+        {
+            if( ! decode_int( p, end, 5, index ) || index > m_limit )
+            {
+                return false;
+            }
+            m_table.set_max_size( index );
+            continue;
+        }
+
+        //字面量表示:01xxxxxx加入动态表,0000xxxx和0001xxxx不加入
+        bool incremental = b & 0x40;
+        if( ! decode_int( p, end, incremental ? 6 : 4, index ) )
+        {
+            return false;
+        }
+        hpack_header h;
+        if( index )
+        {
+            const hpack_header* named = m_table.get( index );
+            if( ! named )
+            {
+                return false;
+            }
+            h.name = named->name;
+        }
+        else if( ! decode_string( p, end, h.name ) )
+        {
+            return false;
+        }
+        if( ! decode_string( p, end, h.value ) )
+        {
+            return false;
+        }
+        if( incremental )
+        {
+            m_table.add( h.name, h.value );
+        }
+        headers.push_back( h );
+    }
+    return true;
+}
+
+void hpack_encoder::set_limit( size_t limit )
+{
+    if( limit > hpack_table::DEFAULT_SIZE )
+    {
+        limit = hpack_table::DEFAULT_SIZE;
+    }
+    if( limit != m_limit )
+    {
+        m_limit = limit;
+        m_pending_update = true;
+    }
+}
+
+void hpack_encoder::begin( std::string& out )
+{
+    if( m_pending_update )
+    {
+        encode_int( out, 0x20, 5, m_limit );
+        m_table.set_max_size( m_limit );
+        m_pending_update = false;
+    }
+}
+
+void hpack_encoder::status( int code, std::string& out )
+{
+    //静态表8~14
+    static const int codes[] = { 200, 204, 206, 304, 400, 404, 500 };
+    for( int i = 0; i < 7; ++i )
+    {
+        if( codes[i] == code )
+        {
+            encode_int( out, 0x80, 7, 8 + i );
+            return;
+        }
+    }
+    char value[ 16 ];
+    snprintf( value, sizeof( value ), "%d", code );
+    encode_int( out, 0, 4, 8 );
+    encode_string( out, value );
+}
+
+void hpack_encoder::header( const std::string& name, const std::string& value, bool index, std::string& out )
+{
+    bool value_match;
+    size_t found = m_table.find( name, value, value_match );
+    if( found && value_match )
+    {
+        encode_int( out, 0x80, 7, found );
+        return;
+    }
+    encode_int( out, index ? 0x40 : 0, index ? 6 : 4, found );
+    if( ! found )
+    {
+        encode_string( out, name );
+    }
+    encode_string( out, value );
+    if( index )
+    {
+        m_table.add( name, value );
+    }
+}
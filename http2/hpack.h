@@ -0,0 +1,82 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+//HPACK(RFC 7541)头部压缩
+//。静态表和动态表统一编号:1~61为静态表,62开始为动态表,最新加入的条目编号最小
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+};
+
+//动态表,每个条目占用name和value的长度加32字节,超过上限时从最旧的条目开始淘汰
+class hpack_table
+{
+public:
+    static const int STATIC_COUNT = 61;
+    //HTTP/2连接建立时动态表的默认大小上限
+    static const size_t DEFAULT_SIZE = 4096;
+
+    hpack_table() : m_size( 0 ), m_max_size( DEFAULT_SIZE ) {}
+
+    //按编号取一个条目,编号无效时返回NULL
+    const hpack_header* get( size_t index ) const;
+    void add( const std::string& name, const std::string& value );
+    void set_max_size( size_t max_size );
+    size_t max_size() const { return m_max_size; }
+    //查找完全相同的条目,找不到时返回同名条目的编号并把value_match置为false,都找不到时返回0
+    size_t find( const std::string& name, const std::string& value, bool& value_match ) const;
+
+private:
+    void evict( size_t limit );
+
+    std::deque< hpack_header > m_entries;
+    size_t m_size;
+    size_t m_max_size;
+};
+
+//解码客户端发来的头部块
+class hpack_decoder
+{
+public:
+    //limit为我们在SETTINGS_HEADER_TABLE_SIZE中通告的动态表大小上限
+    explicit hpack_decoder( size_t limit = hpack_table::DEFAULT_SIZE ) : m_limit( limit ) {}
+
+    //解码一个完整的头部块,出错(COMPRESSION_ERROR)时返回false,此后该连接必须关闭
+    bool decode( const uint8_t* data, size_t len, std::vector< hpack_header >& headers );
+
+private:
+    hpack_table m_table;
+    size_t m_limit;
+};
+
+//编码响应头部
+//。:status优先使用静态表;cache-control、content-type等取值很少的头部加入动态表,之后的响应只需一个字节
+//;content-length等每次都不同的头部不加入动态表
+class hpack_encoder
+{
+public:
+    hpack_encoder() : m_limit( hpack_table::DEFAULT_SIZE ), m_pending_update( false ) {}
+
+    //对端通过SETTINGS_HEADER_TABLE_SIZE修改了动态表大小上限,下一个头部块开头会发送大小更新
+    void set_limit( size_t limit );
+
+    //开始一个新的头部块
+    void begin( std::string& out );
+    void status( int code, std::string& out );
+    //index为true时加入动态表
+    void header( const std::string& name, const std::string& value, bool index, std::string& out );
+
+private:
+    hpack_table m_table;
+    size_t m_limit;
+    bool m_pending_update;
+};
+
+#endif
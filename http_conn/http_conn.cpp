@@ -1,17 +1,31 @@
+#include <linux/tcp.h>
 #include "http_conn.h"
+#include "../locker/rcu.h"
+#include "../metrics/metrics.h"
+#include "../trace/probes.h"
+#include "../capture/capture.h"
+#include "../http2/h2_session.h"
+#include "../mime/mime.h"
+#include "../memory/memory_pressure.h"
 
 //定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* ok_201_title = "Created";
+const char* ok_201_form = "The request body was stored.\n";
+const char* not_modified_304_title = "Not Modified";
+const char* continue_100 = "HTTP/1.1 100 Continue\r\n\r\n";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested URL does not accept this method.\n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than the server is willing to accept.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-//网站根目录
-const char* doc_root = "/home/laputa/WEB/2_BookWeb/web_2.0/resources";
 
 //将文件描述符设置为非阻塞的,返回值没用
 int setnonblocking( int fd )
@@ -22,20 +36,23 @@ int setnonblocking( int fd )
     return old_option;
 }
 
-//将fd上的EPOLLIN和EPOLLET时间注册到epollfd指示的epoll内核时间表中
-//,参数oneshot指定是否注册fd上二等EPOLLONESHOT事件
+//将fd上的EPOLLIN事件注册到epollfd指示的epoll内核时间表中,fd应当已经是非阻塞的
+//,参数oneshot指定是否注册fd上二等EPOLLONESHOT事件,enable_et指定是否使用ET模式
 void addfd( int epollfd, int fd, bool one_shot, bool enable_et )
 {
     epoll_event event;
     event.data.fd = fd;
     //EPOLLRDHUP可以方便地检测客户端是否断开(牛客视频说的)
-    event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    if( enable_et )
+    {
+        event.events |= EPOLLET;
+    }
     if( one_shot )
     {
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl( epollfd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
 }
 
 //删除事件表epollfd上的客户端fd
@@ -57,6 +74,13 @@ void modfd( int epollfd, int fd, int ev )
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+bool http_conn::m_draining = false;
+long http_conn::m_max_body = 1024 * 1024;
+long http_conn::m_write_slice = 256 * 1024;
+int http_conn::m_busy_poll_us = 0;
+int http_conn::m_busy_poll_budget = 8;
+bool http_conn::m_tcp_cork = false;
+int http_conn::m_tcp_info_sample = 16;
 
 //关闭http连接
 void http_conn::close_conn( bool real_close )
@@ -64,7 +88,34 @@ void http_conn::close_conn( bool real_close )
     if( real_close && ( m_sockfd != -1 ) )
     {
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
+        //监听socket设置了SO_LINGER,关闭时会发送复位报文段并丢弃未发送的数据
+        //。平滑重启期间要保证最后一个响应完整送达,HTTP/2连接要保证GOAWAY送达,TLS连接要保证close_notify送达
+        //,改为正常的四次挥手
+        if( m_draining || m_h2 || m_tls )
+        {
+            struct linger graceful = { 0, 0 };
+            setsockopt( m_sockfd, SOL_SOCKET, SO_LINGER, &graceful, sizeof( graceful ) );
+        }
+        if( traffic_capture::enabled() )
+        {
+            traffic_capture::close( m_conn_id );
+        }
+        //尽量告知对端连接将要关闭,发送不完也不再等待
+        if( m_h2 )
+        {
+            m_h2->go_away();
+            m_h2->flush( m_sockfd );
+            delete m_h2;
+            m_h2 = NULL;
+        }
+        if( m_tls )
+        {
+            tls::close( m_ssl );
+            m_ssl = NULL;
+            m_tls = false;
+        }
         removefd( m_epollfd, m_sockfd );
+        unmap();
         m_sockfd = -1;
         m_user_count--;
     }
@@ -75,15 +126,41 @@ void http_conn::init( int sockfd, const sockaddr_in& addr )
 {
     m_sockfd = sockfd;
     m_address = addr;
-    int error = 0;
-    //书P88,获取并清除socket错误状态,error是回传的错误参数,但该程序中没有使用
-    socklen_t len = sizeof( error );
-    getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
-
-    //端口复用,是为了避免TIME_WAIT状态,仅用于调试,实际使用时应该去掉
-    int reuse = 1;
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+    //socket由accept4创建时已经是非阻塞的,这里除了注册事件不再需要其他系统调用
+    //。SO_REUSEADDR只对bind有意义,设置在监听socket上
+    //忙轮询:读这个socket没有数据时内核先在网卡队列上轮询,而不是等待中断。超过net.core.busy_read的值需要CAP_NET_ADMIN
+    //,设置失败时照常工作
+    if( m_busy_poll_us > 0 )
+    {
+        int prefer = 1;
+        setsockopt( m_sockfd, SOL_SOCKET, SO_BUSY_POLL, &m_busy_poll_us, sizeof( m_busy_poll_us ) );
+        setsockopt( m_sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof( prefer ) );
+        setsockopt( m_sockfd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &m_busy_poll_budget, sizeof( m_busy_poll_budget ) );
+    }
 
+    m_file_address = NULL;
+    m_cached = NULL;
+    m_pack = NULL;
+    m_gzip = false;
+    m_sendfile = false;
+    m_file_fd = -1;
+    m_body = NULL;
+    m_body_len = 0;
+    m_micro = NULL;
+    m_sink = NULL;
+    m_stream = NULL;
+    m_stream_refill = false;
+    m_lane = LANE_NORMAL;
+    m_trace.reset();
+    m_conn_id = traffic_capture::next_conn_id();
+    m_h2 = NULL;
+    //配置了证书时所有新连接都是HTTPS,握手在工作线程中进行
+    m_tls = tls::enabled();
+    m_ssl = m_tls ? tls::create( sockfd ) : NULL;
+    m_tls_ready = false;
+    m_ktls = false;
+    m_tls_pending = false;
+    m_dispatched = m_serving = m_released = 0;
     addfd( m_epollfd, sockfd, true, true);
     m_user_count++;
 
@@ -94,16 +171,29 @@ void http_conn::init()
 {
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
+    m_accept_gzip = false;
+    m_if_none_match = NULL;
 
     m_method = GET;
     m_url = NULL;
     m_version = NULL;
     m_content_length = 0;
     m_host = NULL;
+    m_route = NULL;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
+    m_status = 0;
+    m_upgrade_h2c = false;
+    m_h2_settings = NULL;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_body_left = 0;
+    m_body_received = 0;
+    m_chunk.reset();
     memset( m_read_buf, '\0', READ_BUFFER_SIZE );
     memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
     memset( m_real_file, '\0', FILENAME_LEN );
@@ -159,15 +249,46 @@ http_conn::LINE_STATUS http_conn::parse_line()
 //循环读取客户数据,直到无数据可读或对方关闭连接
 bool http_conn::read()
 {
+    m_tls_pending = false;
+    //正在接收请求体,由工作线程直接从socket读取
+    if( m_sink )
+    {
+        m_lane = LANE_BULK;
+        return true;
+    }
     if( m_read_idx >= READ_BUFFER_SIZE )
     {
         return false;
     }
+    //TLS握手还没有完成,交给工作线程继续握手
+    if( m_tls && ! m_tls_ready )
+    {
+        m_lane = LANE_NORMAL;
+        return true;
+    }
+
+    //一个新请求的第一批数据
+    if( m_read_idx == 0 )
+    {
+        m_trace.reset();
+        m_trace.read_start = monotonic_ns();
+        WS_PROBE1( read_start, m_sockfd );
+    }
 
     int bytes_read = 0;
-    while( true )
+    //读缓冲区满时先处理已经读到的数据,HTTP/2连接处理完就会清空读缓冲区
+    //;EPOLLONESHOT事件重新注册时,socket中剩余的数据会再次触发EPOLLIN
+    //。TLS连接中已经解密的明文不在socket中,由rearm检查
+    while( m_read_idx < READ_BUFFER_SIZE )
     {
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        if( m_tls )
+        {
+            bytes_read = tls::read( m_ssl, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
+        }
+        else
+        {
+            bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        }
         if ( bytes_read == -1 )
         {
             /*EAGAIN和 EWOULDBLOCK等效！
@@ -190,11 +311,77 @@ bool http_conn::read()
             return false;
         }
 
+        if( traffic_capture::enabled() )
+        {
+            traffic_capture::data( m_conn_id, m_read_buf + m_read_idx, bytes_read );
+        }
         m_read_idx += bytes_read;
     }
+    m_trace.read_end = monotonic_ns();
+    WS_PROBE2( read_done, m_sockfd, m_read_idx );
+    if( m_h2 )
+    {
+        m_lane = LANE_NORMAL;
+    }
+    else if( m_check_state == CHECK_STATE_REQUESTLINE )
+    {
+        classify();
+        m_trace.lane = m_lane;
+    }
     return true;
 }
 
+//只看请求行中的URL和Host头部,不修改读缓冲区,请求行还不完整时归入LANE_NORMAL
+void http_conn::classify()
+{
+    m_lane = LANE_NORMAL;
+    const char* end = m_read_buf + m_read_idx;
+    const char* url = ( const char* )memchr( m_read_buf, ' ', m_read_idx );
+    if( ! url )
+    {
+        return;
+    }
+    ++url;
+    const char* url_end = url;
+    while( url_end < end && *url_end != ' ' && *url_end != '?' && *url_end != '\r' && *url_end != '\n' )
+    {
+        ++url_end;
+    }
+    if( url_end == end || url_end - url >= FILENAME_LEN )
+    {
+        return;
+    }
+    char path[ FILENAME_LEN ];
+    memcpy( path, url, url_end - url );
+    path[ url_end - url ] = '\0';
+
+    //Host头部可能还没有收到,此时按默认虚拟主机分类
+    char host[ 256 ];
+    host[ 0 ] = '\0';
+    for( const char* p = url_end; p && p < end; p = ( const char* )memchr( p, '\n', end - p ) )
+    {
+        ++p;
+        if( end - p > 5 && strncasecmp( p, "Host:", 5 ) == 0 )
+        {
+            p += 5;
+            p += strspn( p, " \t" );
+            int len = 0;
+            while( p + len < end && p[ len ] != '\r' && p[ len ] != '\n' && len < ( int )sizeof( host ) - 1 )
+            {
+                ++len;
+            }
+            memcpy( host, p, len );
+            host[ len ] = '\0';
+            break;
+        }
+    }
+
+    rcu::read_lock();
+    const route* rt = router::current()->match( host[ 0 ] ? host : NULL, path );
+    m_lane = router::classify( rt, path );
+    rcu::read_unlock();
+}
+
 //解析HTTP请求行,获得请求方法、目标URL,以及HTTP版本号
 http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
 {
@@ -215,6 +402,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     {
         m_method = GET;
     }
+    else if ( strcasecmp( method, "POST" ) == 0 )
+    {
+        m_method = POST;
+    }
+    else if ( strcasecmp( method, "PUT" ) == 0 )
+    {
+        m_method = PUT;
+    }
     else
     {
         return BAD_REQUEST;
@@ -271,11 +466,11 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
             return GET_REQUEST;
         }
 
-        //如果HTTP请求有消息体,则还需要读取m_content_length字节的消息体,状态机转移到CHECK_STATE_CONTENT状态
-        if ( m_content_length != 0 )
+        //如果HTTP请求有消息体,则还需要接收消息体,状态机转移到CHECK_STATE_CONTENT状态
+        //。POST和PUT即使没有消息体也要经过接收的过程,得到一个空文件
+        if ( m_content_length != 0 || m_chunked || m_method == POST || m_method == PUT )
         {
-            m_check_state = CHECK_STATE_CONTENT;
-            return NO_REQUEST;
+            return start_body();
         }
 
         //否则说明我们已经得到了一个完整的HTTP请求
@@ -296,7 +491,29 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
     {
         text += 15;
         text += strspn( text, " \t" );
-        m_content_length = atol( text );
+        char* end = NULL;
+        m_content_length = strtol( text, &end, 10 );
+        if ( ! isdigit( ( unsigned char )text[ 0 ] ) || end[ strspn( end, " \t" ) ] != '\0' )
+        {
+            return BAD_REQUEST;
+        }
+    }
+    //只支持chunked一种传输编码
+    else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "chunked" ) != 0 )
+        {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    else if ( strncasecmp( text, "Expect:", 7 ) == 0 )
+    {
+        text += 7;
+        text += strspn( text, " \t" );
+        m_expect_continue = ( strcasecmp( text, "100-continue" ) == 0 );
     }
     //处理Host头部字段
     else if ( strncasecmp( text, "Host:", 5 ) == 0 )
@@ -305,6 +522,30 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
         text += strspn( text, " \t" );
         m_host = text;
     }
+    //请求升级到明文HTTP/2
+    else if ( strncasecmp( text, "Upgrade:", 8 ) == 0 )
+    {
+        text += 8;
+        text += strspn( text, " \t" );
+        m_upgrade_h2c = ( strcasecmp( text, "h2c" ) == 0 );
+    }
+    else if ( strncasecmp( text, "HTTP2-Settings:", 15 ) == 0 )
+    {
+        text += 15;
+        text += strspn( text, " \t" );
+        m_h2_settings = text;
+    }
+    //资源包中的资源有gzip版本和ETag
+    else if ( strncasecmp( text, "Accept-Encoding:", 16 ) == 0 )
+    {
+        m_accept_gzip = asset_pack::accepts_gzip( text + 16 );
+    }
+    else if ( strncasecmp( text, "If-None-Match:", 14 ) == 0 )
+    {
+        text += 14;
+        text += strspn( text, " \t" );
+        m_if_none_match = text;
+    }
     else
     {
         printf( "oop! unknow header %s\n", text );
@@ -314,15 +555,201 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
 
 }
 
-//我们没有真正解析HTTP请求的消息体,只是判断它是否被完整地读入了
-http_conn::HTTP_CODE http_conn::parse_content( char* text )
+//头部解析完毕,请求带有消息体:按路由决定消息体的去处
+//。消息体不进入读缓冲区,由工作线程分批从socket读出后立即交给m_sink,内存占用与消息体的大小无关
+http_conn::HTTP_CODE http_conn::start_body()
 {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    //同时带有两者的请求可能被前后两个服务器按不同的长度切分(请求走私),直接拒绝
+    if ( m_chunked && m_content_length != 0 )
     {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+        return body_error( BAD_REQUEST );
+    }
+    if ( m_content_length > m_max_body )
+    {
+        metrics::add( BODIES_REJECTED, 1 );
+        return body_error( BODY_TOO_LARGE );
+    }
+
+    //路由只在这一次process()期间有效,消息体可能要经过多次process()才能接收完,只在这里用它决定去处
+    const route* rt = router::current()->match( m_host, m_url );
+    if ( m_method == POST || m_method == PUT )
+    {
+        if ( rt->handler != HANDLER_UPLOAD )
+        {
+            return body_error( BAD_METHOD );
+        }
+        //不允许通过..写到根目录之外,也不能写目录
+        int len = strlen( m_url );
+        if ( router::escapes_root( m_url ) )
+        {
+            return body_error( FORBIDDEN_REQUEST );
+        }
+        if ( m_url[ len - 1 ] == '/' )
+        {
+            return body_error( BAD_REQUEST );
+        }
+        m_sink = file_sink::create( rt->doc_root + m_url );
+        if ( ! m_sink )
+        {
+            return body_error( errno == ENOENT ? NO_RESOURCE : errno == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR );
+        }
+    }
+    else
+    {
+        m_sink = new discard_sink;
+    }
+    m_body_left = m_content_length;
+    m_check_state = CHECK_STATE_CONTENT;
+
+    //客户端在收到100 Continue之前不发送消息体;此时发送缓冲区是空的,不会只写出一部分
+    if ( m_expect_continue && m_checked_idx == m_read_idx )
+    {
+        if ( m_tls )
+        {
+            iovec iv = { ( void* )continue_100, strlen( continue_100 ) };
+            tls::writev( m_ssl, &iv, 1 );
+        }
+        else
+        {
+            send( m_sockfd, continue_100, strlen( continue_100 ), MSG_NOSIGNAL );
+        }
+    }
+    return NO_REQUEST;
+}
+
+//把一段收到的消息体交给m_sink,used为属于消息体的字节数
+http_conn::HTTP_CODE http_conn::feed_body( char* data, int len, int* used )
+{
+    int n = 0;
+    chunked_decoder::RESULT ret = chunked_decoder::CHUNK_MORE;
+    if ( m_chunked )
+    {
+        ret = m_chunk.decode( data, len, used, &n );
+        if ( ret == chunked_decoder::CHUNK_ERROR )
+        {
+            return body_error( BAD_REQUEST );
+        }
+    }
+    else
+    {
+        n = len < m_body_left ? len : m_body_left;
+        m_body_left -= n;
+        *used = n;
+    }
+
+    m_body_received += n;
+    metrics::add( BODY_BYTES, n );
+    if ( m_body_received > m_max_body )
+    {
+        metrics::add( BODIES_REJECTED, 1 );
+        return body_error( BODY_TOO_LARGE );
+    }
+    if ( n > 0 && ! m_sink->write( data, n ) )
+    {
+        return body_error( INTERNAL_ERROR );
+    }
+    if ( m_chunked ? ret == chunked_decoder::CHUNK_DONE : m_body_left == 0 )
+    {
+        return finish_body();
+    }
+    return NO_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::finish_body()
+{
+    bool ok = m_sink->finish();
+    delete m_sink;
+    m_sink = NULL;
+    return ok ? GET_REQUEST : INTERNAL_ERROR;
+}
+
+//消息体没有接收完就要响应,剩下的数据无法跳过,响应后关闭连接
+http_conn::HTTP_CODE http_conn::body_error( HTTP_CODE code )
+{
+    delete m_sink;
+    m_sink = NULL;
+    m_linger = false;
+    return code;
+}
+
+//接收消息体:先处理读缓冲区中随头部一起到达的部分,再直接从socket读取
+//。没有数据可读时返回NO_REQUEST,等待下一个EPOLLIN;读满BODY_BUDGET也返回NO_REQUEST,让出工作线程
+//,重新注册EPOLLIN后socket中剩余的数据会立即再次触发,其他连接的请求因此不会被一个大的上传饿死
+http_conn::HTTP_CODE http_conn::parse_content()
+{
+    int used = 0;
+    HTTP_CODE ret = NO_REQUEST;
+    if ( m_checked_idx < m_read_idx )
+    {
+        ret = feed_body( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx, &used );
+        m_checked_idx += used;
+        //保持连接时读缓冲区会被清空,随消息体一起到达的下一个请求同样得不到响应
+        if ( ret == GET_REQUEST && m_checked_idx < m_read_idx )
+        {
+            m_linger = false;
+        }
+        if ( ret != NO_REQUEST )
+        {
+            return ret;
+        }
     }
 
+    long budget = BODY_BUDGET;
+    while ( budget > 0 )
+    {
+        long n = 0;
+        //Content-Length的明文消息体写入文件时用splice,数据不经过用户态
+        //;抓包时消息体要经过用户态才能记录,不用splice
+        if ( ! m_chunked && ! m_tls && m_sink->can_splice() && ! traffic_capture::enabled() )
+        {
+            n = m_sink->splice_from( m_sockfd, m_body_left < budget ? m_body_left : budget );
+            if ( n > 0 )
+            {
+                m_body_left -= n;
+                m_body_received += n;
+                metrics::add( BODY_BYTES, n );
+                if ( m_body_left == 0 )
+                {
+                    return finish_body();
+                }
+            }
+        }
+        else
+        {
+            //Content-Length时只读属于消息体的部分,chunked时可能读到消息体之后的数据(流水线请求)
+            char window[ BODY_WINDOW ];
+            long want = ( ! m_chunked && m_body_left < BODY_WINDOW ) ? m_body_left : BODY_WINDOW;
+            n = m_tls ? tls::read( m_ssl, window, want ) : recv( m_sockfd, window, want, 0 );
+            if ( n > 0 )
+            {
+                //和read()一样记录原始数据,否则抓包文件中只有请求头部,重放时会把下一个请求当作消息体
+                if ( traffic_capture::enabled() )
+                {
+                    traffic_capture::data( m_conn_id, window, n );
+                }
+                ret = feed_body( window, n, &used );
+                //窗口中消息体之后的数据已经从socket中读出,不能留给下一个请求
+                //,客户端等不到它的响应,响应这个请求后关闭连接,客户端会在新连接上重发
+                if ( ret == GET_REQUEST && used < n )
+                {
+                    m_linger = false;
+                }
+                if ( ret != NO_REQUEST )
+                {
+                    return ret;
+                }
+            }
+        }
+        if ( n == 0 )
+        {
+            return body_error( CLOSED_CONNECTION );
+        }
+        if ( n < 0 )
+        {
+            return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? NO_REQUEST : body_error( CLOSED_CONNECTION );
+        }
+        budget -= n;
+    }
     return NO_REQUEST;
 }
 
@@ -335,9 +762,14 @@ http_conn::HTTP_CODE http_conn::process_read()
     HTTP_CODE ret = NO_REQUEST;
     char* text = NULL;
 
+    //消息体不按行解析
+    if ( m_check_state == CHECK_STATE_CONTENT )
+    {
+        return parse_content();
+    }
+
     //主状态机,用于从buffer中取出所有完整的行
-    while ( ( ( m_check_state == CHECK_STATE_CONTENT ) && ( line_status == LINE_OK  ) )
-                || ( ( line_status = parse_line() ) == LINE_OK ) )
+    while ( ( line_status = parse_line() ) == LINE_OK )
     {
         text = get_line();
         //记录下一行的起始位置
@@ -361,25 +793,15 @@ http_conn::HTTP_CODE http_conn::process_read()
             case CHECK_STATE_HEADER:
             {
                 ret = parse_headers( text );
-                if ( ret == BAD_REQUEST )
+                if ( ret != NO_REQUEST )
                 {
-                    return BAD_REQUEST;
-                }
-                else if ( ret == GET_REQUEST )
-                {
-                    return do_request();
+                    return ret;
                 }
-                break;
-            }
-            //第三个状态,分析请求数据
-            case CHECK_STATE_CONTENT:
-            {
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST )
+                //第三个状态,接收请求数据
+                if ( m_check_state == CHECK_STATE_CONTENT )
                 {
-                    return do_request();
+                    return parse_content();
                 }
-                line_status = LINE_OPEN;
                 break;
             }
             default:
@@ -397,8 +819,35 @@ http_conn::HTTP_CODE http_conn::process_read()
 //，且不是目录,则使用mmap将其映射到内存地址m_file_address处,并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
-    strcpy( m_real_file, doc_root );
-    int len = strlen( doc_root );
+    //按Host头部选择虚拟主机,再按URL的最长前缀选择路由,网站根目录由路由决定
+    m_route = router::current()->match( m_host, m_url );
+    //请求体已经由start_body写入了文件
+    if( m_method == POST || m_method == PUT )
+    {
+        metrics::add( UPLOADS, 1 );
+        return CREATED_REQUEST;
+    }
+    if( m_route->handler == HANDLER_METRICS || m_route->handler == HANDLER_TRACE )
+    {
+        return m_route->microcache ? micro_request() : generate();
+    }
+    if( m_route->pack )
+    {
+        return pack_request();
+    }
+
+    //网站根目录是每条路由的边界,含有..的URL可能读到其他虚拟主机的根目录或整个文件系统
+    if( router::escapes_root( m_url ) )
+    {
+        return FORBIDDEN_REQUEST;
+    }
+    const std::string& doc_root = m_route->doc_root;
+    int len = doc_root.size();
+    if( len >= FILENAME_LEN )
+    {
+        return INTERNAL_ERROR;
+    }
+    memcpy( m_real_file, doc_root.data(), len );
     /*
     函数原型： char *strncpy(char *dest, const char *src, int n)
     返回值：dest字符串起始地址
@@ -409,8 +858,31 @@ http_conn::HTTP_CODE http_conn::do_request()
     2、src和dest所指的内存区域不能重叠，且dest必须有足够的空间放置n个字符
     */
     strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
+    //受inotify监视的文件(以及记住的不存在的路径)直接使用缓存,不需要stat,文件被修改时条目由file_watcher清除
+    if( ! m_ktls )
+    {
+        switch( file_cache::lookup( m_real_file, &m_cached ) )
+        {
+            case file_cache::FILE_HIT:
+            {
+                return file_ready();
+            }
+            case file_cache::FILE_WAIT:
+            {
+                return FILE_PENDING;
+            }
+            default:
+            {
+                break;
+            }
+        }
+    }
     if ( stat( m_real_file, &m_file_stat ) < 0 )
     {
+        if( errno == ENOENT )
+        {
+            file_cache::remember_missing( m_real_file );
+        }
         return NO_RESOURCE;
     }
 
@@ -421,92 +893,673 @@ http_conn::HTTP_CODE http_conn::do_request()
 
     if ( S_ISDIR( m_file_stat.st_mode ) )//S_ISDIR()函数的作用是判断一个路径是不是目录
     {
+        if ( m_route->handler == HANDLER_LISTING )
+        {
+            return m_route->microcache ? micro_request() : generate();
+        }
         return BAD_REQUEST;
     }
 
-    int fd = open( m_real_file, O_RDONLY );
-    //mmap的用法看lesson25的mmap-parent-child-ipc.c
-    m_file_address = ( char* )mmap( 0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
-    return FILE_REQUEST;
-}
-
-//对内存映射区执行munmap操作
-void http_conn::unmap()
-{
-    if( m_file_address )
+    //空文件不需要映射也不需要sendfile,响应体为空
+    if( m_file_stat.st_size == 0 )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = NULL;
+        return FILE_REQUEST;
     }
-}
-
-//写HTTP响应
-bool http_conn::write()
-{
-    int temp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_idx;
-    if ( bytes_to_send == 0 )
+    //kTLS连接用sendfile发送文件,由内核直接从页缓存读取并加密
+    if( m_ktls )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
-        init();
-        return true;
+        int fd = open( m_real_file, O_RDONLY );
+        if( fd < 0 )
+        {
+            return INTERNAL_ERROR;
+        }
+        m_file_fd = fd;
+        m_sendfile = true;
+        return FILE_REQUEST;
     }
 
-    while( 1 )
+    //同一个文件的并发冷加载合并为一次:第一个请求open和mmap,其他请求挂在缓存条目上,不占用工作线程
+    switch( file_cache::acquire( m_real_file, m_file_stat, &m_cached ) )
     {
-        //对于EPOLLIN : 如果状态改变了[ 比如 从无到有],那么只要输入缓冲区可读就会触发
-        //对于EPOLLOUT: 如果状态改变了[比如 从满到不满],只要输出缓冲区可写就会触发;
-        //详见https://blog.csdn.net/dashoumeixi/article/details/94406535 解释.c的第二个
-        temp = writev( m_sockfd, m_iv, m_iv_count );
-        if ( temp <= -1 )
+        case file_cache::FILE_HIT:
         {
-            //如果TCP写缓冲没有空间,则等待下一轮EPOLLOUT事件,虽然在此期间,服务器无法立即接收到同一客户的下一个请求
-            //,但这可以保证连接的完整性
-            if( errno == EAGAIN )
-            {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
-                return true;
-            }
-            //响应成功,根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            return false;
+            return file_ready();
         }
-
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        //if ( bytes_to_send <= bytes_have_send )
-        if( bytes_to_send <= 0 )
-        //https://blog.csdn.net/ad838931963/article/details/118598882?
-        //解释.c的第三个
+        case file_cache::FILE_WAIT:
         {
-            unmap();
-            if( m_linger )
-            {
-                init();
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return true;
-            }
-            else
-            {
-                modfd( m_epollfd, m_sockfd, EPOLLIN );
-                return false;
-            } 
+            return FILE_PENDING;
+        }
+        default:
+        {
+            break;
         }
     }
+    //mmap的用法看lesson25的mmap-parent-child-ipc.c
+    std::vector< void* > waiters;
+    file_cache::load( m_cached, waiters );
+    for( size_t i = 0; i < waiters.size(); ++i )
+    {
+        static_cast< http_conn* >( waiters[i] )->resume_file();
+    }
+    return file_ready();
 }
 
-//往写缓冲区写入待发送的数据
-//https://blog.csdn.net/weixin_40332490/article/details/105306188
-//详情查看 解释.cpp
-bool http_conn::add_response( const char* format, ... )
+//在资源包中查找URL,查询字符串不参与查找(常用来让浏览器绕过缓存取新版本)
+//。包在打开时已经校验过,这里没有系统调用,响应体直接从包的映射中writev
+http_conn::HTTP_CODE http_conn::pack_request()
 {
-    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    if( ! m_route->pack->find( m_url, strcspn( m_url, "?" ), &m_asset ) )
     {
-        return false;
+        metrics::add( PACK_MISSES, 1 );
+        return NO_RESOURCE;
     }
-    va_list arg_list;
+    //路由表被替换后包可能只剩这一个引用,发送完毕后在unmap中释放
+    m_pack = m_route->pack;
+    m_pack->acquire();
+    m_gzip = m_accept_gzip && m_asset.gzip;
+    if( m_if_none_match && asset_pack::etag_matches( m_if_none_match, m_asset.etag, m_asset.etag_len ) )
+    {
+        metrics::add( PACK_NOT_MODIFIED, 1 );
+        return NOT_MODIFIED;
+    }
+    m_file_address = const_cast< char* >( m_gzip ? m_asset.gzip : m_asset.body );
+    memset( &m_file_stat, 0, sizeof( m_file_stat ) );
+    m_file_stat.st_size = m_gzip ? m_asset.gzip_len : m_asset.body_len;
+    metrics::add( m_gzip ? PACK_GZIP_HITS : PACK_HITS, 1 );
+    return FILE_REQUEST;
+}
+
+http_conn::HTTP_CODE http_conn::generate()
+{
+    if( m_route->handler == HANDLER_METRICS )
+    {
+        m_body = metrics::render( &m_body_len );
+        return m_body ? DYNAMIC_REQUEST : INTERNAL_ERROR;
+    }
+    if( m_route->handler == HANDLER_TRACE )
+    {
+        m_body = request_tracer::render( &m_body_len );
+        return m_body ? DYNAMIC_REQUEST : INTERNAL_ERROR;
+    }
+    //目录列表的长度事先未知,以流式响应发送
+    dir_listing* listing = dir_listing::create( m_real_file, m_url );
+    if ( ! listing )
+    {
+        return errno == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+    }
+    m_stream = new response_stream( listing );
+    return STREAM_REQUEST;
+}
+
+//微缓存的键是Host和URL,只有GET请求会到达这里;生成的响应不随其他请求头部变化,不需要按Vary区分
+//。未命中时这个请求生成响应,目录列表不分块地一次生成完毕,同一个键的其他请求在此期间挂在条目上
+http_conn::HTTP_CODE http_conn::micro_request()
+{
+    std::string key( m_host ? m_host : "" );
+    key += ' ';
+    key += m_url;
+    long long now = monotonic_ns();
+    switch( response_cache::acquire( key, now, &m_micro ) )
+    {
+        case response_cache::RESP_HIT:
+        case response_cache::RESP_STALE:
+        {
+            return micro_ready();
+        }
+        case response_cache::RESP_WAIT:
+        {
+            return CACHE_PENDING;
+        }
+        case response_cache::RESP_PASS:
+        {
+            return generate();
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    HTTP_CODE ret = generate();
+    //新鲜期和两个宽限期由路由为这个URL配置的Cache-Control决定,没有配置时缓存1秒
+    const std::string& policy = m_route->type_cache[ mime::classify( m_url ) ];
+    std::vector< void* > waiters;
+    if( ret == STREAM_REQUEST && ! m_stream->collect( response_cache::max_entry() ) )
+    {
+        //超过了单个响应的上限:这个请求照常以流式响应发送,新鲜期内的其他请求也各自生成
+        response_cache::pass( m_micro, policy, now, waiters );
+        response_cache::release( m_micro );
+        m_micro = NULL;
+    }
+    else if( ret == DYNAMIC_REQUEST || ret == STREAM_REQUEST )
+    {
+        char* body = m_body;
+        long len = m_body_len;
+        m_body = NULL;
+        m_body_len = 0;
+        if( ret == STREAM_REQUEST )
+        {
+            len = m_stream->queued();
+            body = ( char* )malloc( len > 0 ? len : 1 );
+            if( body )
+            {
+                memcpy( body, m_stream->data(), len );
+            }
+            delete m_stream;
+            m_stream = NULL;
+        }
+        if( body )
+        {
+            std::string headers = std::string( "Content-Type: " ) + dynamic_type() + "\r\nCache-Control: "
+                                  + dynamic_cache_control() + "\r\n";
+            response_cache::complete( m_micro, body, len, headers, policy, now, waiters );
+        }
+        else
+        {
+            response_cache::fail( m_micro, ENOMEM, now, waiters );
+        }
+        ret = micro_ready();
+    }
+    else
+    {
+        response_cache::fail( m_micro, ret == FORBIDDEN_REQUEST ? EACCES : EIO, now, waiters );
+        ret = micro_ready();
+    }
+    for( size_t i = 0; i < waiters.size(); ++i )
+    {
+        static_cast< http_conn* >( waiters[i] )->resume_micro();
+    }
+    return ret;
+}
+
+http_conn::HTTP_CODE http_conn::micro_ready()
+{
+    const cached_response* r = m_micro;
+    //等待的响应太大不能缓存,自己生成
+    if( r->pass )
+    {
+        response_cache::release( m_micro );
+        m_micro = NULL;
+        return generate();
+    }
+    if( r->err )
+    {
+        if( ! r->fallback )
+        {
+            return r->err == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR;
+        }
+        //stale-if-error:返回过期的旧响应,它由m_micro持有引用
+        r = r->fallback;
+        metrics::add( MICROCACHE_STALE_ERRORS, 1 );
+    }
+    m_body = r->body;
+    m_body_len = r->len;
+    return CACHED_REQUEST;
+}
+
+void http_conn::resume_micro()
+{
+    //挂起期间路由表可能已被替换,在生成者的rcu读侧临界区内重新匹配
+    m_route = router::current()->match( m_host, m_url );
+    HTTP_CODE ret = micro_ready();
+    m_trace.resolved = monotonic_ns();
+    WS_PROBE2( resolve_done, m_sockfd, ( int )ret );
+    bool write_ret = process_write( ret );
+    m_route = NULL;
+    if( ! write_ret )
+    {
+        close_conn();
+        return;
+    }
+    rearm( EPOLLOUT );
+}
+
+const char* http_conn::dynamic_type() const
+{
+    return ( m_route && m_route->handler == HANDLER_LISTING ) ? "text/html; charset=utf-8" : "text/plain; version=0.0.4";
+}
+
+const char* http_conn::dynamic_cache_control() const
+{
+    if( m_route && ! m_route->type_cache[ mime::classify( m_url ) ].empty() )
+    {
+        return m_route->type_cache[ mime::classify( m_url ) ].c_str();
+    }
+    return ( m_route && m_route->handler == HANDLER_LISTING ) ? "no-cache" : "no-store";
+}
+
+http_conn::HTTP_CODE http_conn::file_ready()
+{
+    //stat之后文件被清空(EAGAIN):按空文件回复,和do_request中st_size为0时相同
+    if( m_cached->err == EAGAIN )
+    {
+        m_file_stat = m_cached->st;
+        m_file_stat.st_size = 0;
+        m_file_address = NULL;
+        return FILE_REQUEST;
+    }
+    if( m_cached->err )
+    {
+        return m_cached->err == ENOENT ? NO_RESOURCE : ( m_cached->err == EACCES ? FORBIDDEN_REQUEST : INTERNAL_ERROR );
+    }
+    m_file_stat = m_cached->st;
+    m_file_address = m_cached->data;
+    return FILE_REQUEST;
+}
+
+void http_conn::resume_file()
+{
+    //挂起期间路由表可能已被替换,在加载者的rcu读侧临界区内重新匹配
+    m_route = router::current()->match( m_host, m_url );
+    HTTP_CODE ret = file_ready();
+    m_trace.resolved = monotonic_ns();
+    WS_PROBE2( resolve_done, m_sockfd, ( int )ret );
+    bool write_ret = process_write( ret );
+    m_route = NULL;
+    if( ! write_ret )
+    {
+        close_conn();
+        return;
+    }
+    rearm( EPOLLOUT );
+}
+
+//对内存映射区执行munmap操作
+void http_conn::unmap()
+{
+    if( m_cached )
+    {
+        file_cache::release( m_cached );
+        m_cached = NULL;
+        m_file_address = NULL;
+    }
+    if( m_pack )
+    {
+        m_pack->release();
+        m_pack = NULL;
+        m_file_address = NULL;
+        m_gzip = false;
+    }
+    if( m_sendfile )
+    {
+        close( m_file_fd );
+        m_file_fd = -1;
+        m_sendfile = false;
+    }
+    //微缓存中的响应体属于条目,释放引用即可
+    if( m_micro )
+    {
+        response_cache::release( m_micro );
+        m_micro = NULL;
+        m_body = NULL;
+        m_body_len = 0;
+    }
+    if( m_body )
+    {
+        free( m_body );
+        m_body = NULL;
+        m_body_len = 0;
+    }
+    if( m_stream )
+    {
+        delete m_stream;
+        m_stream = NULL;
+        m_stream_refill = false;
+    }
+    //连接在请求体接收完之前关闭,file_sink删除临时文件
+    if( m_sink )
+    {
+        delete m_sink;
+        m_sink = NULL;
+    }
+}
+
+bool http_conn::is_idle() const
+{
+    //工作线程交还连接之前写入的成员,在读到m_released之后才可见
+    if( m_sockfd == -1 || __atomic_load_n( &m_released, __ATOMIC_ACQUIRE ) != m_dispatched )
+    {
+        return false;
+    }
+    return m_h2 ? m_h2->idle() : ( m_read_idx == 0 && m_write_idx == 0 );
+}
+
+void http_conn::rearm( int ev )
+{
+    //modfd之后主线程可能立即再次派发,新的工作线程会改写m_serving,序号要在modfd之前读出
+    unsigned seq = m_serving;
+    //TLS连接读缓冲区满或只读了消息体需要的部分时,OpenSSL中可能还有已经解密的明文,socket不会再变为可读
+    //。同时注册EPOLLOUT,可写事件立即触发,主线程见到m_tls_pending后按可读处理
+    if( ev == EPOLLIN && m_tls && m_tls_ready && tls::pending( m_ssl ) > 0 )
+    {
+        m_tls_pending = true;
+        ev |= EPOLLOUT;
+    }
+    modfd( m_epollfd, m_sockfd, ev );
+    __atomic_store_n( &m_released, seq, __ATOMIC_RELEASE );
+}
+
+bool http_conn::tls_handshake()
+{
+    switch( tls::handshake( m_ssl ) )
+    {
+        case tls::TLS_DONE:
+        {
+            m_tls_ready = true;
+            m_ktls = tls::ktls_send( m_ssl );
+            rearm( EPOLLIN );
+            return true;
+        }
+        case tls::TLS_WANT_READ:
+        {
+            rearm( EPOLLIN );
+            return true;
+        }
+        case tls::TLS_WANT_WRITE:
+        {
+            rearm( EPOLLOUT );
+            return true;
+        }
+        default:
+        {
+            return false;
+        }
+    }
+}
+
+bool http_conn::h2_flush()
+{
+    h2_session::FLUSH_RESULT ret = m_h2->flush( m_sockfd );
+    if( ret == h2_session::FLUSH_ERROR )
+    {
+        return false;
+    }
+    //发送缓冲区已满,同时关注EPOLLIN,对端的WINDOW_UPDATE、PING等帧不会因为我们在等待写而得不到处理
+    if( ret == h2_session::FLUSH_AGAIN )
+    {
+        rearm( EPOLLOUT | EPOLLIN );
+        return true;
+    }
+    if( m_h2->finished() )
+    {
+        return false;
+    }
+    rearm( EPOLLIN );
+    return true;
+}
+
+//写HTTP响应
+bool http_conn::write()
+{
+    //握手时发送缓冲区已满,现在可写了
+    if( m_tls && ! m_tls_ready )
+    {
+        return tls_handshake();
+    }
+    if( m_h2 )
+    {
+        return h2_flush();
+    }
+    if( m_stream )
+    {
+        return stream_write();
+    }
+
+    if ( m_bytes_to_send == 0 )
+    {
+        rearm( EPOLLIN );
+        init();
+        return true;
+    }
+
+    long long now = monotonic_ns();
+    if( m_trace.write_start == 0 )
+    {
+        m_trace.write_start = now;
+    }
+    //上一次写因发送缓冲区已满而返回,现在收到了EPOLLOUT
+    if( m_trace.stall_start )
+    {
+        m_trace.stall_ns += now - m_trace.stall_start;
+        m_trace.stall_start = 0;
+    }
+
+    //tcp_cork:第一轮写出的头部和响应体只按满的报文段发送,解除时把不满的尾部一起发出
+    //。writev和用户态TLS已经把头部和响应体放在同一次调用中,这主要减少TLS记录(设置了TCP_NODELAY)之间不满的报文段
+    bool cork = m_tcp_cork && m_bytes_have_send == 0;
+    int on = 1, off = 0;
+    if( cork )
+    {
+        setsockopt( m_sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof( on ) );
+    }
+    bool ret = write_slice();
+    if( cork )
+    {
+        setsockopt( m_sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof( off ) );
+    }
+    return ret;
+}
+
+//监听socket设置了TCP_NOTSENT_LOWAT时,内核中尚未发出的数据超过阈值writev就返回EAGAIN,低于阈值时才报告EPOLLOUT
+//,每个连接排队的数据不超过阈值加上拥塞窗口,而不是整个发送缓冲区
+bool http_conn::write_slice()
+{
+    int temp = 0;
+    //这一轮已经写出的字节数
+    long slice = 0;
+    while( 1 )
+    {
+        //对于EPOLLIN : 如果状态改变了[ 比如 从无到有],那么只要输入缓冲区可读就会触发
+        //对于EPOLLOUT: 如果状态改变了[比如 从满到不满],只要输出缓冲区可写就会触发;
+        //详见https://blog.csdn.net/dashoumeixi/article/details/94406535 解释.c的第二个
+        if( m_sendfile && m_bytes_have_send >= m_write_idx )
+        {
+            off_t offset = m_bytes_have_send - m_write_idx;
+            temp = sendfile( m_sockfd, m_file_fd, &offset, m_bytes_to_send );
+            //文件在发送过程中被截断
+            if( temp == 0 )
+            {
+                unmap();
+                return false;
+            }
+        }
+        else if( m_sendfile )
+        {
+            //MSG_MORE让内核把响应头部和随后的文件内容合并到同一个TLS记录中
+            //;后面没有文件内容时不能带MSG_MORE,否则这个记录一直不会封口发出
+            int more = m_bytes_to_send > m_write_idx - m_bytes_have_send ? MSG_MORE : 0;
+            temp = send( m_sockfd, m_write_buf + m_bytes_have_send, m_write_idx - m_bytes_have_send, more );
+        }
+        else if( m_tls && ! m_ktls )
+        {
+            temp = tls::writev( m_ssl, m_iv, m_iv_count );
+        }
+        else
+        {
+            temp = writev( m_sockfd, m_iv, m_iv_count );
+        }
+        if ( temp <= -1 )
+        {
+            //如果TCP写缓冲没有空间,则等待下一轮EPOLLOUT事件,虽然在此期间,服务器无法立即接收到同一客户的下一个请求
+            //,但这可以保证连接的完整性
+            if( errno == EAGAIN )
+            {
+                m_trace.stall_start = monotonic_ns();
+                m_trace.eagain++;
+                WS_PROBE2( write_eagain, m_sockfd, m_bytes_to_send );
+                sample_tcp_info();
+                rearm( EPOLLOUT );
+                return true;
+            }
+            //响应成功,根据HTTP请求中的Connection字段决定是否立即关闭连接
+            unmap();
+            return false;
+        }
+
+        m_bytes_to_send -= temp;
+        m_bytes_have_send += temp;
+        //writev只写出了一部分,跳过已经发送的内容,下次从未发送的位置继续
+        if( m_bytes_have_send >= m_write_idx )
+        {
+            m_iv[ 0 ].iov_len = 0;
+            if( m_iv_count > 1 )
+            {
+                char* body = m_file_address ? m_file_address : m_body;
+                m_iv[ 1 ].iov_base = body + ( m_bytes_have_send - m_write_idx );
+                m_iv[ 1 ].iov_len = m_bytes_to_send;
+            }
+        }
+        else
+        {
+            m_iv[ 0 ].iov_base = m_write_buf + m_bytes_have_send;
+            m_iv[ 0 ].iov_len = m_write_idx - m_bytes_have_send;
+        }
+
+        if( m_bytes_to_send <= 0 )
+        //https://blog.csdn.net/ad838931963/article/details/118598882?
+        //解释.c的第三个
+        {
+            return end_response( m_write_idx + ( ( m_file_address || m_sendfile ) ? m_file_stat.st_size : m_body_len ) );
+        }
+
+        //用完了时间片:重新注册EPOLLOUT,发送缓冲区仍然可写,下一次epoll_wait会再次返回这个连接
+        //,在此之前同一批就绪的其他连接先得到处理,一个快速的大文件下载不会独占反应堆
+        slice += temp;
+        if( slice >= m_write_slice )
+        {
+            metrics::add( WRITE_SLICES, 1 );
+            rearm( EPOLLOUT );
+            return true;
+        }
+    }
+}
+
+//每个响应的第一次和之后每m_tcp_info_sample次写阻塞时读取TCP_INFO
+//:尚未发出的字节数反映TCP_NOTSENT_LOWAT的效果,已发出未确认的字节数反映拥塞窗口,两者之和就是这个连接占用的发送队列
+void http_conn::sample_tcp_info()
+{
+    if( m_tcp_info_sample <= 0 || ( m_trace.eagain - 1 ) % m_tcp_info_sample != 0 )
+    {
+        return;
+    }
+    struct tcp_info info;
+    socklen_t len = sizeof( info );
+    memset( &info, 0, sizeof( info ) );
+    if( getsockopt( m_sockfd, IPPROTO_TCP, TCP_INFO, &info, &len ) < 0 )
+    {
+        return;
+    }
+    metrics::observe( WRITE_NOTSENT_BYTES, info.tcpi_notsent_bytes );
+    metrics::observe( WRITE_INFLIGHT_BYTES, ( long long )info.tcpi_unacked * info.tcpi_snd_mss );
+}
+
+bool http_conn::end_response( long bytes )
+{
+    request_tracer::finish( m_trace, monotonic_ns(), m_sockfd, m_url, m_status, bytes );
+    m_trace.reset();
+    unmap();
+    if( m_linger )
+    {
+        init();
+        rearm( EPOLLIN );
+        return true;
+    }
+    else
+    {
+        //监听socket上的SO_LINGER使close发送复位报文段并丢弃发送队列,响应的最后一段可能还在队列中
+        //,完整写出的响应之后改为正常关闭;出错时关闭连接仍然直接复位
+        struct linger graceful = { 0, 0 };
+        setsockopt( m_sockfd, SOL_SOCKET, SO_LINGER, &graceful, sizeof( graceful ) );
+        rearm( EPOLLIN );
+        return false;
+    }
+}
+
+//流式响应:头部在写缓冲区中,响应体在m_stream的队列中,两者一起writev
+//。队列低于低水位时停止写,置m_stream_refill由主线程把连接交给工作线程生成下一批
+//;发送缓冲区满时只等待EPOLLOUT,生产者在此期间不会被调用
+bool http_conn::stream_write()
+{
+    long slice = 0;
+    while( 1 )
+    {
+        int count = 0;
+        long head_left = m_write_idx - m_bytes_have_send;
+        if( head_left > 0 )
+        {
+            m_iv[ count ].iov_base = m_write_buf + m_bytes_have_send;
+            m_iv[ count ].iov_len = head_left;
+            ++count;
+        }
+        if( m_stream->queued() > 0 )
+        {
+            m_iv[ count ].iov_base = ( void* )m_stream->data();
+            m_iv[ count ].iov_len = m_stream->queued();
+            ++count;
+        }
+        if( count == 0 )
+        {
+            return end_response( m_bytes_have_send );
+        }
+
+        long long now = monotonic_ns();
+        if( m_trace.write_start == 0 )
+        {
+            m_trace.write_start = now;
+        }
+        if( m_trace.stall_start )
+        {
+            m_trace.stall_ns += now - m_trace.stall_start;
+            m_trace.stall_start = 0;
+        }
+        long temp = ( m_tls && ! m_ktls ) ? tls::writev( m_ssl, m_iv, count ) : writev( m_sockfd, m_iv, count );
+        if( temp < 0 )
+        {
+            if( errno == EAGAIN )
+            {
+                m_trace.stall_start = monotonic_ns();
+                m_trace.eagain++;
+                WS_PROBE2( write_eagain, m_sockfd, m_stream->queued() );
+                sample_tcp_info();
+                rearm( EPOLLOUT );
+                return true;
+            }
+            unmap();
+            return false;
+        }
+
+        m_bytes_have_send += temp;
+        if( head_left > 0 )
+        {
+            temp -= ( temp < head_left ? temp : head_left );
+        }
+        m_stream->consume( temp );
+        if( m_stream->starving() )
+        {
+            m_stream_refill = true;
+            m_lane = LANE_BULK;
+            return true;
+        }
+        slice += temp;
+        if( slice >= m_write_slice )
+        {
+            metrics::add( WRITE_SLICES, 1 );
+            rearm( EPOLLOUT );
+            return true;
+        }
+    }
+}
+
+//往写缓冲区写入待发送的数据
+//https://blog.csdn.net/weixin_40332490/article/details/105306188
+//详情查看 解释.cpp
+bool http_conn::add_response( const char* format, ... )
+{
+    if( m_write_idx >= WRITE_BUFFER_SIZE )
+    {
+        return false;
+    }
+    va_list arg_list;
     va_start( arg_list, format );
     int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
     if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) )
@@ -520,14 +1573,13 @@ bool http_conn::add_response( const char* format, ... )
 
 bool http_conn::add_status_line( int status, const char* title )
 {
+    m_status = status;
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
 bool http_conn::add_headers( int content_len )
 {
-    add_content_length( content_len );
-    add_linger();
-    add_blank_line();
+    return add_content_length( content_len ) && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length( int content_len )
@@ -535,6 +1587,54 @@ bool http_conn::add_content_length( int content_len )
     return add_response( "Content-Length: %d\r\n", content_len );
 }
 
+//按URL扩展名的类型选择路由的Cache-Control
+bool http_conn::add_cache_control()
+{
+    if( ! m_route )
+    {
+        return true;
+    }
+    const std::string& policy = m_route->type_cache[ mime::classify( m_url ) ];
+    return policy.empty() || add_response( "Cache-Control: %s\r\n", policy.c_str() );
+}
+
+//静态文件的Content-Type和Cache-Control在构建路由表时已经生成,直接复制
+bool http_conn::add_file_headers()
+{
+    if( ! m_route )
+    {
+        return true;
+    }
+    const std::string& headers = m_route->file_headers[ mime::classify( m_url ) ];
+    if( m_write_idx + ( int )headers.size() >= WRITE_BUFFER_SIZE - 1 )
+    {
+        return false;
+    }
+    memcpy( m_write_buf + m_write_idx, headers.data(), headers.size() );
+    m_write_idx += headers.size();
+    return true;
+}
+
+bool http_conn::add_asset_headers()
+{
+    if( ! m_pack )
+    {
+        return true;
+    }
+    //压缩版本和原文件是同一个资源的两种表示,ETag不同,缓存需要按Accept-Encoding区分
+    bool ok = add_response( "Content-Type: %.*s\r\n", m_asset.mime_len, m_asset.mime )
+              && add_response( "ETag: \"%.*s%s\"\r\n", m_asset.etag_len, m_asset.etag, m_gzip ? "-gz" : "" );
+    if( ok && m_gzip )
+    {
+        ok = add_response( "Content-Encoding: %s\r\n", "gzip" );
+    }
+    if( ok && m_asset.gzip )
+    {
+        ok = add_response( "Vary: %s\r\n", "Accept-Encoding" );
+    }
+    return ok;
+}
+
 bool http_conn::add_linger()
 {
     return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
@@ -553,6 +1653,11 @@ bool http_conn::add_content( const char* content )
 //根据服务器处理HTTP请求的结果,决定返回给客户端的内容
 bool http_conn::process_write( HTTP_CODE ret )
 {
+    //平滑重启和内存压力的第三级都不再保持连接,响应后关闭,释放连接的缓冲区
+    if( m_draining || memory_pressure::stage() >= STAGE_SHED )
+    {
+        m_linger = false;
+    }
     switch ( ret )
     {
         case INTERNAL_ERROR:
@@ -585,6 +1690,37 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
             break;
         }
+        case BAD_METHOD:
+        {
+            add_status_line( 405, error_405_title );
+            add_response( "Allow: %s\r\n", "GET" );
+            add_headers( strlen( error_405_form ) );
+            if ( ! add_content( error_405_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case BODY_TOO_LARGE:
+        {
+            add_status_line( 413, error_413_title );
+            add_headers( strlen( error_413_form ) );
+            if ( ! add_content( error_413_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case CREATED_REQUEST:
+        {
+            add_status_line( 201, ok_201_title );
+            add_headers( strlen( ok_201_form ) );
+            if ( ! add_content( ok_201_form ) )
+            {
+                return false;
+            }
+            break;
+        }
         case FORBIDDEN_REQUEST:
         {
             add_status_line( 403, error_403_title );
@@ -598,25 +1734,100 @@ bool http_conn::process_write( HTTP_CODE ret )
         case FILE_REQUEST:
         {
             add_status_line( 200, ok_200_title );
-            if ( m_file_stat.st_size != 0 )
+            //资源包的Content-Type由打包工具写在包中
+            if ( m_pack )
+            {
+                add_cache_control();
+                add_asset_headers();
+            }
+            else
+            {
+                add_file_headers();
+            }
+            //空文件(包括资源包中的空文件)如实返回空的响应体
+            if ( m_file_stat.st_size != 0 || m_pack )
             {
                 add_headers( m_file_stat.st_size );
                 m_iv[ 0 ].iov_base = m_write_buf;
                 m_iv[ 0 ].iov_len = m_write_idx;
                 m_iv[ 1 ].iov_base = m_file_address;
                 m_iv[ 1 ].iov_len = m_file_stat.st_size;
-                m_iv_count = 2;
+                m_iv_count = m_sendfile ? 1 : 2;
+                m_bytes_to_send = m_write_idx + m_file_stat.st_size;
                 return true;
             }
-            else
+            else if ( ! add_headers( 0 ) )
             {
-                const char* ok_string = "<html><body></body></html>";
-                add_headers( strlen( ok_string ) );
-                if ( ! add_content( ok_string ) )
-                {
-                    return false;
-                }
+                return false;
             }
+            break;
+        }
+        case NOT_MODIFIED:
+        {
+            //304没有响应体,只带上客户端据以更新缓存的头部
+            add_status_line( 304, not_modified_304_title );
+            add_cache_control();
+            add_response( "ETag: \"%.*s%s\"\r\n", m_asset.etag_len, m_asset.etag, m_gzip ? "-gz" : "" );
+            if ( m_asset.gzip )
+            {
+                add_response( "Vary: %s\r\n", "Accept-Encoding" );
+            }
+            if ( ! add_linger() || ! add_blank_line() )
+            {
+                return false;
+            }
+            break;
+        }
+        case STREAM_REQUEST:
+        {
+            add_status_line( 200, ok_200_title );
+            add_response( "Content-Type: %s\r\n", dynamic_type() );
+            add_response( "Cache-Control: %s\r\n", dynamic_cache_control() );
+            add_response( "Transfer-Encoding: %s\r\n", "chunked" );
+            if ( ! add_linger() || ! add_blank_line() )
+            {
+                return false;
+            }
+            //第一批数据在工作线程中生成,随头部一起发送
+            m_stream->fill();
+            m_bytes_to_send = m_write_idx;
+            return true;
+        }
+        case DYNAMIC_REQUEST:
+        {
+            add_status_line( 200, ok_200_title );
+            add_response( "Content-Type: %s\r\n", dynamic_type() );
+            add_response( "Cache-Control: %s\r\n", dynamic_cache_control() );
+            if ( ! add_headers( m_body_len ) )
+            {
+                return false;
+            }
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = m_body;
+            m_iv[ 1 ].iov_len = m_body_len;
+            m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + m_body_len;
+            return true;
+        }
+        case CACHED_REQUEST:
+        {
+            //头部在生成时已经拼好;Age是响应生成以来的秒数,过期后刷新期间返回的旧响应据此可以看出
+            const cached_response* r = m_micro->err ? m_micro->fallback : m_micro;
+            add_status_line( 200, ok_200_title );
+            add_response( "%s", r->headers.c_str() );
+            add_response( "Age: %lld\r\n", ( monotonic_ns() - r->born ) / 1000000000LL );
+            if ( ! add_headers( m_body_len ) )
+            {
+                return false;
+            }
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = m_body;
+            m_iv[ 1 ].iov_len = m_body_len;
+            m_iv_count = 2;
+            m_bytes_to_send = m_write_idx + m_body_len;
+            return true;
         }
         default:
         {
@@ -627,25 +1838,170 @@ bool http_conn::process_write( HTTP_CODE ret )
     m_iv[ 0 ].iov_base = m_write_buf;
     m_iv[ 0 ].iov_len = m_write_idx;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_idx;
     return true;
 }
 
 //由线程池中的工作线程调用,这是处理HTTP请求的入口函数
 void http_conn::process()
 {
+    m_serving = __atomic_load_n( &m_dispatched, __ATOMIC_RELAXED );
+    //流式响应的队列低于低水位:生成下一批数据,再交回反应堆发送
+    if( m_stream_refill )
+    {
+        m_stream_refill = false;
+        m_stream->fill();
+        rearm( EPOLLOUT );
+        return;
+    }
+
+    //路由表可能被重新加载的线程替换,在rcu读侧临界区内使用它,结束前不会被释放
+    m_trace.dequeue = monotonic_ns();
+    WS_PROBE2( dequeue, m_sockfd, m_trace.dequeue - m_trace.read_end );
+
+    if( m_tls && ! m_tls_ready )
+    {
+        if( ! tls_handshake() )
+        {
+            close_conn();
+        }
+        return;
+    }
+
+    //以连接前言开头的是prior knowledge方式的HTTP/2连接;TLS连接上的HTTP/2需要ALPN协商,不支持
+    if( ! m_h2 && ! m_tls && m_checked_idx == 0 )
+    {
+        int preface = h2_session::match_preface( m_read_buf, m_read_idx );
+        if( preface == 0 )
+        {
+            rearm( EPOLLIN );
+            return;
+        }
+        if( preface > 0 )
+        {
+            m_h2 = new h2_session();
+            m_h2->start();
+        }
+    }
+    if( m_h2 )
+    {
+        rcu::read_lock();
+        m_h2->feed( m_read_buf, m_read_idx );
+        rcu::read_unlock();
+        m_read_idx = 0;
+        if( m_draining )
+        {
+            m_h2->go_away();
+        }
+        if( ! h2_flush() )
+        {
+            close_conn();
+        }
+        return;
+    }
+
+    rcu::read_lock();
     HTTP_CODE read_ret = process_read();
+    //Upgrade: h2c,升级后这个请求作为流1由HTTP/2会话响应,读缓冲区中剩下的数据是客户端的连接前言和后续的帧
+    //。HTTP2-Settings无效时忽略升级,按HTTP/1.1响应
+    if ( read_ret == GET_REQUEST && m_method == GET && m_upgrade_h2c && m_h2_settings && ! m_tls )
+    {
+        m_h2 = new h2_session();
+        if( m_h2->upgrade( m_h2_settings, m_url, m_host ) )
+        {
+            m_h2->feed( m_read_buf + m_checked_idx, m_read_idx - m_checked_idx );
+            rcu::read_unlock();
+            m_read_idx = 0;
+            if( m_draining )
+            {
+                m_h2->go_away();
+            }
+            if( ! h2_flush() )
+            {
+                close_conn();
+            }
+            return;
+        }
+        delete m_h2;
+        m_h2 = NULL;
+    }
+    //得到一个完整的请求后再定位资源
+    if ( read_ret == GET_REQUEST )
+    {
+        m_trace.parsed = monotonic_ns();
+        WS_PROBE2( parse_done, m_sockfd, m_url );
+        read_ret = do_request();
+        //挂起:加载者可能在park返回之前就恢复了这个连接,所以挂起之后不能再访问任何成员
+        if( read_ret == FILE_PENDING )
+        {
+            m_route = NULL;
+            if( file_cache::park( m_cached, this ) )
+            {
+                rcu::read_unlock();
+                return;
+            }
+            m_route = router::current()->match( m_host, m_url );
+            read_ret = file_ready();
+        }
+        else if( read_ret == CACHE_PENDING )
+        {
+            m_route = NULL;
+            if( response_cache::park( m_micro, this ) )
+            {
+                rcu::read_unlock();
+                return;
+            }
+            m_route = router::current()->match( m_host, m_url );
+            read_ret = micro_ready();
+        }
+    }
+    m_trace.resolved = monotonic_ns();
+    WS_PROBE2( resolve_done, m_sockfd, ( int )read_ret );
     if ( read_ret == NO_REQUEST )
     {
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        rcu::read_unlock();
+        rearm( EPOLLIN );
         return;
     }
 
     bool write_ret = process_write( read_ret );
+    m_route = NULL;
+    rcu::read_unlock();
     if ( ! write_ret )
     {
         close_conn();
+        return;
     }
 
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+    rearm( EPOLLOUT );
+}
+
+//不经过socket,把内存中的数据追加到读缓冲区并解析
+http_conn::HTTP_CODE http_conn::parse( const char* data, int len )
+{
+    if( len > READ_BUFFER_SIZE - m_read_idx )
+    {
+        return BAD_REQUEST;
+    }
+    memcpy( m_read_buf + m_read_idx, data, len );
+    m_read_idx += len;
+    return process_read();
 }
 
+//按解析结果在写缓冲区中生成响应,返回写缓冲区中的字节数,失败时返回-1
+int http_conn::build_response( HTTP_CODE ret )
+{
+    return process_write( ret ) ? m_write_idx : -1;
+}
+
+//一个请求处理完毕,重置解析状态,读缓冲区中已经收到的后续请求(流水线)移到缓冲区开头
+void http_conn::next_request()
+{
+    int left = m_read_idx - m_checked_idx;
+    char pipelined[ READ_BUFFER_SIZE ];
+    memcpy( pipelined, m_read_buf + m_checked_idx, left );
+    unmap();
+    init();
+    memcpy( m_read_buf, pipelined, left );
+    m_read_idx = left;
+}
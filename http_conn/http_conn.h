@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,7 +20,18 @@
 #include <stdarg.h>
 #include <errno.h>
 #include<sys/uio.h>
+#include <sys/sendfile.h>
 #include "../locker/locker.h"
+#include "../router/router.h"
+#include "../trace/trace.h"
+#include "../tls/tls.h"
+#include "../upload/body.h"
+#include "../stream/response_stream.h"
+#include "../cache/file_cache.h"
+#include "../cache/response_cache.h"
+#include "../pack/asset_pack.h"
+
+class h2_session;
 
 class http_conn
 {
@@ -30,7 +42,11 @@ public:
     static const int READ_BUFFER_SIZE = 2048;
     //写缓冲区大小
     static const int WRITE_BUFFER_SIZE = 1024;
-    //HTTP请求方法,我们仅支持GET
+    //请求体由工作线程直接从socket读取,一次最多读这么多字节后让出工作线程
+    static const long BODY_BUDGET = 1024 * 1024;
+    //不能splice时从socket读取请求体使用的栈上窗口
+    static const int BODY_WINDOW = 65536;
+    //HTTP请求方法,支持GET,以及handler=upload的路由上的POST和PUT
     enum METHOD { GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
     //解析客户请求时,主状态机所处的状态,分别表示:当前正在分析请求行、头部字段、请求数据
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
@@ -41,10 +57,19 @@ public:
     //NO_RESOURCE
     //FORBIDDEN_REQUEST表示客户对资源没有足够的访问权限
     //FILE_REQUEST
+    //DYNAMIC_REQUEST表示响应体由处理函数动态生成,保存在m_body中
+    //STREAM_REQUEST表示响应体由m_stream的生产者逐批生成,以chunked编码发送
+    //FILE_PENDING表示目标文件正由另一个请求加载,连接挂在文件缓存的条目上,加载完成后被恢复
+    //CACHED_REQUEST表示响应来自微缓存的条目m_micro,头部和响应体都不需要生成
+    //CACHE_PENDING表示同一个动态响应正由另一个请求生成,连接挂在微缓存的条目上,生成完毕后被恢复
+    //NOT_MODIFIED表示资源包中的资源与If-None-Match中的ETag相同,返回304
+    //CREATED_REQUEST表示请求体已经保存到文件
+    //BAD_METHOD表示路由不接受这个请求方法
+    //BODY_TOO_LARGE表示请求体超过了max_body_kb
     //INTERNAL_ERROR表示服务器内部错误
     //CLOSED_CONNECTION表示客户端已关闭连接
     enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST
-    , INTERNAL_ERROR, CLOSED_CONNECTION };
+    , DYNAMIC_REQUEST, STREAM_REQUEST, FILE_PENDING, CACHED_REQUEST, CACHE_PENDING, NOT_MODIFIED, CREATED_REQUEST, BAD_METHOD, BODY_TOO_LARGE, INTERNAL_ERROR, CLOSED_CONNECTION };
     //读取状态,从状态机的三种可能状态,分别表示:读取到一个完整的行、行出错和数据尚且不完整
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
 
@@ -61,11 +86,44 @@ public:
     bool read();
     //非阻塞写操作
     bool write();
+    //下面三个函数不经过socket处理内存中的请求,供基准测试使用
+    //把data追加到读缓冲区并解析,返回GET_REQUEST表示得到了一个完整的请求,NO_REQUEST表示还需要更多数据
+    HTTP_CODE parse( const char* data, int len );
+    //按解析结果生成响应,返回写缓冲区中的字节数,失败时返回-1
+    int build_response( HTTP_CODE ret );
+    //开始解析读缓冲区中的下一个请求
+    void next_request();
+    //连接是否处于两个请求之间(没有交给工作线程,既没有未处理的请求数据,也没有待发送的响应),只能由主线程调用
+    //。HTTP/2连接在没有进行中的流时是空闲的
+    bool is_idle() const;
+    //流式响应的队列已低于低水位,应交给工作线程继续生成,只能由主线程在write()之后调用
+    bool needs_refill() const { return m_stream_refill; }
+    //这次交给线程池时应排入的通道(REQUEST_LANE),只能由主线程在read()或write()之后调用
+    int lane() const { return m_lane; }
+    //TLS连接在OpenSSL中还有没有读出的明文,由主线程在EPOLLOUT时按可读处理
+    bool tls_pending() const { return m_tls_pending; }
+    //主线程在把连接交给线程池之前调用,此后直到工作线程重新注册事件之前,连接都不是空闲的
+    void dispatch() { __atomic_store_n( &m_dispatched, m_dispatched + 1, __ATOMIC_RELAXED ); }
+    //任务队列已满、连接没有交给工作线程时撤销dispatch
+    void undispatch() { __atomic_store_n( &m_dispatched, m_dispatched - 1, __ATOMIC_RELAXED ); }
 
     //所有socket上的事件都被注册到同一个epoll内核事件表中,所以将epoll文件描述符设置为静态的
     static int m_epollfd;
     //统计用户数量
     static int m_user_count;
+    //平滑重启时老进程置为true,此后所有响应都带Connection: close,发送完毕即关闭连接
+    static bool m_draining;
+    //请求体的最大字节数
+    static long m_max_body;
+    //反应堆一次为一个连接写出的最大字节数,用完后让出,其他就绪的连接先得到处理
+    static long m_write_slice;
+    //忙轮询模式下新连接的SO_BUSY_POLL(微秒,0表示不设置)和每次忙轮询最多处理的包数
+    static int m_busy_poll_us;
+    static int m_busy_poll_budget;
+    //响应的第一轮写(头部和第一段响应体)前后是否加TCP_CORK
+    static bool m_tcp_cork;
+    //写被阻塞时每多少次采样一次TCP_INFO,0表示不采样
+    static int m_tcp_info_sample;
 
 private:
     //初始化连接
@@ -78,10 +136,40 @@ private:
     //下面一组函数被process_read调用以分析HTTP请求
     HTTP_CODE parse_request_line( char* text );
     HTTP_CODE parse_headers( char* text );
-    HTTP_CODE parse_content( char* text );
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
     char* get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
+    //目标文件在缓存中加载完毕,按加载结果返回FILE_REQUEST或错误
+    HTTP_CODE file_ready();
+    //挂起的请求等待的文件已经加载完毕:由加载者的线程调用,生成响应并交给反应堆发送
+    void resume_file();
+    //路由带有资源包:在包中查找URL,不访问文件系统
+    HTTP_CODE pack_request();
+    //按路由的处理方式生成动态响应(metrics、trace、目录列表),返回DYNAMIC_REQUEST、STREAM_REQUEST或错误
+    HTTP_CODE generate();
+    //路由打开了microcache:在微缓存中查找,未命中时由这个请求生成并恢复合并到它上面的请求
+    HTTP_CODE micro_request();
+    //m_micro生成完毕,返回CACHED_REQUEST,或者生成失败时的错误,不可缓存时自己生成
+    HTTP_CODE micro_ready();
+    //挂起的请求等待的动态响应已经生成:由生成者的线程调用,生成响应并交给反应堆发送
+    void resume_micro();
+    //动态响应的Content-Type,以及路由配置的Cache-Control(没有配置时目录列表为no-cache,其他为no-store)
+    const char* dynamic_type() const;
+    const char* dynamic_cache_control() const;
+    //反应堆给读缓冲区中的新请求分类,决定m_lane
+    void classify();
+
+    //下面一组函数接收请求体
+    HTTP_CODE start_body();
+    HTTP_CODE feed_body( char* data, int len, int* used );
+    HTTP_CODE finish_body();
+    HTTP_CODE body_error( HTTP_CODE code );
+
+    //写出头部和文件内容(或内存中的响应体),最多写出m_write_slice字节
+    bool write_slice();
+    //写被阻塞时按m_tcp_info_sample采样内核中排队和在途的字节数
+    void sample_tcp_info();
 
     //下面一组函数被process_write调用以填充HTTP应答
     void unmap();
@@ -90,9 +178,26 @@ private:
     bool add_status_line( int status, const char* title );
     bool add_headers( int content_length );
     bool add_content_length( int content_length );
+    bool add_cache_control();
+    //静态文件预先生成的Content-Type和Cache-Control
+    bool add_file_headers();
+    //资源包中的资源的Content-Type、ETag和Content-Encoding
+    bool add_asset_headers();
     bool add_linger();
     bool add_blank_line();
 
+    //流式响应:把写缓冲区中的头部和m_stream的队列写到socket
+    bool stream_write();
+    //响应已全部写出,记录追踪信息,按是否保持连接重新注册事件,返回false表示应关闭连接
+    bool end_response( long bytes );
+
+    //继续TLS握手并按结果注册事件,返回false表示握手失败
+    bool tls_handshake();
+    //HTTP/2连接:把会话的输出写到socket,并按是否还有待发送的数据注册事件,返回false表示应关闭连接
+    bool h2_flush();
+    //重新注册EPOLLONESHOT事件,并把连接交还给主线程,调用之后不能再访问连接的任何成员
+    void rearm( int ev );
+
     //该HTTP连接的socket和对方的socket地址
     int m_sockfd;
     sockaddr_in m_address;
@@ -124,17 +229,82 @@ private:
     //主机名
     char* m_host;
     //HTTP请求的消息体的长度
-    int m_content_length;
+    long m_content_length;
     //HTTP请求是否要求保持连接
     bool m_linger;
+    //Accept-Encoding中是否接受gzip,If-None-Match头部的值
+    bool m_accept_gzip;
+    char* m_if_none_match;
+    //根据Host和URL匹配到的路由,只在process()执行期间(rcu读侧临界区内)有效
+    const route* m_route;
 
-    //客户请求的目标文件被mmap到内存中的起始位置
+    //客户请求的目标文件被mmap到内存中的起始位置,映射属于文件缓存中的条目m_cached,多个连接共享
     char* m_file_address;
+    cached_file* m_cached;
+    //响应体来自资源包时m_file_address指向包的映射,发送期间持有包的一个引用;m_gzip表示发送的是压缩版本
+    asset_pack* m_pack;
+    pack_asset m_asset;
+    bool m_gzip;
+    //发送方向交给了内核的TLS连接不做mmap,响应体由sendfile从m_file_fd发出,由内核加密
+    bool m_sendfile;
+    int m_file_fd;
+    //动态生成的响应体,由malloc分配,在unmap中释放
+    char* m_body;
+    int m_body_len;
+    //响应来自微缓存时m_body指向这个条目(或它的后备条目)的响应体,发送期间持有条目的一个引用
+    cached_response* m_micro;
     //目标文件的状态,通过它我们可以判断文件是否存在、是否为目录、是否可读,并获取文件大小等信息
     struct stat m_file_stat;
     //我们将采用writev来执行写操作,所以定义下面两个成员,其中m_iv_count表示被写内存块的数量
     struct iovec m_iv[2];
     int m_iv_count;
+    //响应的总字节数和已经发送的字节数,writev只写出一部分时据此调整m_iv
+    long m_bytes_to_send;
+    long m_bytes_have_send;
+
+    //响应状态码,写完后记入追踪信息
+    int m_status;
+    //当前请求各阶段的时间戳
+    req_trace m_trace;
+    //抓包时的连接编号
+    unsigned int m_conn_id;
+
+    //请求中的Upgrade: h2c和HTTP2-Settings头部,两者都有时在响应这个请求的同时升级到HTTP/2
+    bool m_upgrade_h2c;
+    char* m_h2_settings;
+    //升级或以连接前言开始后的HTTP/2会话,此后读到的数据都交给它处理
+    h2_session* m_h2;
+
+    //请求体:是否为chunked编码、客户端是否在等待100 Continue、Content-Length中还没有收到的字节数、已经收到的字节数
+    //。m_sink不为NULL时正在接收请求体,由工作线程直接读socket
+    bool m_chunked;
+    bool m_expect_continue;
+    long m_body_left;
+    long m_body_received;
+    chunked_decoder m_chunk;
+    body_sink* m_sink;
+
+    //交给线程池时的通道:新请求按路由和扩展名分类,请求体的后续数据和流式响应的后续生成归入LANE_BULK
+    int m_lane;
+
+    //流式响应,为NULL时不是流式响应;m_stream_refill为true时连接已交给工作线程生成下一批数据
+    response_stream* m_stream;
+    bool m_stream_refill;
+
+    //是否为TLS连接,握手是否已经完成,发送方向是否由内核(kTLS)加密
+    bool m_tls;
+    SSL* m_ssl;
+    bool m_tls_ready;
+    bool m_ktls;
+    //等待读时OpenSSL中还有明文,rearm同时注册了EPOLLOUT来唤醒主线程
+    bool m_tls_pending;
+
+    //主线程交给线程池的次数、处理它的工作线程看到的次数,以及已经交还给主线程的次数
+    //。m_released与m_dispatched不相等时有线程正在使用连接(包括挂在缓存条目上等待恢复),主线程不能关闭它
+    //;m_released在modfd之后才更新,modfd之后主线程立即再次派发时,旧的工作线程写入的是旧的序号,不会误判为空闲
+    unsigned m_dispatched;
+    unsigned m_serving;
+    unsigned m_released;
 };
 
 #endif
@@ -4,6 +4,9 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 class sem
 {
@@ -112,4 +115,101 @@ private:
     pthread_cond_t m_cond;
 };
 
+//futex等待:*addr仍等于val时休眠,直到被futex_wake唤醒(也可能被信号或伪唤醒打断)
+inline void futex_wait( int* addr, int val )
+{
+    syscall( SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0 );
+}
+
+//futex唤醒:最多唤醒n个在addr上休眠的线程
+inline void futex_wake( int* addr, int n )
+{
+    syscall( SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0 );
+}
+
+//自旋等待时让出流水线,减少对超线程兄弟核的影响
+inline void cpu_relax()
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    __builtin_ia32_pause();
+#elif defined( __aarch64__ )
+    asm volatile( "yield" ::: "memory" );
+#endif
+}
+
+//自旋后休眠的唤醒器,用于替代线程池中sem和locker的组合
+//。等待者先登记为自旋者,在有限的时间内轮询条件;仍没有任务时登记为休眠者,再检查一次条件后在futex上休眠
+//。通知者只在没有自旋者(即没有醒着的线程会看到新任务)时才发起唤醒,并且只唤醒一个休眠者
+//。所有计数都使用顺序一致的原子操作:通知者先发布任务再读计数,等待者先改计数再检查任务,两者至少有一方能看到对方
+class parker
+{
+public:
+    parker() : m_seq( 0 ), m_sleepers( 0 ), m_spinners( 0 ) {}
+
+    //登记为自旋者,已有max_spinners个自旋者时返回false,应直接休眠
+    bool try_spin( int max_spinners )
+    {
+        int n = __atomic_load_n( &m_spinners, __ATOMIC_SEQ_CST );
+        while( n < max_spinners )
+        {
+            if( __atomic_compare_exchange_n( &m_spinners, &n, n + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    void stop_spin()
+    {
+        __atomic_sub_fetch( &m_spinners, 1, __ATOMIC_SEQ_CST );
+    }
+    //醒着并在寻找任务的线程数
+    int spinners() const
+    {
+        return __atomic_load_n( &m_spinners, __ATOMIC_SEQ_CST );
+    }
+
+    //准备休眠:登记为休眠者并返回当前序号,之后调用者必须再检查一次条件
+    //,条件满足时调用cancel_park,否则调用park
+    int prepare_park()
+    {
+        int seq = __atomic_load_n( &m_seq, __ATOMIC_SEQ_CST );
+        __atomic_add_fetch( &m_sleepers, 1, __ATOMIC_SEQ_CST );
+        return seq;
+    }
+    void cancel_park()
+    {
+        __atomic_sub_fetch( &m_sleepers, 1, __ATOMIC_SEQ_CST );
+    }
+    //在序号仍为seq时休眠,被唤醒或序号已变化时返回
+    void park( int seq )
+    {
+        futex_wait( &m_seq, seq );
+        __atomic_sub_fetch( &m_sleepers, 1, __ATOMIC_SEQ_CST );
+    }
+
+    //有休眠者时唤醒其中一个,返回是否发起了唤醒
+    bool unpark_one()
+    {
+        if( __atomic_load_n( &m_sleepers, __ATOMIC_SEQ_CST ) == 0 )
+        {
+            return false;
+        }
+        __atomic_add_fetch( &m_seq, 1, __ATOMIC_SEQ_CST );
+        futex_wake( &m_seq, 1 );
+        return true;
+    }
+    //唤醒所有休眠者
+    void unpark_all()
+    {
+        __atomic_add_fetch( &m_seq, 1, __ATOMIC_SEQ_CST );
+        futex_wake( &m_seq, 0x7fffffff );
+    }
+
+private:
+    int m_seq;//futex字,每次唤醒加一,使准备休眠之后发生的唤醒不会丢失
+    int m_sleepers;//已登记休眠的线程数
+    int m_spinners;//正在自旋寻找任务的线程数
+};
+
 #endif
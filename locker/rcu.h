@@ -0,0 +1,147 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <exception>
+
+//简化的RCU(读-复制-更新)机制
+//读者进入临界区时只写自己线程私有的槽位,不加任何锁;写者先发布新的数据,再调用synchronize
+//等待所有在发布之前进入临界区的读者退出(宽限期),之后才能释放旧数据
+class rcu
+{
+public:
+    //最多同时登记的读者线程数
+    static const int MAX_READERS = 512;
+
+    //进入读侧临界区,允许嵌套
+    static void read_lock()
+    {
+        reader* r = self();
+        if( r->nesting++ == 0 )
+        {
+            __atomic_store_n( &r->seq, __atomic_load_n( &storage().gp_seq, __ATOMIC_RELAXED ), __ATOMIC_RELAXED );
+            //保证槽位的写入先于之后对共享指针的读取被写者看到
+            __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        }
+    }
+
+    //退出读侧临界区
+    static void read_unlock()
+    {
+        reader* r = self();
+        if( --r->nesting == 0 )
+        {
+            __atomic_store_n( &r->seq, 0UL, __ATOMIC_RELEASE );
+        }
+    }
+
+    //等待宽限期结束:调用前已发布新指针,返回后旧数据不再被任何读者引用
+    static void synchronize()
+    {
+        domain& d = state();
+        pthread_mutex_lock( &d.writer_lock );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        unsigned long target = __atomic_add_fetch( &d.gp_seq, 1UL, __ATOMIC_SEQ_CST );
+        int count = __atomic_load_n( &d.used, __ATOMIC_ACQUIRE );
+        for( int i = 0; i < count; ++i )
+        {
+            while( true )
+            {
+                unsigned long seq = __atomic_load_n( &d.readers[ i ].seq, __ATOMIC_ACQUIRE );
+                if( seq == 0 || seq >= target )
+                {
+                    break;
+                }
+                sched_yield();
+            }
+        }
+        pthread_mutex_unlock( &d.writer_lock );
+    }
+
+private:
+    //每个读者线程一个槽位,按缓存行对齐避免伪共享
+    struct reader
+    {
+        unsigned long seq;//0表示不在临界区内,否则为进入时的宽限期序号
+        int nesting;
+        int free;//线程退出后槽位可被复用
+    } __attribute__( ( aligned( 64 ) ) );
+
+    struct domain
+    {
+        unsigned long gp_seq;
+        int used;
+        pthread_mutex_t writer_lock;
+        pthread_key_t key;
+        reader readers[ MAX_READERS ];
+    };
+
+    //静态存储,程序启动时即为全零,不需要构造
+    static domain& storage()
+    {
+        static domain d;
+        return d;
+    }
+
+    static domain& state()
+    {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        pthread_once( &once, create );
+        return storage();
+    }
+
+    static void create()
+    {
+        domain& d = storage();
+        d.gp_seq = 1;
+        d.used = 0;
+        pthread_mutex_init( &d.writer_lock, NULL );
+        pthread_key_create( &d.key, release );
+    }
+
+    //线程退出时归还槽位
+    static void release( void* arg )
+    {
+        reader* r = ( reader* )arg;
+        __atomic_store_n( &r->seq, 0UL, __ATOMIC_RELEASE );
+        __atomic_store_n( &r->free, 1, __ATOMIC_RELEASE );
+    }
+
+    static reader* self()
+    {
+        static __thread reader* r = NULL;
+        if( r )
+        {
+            return r;
+        }
+
+        domain& d = state();
+        pthread_mutex_lock( &d.writer_lock );
+        for( int i = 0; i < d.used && ! r; ++i )
+        {
+            if( d.readers[ i ].free )
+            {
+                r = d.readers + i;
+            }
+        }
+        if( ! r )
+        {
+            if( d.used >= MAX_READERS )
+            {
+                pthread_mutex_unlock( &d.writer_lock );
+                throw std::exception();
+            }
+            r = d.readers + d.used;
+            __atomic_store_n( &d.used, d.used + 1, __ATOMIC_RELEASE );
+        }
+        r->seq = 0;
+        r->nesting = 0;
+        r->free = 0;
+        pthread_mutex_unlock( &d.writer_lock );
+        pthread_setspecific( d.key, r );
+        return r;
+    }
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,16 +10,105 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
 
 #include "./locker/locker.h"
 #include "./threadpool/threadpool.h"
 #include "./http_conn/http_conn.h"
+#include "./config/config.h"
+#include "./router/router.h"
+#include "./affinity/affinity.h"
+#include "./trace/trace.h"
+#include "./capture/capture.h"
+#include "./tls/tls.h"
+#include "./cache/file_watcher.h"
+#include "./memory/memory_pressure.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
+//未指定配置文件时使用的网站根目录
+#define DEFAULT_DOC_ROOT "./resources"
+//新进程通过这两个环境变量继承监听socket和就绪通知管道
+#define LISTEN_FD_ENV "WEBSERVER_LISTEN_FD"
+#define READY_FD_ENV "WEBSERVER_READY_FD"
+//平滑重启时新进程中监听socket和就绪通知管道的文件描述符
+#define INHERITED_LISTEN_FD 3
+#define INHERITED_READY_FD 4
+//老进程等待存量连接结束的默认最长时间(秒)
+#define DEFAULT_DRAIN_TIMEOUT 30
+//慢请求的默认阈值(微秒)和追踪环形缓冲区的默认容量
+#define DEFAULT_TRACE_SLOW_US 100000
+#define DEFAULT_TRACE_RING 1024
+//请求体的默认上限(KB)
+#define DEFAULT_MAX_BODY_KB 1024
+//文件缓存的默认总大小(MB)和单个文件的上限(KB)
+#define DEFAULT_FILE_CACHE_MB 64
+#define DEFAULT_FILE_CACHE_MAX_KB 1024
+//微缓存的默认总大小(MB)和单个响应的上限(KB)
+#define DEFAULT_MICROCACHE_MB 16
+#define DEFAULT_MICROCACHE_MAX_KB 1024
+//反应堆写响应的默认时间片(KB)
+#define DEFAULT_WRITE_SLICE_KB 256
+//每个连接内核中尚未发出的数据的默认上限(KB),0表示不限制,使用系统默认值
+#define DEFAULT_NOTSENT_LOWAT_KB 128
+//内存压力三级的PSI阈值:每个窗口内some停顿超过前两个值、full停顿超过第三个值(毫秒)
+//,以及PSI的窗口(毫秒)和回落一级之前保持的秒数
+#define DEFAULT_PRESSURE_TRIM_MS 100
+#define DEFAULT_PRESSURE_RELEASE_MS 300
+#define DEFAULT_PRESSURE_SHED_MS 200
+#define DEFAULT_PRESSURE_WINDOW_MS 2000
+#define DEFAULT_PRESSURE_HOLD_S 10
+//线程池三个通道(高优先级、普通、大文件)的默认权重
+#define DEFAULT_WEIGHT_HIGH 8
+#define DEFAULT_WEIGHT_NORMAL 4
+#define DEFAULT_WEIGHT_BULK 1
+//监听队列的默认长度(实际值受net.core.somaxconn限制)和一次监听事件最多accept的连接数
+#define DEFAULT_LISTEN_BACKLOG 4096
+#define DEFAULT_ACCEPT_BUDGET 64
+//忙轮询时每次最多处理的包数,和内核的默认值相同
+#define DEFAULT_BUSY_POLL_BUDGET 8
+
+//epoll实例的忙轮询参数(Linux 6.9),较老的头文件中没有
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW( 0x8A, 0x01, struct epoll_params )
+#endif
 
 extern int addfd( int epollfd, int fd, bool one_shot, bool enable_et );
 extern int removefd( int epollfd, int fd );
+extern int setnonblocking( int fd );
+
+//信号处理函数通过这个管道把信号值传给主循环,统一事件源
+static int sig_pipefd[2];
+//配置文件路径,SIGHUP时重新读取
+static const char* config_path = NULL;
+//反应堆在阻塞之前忙轮询的时长(纳秒),0表示直接阻塞在epoll_wait上
+static long long busy_poll_ns = 0;
+//预留的文件描述符,描述符用完时释放它来拒绝连接
+static int spare_fd = -1;
+//记录哪些http_conn对象被初始化过,其余对象的成员未初始化,不能访问
+static bool conn_inited[ MAX_FD ];
+
+void sig_handler( int sig )
+{
+    //保留原来的errno,在函数最后恢复,以保证函数的可重入性
+    int save_errno = errno;
+    char msg = sig;
+    send( sig_pipefd[1], &msg, 1, 0 );
+    errno = save_errno;
+}
 
 //进行信号捕捉与处理
 void addsig( int sig, void( handler )(int), bool restart = true )
@@ -41,94 +131,679 @@ void show_error( int connfd, const char* info )
     close( connfd );
 }
 
+//文件描述符用完时accept失败,连接留在队列中,水平触发的监听socket会让反应堆空转
+//:释放预留的描述符,accept一个连接并立即关闭,再重新预留
+void shed_connection( int listenfd )
+{
+    printf( "out of file descriptors, drop a connection\n" );
+    if( spare_fd >= 0 )
+    {
+        close( spare_fd );
+        int fd = accept( listenfd, NULL, NULL );
+        if( fd >= 0 )
+        {
+            close( fd );
+        }
+    }
+    spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+}
+
+//慢请求追踪:总耗时不低于trace_slow_us微秒的请求每trace_sample个记录一个到容量为trace_ring的环形缓冲区
+void configure_tracing( const config& conf )
+{
+    request_tracer::configure( conf.get_int( "trace_slow_us", DEFAULT_TRACE_SLOW_US ), conf.get_int( "trace_sample", 1 ),
+            conf.get_int( "trace_ring", DEFAULT_TRACE_RING ) );
+    //把收到的请求写入抓包文件,capture_max_mb限制文件大小
+    traffic_capture::configure( conf.get( "capture" ), conf.get_int( "capture_max_mb", 0 ) * 1024L * 1024L );
+}
+
+//请求体(POST、PUT的上传和带消息体的GET)超过max_body_kb时返回413
+void configure_limits( const config& conf )
+{
+    http_conn::m_max_body = conf.get_int( "max_body_kb", DEFAULT_MAX_BODY_KB ) * 1024L;
+    //反应堆一次为一个连接写出的上限,用完后让出给其他就绪的连接
+    http_conn::m_write_slice = conf.get_int( "write_slice_kb", DEFAULT_WRITE_SLICE_KB ) * 1024L;
+}
+
+//TCP_NOTSENT_LOWAT设置在监听socket上,之后accept的连接继承这个值,不必每个连接调用一次setsockopt
+//。慢客户端的连接只在内核中保留notsent_lowat_kb加上拥塞窗口的数据,其余部分留在文件和页缓存中,等EPOLLOUT时再写
+//。重新加载配置只影响之后的连接;平滑重启期间监听socket已经交给新进程,listenfd为-1
+void configure_write( const config& conf, int listenfd )
+{
+    http_conn::m_tcp_cork = conf.get_bool( "tcp_cork", false );
+    http_conn::m_tcp_info_sample = conf.get_int( "tcp_info_sample", 16 );
+    if( listenfd < 0 )
+    {
+        return;
+    }
+    int kb = conf.get_int( "notsent_lowat_kb", DEFAULT_NOTSENT_LOWAT_KB );
+    //0表示恢复系统默认值(net.ipv4.tcp_notsent_lowat,默认不限制)
+    unsigned int lowat = kb > 0 ? kb * 1024U : 0xFFFFFFFFU;
+    if( setsockopt( listenfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof( lowat ) ) < 0 )
+    {
+        printf( "TCP_NOTSENT_LOWAT unsupported, errno is: %d\n", errno );
+    }
+}
+
+//文件缓存和微缓存的大小,以及用inotify监视routes中的所有网站根目录。routes是主线程刚刚发布的路由表,只有主线程会释放它
+void configure_cache( const config& conf, const router* routes )
+{
+    file_cache::configure( conf.get_int( "file_cache_mb", DEFAULT_FILE_CACHE_MB ) * 1024L * 1024
+                         , conf.get_int( "file_cache_max_kb", DEFAULT_FILE_CACHE_MAX_KB ) * 1024L );
+    response_cache::configure( conf.get_int( "microcache_mb", DEFAULT_MICROCACHE_MB ) * 1024L * 1024
+                             , conf.get_int( "microcache_max_kb", DEFAULT_MICROCACHE_MAX_KB ) * 1024L );
+    if( ! conf.get_bool( "file_watch", true ) )
+    {
+        file_watcher::stop();
+        return;
+    }
+    std::vector< std::string > roots;
+    routes->doc_roots( roots );
+    file_watcher::watch( roots );
+}
+
+//内存压力监视:memory_pressure off时关闭;阈值为0的级别不使用PSI触发器,只看cgroup的用量
+void configure_memory( const config& conf )
+{
+    pressure_settings s;
+    s.enabled = conf.get_bool( "memory_pressure", true );
+    s.trim_ms = conf.get_int( "pressure_trim_ms", DEFAULT_PRESSURE_TRIM_MS );
+    s.release_ms = conf.get_int( "pressure_release_ms", DEFAULT_PRESSURE_RELEASE_MS );
+    s.shed_ms = conf.get_int( "pressure_shed_ms", DEFAULT_PRESSURE_SHED_MS );
+    s.window_ms = conf.get_int( "pressure_window_ms", DEFAULT_PRESSURE_WINDOW_MS );
+    s.hold_s = conf.get_int( "pressure_hold_s", DEFAULT_PRESSURE_HOLD_S );
+    memory_pressure::configure( s );
+}
+
+//忙轮询模式:busy_poll_us不为0时反应堆没有事件时先以超时0反复epoll_wait这么多微秒再阻塞
+//,新连接设置SO_BUSY_POLL和SO_PREFER_BUSY_POLL,内核支持时epoll实例也在网卡队列上忙轮询。必须在创建epoll实例之后调用
+void configure_busy_poll( const config& conf )
+{
+    int us = conf.get_int( "busy_poll_us", 0 );
+    int budget = conf.get_int( "busy_poll_budget", DEFAULT_BUSY_POLL_BUDGET );
+    us = us > 0 ? us : 0;
+    busy_poll_ns = us * 1000LL;
+    http_conn::m_busy_poll_us = us;
+    http_conn::m_busy_poll_budget = budget;
+
+    struct epoll_params params;
+    memset( &params, 0, sizeof( params ) );
+    params.busy_poll_usecs = us;
+    params.busy_poll_budget = budget;
+    params.prefer_busy_poll = us > 0;
+    if( ioctl( http_conn::m_epollfd, EPIOCSPARAMS, &params ) < 0 && us > 0 )
+    {
+        printf( "epoll busy poll params unsupported, errno is: %d\n", errno );
+    }
+}
+
+//忙轮询:以超时0反复调用epoll_wait,最多busy_poll_ns纳秒,期间反应堆不休眠,事件到达时不需要被唤醒
+//。用完预算仍没有事件时返回0,由调用者阻塞等待
+static int busy_wait( int epollfd, epoll_event* events )
+{
+    long long deadline = monotonic_ns() + busy_poll_ns;
+    while( true )
+    {
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, 0 );
+        if( number != 0 || monotonic_ns() >= deadline )
+        {
+            return number;
+        }
+        cpu_relax();
+    }
+}
+
+//HTTPS:tls_cert和tls_key是PEM格式的证书链和私钥(私钥可以放在证书文件中),ktls off时总是在用户态加密
+bool configure_tls( const config& conf )
+{
+    return tls::configure( conf.get( "tls_cert" ), conf.get( "tls_key" ), conf.get_bool( "ktls", true ) );
+}
+
+//重新读取配置文件,构建新的路由表并原子地替换,失败时保留原来的配置
+bool reload_config( int listenfd )
+{
+    if( ! config_path )
+    {
+        printf( "no config file to reload\n" );
+        return false;
+    }
+    config conf;
+    router* routes = NULL;
+    if( ! conf.load( config_path ) || ! ( routes = router::build( conf ) ) )
+    {
+        printf( "reload %s failed, keep the old config\n", config_path );
+        return false;
+    }
+    router::publish( routes );
+    configure_tracing( conf );
+    configure_limits( conf );
+    configure_write( conf, listenfd );
+    configure_cache( conf, routes );
+    configure_memory( conf );
+    configure_busy_poll( conf );
+    if( ! configure_tls( conf ) )
+    {
+        printf( "keep the old tls config\n" );
+    }
+    printf( "config %s reloaded\n", config_path );
+    return true;
+}
+
+//fork并exec新的可执行文件,新进程继承监听socket,初始化完成后向就绪管道写入一个字节
+//,老进程在读到这个字节后才停止accept。返回子进程pid和就绪管道的读端
+pid_t spawn_new_binary( const char* exe, char* argv[], int listenfd, int* ready_fd )
+{
+    int pipefd[2];
+    if( pipe( pipefd ) < 0 )
+    {
+        return -1;
+    }
+
+    //fork之后的子进程只能调用异步信号安全的函数,环境变量在fork之前准备好
+    static char listen_env[ 64 ];
+    static char ready_env[ 64 ];
+    snprintf( listen_env, sizeof( listen_env ), "%s=%d", LISTEN_FD_ENV, INHERITED_LISTEN_FD );
+    snprintf( ready_env, sizeof( ready_env ), "%s=%d", READY_FD_ENV, INHERITED_READY_FD );
+    int envc = 0;
+    while( environ[ envc ] )
+    {
+        ++envc;
+    }
+    char** envp = new char*[ envc + 3 ];
+    int n = 0;
+    for( int i = 0; i < envc; ++i )
+    {
+        if( strncmp( environ[ i ], LISTEN_FD_ENV "=", strlen( LISTEN_FD_ENV ) + 1 ) != 0
+                && strncmp( environ[ i ], READY_FD_ENV "=", strlen( READY_FD_ENV ) + 1 ) != 0 )
+        {
+            envp[ n++ ] = environ[ i ];
+        }
+    }
+    envp[ n++ ] = listen_env;
+    envp[ n++ ] = ready_env;
+    envp[ n ] = NULL;
+
+    pid_t pid = fork();
+    if( pid == 0 )
+    {
+        //把要继承的两个描述符移到固定位置,关闭其余所有描述符,避免客户连接泄漏到新进程中
+        int ready = dup( pipefd[1] );
+        int listen_copy = dup( listenfd );
+        if( ready < 0 || listen_copy < 0 || dup2( listen_copy, INHERITED_LISTEN_FD ) < 0
+                || dup2( ready, INHERITED_READY_FD ) < 0 )
+        {
+            _exit( 127 );
+        }
+        if( syscall( SYS_close_range, INHERITED_READY_FD + 1, ~0U, 0 ) < 0 )
+        {
+            for( int fd = INHERITED_READY_FD + 1; fd < MAX_FD; ++fd )
+            {
+                close( fd );
+            }
+        }
+        execve( exe, argv, envp );
+        _exit( 127 );
+    }
+
+    delete [] envp;
+    close( pipefd[1] );
+    if( pid < 0 )
+    {
+        close( pipefd[0] );
+        return -1;
+    }
+    *ready_fd = pipefd[0];
+    return pid;
+}
+
+//按分配方案绑定反应堆线程(即主线程)和工作线程,并让之后分配的内存优先落在选定的NUMA节点上
+void apply_affinity( const affinity_plan& plan, threadpool< http_conn >* pool )
+{
+    if( plan.reactor_cpu >= 0 && ! pin_thread( pthread_self(), plan.reactor_cpu ) )
+    {
+        printf( "pin reactor to cpu %d failed\n", plan.reactor_cpu );
+    }
+    if( pool && ! pool->set_cpus( plan.worker_cpus ) )
+    {
+        printf( "pin workers failed\n" );
+    }
+    if( plan.node >= 0 && ! prefer_node( plan.node ) )
+    {
+        printf( "set memory policy to node %d failed\n", plan.node );
+    }
+}
+
+//把连接交给工作线程。任务队列已满时连接不会再被处理,撤销派发并关闭,否则它永远不是空闲的,排空要等到超时
+void dispatch( http_conn* users, int sockfd, threadpool< http_conn >* pool )
+{
+    users[sockfd].dispatch();
+    if( ! pool->append( users + sockfd, users[sockfd].lane() ) )
+    {
+        users[sockfd].undispatch();
+        users[sockfd].close_conn();
+        metrics::add( POOL_REJECTS, 1 );
+    }
+}
+
+//老进程停止accept之后,关闭所有空闲的keep-alive连接;正在处理的请求在响应时带上Connection: close
+void close_idle_conns( http_conn* users )
+{
+    for( int fd = 0; fd < MAX_FD && http_conn::m_user_count > 0; ++fd )
+    {
+        if( conn_inited[fd] && users[fd].is_idle() )
+        {
+            users[fd].close_conn();
+        }
+    }
+}
+
 
 int main( int argc, char* argv[] )
 {
     if( argc <= 2 )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
+        printf( "usage: %s ip_address port_number [config_file]\n", basename( argv[0] ) );
         return 1;
     }
     const char* ip = argv[1];
     int port = atoi( argv[2] );
 
+    //平滑重启时exec的可执行文件,部署时它可能已被替换为新版本
+    char exe_path[ PATH_MAX ];
+    if( ! strchr( argv[0], '/' ) || ! realpath( argv[0], exe_path ) )
+    {
+        strcpy( exe_path, "/proc/self/exe" );
+    }
+
+    //加载配置文件并构建路由表
+    config conf;
+    router* routes = NULL;
+    if( argc > 3 )
+    {
+        config_path = argv[3];
+        if( ! conf.load( argv[3] ) || ! ( routes = router::build( conf ) ) )
+        {
+            printf( "bad config file %s\n", argv[3] );
+            return 1;
+        }
+    }
+    else
+    {
+        routes = router::create_default( DEFAULT_DOC_ROOT );
+    }
+    router::publish( routes );
+    configure_tracing( conf );
+    configure_limits( conf );
+    configure_cache( conf, routes );
+    if( ! configure_tls( conf ) )
+    {
+        return 1;
+    }
+
     //对SIGPIE信号进行处理_2.14_管道的读写特点和管道设置为非阻塞_PPT2.19信号
     //向一个没有读端的管道写数据会导致SIGPIPE信号的产生,使用SIG_IGN忽略此信号
     addsig(SIGPIPE, SIG_IGN);
+    int drain_timeout = conf.get_int( "drain_timeout", DEFAULT_DRAIN_TIMEOUT );
+
+    //先绑定反应堆线程,这样之后创建的工作线程和首次访问的连接缓冲区都位于同一个NUMA节点上
+    cpu_topology topo;
+    topo.load();
+    affinity_plan plan;
+    if( ! make_affinity_plan( conf, topo, plan ) )
+    {
+        return 1;
+    }
+    apply_affinity( plan, NULL );
+    irq_aligner aligner( topo );
 
     threadpool< http_conn >* pool = NULL;
     try
     {
-        pool = new threadpool< http_conn >;
+        //pool_min_threads和pool_max_threads不同时,线程数根据排队时间在两者之间自动调整
+        int min_threads = conf.get_int( "pool_min_threads", 8 );
+        int max_threads = conf.get_int( "pool_max_threads", min_threads );
+        pool = new threadpool< http_conn >( min_threads, max_threads, conf.get_int( "max_requests", 10000 ) );
     }
     catch( ... )
     {
         return 1;//?为啥是1
         //牛客视频里这里写的exit(-1);
     }
+    apply_affinity( plan, pool );
+    //空闲工作线程休眠前的最大自旋时长和同时自旋的线程数,设为0可关闭自旋
+    //。忙轮询模式下工作线程默认和反应堆自旋同样长的时间,反应堆交来的任务不需要唤醒线程
+    int busy_us = conf.get_int( "busy_poll_us", 0 );
+    if( conf.get( "pool_spin_ns" ) || conf.get( "pool_spinners" ) || busy_us > 0 )
+    {
+        int spin_ns = busy_us > 0 ? busy_us * 1000 : threadpool< http_conn >::DEFAULT_MAX_SPIN_NS;
+        pool->set_spin( conf.get_int( "pool_spin_ns", spin_ns ),
+                conf.get_int( "pool_spinners", threadpool< http_conn >::DEFAULT_MAX_SPINNERS ) );
+    }
+    if( busy_us > 0 && plan.reactor_cpu < 0 )
+    {
+        printf( "busy polling without affinity, the spinning threads may share cpus with each other\n" );
+    }
+    //线程池按通道排队,非空的通道按权重轮流出队
+    static_assert( threadpool< http_conn >::LANES == LANE_COUNT, "one pool lane per REQUEST_LANE" );
+    int weights[ LANE_COUNT ] = { conf.get_int( "pool_weight_high", DEFAULT_WEIGHT_HIGH ),
+                                  conf.get_int( "pool_weight_normal", DEFAULT_WEIGHT_NORMAL ),
+                                  conf.get_int( "pool_weight_bulk", DEFAULT_WEIGHT_BULK ) };
+    pool->set_weights( weights );
 
     //预先为每个可能的客户连接分配一个http_conn对象
     http_conn* users = new http_conn[ MAX_FD ];
     assert( users );
-    int user_count = 0;
-
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    //书P87、88、93、94
-    //这样设置后,此时close系统调用立即返回,TCP模块将丢弃关闭的socket对应的TCP发送缓冲区残留的数据
-    //,同时给对方发送一个复位报文段。因此,这种情况给服务器提供了异常终止一个连接的方法。
-    struct linger tmp = { 1, 0 };
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
 
     int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
+    int listenfd = -1;
+    //由老进程平滑重启而来时,直接使用继承的监听socket,整个过程中监听队列一直存在,不会拒绝任何连接
+    const char* inherited = getenv( LISTEN_FD_ENV );
+    if( inherited )
+    {
+        listenfd = atoi( inherited );
+        int accepting = 0;
+        socklen_t len = sizeof( accepting );
+        ret = getsockopt( listenfd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len );
+        assert( ret >= 0 && accepting );
+        unsetenv( LISTEN_FD_ENV );
+        printf( "inherited listen socket %d\n", listenfd );
+    }
+    else
+    {
+        listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+        assert( listenfd >= 0 );
+        //端口复用,服务器重启时不必等待上一个进程的连接离开TIME_WAIT状态
+        int reuse_addr = 1;
+        setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof( reuse_addr ) );
+        //书P87、88、93、94
+        //这样设置后,此时close系统调用立即返回,TCP模块将丢弃关闭的socket对应的TCP发送缓冲区残留的数据
+        //,同时给对方发送一个复位报文段。因此,这种情况给服务器提供了异常终止一个连接的方法。
+        struct linger tmp = { 1, 0 };
+        setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
+        //每个NUMA节点运行一个实例时,用SO_REUSEPORT共享端口
+        if( conf.get_bool( "reuseport", false ) )
+        {
+            int reuse = 1;
+            setsockopt( listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) );
+        }
 
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
+        struct sockaddr_in address;
+        bzero( &address, sizeof( address ) );
+        address.sin_family = AF_INET;
+        inet_pton( AF_INET, ip, &address.sin_addr );
+        address.sin_port = htons( port );
 
-    ret = listen( listenfd, 5 );
+        ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+        assert( ret >= 0 );
+    }
+
+    //监听队列满时内核丢弃新的SYN,客户端要等1秒后重传,连接风暴时需要足够长的队列
+    //。对已经在监听的socket再次listen只修改队列长度,继承来的监听socket也按本进程的配置调整
+    ret = listen( listenfd, conf.get_int( "listen_backlog", DEFAULT_LISTEN_BACKLOG ) );
     assert( ret >= 0 );
+    setnonblocking( listenfd );
+    //TCP_DEFER_ACCEPT:握手完成后等到请求的数据到达(最多defer_accept秒)才放入accept队列,反应堆不必为还没有发送请求的连接醒来
+    //。HTTP、HTTPS和HTTP/2都由客户端先发送数据,超时后连接照常交给accept
+    int defer_accept = conf.get_int( "defer_accept", 0 );
+    setsockopt( listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof( defer_accept ) );
+    configure_write( conf, listenfd );
+    int accept_budget = conf.get_int( "accept_budget", DEFAULT_ACCEPT_BUDGET );
+    accept_budget = accept_budget > 0 ? accept_budget : 1;
+    spare_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+
+    //SO_REUSEPORT组内,内核优先把连接交给SO_INCOMING_CPU与收包CPU相同的监听socket
+    if( plan.reactor_cpu >= 0 )
+    {
+        setsockopt( listenfd, SOL_SOCKET, SO_INCOMING_CPU, &plan.reactor_cpu, sizeof( plan.reactor_cpu ) );
+    }
 
     epoll_event events[ MAX_EVENT_NUMBER ];
     int epollfd = epoll_create( 5 );
     assert( epollfd != -1 );
+    //监听socket使用LT模式:一次没有accept完的连接在下一次epoll_wait时立即返回
     addfd( epollfd, listenfd, false, false);
     http_conn::m_epollfd = epollfd;
+    configure_busy_poll( conf );
 
-    while( true )
+    //SIGHUP重新加载配置,SIGUSR2平滑重启,SIGCHLD回收平滑重启失败的子进程,SIGTERM和SIGINT正常退出
+    //(正常退出时才会执行atexit,例如写出PGO的profile)
+    ret = socketpair( PF_UNIX, SOCK_STREAM, 0, sig_pipefd );
+    assert( ret != -1 );
+    setnonblocking( sig_pipefd[1] );
+    setnonblocking( sig_pipefd[0] );
+    addfd( epollfd, sig_pipefd[0], false, false );
+    addsig( SIGHUP, sig_handler );
+    addsig( SIGUSR2, sig_handler );
+    addsig( SIGCHLD, sig_handler );
+    addsig( SIGTERM, sig_handler );
+    addsig( SIGINT, sig_handler );
+    //内存压力的级别变化时反应堆被唤醒,第三级需要关闭空闲连接并限制新连接
+    configure_memory( conf );
+    int pressure_fd = memory_pressure::event_fd();
+    if( pressure_fd >= 0 )
+    {
+        addfd( epollfd, pressure_fd, false, false );
+    }
+
+    //初始化已经完成,通知老进程可以停止accept了
+    const char* ready_env = getenv( READY_FD_ENV );
+    if( ready_env )
+    {
+        int ready_fd = atoi( ready_env );
+        char ok = 1;
+        ret = ::write( ready_fd, &ok, 1 );
+        close( ready_fd );
+        unsetenv( READY_FD_ENV );
+    }
+
+    pid_t child = -1;
+    int ready_fd = -1;
+    //draining为true表示已经把监听socket交给了新进程,正在等待存量连接结束
+    bool draining = false;
+    bool stop_server = false;
+    time_t drain_deadline = 0;
+    //shedding为true表示处于内存压力的第三级,连接数不超过shed_cap个
+    bool shedding = false;
+    int shed_cap = 0;
+
+    while( ! stop_server )
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        //排空和抓包时需要定期醒来
+        int number = 0;
+        if( busy_poll_ns > 0 )
+        {
+            number = busy_wait( epollfd, events );
+            metrics::add( number > 0 ? REACTOR_BUSY_POLL_HITS : REACTOR_SLEEPS, 1 );
+        }
+        if( number == 0 )
+        {
+            number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, ( draining || traffic_capture::enabled() ) ? 1000 : -1 );
+        }
         if ( ( number < 0 ) && ( errno != EINTR ) /*某种信号机制引起的错误?*/)
         {
             printf( "epoll failure\n" );
             break;
         }
 
-        for ( int i = 0; i < number; i++ )
+        traffic_capture::tick();
+        long long loop_start = monotonic_ns();
+        //收到SIGTERM之后不再处理这一批中剩下的事件,不再把连接交给工作线程
+        for ( int i = 0; i < number && ! stop_server; i++ )
         {
             int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
+            if( sockfd == sig_pipefd[0] )
+            {
+                char signals[ 1024 ];
+                ret = recv( sig_pipefd[0], signals, sizeof( signals ), 0 );
+                for( int j = 0; j < ret; ++j )
+                {
+                    switch( signals[j] )
+                    {
+                        case SIGHUP:
+                        {
+                            reload_config( listenfd );
+                            //重新加载可能打开或关闭了内存压力监视
+                            if( memory_pressure::event_fd() != pressure_fd )
+                            {
+                                pressure_fd = memory_pressure::event_fd();
+                                shedding = false;
+                                if( pressure_fd >= 0 )
+                                {
+                                    addfd( epollfd, pressure_fd, false, false );
+                                }
+                            }
+                            break;
+                        }
+                        case SIGUSR2:
+                        {
+                            if( child > 0 || draining )
+                            {
+                                printf( "upgrade already in progress\n" );
+                                break;
+                            }
+                            child = spawn_new_binary( exe_path, argv, listenfd, &ready_fd );
+                            if( child < 0 )
+                            {
+                                printf( "fork new binary failed, errno is: %d\n", errno );
+                                break;
+                            }
+                            setnonblocking( ready_fd );
+                            addfd( epollfd, ready_fd, false, false );
+                            printf( "started new binary %s, pid %d\n", exe_path, child );
+                            break;
+                        }
+                        case SIGTERM:
+                        case SIGINT:
+                        {
+                            //退出时先等工作线程结束再释放连接,atexit(例如写出PGO的profile)时没有线程还在使用它们
+                            printf( "stop\n" );
+                            stop_server = true;
+                            break;
+                        }
+                        case SIGCHLD:
+                        {
+                            pid_t pid;
+                            int status;
+                            while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 )
+                            {
+                                if( pid == child )
+                                {
+                                    printf( "new binary exited with status %d\n", status );
+                                    child = -1;
+                                }
+                            }
+                            break;
+                        }
+                        default:
+                        {
+                            break;
+                        }
+                    }
+                }
+            }
+            else if( sockfd == ready_fd )
+            {
+                //读到一个字节表示新进程已就绪;读到EOF说明新进程启动失败,继续由本进程提供服务
+                char ok = 0;
+                ret = ::read( ready_fd, &ok, 1 );
+                removefd( epollfd, ready_fd );
+                ready_fd = -1;
+                if( ret == 1 )
+                {
+                    printf( "new binary is ready, stop accepting and drain %d connections\n", http_conn::m_user_count );
+                    removefd( epollfd, listenfd );
+                    listenfd = -1;
+                    http_conn::m_draining = true;
+                    draining = true;
+                    drain_deadline = time( NULL ) + drain_timeout;
+                    close_idle_conns( users );
+                }
+                else
+                {
+                    printf( "new binary failed to start, keep serving\n" );
+                    child = -1;
+                }
+            }
+            else if( sockfd == pressure_fd )
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
+                //进入第三级时关闭所有空闲的keep-alive连接,之后的响应都带Connection: close(见process_write)
+                //,连接数只降不升;离开第三级后恢复正常
+                uint64_t n;
+                ret = ::read( pressure_fd, &n, sizeof( n ) );
+                bool shed = memory_pressure::stage() >= STAGE_SHED;
+                if( shed && ! shedding )
                 {
-                    printf( "errno is: %d\n", errno );
-                    continue;
+                    int before = http_conn::m_user_count;
+                    close_idle_conns( users );
+                    int closed = before - http_conn::m_user_count;
+                    //连接数上限取剩下的连接数和原来的一半中较大的一个,所有连接都空闲时也不会拒绝全部新连接
+                    shed_cap = before / 2 + 1;
+                    shed_cap = http_conn::m_user_count > shed_cap ? http_conn::m_user_count : shed_cap;
+                    metrics::add( MEMORY_SHED_CONNS, closed );
+                    printf( "memory pressure: closed %d idle connections, keep at most %d\n", closed, shed_cap );
                 }
-                if( http_conn::m_user_count >= MAX_FD )
+                shedding = shed;
+            }
+            else if( sockfd == listenfd )
+            {
+                //一次监听事件最多accept accept_budget个连接,队列中剩下的连接留到下一轮
+                //,同一批就绪的其他连接不会因为连接风暴而等待
+                int accepted = 0;
+                while( accepted < accept_budget )
+                {
+                    struct sockaddr_in client_address;
+                    socklen_t client_addrlength = sizeof( client_address );
+                    int connfd = accept4( listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC );
+                    if ( connfd < 0 )
+                    {
+                        if( errno == EMFILE || errno == ENFILE )
+                        {
+                            shed_connection( listenfd );
+                        }
+                        else if( errno == ECONNABORTED || errno == EINTR )
+                        {
+                            continue;
+                        }
+                        else if( errno != EAGAIN )
+                        {
+                            printf( "errno is: %d\n", errno );
+                        }
+                        break;
+                    }
+                    ++accepted;
+                    //users按文件描述符下标访问,进程的文件描述符上限大于MAX_FD时也不能越界
+                    if( http_conn::m_user_count >= MAX_FD || connfd >= MAX_FD )
+                    {
+                        show_error( connfd, "Internal server busy" );
+                        continue;
+                    }
+                    //内存压力的第三级:每个新连接都需要一套缓冲区,超过上限的连接直接拒绝
+                    if( shedding && http_conn::m_user_count >= shed_cap )
+                    {
+                        metrics::add( MEMORY_SHED_CONNS, 1 );
+                        show_error( connfd, "Internal server busy" );
+                        continue;
+                    }
+
+                    //初始化客户连接
+                    users[connfd].init( connfd, client_address );
+                    conn_inited[connfd] = true;
+
+                    //网卡中断集中在其他节点上时,把反应堆和工作线程迁移过去,减少跨节点访问
+                    int node = -1;
+                    if( plan.irq_align && aligner.sample( connfd, node ) && node != plan.node )
+                    {
+                        printf( "move reactor and workers to numa node %d\n", node );
+                        plan_node( topo, node, plan );
+                        apply_affinity( plan, pool );
+                    }
+                }
+                metrics::add( ACCEPTS, accepted );
+                if( accepted == accept_budget )
                 {
-                    show_error( connfd, "Internal server busy" );
-                    continue;
+                    metrics::add( ACCEPT_BUDGET_HITS, 1 );
                 }
-                
-                //初始化客户连接
-                users[connfd].init( connfd, client_address );
             }
             //EPOLLHUP表示读写都关闭
             else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
@@ -136,12 +811,12 @@ int main( int argc, char* argv[] )
                 //如由异常,直接关闭客户连接
                 users[sockfd].close_conn();
             }
-            else if( events[i].events & EPOLLIN )
+            else if( ( events[i].events & EPOLLIN ) || users[sockfd].tls_pending() )
             {
                 //根据读的结果,决定是将任务添加到线程池,还是关闭连接
                 if( users[sockfd].read() )
                 {
-                    pool->append( users + sockfd );
+                    dispatch( users, sockfd, pool );
                 }
                 else
                 {
@@ -155,15 +830,49 @@ int main( int argc, char* argv[] )
                 {
                     users[sockfd].close_conn();
                 }
+                //流式响应的队列低于低水位,由工作线程继续生成
+                else if( users[sockfd].needs_refill() )
+                {
+                    dispatch( users, sockfd, pool );
+                }
             }
             else
             {}
         }
+        if( number > 0 )
+        {
+            metrics::observe( REACTOR_LOOP_US, ( monotonic_ns() - loop_start ) / 1000 );
+        }
+
+        if( draining )
+        {
+            close_idle_conns( users );
+            if( http_conn::m_user_count <= 0 || time( NULL ) >= drain_deadline )
+            {
+                printf( "drained, %d connections left, exit\n", http_conn::m_user_count );
+                break;
+            }
+        }
     }
 
+    //排空超时或收到SIGTERM时工作线程可能还在process、resume_file或resume_micro中使用连接
+    //,先等所有工作线程退出,再关闭剩下的连接并释放连接数组
+    delete pool;
+    for( int fd = 0; fd < MAX_FD && http_conn::m_user_count > 0; ++fd )
+    {
+        if( conn_inited[fd] )
+        {
+            users[fd].close_conn();
+        }
+    }
+    traffic_capture::configure( NULL, 0 );
+    file_watcher::stop();
+    memory_pressure::stop();
     close( epollfd );
-    close( listenfd );
+    if( listenfd >= 0 )
+    {
+        close( listenfd );
+    }
     delete [] users;
-    delete pool;
     return 0;
 }
@@ -0,0 +1,476 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "memory_pressure.h"
+#include "../cache/file_cache.h"
+#include "../cache/response_cache.h"
+#include "../metrics/metrics.h"
+
+pthread_t memory_pressure::s_thread;
+bool memory_pressure::s_started = false;
+int memory_pressure::s_wake = -1;
+int memory_pressure::s_event = -1;
+int memory_pressure::s_stage = STAGE_NORMAL;
+locker memory_pressure::s_lock;
+pressure_settings memory_pressure::s_settings;
+bool memory_pressure::s_changed = false;
+bool memory_pressure::s_stop = false;
+int memory_pressure::s_triggers[ STAGE_COUNT ] = { -1, -1, -1, -1 };
+std::string memory_pressure::s_memory_dir;
+bool memory_pressure::s_v1 = false;
+
+//没有PSI事件时也每隔这么久读一次cgroup的用量
+static const int POLL_INTERVAL_MS = 1000;
+//工作集达到上限的这个百分比时进入第一级,第二、三级分别在剩余部分的一半和四分之三处
+static const long USAGE_TRIM_PERCENT = 80;
+//第一级把两个缓存的上限降为原来的百分比,第二级降为0
+static const int TRIM_PERCENT = 50;
+//cgroup v1用一个接近LONG_MAX的值表示不限制
+static const long UNLIMITED = 1L << 60;
+
+//读取一个/proc或/sys下的小文件,返回读到的字节数,失败时返回-1
+static int read_small_file( const char* path, char* buf, int len )
+{
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    int n = read( fd, buf, len - 1 );
+    close( fd );
+    if( n < 0 )
+    {
+        return -1;
+    }
+    buf[ n ] = '\0';
+    return n;
+}
+
+//memory.max、memory.current这类只有一个数的文件,"max"和不存在都视为不限制
+static long read_number( const std::string& path )
+{
+    char buf[ 64 ];
+    if( read_small_file( path.c_str(), buf, sizeof( buf ) ) <= 0 || strncmp( buf, "max", 3 ) == 0 )
+    {
+        return -1;
+    }
+    return atol( buf );
+}
+
+//memory.stat中名为key的一行的值,没有时返回0
+static long read_stat( const std::string& dir, const char* key )
+{
+    char buf[ 8192 ];
+    if( read_small_file( ( dir + "/memory.stat" ).c_str(), buf, sizeof( buf ) ) <= 0 )
+    {
+        return 0;
+    }
+    size_t len = strlen( key );
+    for( char* line = buf; line && *line; )
+    {
+        if( strncmp( line, key, len ) == 0 && line[ len ] == ' ' )
+        {
+            return atol( line + len + 1 );
+        }
+        line = strchr( line, '\n' );
+        line = line ? line + 1 : NULL;
+    }
+    return 0;
+}
+
+//本进程的常驻内存(/proc/self/statm的第二项,单位为页)
+static long resident_bytes()
+{
+    char buf[ 128 ];
+    long size = 0, resident = 0;
+    if( read_small_file( "/proc/self/statm", buf, sizeof( buf ) ) <= 0 || sscanf( buf, "%ld %ld", &size, &resident ) != 2 )
+    {
+        return 0;
+    }
+    return resident * sysconf( _SC_PAGESIZE );
+}
+
+//在/proc/self/cgroup中找到本进程所在的cgroup,再在/proc/self/mountinfo中找到挂载它的目录
+//。v1为true时找memory控制器所在的v1层级,否则找v2的统一层级。找到时*dir为cgroup的目录
+static bool find_cgroup( bool v1, std::string* dir )
+{
+    char buf[ 4096 ];
+    if( read_small_file( "/proc/self/cgroup", buf, sizeof( buf ) ) <= 0 )
+    {
+        return false;
+    }
+    //每行为"层级编号:控制器列表:路径",v2的控制器列表为空
+    std::string path;
+    bool found = false;
+    char* save = NULL;
+    for( char* line = strtok_r( buf, "\n", &save ); line && ! found; line = strtok_r( NULL, "\n", &save ) )
+    {
+        char* c1 = strchr( line, ':' );
+        char* c2 = c1 ? strchr( c1 + 1, ':' ) : NULL;
+        if( ! c2 )
+        {
+            continue;
+        }
+        std::string controllers( c1 + 1, c2 );
+        if( v1 ? ( "," + controllers + "," ).find( ",memory," ) != std::string::npos : controllers.empty() )
+        {
+            path = c2 + 1;
+            found = true;
+        }
+    }
+    FILE* fp = found ? fopen( "/proc/self/mountinfo", "re" ) : NULL;
+    if( ! fp )
+    {
+        return false;
+    }
+    //每行为"编号 父编号 设备 根 挂载点 选项... - 类型 来源 超级块选项",容器中根往往就是本cgroup的路径
+    found = false;
+    char line[ 4096 ];
+    while( ! found && fgets( line, sizeof( line ), fp ) )
+    {
+        char root[ 1024 ], point[ 1024 ], type[ 64 ], source[ 1024 ], options[ 1024 ];
+        const char* sep = strstr( line, " - " );
+        if( ! sep || sscanf( line, "%*s %*s %*s %1023s %1023s", root, point ) != 2
+                || sscanf( sep + 3, "%63s %1023s %1023s", type, source, options ) != 3 )
+        {
+            continue;
+        }
+        if( v1 ? strcmp( type, "cgroup" ) != 0 || ( "," + std::string( options ) + "," ).find( ",memory," ) == std::string::npos
+               : strcmp( type, "cgroup2" ) != 0 )
+        {
+            continue;
+        }
+        std::string r( root );
+        if( r == "/" )
+        {
+            *dir = point + path;
+        }
+        else if( path.compare( 0, r.size(), r ) == 0 && ( path.size() == r.size() || path[ r.size() ] == '/' ) )
+        {
+            *dir = point + path.substr( r.size() );
+        }
+        else
+        {
+            continue;
+        }
+        while( dir->size() > 1 && ( *dir )[ dir->size() - 1 ] == '/' )
+        {
+            dir->erase( dir->size() - 1 );
+        }
+        found = true;
+    }
+    fclose( fp );
+    return found;
+}
+
+void memory_pressure::configure( const pressure_settings& s )
+{
+    if( ! s.enabled )
+    {
+        stop();
+        return;
+    }
+    if( ! s_started )
+    {
+        s_wake = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        s_event = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        s_settings = s;
+        s_changed = true;
+        if( s_wake < 0 || s_event < 0 || pthread_create( &s_thread, NULL, run, NULL ) != 0 )
+        {
+            printf( "memory pressure monitor unavailable, errno is: %d\n", errno );
+            if( s_wake >= 0 )
+            {
+                close( s_wake );
+            }
+            if( s_event >= 0 )
+            {
+                close( s_event );
+            }
+            s_wake = s_event = -1;
+            return;
+        }
+        s_started = true;
+        return;
+    }
+    s_lock.lock();
+    s_settings = s;
+    s_changed = true;
+    s_lock.unlock();
+    uint64_t one = 1;
+    ::write( s_wake, &one, sizeof( one ) );
+}
+
+void memory_pressure::stop()
+{
+    if( ! s_started )
+    {
+        return;
+    }
+    s_lock.lock();
+    s_stop = true;
+    s_lock.unlock();
+    uint64_t one = 1;
+    ::write( s_wake, &one, sizeof( one ) );
+    pthread_join( s_thread, NULL );
+    close( s_wake );
+    close( s_event );
+    s_wake = s_event = -1;
+    s_stop = false;
+    s_started = false;
+}
+
+int memory_pressure::open_triggers( const pressure_settings& s )
+{
+    close_triggers();
+    std::string dir;
+    //cgroup v2中优先用本cgroup的memory.pressure,只反映容器自己的停顿;否则用整个系统的/proc/pressure/memory
+    std::string psi = "/proc/pressure/memory";
+    if( find_cgroup( false, &dir ) && access( ( dir + "/memory.pressure" ).c_str(), R_OK | W_OK ) == 0 )
+    {
+        psi = dir + "/memory.pressure";
+    }
+    //上限和用量:v2的根cgroup没有memory.max,这时看memory控制器是否挂在v1层级上
+    s_v1 = false;
+    s_memory_dir.clear();
+    if( ! dir.empty() && access( ( dir + "/memory.current" ).c_str(), R_OK ) == 0 )
+    {
+        s_memory_dir = dir;
+    }
+    else if( find_cgroup( true, &dir ) && access( ( dir + "/memory.usage_in_bytes" ).c_str(), R_OK ) == 0 )
+    {
+        s_memory_dir = dir;
+        s_v1 = true;
+    }
+
+    //内核只接受窗口为500毫秒到10秒、且停顿阈值不超过窗口的触发器;非特权进程的窗口还必须是2秒的整数倍
+    const char* kinds[ STAGE_COUNT ] = { NULL, "some", "some", "full" };
+    int thresholds[ STAGE_COUNT ] = { 0, s.trim_ms, s.release_ms, s.shed_ms };
+    int opened = 0;
+    for( int i = STAGE_TRIM; i < STAGE_COUNT; ++i )
+    {
+        if( thresholds[ i ] <= 0 )
+        {
+            continue;
+        }
+        char trigger[ 64 ];
+        snprintf( trigger, sizeof( trigger ), "%s %ld %ld", kinds[ i ], thresholds[ i ] * 1000L, s.window_ms * 1000L );
+        int fd = open( psi.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC );
+        //写入时包含结尾的'\0'
+        if( fd < 0 || ::write( fd, trigger, strlen( trigger ) + 1 ) < 0 )
+        {
+            printf( "psi trigger \"%s\" on %s failed, errno is: %d\n", trigger, psi.c_str(), errno );
+            if( fd >= 0 )
+            {
+                close( fd );
+            }
+            continue;
+        }
+        s_triggers[ i ] = fd;
+        ++opened;
+    }
+    printf( "memory pressure: %d psi triggers on %s, limit from %s\n", opened, psi.c_str(),
+            s_memory_dir.empty() ? "nowhere" : s_memory_dir.c_str() );
+    return opened;
+}
+
+void memory_pressure::close_triggers()
+{
+    for( int i = 0; i < STAGE_COUNT; ++i )
+    {
+        if( s_triggers[ i ] >= 0 )
+        {
+            close( s_triggers[ i ] );
+            s_triggers[ i ] = -1;
+        }
+    }
+}
+
+bool memory_pressure::read_usage( long* usage, long* limit )
+{
+    if( s_memory_dir.empty() )
+    {
+        return false;
+    }
+    //页缓存中不活跃的部分内核随时可以回收,不算作压力;静态文件多的服务器用量中大部分是它们
+    if( s_v1 )
+    {
+        //hierarchical_memory_limit是本cgroup和所有祖先中最小的上限
+        *limit = read_stat( s_memory_dir, "hierarchical_memory_limit" );
+        if( *limit <= 0 )
+        {
+            *limit = read_number( s_memory_dir + "/memory.limit_in_bytes" );
+        }
+        *usage = read_number( s_memory_dir + "/memory.usage_in_bytes" ) - read_stat( s_memory_dir, "total_inactive_file" );
+    }
+    else
+    {
+        //v2的memory.max只是本cgroup的上限,祖先的上限可能更小,一直向上找到没有memory.max的根cgroup
+        *limit = -1;
+        for( std::string dir = s_memory_dir; ; )
+        {
+            long max = read_number( dir + "/memory.max" );
+            if( max > 0 && ( *limit < 0 || max < *limit ) )
+            {
+                *limit = max;
+            }
+            size_t slash = dir.rfind( '/' );
+            if( slash == std::string::npos || slash == 0 || access( ( dir.substr( 0, slash ) + "/memory.max" ).c_str(), R_OK ) != 0 )
+            {
+                break;
+            }
+            dir.erase( slash );
+        }
+        *usage = read_number( s_memory_dir + "/memory.current" ) - read_stat( s_memory_dir, "inactive_file" );
+    }
+    if( *limit <= 0 || *limit >= UNLIMITED )
+    {
+        *limit = 0;
+    }
+    *usage = *usage > 0 ? *usage : 0;
+    metrics::set( MEMORY_LIMIT_BYTES, *limit );
+    metrics::set( MEMORY_USAGE_BYTES, *usage );
+    return *limit > 0;
+}
+
+void memory_pressure::apply( int from, int to )
+{
+    //两个缓存的上限只取决于目标级别,回落时也一样
+    int percent = to >= STAGE_RELEASE ? 0 : ( to == STAGE_TRIM ? TRIM_PERCENT : 100 );
+    int old_percent = from >= STAGE_RELEASE ? 0 : ( from == STAGE_TRIM ? TRIM_PERCENT : 100 );
+    if( percent != old_percent )
+    {
+        file_cache::shrink( percent );
+        response_cache::shrink( percent );
+    }
+    if( to >= STAGE_TRIM && from < STAGE_TRIM )
+    {
+        metrics::add( MEMORY_TRIMS, 1 );
+    }
+    if( to >= STAGE_RELEASE && from < STAGE_RELEASE )
+    {
+        //缓存释放的映射已经直接还给了内核;堆上释放的内存(连接的请求体、缓存条目、微缓存的响应体等)
+        //仍留在glibc的空闲链表中,malloc_trim对其中整页的部分调用madvise(MADV_DONTNEED)
+        long before = resident_bytes();
+        malloc_trim( 0 );
+        long released = before - resident_bytes();
+        metrics::add( MEMORY_RELEASED_BYTES, released > 0 ? released : 0 );
+        metrics::add( MEMORY_RELEASES, 1 );
+    }
+    if( to >= STAGE_SHED && from < STAGE_SHED )
+    {
+        metrics::add( MEMORY_SHEDS, 1 );
+    }
+    printf( "memory pressure stage %d -> %d\n", from, to );
+    __atomic_store_n( &s_stage, to, __ATOMIC_RELAXED );
+    metrics::set( MEMORY_PRESSURE_STAGE, to );
+    //第三级的进入和离开由反应堆处理
+    uint64_t one = 1;
+    ::write( s_event, &one, sizeof( one ) );
+}
+
+void* memory_pressure::run( void* arg )
+{
+    pressure_settings settings;
+    int usage_percent[ STAGE_COUNT ] = { 0, USAGE_TRIM_PERCENT, USAGE_TRIM_PERCENT + ( 100 - USAGE_TRIM_PERCENT ) / 2,
+                                         USAGE_TRIM_PERCENT + ( 100 - USAGE_TRIM_PERCENT ) * 3 / 4 };
+    //最近一次出现不低于当前级别的压力的时刻
+    time_t last_hit = 0;
+    while( true )
+    {
+        s_lock.lock();
+        bool stop = s_stop;
+        bool changed = s_changed;
+        s_changed = false;
+        settings = s_settings;
+        s_lock.unlock();
+        if( stop )
+        {
+            break;
+        }
+        if( changed )
+        {
+            open_triggers( settings );
+        }
+
+        //第0项是s_wake,其余每一级一项
+        struct pollfd fds[ STAGE_COUNT ];
+        fds[ 0 ].fd = s_wake;
+        fds[ 0 ].events = POLLIN;
+        for( int i = STAGE_TRIM; i < STAGE_COUNT; ++i )
+        {
+            //fd为负时poll忽略这一项
+            fds[ i ].fd = s_triggers[ i ];
+            fds[ i ].events = POLLPRI;
+            fds[ i ].revents = 0;
+        }
+        int ret = poll( fds, STAGE_COUNT, POLL_INTERVAL_MS );
+        if( ret < 0 && errno != EINTR )
+        {
+            break;
+        }
+        if( ret > 0 && ( fds[ 0 ].revents & POLLIN ) )
+        {
+            uint64_t n;
+            ::read( s_wake, &n, sizeof( n ) );
+        }
+
+        //本轮出现的最高级别的压力:PSI触发器和用量占上限的比例
+        int level = STAGE_NORMAL;
+        for( int i = STAGE_TRIM; i < STAGE_COUNT; ++i )
+        {
+            if( ret > 0 && ( fds[ i ].revents & POLLERR ) )
+            {
+                //cgroup被删除或迁移,下次设置变化时重新打开
+                close( s_triggers[ i ] );
+                s_triggers[ i ] = -1;
+            }
+            else if( ret > 0 && ( fds[ i ].revents & POLLPRI ) )
+            {
+                level = i;
+            }
+        }
+        long usage = 0, limit = 0;
+        if( read_usage( &usage, &limit ) )
+        {
+            for( int i = STAGE_COUNT - 1; i > level; --i )
+            {
+                if( usage * 100 / limit >= usage_percent[ i ] )
+                {
+                    level = i;
+                    break;
+                }
+            }
+        }
+
+        //压力升高时立即进入对应的级别;压力消失后每hold_s秒回落一级,避免在两级之间来回切换
+        time_t now = time( NULL );
+        int cur = stage();
+        if( level >= cur && level > STAGE_NORMAL )
+        {
+            last_hit = now;
+            if( level > cur )
+            {
+                apply( cur, level );
+            }
+        }
+        else if( cur > STAGE_NORMAL && now - last_hit >= settings.hold_s )
+        {
+            last_hit = now;
+            apply( cur, cur - 1 );
+        }
+    }
+    close_triggers();
+    if( stage() != STAGE_NORMAL )
+    {
+        apply( stage(), STAGE_NORMAL );
+    }
+    return NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef MEMORY_PRESSURE_H
+#define MEMORY_PRESSURE_H
+
+#include <pthread.h>
+#include <string>
+#include "../locker/locker.h"
+
+//内存压力的级别,逐级叠加:收缩文件缓存和微缓存,把空闲的堆内存还给操作系统,不再保持连接并限制新连接
+enum MEMORY_STAGE { STAGE_NORMAL = 0, STAGE_TRIM, STAGE_RELEASE, STAGE_SHED, STAGE_COUNT };
+
+//内存压力的阈值,由配置文件决定
+struct pressure_settings
+{
+    bool enabled;
+    //PSI触发器:每个窗口内有任务因内存而停顿(some)的时间超过trim_ms、release_ms,或所有任务都停顿(full)超过shed_ms
+    int trim_ms;
+    int release_ms;
+    int shed_ms;
+    int window_ms;
+    //最后一次达到某一级别之后至少保持这么多秒,才回落一级
+    int hold_s;
+};
+
+//订阅Linux的PSI内存压力触发器(cgroup v2的memory.pressure,没有时用/proc/pressure/memory)
+//,同时每秒读取cgroup的内存上限(memory.max,cgroup v1为memory.limit_in_bytes)和用量,按两者中较高的级别逐级降低内存占用
+//。容器接近硬上限时先放弃缓存,再归还空闲内存,最后减少连接,而不是被OOM killer杀掉
+//。后台线程负责检测和前两级的动作;第三级需要遍历连接,由反应堆在event_fd可读时处理
+class memory_pressure
+{
+public:
+    //启动或更新后台线程,enabled为false时停止。只能由主线程调用
+    static void configure( const pressure_settings& s );
+    static void stop();
+
+    //级别变化时可读的eventfd,反应堆读出后按stage()调整连接;没有启动时为-1
+    static int event_fd() { return s_event; }
+    //当前级别,任何线程都可以调用
+    static int stage() { return __atomic_load_n( &s_stage, __ATOMIC_RELAXED ); }
+
+private:
+    static void* run( void* arg );
+    //下面的函数只在后台线程中调用
+    //找到本进程所在的cgroup,打开PSI触发器,返回打开的触发器个数
+    static int open_triggers( const pressure_settings& s );
+    static void close_triggers();
+    //读取cgroup的工作集(用量减去不活跃的页缓存)和上限,没有上限时返回false
+    static bool read_usage( long* usage, long* limit );
+    //从from级别变为to级别时执行的动作
+    static void apply( int from, int to );
+
+    static pthread_t s_thread;
+    static bool s_started;
+    //主线程通过它通知后台线程:阈值有变化或应当退出
+    static int s_wake;
+    //后台线程通过它通知反应堆:级别有变化
+    static int s_event;
+    static int s_stage;
+
+    //保护下面的成员
+    static locker s_lock;
+    static pressure_settings s_settings;
+    static bool s_changed;
+    static bool s_stop;
+
+    //PSI触发器,每一级一个,-1表示没有打开
+    static int s_triggers[ STAGE_COUNT ];
+    //cgroup中memory.current/memory.max等文件所在的目录,以及是否为cgroup v1
+    static std::string s_memory_dir;
+    static bool s_v1;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "metrics.h"
+
+long metrics::s_values[ METRIC_COUNT ];
+metrics::histogram metrics::s_histograms[ HISTOGRAM_COUNT ];
+
+//顺序必须和METRIC_ID一致
+const metrics::info metrics::s_infos[ METRIC_COUNT ] =
+{
+    { "webserver_pool_threads", "gauge", "Worker threads currently running" },
+    { "webserver_pool_min_threads", "gauge", "Lower bound of the worker thread count" },
+    { "webserver_pool_max_threads", "gauge", "Upper bound of the worker thread count" },
+    { "webserver_pool_grows_total", "counter", "Times the pool added worker threads" },
+    { "webserver_pool_shrinks_total", "counter", "Times the pool retired a worker thread" },
+    { "webserver_pool_queue_depth", "gauge", "Requests waiting in the work queue" },
+    { "webserver_pool_queue_wait_us", "gauge", "Average queue wait over the last sizing interval" },
+    { "webserver_pool_utilization_percent", "gauge", "Worker busy time over the last sizing interval" },
+    { "webserver_pool_wakeups_total", "counter", "Futex wakeups issued to parked workers" },
+    { "webserver_pool_wakeups_skipped_total", "counter", "Enqueues that needed no wakeup because a worker was spinning" },
+    { "webserver_pool_spin_hits_total", "counter", "Times a spinning worker found work before parking" },
+    { "webserver_pool_parks_total", "counter", "Times a worker parked on the futex" },
+    { "webserver_pool_rejects_total", "counter", "Connections closed because the work queue was full" },
+    { "webserver_requests_total", "counter", "Responses completely written" },
+    { "webserver_slow_requests_total", "counter", "Responses slower than trace_slow_us" },
+    { "webserver_h2_sessions_total", "counter", "HTTP/2 connections started by prior knowledge or Upgrade: h2c" },
+    { "webserver_h2_streams_total", "counter", "HTTP/2 requests answered" },
+    { "webserver_tls_handshakes_total", "counter", "TLS handshakes completed" },
+    { "webserver_tls_handshake_failures_total", "counter", "TLS handshakes that failed" },
+    { "webserver_tls_ktls_total", "counter", "TLS connections whose send side was handed to the kernel" },
+    { "webserver_tls_userspace_total", "counter", "TLS connections encrypting with SSL_write because kTLS was unavailable" },
+    { "webserver_request_body_bytes_total", "counter", "Request body bytes received" },
+    { "webserver_uploads_total", "counter", "Request bodies stored as files by handler=upload routes" },
+    { "webserver_request_bodies_rejected_total", "counter", "Requests answered 413 because the body exceeded max_body_kb" },
+    { "webserver_write_slices_total", "counter", "Times a response write used up write_slice_kb and yielded the reactor" },
+    { "webserver_file_cache_hits_total", "counter", "Static file requests served from an already loaded mapping" },
+    { "webserver_file_cache_loads_total", "counter", "Files opened and mapped into the file cache" },
+    { "webserver_file_cache_coalesced_total", "counter", "Requests parked on a load already in flight for the same file" },
+    { "webserver_file_cache_evictions_total", "counter", "Files dropped from the file cache to stay under file_cache_mb" },
+    { "webserver_file_cache_bytes", "gauge", "Bytes of files kept in the file cache" },
+    { "webserver_file_cache_negative_hits_total", "counter", "Requests answered 404 from a cached missing path without stat" },
+    { "webserver_file_cache_invalidations_total", "counter", "File cache entries dropped by inotify change events" },
+    { "webserver_file_cache_flushes_total", "counter", "Generation bumps that invalidated the whole file cache" },
+    { "webserver_file_watches", "gauge", "Directories under the document roots watched with inotify" },
+    { "webserver_pack_hits_total", "counter", "Requests served uncompressed from an asset pack" },
+    { "webserver_pack_gzip_hits_total", "counter", "Requests served the gzip variant from an asset pack" },
+    { "webserver_pack_not_modified_total", "counter", "Asset pack requests answered 304 from If-None-Match" },
+    { "webserver_pack_misses_total", "counter", "Requests to an asset pack route for a URL not in the pack" },
+    { "webserver_microcache_hits_total", "counter", "Dynamic responses served fresh from the micro-cache" },
+    { "webserver_microcache_stale_hits_total", "counter", "Expired responses served while another request regenerated them (stale-while-revalidate)" },
+    { "webserver_microcache_stale_errors_total", "counter", "Expired responses served because regenerating them failed (stale-if-error)" },
+    { "webserver_microcache_fills_total", "counter", "Dynamic responses generated to fill or refresh the micro-cache" },
+    { "webserver_microcache_coalesced_total", "counter", "Requests parked on a generation already in flight for the same key" },
+    { "webserver_microcache_passes_total", "counter", "Requests that generated their own response because it is too large to cache" },
+    { "webserver_microcache_evictions_total", "counter", "Responses dropped from the micro-cache to stay under microcache_mb" },
+    { "webserver_microcache_bytes", "gauge", "Bytes of responses kept in the micro-cache" },
+    { "webserver_accepts_total", "counter", "Connections accepted from the listen queue" },
+    { "webserver_accept_budget_hits_total", "counter", "Listen events that used up accept_budget with connections still queued" },
+    { "webserver_reactor_busy_poll_hits_total", "counter", "Reactor wakeups that found events while busy polling" },
+    { "webserver_reactor_sleeps_total", "counter", "Reactor busy poll budgets spent without events, followed by a blocking wait" },
+    { "webserver_memory_pressure_stage", "gauge", "Memory pressure stage: 0 normal, 1 trim caches, 2 release memory, 3 shed connections" },
+    { "webserver_memory_trims_total", "counter", "Times memory pressure reached stage 1 and halved the file cache and micro-cache" },
+    { "webserver_memory_releases_total", "counter", "Times memory pressure reached stage 2, emptied the caches and returned free heap to the kernel" },
+    { "webserver_memory_sheds_total", "counter", "Times memory pressure reached stage 3 and stopped keep-alive and new connections" },
+    { "webserver_memory_released_bytes_total", "counter", "Resident bytes returned to the kernel by stage 2" },
+    { "webserver_memory_shed_conns_total", "counter", "Idle connections closed and new connections refused at stage 3" },
+    { "webserver_memory_limit_bytes", "gauge", "Memory limit of the cgroup, 0 when unlimited" },
+    { "webserver_memory_usage_bytes", "gauge", "Working set of the cgroup: usage minus inactive page cache" },
+};
+
+const metrics::info metrics::s_hist_infos[ HISTOGRAM_COUNT ] =
+{
+    { "webserver_request_read_us", "histogram", "From the first byte of a request to handing it to the pool" },
+    { "webserver_request_queue_us", "histogram", "Time a request waited in the pool queue" },
+    { "webserver_request_parse_us", "histogram", "Time spent in process_read before do_request" },
+    { "webserver_request_resolve_us", "histogram", "Time spent in do_request (stat, open, mmap)" },
+    { "webserver_request_write_us", "histogram", "From the first write to the last byte, including EAGAIN stalls" },
+    { "webserver_request_total_us", "histogram", "From the first byte of a request to the last byte of its response" },
+    { "webserver_lane_high_queue_us", "histogram", "Pool queue wait of tasks in the high priority lane" },
+    { "webserver_lane_normal_queue_us", "histogram", "Pool queue wait of tasks in the normal lane" },
+    { "webserver_lane_bulk_queue_us", "histogram", "Pool queue wait of tasks in the bulk lane (large files, uploads, streams)" },
+    { "webserver_lane_high_total_us", "histogram", "Total time of requests classified into the high priority lane" },
+    { "webserver_lane_normal_total_us", "histogram", "Total time of requests classified into the normal lane" },
+    { "webserver_lane_bulk_total_us", "histogram", "Total time of requests classified into the bulk lane" },
+    { "webserver_reactor_loop_us", "histogram", "Time the reactor spent dispatching one batch of ready events" },
+    { "webserver_write_notsent_bytes", "histogram", "Unsent bytes in the socket send queue when a write hit EAGAIN (TCP_INFO)" },
+    { "webserver_write_inflight_bytes", "histogram", "Sent but unacknowledged bytes when a write hit EAGAIN (TCP_INFO)" },
+};
+
+void metrics::observe( HISTOGRAM_ID id, long long us )
+{
+    int bucket = 0;
+    while( bucket < HISTOGRAM_BUCKETS - 1 && ( 1LL << bucket ) < us )
+    {
+        ++bucket;
+    }
+    histogram& h = s_histograms[ id ];
+    __atomic_add_fetch( &h.buckets[ bucket ], 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &h.count, 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &h.sum, us, __ATOMIC_RELAXED );
+}
+
+//向buf追加格式化的内容,空间不够时扩大,失败时释放buf并置为NULL
+static void append( char*& buf, int& cap, int& used, const char* format, ... )
+{
+    while( buf )
+    {
+        va_list args;
+        va_start( args, format );
+        int n = vsnprintf( buf + used, cap - used, format, args );
+        va_end( args );
+        if( n < cap - used )
+        {
+            used += n;
+            return;
+        }
+        cap *= 2;
+        char* bigger = ( char* )realloc( buf, cap );
+        if( ! bigger )
+        {
+            free( buf );
+        }
+        buf = bigger;
+    }
+}
+
+char* metrics::render( int* len )
+{
+    int cap = 4096;
+    int used = 0;
+    char* buf = ( char* )malloc( cap );
+    for( int i = 0; i < METRIC_COUNT; ++i )
+    {
+        append( buf, cap, used, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n",
+                s_infos[ i ].name, s_infos[ i ].help, s_infos[ i ].name, s_infos[ i ].type,
+                s_infos[ i ].name, get( ( METRIC_ID )i ) );
+    }
+
+    //Prometheus直方图的桶是累积的
+    for( int i = 0; i < HISTOGRAM_COUNT; ++i )
+    {
+        const info& in = s_hist_infos[ i ];
+        const histogram& h = s_histograms[ i ];
+        append( buf, cap, used, "# HELP %s %s\n# TYPE %s histogram\n", in.name, in.help, in.name );
+        long cumulative = 0;
+        for( int b = 0; b < HISTOGRAM_BUCKETS - 1; ++b )
+        {
+            cumulative += __atomic_load_n( &h.buckets[ b ], __ATOMIC_RELAXED );
+            append( buf, cap, used, "%s_bucket{le=\"%lld\"} %ld\n", in.name, 1LL << b, cumulative );
+        }
+        cumulative += __atomic_load_n( &h.buckets[ HISTOGRAM_BUCKETS - 1 ], __ATOMIC_RELAXED );
+        append( buf, cap, used, "%s_bucket{le=\"+Inf\"} %ld\n%s_sum %lld\n%s_count %ld\n", in.name, cumulative,
+                in.name, __atomic_load_n( &h.sum, __ATOMIC_RELAXED ), in.name, cumulative );
+    }
+
+    *len = buf ? used : 0;
+    return buf;
+}
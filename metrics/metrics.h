@@ -0,0 +1,113 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+//所有运行指标的编号,新增指标时同时在metrics.cpp的s_infos中添加名称和类型
+enum METRIC_ID
+{
+    //线程池
+    POOL_THREADS = 0, POOL_MIN_THREADS, POOL_MAX_THREADS, POOL_GROWS, POOL_SHRINKS,
+    POOL_QUEUE_DEPTH, POOL_WAIT_US, POOL_UTILIZATION,
+    POOL_WAKEUPS, POOL_WAKEUPS_SKIPPED, POOL_SPIN_HITS, POOL_PARKS, POOL_REJECTS,
+    //请求
+    REQUESTS, SLOW_REQUESTS,
+    //HTTP/2
+    H2_SESSIONS, H2_STREAMS,
+    //TLS
+    TLS_HANDSHAKES, TLS_HANDSHAKE_FAILURES, TLS_KTLS, TLS_USERSPACE,
+    //请求体
+    BODY_BYTES, UPLOADS, BODIES_REJECTED,
+    //写响应时用完时间片、让出反应堆的次数
+    WRITE_SLICES,
+    //文件缓存:命中、加载、挂起等待其他请求加载的请求数、淘汰,以及缓存中文件的总字节数
+    FILE_CACHE_HITS, FILE_CACHE_LOADS, FILE_CACHE_COALESCED, FILE_CACHE_EVICTIONS, FILE_CACHE_BYTES,
+    //不存在的路径的缓存命中、inotify事件使之失效的条目数、所有条目失效的次数,以及受监视的目录数
+    FILE_CACHE_NEGATIVE_HITS, FILE_CACHE_INVALIDATIONS, FILE_CACHE_FLUSHES, FILE_WATCHES,
+    //资源包:命中、发送gzip版本的命中、返回304的请求数,以及包中没有的URL
+    PACK_HITS, PACK_GZIP_HITS, PACK_NOT_MODIFIED, PACK_MISSES,
+    //微缓存:新鲜的命中、过期后刷新期间的命中、生成失败时返回的旧响应、生成次数、合并到其他请求的生成上的请求数
+    //、不可缓存而各自生成的请求数、淘汰,以及缓存的总字节数
+    MICROCACHE_HITS, MICROCACHE_STALE_HITS, MICROCACHE_STALE_ERRORS, MICROCACHE_FILLS, MICROCACHE_COALESCED,
+    MICROCACHE_PASSES, MICROCACHE_EVICTIONS, MICROCACHE_BYTES,
+    //accept的连接数,以及一次监听事件用完accept_budget、队列中还有连接的次数
+    ACCEPTS, ACCEPT_BUDGET_HITS,
+    //忙轮询模式下反应堆在自旋期间等到事件的次数,以及用完预算后阻塞等待的次数
+    REACTOR_BUSY_POLL_HITS, REACTOR_SLEEPS,
+    //内存压力:当前级别、进入各级的次数、归还给操作系统的字节数、第三级关闭和拒绝的连接数,以及cgroup的上限和工作集
+    MEMORY_PRESSURE_STAGE, MEMORY_TRIMS, MEMORY_RELEASES, MEMORY_SHEDS, MEMORY_RELEASED_BYTES, MEMORY_SHED_CONNS,
+    MEMORY_LIMIT_BYTES, MEMORY_USAGE_BYTES,
+    METRIC_COUNT
+};
+
+//所有直方图的编号,新增时同时在metrics.cpp的s_hist_infos中添加名称
+enum HISTOGRAM_ID
+{
+    //请求各阶段的耗时:读请求、排队、解析、定位资源(stat/open/mmap)、写响应(含EAGAIN等待)、总耗时
+    REQ_READ_US = 0, REQ_QUEUE_US, REQ_PARSE_US, REQ_RESOLVE_US, REQ_WRITE_US, REQ_TOTAL_US,
+    //线程池各通道(0高优先级、1普通、2大文件)的排队时间,按通道编号连续排列
+    LANE_HIGH_QUEUE_US, LANE_NORMAL_QUEUE_US, LANE_BULK_QUEUE_US,
+    //各通道请求的总耗时
+    LANE_HIGH_TOTAL_US, LANE_NORMAL_TOTAL_US, LANE_BULK_TOTAL_US,
+    //反应堆处理一批就绪事件的耗时,这段时间内新到达的事件都要等待
+    REACTOR_LOOP_US,
+    //写被阻塞时采样的TCP_INFO(字节):内核中尚未发出的数据,以及已经发出、尚未确认的数据
+    WRITE_NOTSENT_BYTES, WRITE_INFLIGHT_BYTES,
+    HISTOGRAM_COUNT
+};
+
+//进程内的运行指标,计数器(只增不减)和仪表(当前值)都是一个long,各线程直接原子地修改
+//,通过handler=metrics的路由以Prometheus文本格式输出
+class metrics
+{
+public:
+    static void add( METRIC_ID id, long delta )
+    {
+        __atomic_add_fetch( &s_values[ id ], delta, __ATOMIC_RELAXED );
+    }
+    static void set( METRIC_ID id, long value )
+    {
+        __atomic_store_n( &s_values[ id ], value, __ATOMIC_RELAXED );
+    }
+    static long get( METRIC_ID id )
+    {
+        return __atomic_load_n( &s_values[ id ], __ATOMIC_RELAXED );
+    }
+
+    //直方图按2的幂划分桶,第i个桶统计(2^(i-1), 2^i]微秒内的样本,最后一个桶统计其余所有样本
+    static const int HISTOGRAM_BUCKETS = 26;
+    static void observe( HISTOGRAM_ID id, long long us );
+
+    //把所有指标输出到malloc分配的缓冲区中,由调用者free,len为输出的长度
+    static char* render( int* len );
+
+private:
+    struct info
+    {
+        const char* name;
+        const char* type;//counter或gauge
+        const char* help;
+    };
+
+    struct histogram
+    {
+        long buckets[ HISTOGRAM_BUCKETS ];
+        long count;
+        long long sum;
+    };
+
+    static long s_values[ METRIC_COUNT ];
+    static const info s_infos[ METRIC_COUNT ];
+    static histogram s_histograms[ HISTOGRAM_COUNT ];
+    static const info s_hist_infos[ HISTOGRAM_COUNT ];
+};
+
+//单调时钟,单位纳秒
+inline long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <string.h>
+#include "mime.h"
+
+struct mime_entry
+{
+    const char* ext;
+    const char* type;
+};
+
+//扩展名一律小写,查找时不区分大小写
+static constexpr mime_entry s_types[] =
+{
+    { "html", "text/html; charset=utf-8" }, { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" }, { "js", "application/javascript; charset=utf-8" },
+    { "mjs", "application/javascript; charset=utf-8" }, { "json", "application/json" },
+    { "map", "application/json" }, { "webmanifest", "application/manifest+json" },
+    { "txt", "text/plain; charset=utf-8" }, { "md", "text/markdown; charset=utf-8" },
+    { "csv", "text/csv; charset=utf-8" }, { "xml", "application/xml" }, { "rss", "application/rss+xml" },
+    { "atom", "application/atom+xml" }, { "ics", "text/calendar; charset=utf-8" },
+    { "svg", "image/svg+xml" }, { "wasm", "application/wasm" },
+    { "png", "image/png" }, { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "gif", "image/gif" },
+    { "webp", "image/webp" }, { "avif", "image/avif" }, { "ico", "image/x-icon" }, { "bmp", "image/bmp" },
+    { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" }, { "otf", "font/otf" },
+    { "eot", "application/vnd.ms-fontobject" },
+    { "mp4", "video/mp4" }, { "webm", "video/webm" }, { "mov", "video/quicktime" },
+    { "mp3", "audio/mpeg" }, { "m4a", "audio/mp4" }, { "ogg", "audio/ogg" }, { "oga", "audio/ogg" },
+    { "wav", "audio/wav" }, { "flac", "audio/flac" },
+    { "pdf", "application/pdf" }, { "zip", "application/zip" }, { "gz", "application/gzip" },
+    { "tar", "application/x-tar" }, { "7z", "application/x-7z-compressed" },
+};
+
+static constexpr int TYPE_COUNT = sizeof( s_types ) / sizeof( s_types[ 0 ] );
+static const char* const DEFAULT_TYPE = "application/octet-stream";
+//比最长的扩展名还长的一定不在表中,不必计算散列
+static const int MAX_EXT_LEN = 16;
+
+//散列表有2^SLOT_BITS个槽位,每个槽位最多对应表中的一项
+static constexpr int SLOT_BITS = 8;
+//散列的种子。向表中增加类型后如果static_assert失败,说明有两个扩展名落到同一个槽位,把种子依次加1直到编译通过
+static constexpr uint32_t SEED = 8;
+
+const int mime::COUNT = TYPE_COUNT;
+
+static constexpr char lower( char c )
+{
+    return ( c >= 'A' && c <= 'Z' ) ? c + ( 'a' - 'A' ) : c;
+}
+
+//不区分大小写的FNV-1a,再和种子混合,取高SLOT_BITS位作为槽位
+static constexpr uint32_t mix( uint32_t h )
+{
+    return ( ( h ^ SEED ) * 0x9E3779B1u ) >> ( 32 - SLOT_BITS );
+}
+
+static constexpr uint32_t fnv( const char* s, uint32_t h )
+{
+    return *s ? fnv( s + 1, ( h ^ ( unsigned char )lower( *s ) ) * 16777619u ) : h;
+}
+
+static constexpr uint32_t slot_of( int i )
+{
+    return mix( fnv( s_types[ i ].ext, 2166136261u ) );
+}
+
+//编译期检查散列是完美的:表中任意两项的槽位都不相同
+static constexpr bool distinct( int i, int j )
+{
+    return j >= i || ( slot_of( i ) != slot_of( j ) && distinct( i, j + 1 ) );
+}
+
+static constexpr bool perfect( int i )
+{
+    return i >= TYPE_COUNT || ( distinct( i, 0 ) && perfect( i + 1 ) );
+}
+
+static_assert( perfect( 0 ), "two extensions share a slot, change SEED in mime.cpp" );
+static_assert( TYPE_COUNT < ( 1 << SLOT_BITS ) && TYPE_COUNT < 255, "too many mime types for the slot table" );
+
+//槽位到表中编号的映射,255表示空槽位。只有256个字节,启动时由编译期常量填好
+static unsigned char s_slots[ 1 << SLOT_BITS ];
+
+static bool fill_slots()
+{
+    memset( s_slots, 255, sizeof( s_slots ) );
+    for( int i = 0; i < TYPE_COUNT; ++i )
+    {
+        s_slots[ slot_of( i ) ] = i;
+    }
+    return true;
+}
+
+static const bool s_filled = fill_slots();
+
+int mime::find( const char* ext, int len )
+{
+    if( len <= 0 || len > MAX_EXT_LEN )
+    {
+        return -1;
+    }
+    uint32_t h = 2166136261u;
+    for( int i = 0; i < len; ++i )
+    {
+        h = ( h ^ ( unsigned char )lower( ext[ i ] ) ) * 16777619u;
+    }
+    int id = s_slots[ mix( h ) ];
+    //不在表中的扩展名也会落到某个槽位上,比较一次扩展名排除它
+    if( id == 255 || strncasecmp( s_types[ id ].ext, ext, len ) != 0 || s_types[ id ].ext[ len ] != '\0' )
+    {
+        return -1;
+    }
+    return id;
+}
+
+int mime::classify( const char* url )
+{
+    int end = strcspn( url, "?" );
+    int dot = -1;
+    for( int i = end - 1; i >= 0 && url[ i ] != '/'; --i )
+    {
+        if( url[ i ] == '.' )
+        {
+            dot = i;
+            break;
+        }
+    }
+    if( dot < 0 )
+    {
+        return COUNT;
+    }
+    int id = find( url + dot + 1, end - dot - 1 );
+    return id < 0 ? COUNT : id;
+}
+
+const char* mime::type( int id )
+{
+    return ( id >= 0 && id < TYPE_COUNT ) ? s_types[ id ].type : DEFAULT_TYPE;
+}
+
+const char* mime::extension( int id )
+{
+    return ( id >= 0 && id < TYPE_COUNT ) ? s_types[ id ].ext : NULL;
+}
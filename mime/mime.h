@@ -0,0 +1,22 @@
+#ifndef MIME_H
+#define MIME_H
+
+//按扩展名决定Content-Type
+//。类型表是编译期常量,扩展名经过完美散列直接定位到表中唯一可能的一项,查找只计算一次散列、比较一次扩展名
+class mime
+{
+public:
+    //表中类型的个数;不在表中的扩展名和没有扩展名的文件编号为COUNT,类型为application/octet-stream
+    static const int COUNT;
+
+    //url最后一段路径的扩展名对应的编号,查询字符串不参与判断
+    static int classify( const char* url );
+    //长度为len的扩展名(不含点,不区分大小写)对应的编号,不在表中时返回-1
+    static int find( const char* ext, int len );
+    //编号对应的Content-Type
+    static const char* type( int id );
+    //编号对应的扩展名,COUNT返回NULL
+    static const char* extension( int id );
+};
+
+#endif
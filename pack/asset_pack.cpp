@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "asset_pack.h"
+
+asset_pack* asset_pack::open( const char* path )
+{
+    int fd = ::open( path, O_RDONLY | O_CLOEXEC );
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) < 0 )
+    {
+        printf( "cannot open asset pack %s, errno is: %d\n", path, errno );
+        if( fd >= 0 )
+        {
+            close( fd );
+        }
+        return NULL;
+    }
+    if( ( uint64_t )st.st_size < sizeof( pack_header ) )
+    {
+        printf( "asset pack %s is too short\n", path );
+        close( fd );
+        return NULL;
+    }
+    //内容按需缺页;索引部分提前读入,第一批请求不必等待磁盘
+    void* addr = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( addr == MAP_FAILED )
+    {
+        printf( "cannot map asset pack %s, errno is: %d\n", path, errno );
+        return NULL;
+    }
+
+    asset_pack* pack = new asset_pack;
+    pack->m_path = path;
+    pack->m_base = ( char* )addr;
+    pack->m_size = st.st_size;
+    pack->m_header = ( const pack_header* )addr;
+    if( ! pack->validate() )
+    {
+        printf( "asset pack %s is corrupt or from another version\n", path );
+        delete pack;
+        return NULL;
+    }
+    const pack_header* h = pack->m_header;
+    pack->m_seeds = ( const uint32_t* )( pack->m_base + h->seeds_off );
+    pack->m_entries = ( const pack_entry* )( pack->m_base + h->entries_off );
+    pack->m_strings = pack->m_base + h->strings_off;
+    madvise( pack->m_base, h->strings_off + h->strings_len, MADV_WILLNEED );
+    return pack;
+}
+
+asset_pack::~asset_pack()
+{
+    if( m_base )
+    {
+        munmap( m_base, m_size );
+    }
+}
+
+//所有偏移在打开时检查一遍,查找时不再做边界检查
+bool asset_pack::validate() const
+{
+    const pack_header* h = m_header;
+    if( memcmp( h->magic, PACK_MAGIC, sizeof( PACK_MAGIC ) ) != 0 || h->file_size != m_size || h->buckets == 0 )
+    {
+        return false;
+    }
+    if( h->seeds_off % sizeof( uint32_t ) != 0 || h->entries_off % sizeof( uint64_t ) != 0
+        || h->seeds_off > m_size || ( uint64_t )h->buckets * sizeof( uint32_t ) > m_size - h->seeds_off
+        || h->entries_off > m_size || ( uint64_t )h->count * sizeof( pack_entry ) > m_size - h->entries_off
+        || h->strings_off > m_size || h->strings_len > m_size - h->strings_off )
+    {
+        return false;
+    }
+    const pack_entry* entries = ( const pack_entry* )( m_base + h->entries_off );
+    for( uint32_t i = 0; i < h->count; ++i )
+    {
+        const pack_entry& e = entries[ i ];
+        if( ( uint64_t )e.url_off + e.url_len > h->strings_len || ( uint64_t )e.mime_off + e.mime_len > h->strings_len
+            || ( uint64_t )e.etag_off + e.etag_len > h->strings_len
+            || e.body_off > m_size || e.body_len > m_size - e.body_off
+            || e.gzip_off > m_size || e.gzip_len > m_size - e.gzip_off )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool asset_pack::find( const char* url, int len, pack_asset* out ) const
+{
+    const pack_header* h = m_header;
+    if( h->count == 0 )
+    {
+        return false;
+    }
+    uint64_t hv = hash( url, len );
+    const pack_entry& e = m_entries[ slot( hv, m_seeds[ hv % h->buckets ], h->count ) ];
+    //不在包中的URL也会落到某个槽位上,比较散列值和URL排除它
+    if( e.hash != hv || e.url_len != ( uint32_t )len || memcmp( m_strings + e.url_off, url, len ) != 0 )
+    {
+        return false;
+    }
+    out->body = m_base + e.body_off;
+    out->body_len = e.body_len;
+    out->gzip = e.gzip_len ? m_base + e.gzip_off : NULL;
+    out->gzip_len = e.gzip_len;
+    out->mime = m_strings + e.mime_off;
+    out->mime_len = e.mime_len;
+    out->etag = m_strings + e.etag_off;
+    out->etag_len = e.etag_len;
+    return true;
+}
+
+void asset_pack::acquire()
+{
+    __atomic_add_fetch( &m_refs, 1, __ATOMIC_RELAXED );
+}
+
+void asset_pack::release()
+{
+    if( __atomic_sub_fetch( &m_refs, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        delete this;
+    }
+}
+
+//FNV-1a
+uint64_t asset_pack::hash( const char* url, int len )
+{
+    uint64_t h = 14695981039346656037ULL;
+    for( int i = 0; i < len; ++i )
+    {
+        h ^= ( unsigned char )url[ i ];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+//用splitmix64把散列值和种子混合,再把高32位按比例映射到[0, count)
+uint32_t asset_pack::slot( uint64_t hash, uint32_t seed, uint32_t count )
+{
+    uint64_t x = hash ^ ( ( uint64_t )seed * 0x9E3779B97F4A7C15ULL );
+    x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return ( uint32_t )( ( ( x >> 32 ) * count ) >> 32 );
+}
+
+bool asset_pack::accepts_gzip( const char* text )
+{
+    while( *text )
+    {
+        text += strspn( text, " \t," );
+        int len = strcspn( text, " \t;," );
+        bool gzip = ( len == 4 && strncasecmp( text, "gzip", 4 ) == 0 ) || ( len == 6 && strncasecmp( text, "x-gzip", 6 ) == 0 );
+        text += len;
+        int params = strcspn( text, "," );
+        if( gzip )
+        {
+            const char* q = strcasestr( text, "q=" );
+            return ! q || q >= text + params || strtod( q + 2, NULL ) > 0;
+        }
+        text += params;
+    }
+    return false;
+}
+
+bool asset_pack::etag_matches( const char* text, const char* etag, int etag_len )
+{
+    while( *text )
+    {
+        text += strspn( text, " \t," );
+        if( *text == '*' )
+        {
+            return true;
+        }
+        if( strncmp( text, "W/", 2 ) == 0 )
+        {
+            text += 2;
+        }
+        if( *text != '"' )
+        {
+            return false;
+        }
+        const char* end = strchr( ++text, '"' );
+        if( ! end )
+        {
+            return false;
+        }
+        int len = end - text;
+        if( len >= etag_len && strncmp( text, etag, etag_len ) == 0
+            && ( len == etag_len || ( len == etag_len + 3 && strncmp( text + etag_len, "-gz", 3 ) == 0 ) ) )
+        {
+            return true;
+        }
+        text = end + 1;
+    }
+    return false;
+}
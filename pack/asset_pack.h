@@ -0,0 +1,93 @@
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stdint.h>
+#include <string>
+
+//资源包的文件格式,由asset_packer生成,按本机字节序存储
+//。依次为:头部、每个桶的种子、按槽位排列的条目、字符串区(URL、MIME类型、ETag),之后是按页对齐的各文件内容
+//。URL经最小完美散列(hash and displace)直接得到条目的下标:先按散列值选桶,再用桶的种子重新混合得到槽位
+//,n个URL恰好占满n个槽位,查找只需读一个种子和一个条目
+static const char PACK_MAGIC[ 8 ] = { 'W', 'S', 'P', 'A', 'C', 'K', '1', '\0' };
+static const uint64_t PACK_ALIGN = 4096;
+
+struct pack_header
+{
+    char magic[ 8 ];
+    uint32_t count;
+    uint32_t buckets;
+    uint64_t seeds_off;
+    uint64_t entries_off;
+    uint64_t strings_off;
+    uint64_t strings_len;
+    uint64_t file_size;
+};
+
+struct pack_entry
+{
+    //URL的完整散列值,和URL本身一起用来确认命中
+    uint64_t hash;
+    //在字符串区中的偏移和长度,ETag不带引号
+    uint32_t url_off, url_len;
+    uint32_t mime_off, mime_len;
+    uint32_t etag_off, etag_len;
+    //文件内容在包中的偏移和长度,gzip_len为0时没有压缩版本
+    uint64_t body_off, body_len;
+    uint64_t gzip_off, gzip_len;
+};
+
+//查找得到的一个资源,指针都指向包的映射,在包被释放之前有效
+struct pack_asset
+{
+    const char* body;
+    long body_len;
+    const char* gzip;
+    long gzip_len;
+    const char* mime;
+    int mime_len;
+    const char* etag;
+    int etag_len;
+};
+
+//只读映射的资源包:启动或重新加载配置时整个文件mmap一次,之后查找和发送都不需要文件系统的系统调用
+//。包有引用计数,引用它的路由持有一个,正在发送其中内容的连接各持有一个,重新加载时新的路由表打开新的包
+//,旧的包在最后一个使用它的连接结束后才munmap。替换包文件应写入临时文件再rename,不要原地改写
+class asset_pack
+{
+public:
+    //打开并校验path,失败时打印原因并返回NULL,返回的包带有一个引用
+    static asset_pack* open( const char* path );
+
+    //查找长度为len的url,不分配内存
+    bool find( const char* url, int len, pack_asset* out ) const;
+    int count() const { return m_header->count; }
+    const std::string& path() const { return m_path; }
+
+    void acquire();
+    void release();
+
+    //Accept-Encoding的值是否接受gzip:逗号分隔的编码,q=0表示不接受
+    static bool accepts_gzip( const char* text );
+    //If-None-Match的值中是否有与etag相同的实体标签,按弱比较忽略W/前缀
+    //。同一内容的gzip版本的标签带有-gz后缀,两种表示的标签都视为匹配
+    static bool etag_matches( const char* text, const char* etag, int etag_len );
+    //URL的散列值和由种子得到的槽位,asset_packer构建索引时使用同样的函数
+    static uint64_t hash( const char* url, int len );
+    static uint32_t slot( uint64_t hash, uint32_t seed, uint32_t count );
+
+private:
+    asset_pack() : m_base( NULL ), m_size( 0 ), m_header( NULL ), m_refs( 1 ) {}
+    ~asset_pack();
+    bool validate() const;
+
+    std::string m_path;
+    char* m_base;
+    size_t m_size;
+    const pack_header* m_header;
+    const uint32_t* m_seeds;
+    const pack_entry* m_entries;
+    const char* m_strings;
+    int m_refs;
+};
+
+#endif
@@ -0,0 +1,382 @@
+//把网站根目录编译成一个资源包,供location的pack=选项使用
+//。用法: asset_packer <网站根目录> <输出文件> [gzip级别,0表示不生成压缩版本,默认9]
+//。先写入同一目录下的临时文件,完成后rename,正在运行的服务器重新加载配置时看到的总是完整的包
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#ifdef WEBSERVER_ZLIB
+#include <zlib.h>
+#endif
+#include "asset_pack.h"
+#include "../mime/mime.h"
+
+struct asset
+{
+    std::string path;
+    std::string url;
+    const char* mime;
+    uint64_t size;
+    uint64_t content_hash;
+    //比原文件小到值得发送时才保留压缩版本
+    std::string gzip;
+};
+
+#ifdef WEBSERVER_ZLIB
+//文本类的内容才尝试压缩,图片、视频、字体等本身已经压缩过
+static bool compressible( const char* mime )
+{
+    return strncmp( mime, "text/", 5 ) == 0 || strncmp( mime, "application/javascript", 22 ) == 0
+           || strcmp( mime, "application/json" ) == 0 || strcmp( mime, "application/xml" ) == 0
+           || strcmp( mime, "image/svg+xml" ) == 0 || strcmp( mime, "application/wasm" ) == 0;
+}
+#endif
+
+static bool read_file( const std::string& path, std::string& out )
+{
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    out.clear();
+    char buf[ 65536 ];
+    ssize_t n;
+    while( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 )
+    {
+        out.append( buf, n );
+    }
+    close( fd );
+    return n == 0;
+}
+
+#ifdef WEBSERVER_ZLIB
+static bool gzip_compress( const std::string& in, int level, std::string& out )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    //windowBits加16输出gzip格式,浏览器的Content-Encoding: gzip需要它
+    if( deflateInit2( &zs, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK )
+    {
+        return false;
+    }
+    out.resize( deflateBound( &zs, in.size() ) );
+    zs.next_in = ( Bytef* )in.data();
+    zs.avail_in = in.size();
+    zs.next_out = ( Bytef* )&out[ 0 ];
+    zs.avail_out = out.size();
+    int ret = deflate( &zs, Z_FINISH );
+    out.resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END;
+}
+#endif
+
+//深度优先收集root下的普通文件,跟随指向文件的符号链接,不进入指向目录的符号链接
+static bool collect( const std::string& root, std::vector< asset >& assets )
+{
+    std::vector< std::string > stack( 1, "" );
+    while( ! stack.empty() )
+    {
+        std::string rel = stack.back();
+        stack.pop_back();
+        std::string dir = root + rel;
+        DIR* d = opendir( dir.c_str() );
+        if( ! d )
+        {
+            printf( "cannot open directory %s: %s\n", dir.c_str(), strerror( errno ) );
+            return false;
+        }
+        while( struct dirent* ent = readdir( d ) )
+        {
+            if( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+            {
+                continue;
+            }
+            std::string url = rel + "/" + ent->d_name;
+            std::string path = root + url;
+            struct stat lst, st;
+            if( lstat( path.c_str(), &lst ) < 0 || stat( path.c_str(), &st ) < 0 )
+            {
+                continue;
+            }
+            if( S_ISDIR( lst.st_mode ) )
+            {
+                stack.push_back( url );
+            }
+            else if( S_ISREG( st.st_mode ) && ( st.st_mode & S_IROTH ) )
+            {
+                //服务器不返回其他用户不可读的文件,包中也不收录
+                asset a;
+                a.path = path;
+                a.url = url;
+                a.mime = mime::type( mime::classify( url.c_str() ) );
+                a.size = 0;
+                a.content_hash = 0;
+                assets.push_back( a );
+            }
+        }
+        closedir( d );
+    }
+    return true;
+}
+
+//hash and displace:桶按大小降序依次为每个桶找一个种子,使桶中所有URL落在互不相同的空槽位上
+static bool build_index( const std::vector< uint64_t >& hashes, uint32_t buckets, std::vector< uint32_t >& seeds, std::vector< uint32_t >& order )
+{
+    uint32_t n = hashes.size();
+    std::vector< std::vector< uint32_t > > members( buckets );
+    for( uint32_t i = 0; i < n; ++i )
+    {
+        members[ hashes[ i ] % buckets ].push_back( i );
+    }
+    std::vector< uint32_t > by_size( buckets );
+    for( uint32_t b = 0; b < buckets; ++b )
+    {
+        by_size[ b ] = b;
+    }
+    std::stable_sort( by_size.begin(), by_size.end(), [ &members ]( uint32_t a, uint32_t b ) { return members[ a ].size() > members[ b ].size(); } );
+
+    seeds.assign( buckets, 0 );
+    //order[槽位] = 资源的下标
+    order.assign( n, ( uint32_t )-1 );
+    std::vector< uint32_t > slots;
+    for( uint32_t k = 0; k < buckets; ++k )
+    {
+        const std::vector< uint32_t >& m = members[ by_size[ k ] ];
+        if( m.empty() )
+        {
+            break;
+        }
+        bool placed = false;
+        for( uint32_t seed = 0; seed < ( 1u << 24 ) && ! placed; ++seed )
+        {
+            slots.clear();
+            placed = true;
+            for( size_t j = 0; j < m.size() && placed; ++j )
+            {
+                uint32_t s = asset_pack::slot( hashes[ m[ j ] ], seed, n );
+                placed = order[ s ] == ( uint32_t )-1 && std::find( slots.begin(), slots.end(), s ) == slots.end();
+                slots.push_back( s );
+            }
+            if( placed )
+            {
+                seeds[ by_size[ k ] ] = seed;
+                for( size_t j = 0; j < m.size(); ++j )
+                {
+                    order[ slots[ j ] ] = m[ j ];
+                }
+            }
+        }
+        if( ! placed )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t align_up( uint64_t off, uint64_t align )
+{
+    return ( off + align - 1 ) / align * align;
+}
+
+static bool write_at( int fd, const void* data, size_t len, uint64_t off )
+{
+    const char* p = ( const char* )data;
+    while( len > 0 )
+    {
+        ssize_t n = pwrite( fd, p, len, off );
+        if( n <= 0 )
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+int main( int argc, char* argv[] )
+{
+    if( argc < 3 )
+    {
+        printf( "usage: %s doc_root output [gzip_level]\n", basename( argv[ 0 ] ) );
+        return 1;
+    }
+    std::string root = argv[ 1 ];
+    while( root.size() > 1 && root[ root.size() - 1 ] == '/' )
+    {
+        root.erase( root.size() - 1 );
+    }
+    const char* output = argv[ 2 ];
+    int level = argc > 3 ? atoi( argv[ 3 ] ) : 9;
+#ifndef WEBSERVER_ZLIB
+    if( level != 0 )
+    {
+        printf( "built without zlib, no gzip variants\n" );
+        level = 0;
+    }
+#endif
+
+    std::vector< asset > assets;
+    if( ! collect( root, assets ) )
+    {
+        return 1;
+    }
+    if( assets.size() > 0xffffffffu / 4 )
+    {
+        printf( "too many files\n" );
+        return 1;
+    }
+
+    //第一遍:计算内容的散列值(ETag)和压缩版本
+    std::string content;
+    std::vector< uint64_t > hashes;
+    uint64_t raw_bytes = 0, gzip_bytes = 0, gzip_count = 0;
+    for( size_t i = 0; i < assets.size(); ++i )
+    {
+        asset& a = assets[ i ];
+        if( ! read_file( a.path, content ) )
+        {
+            printf( "cannot read %s: %s\n", a.path.c_str(), strerror( errno ) );
+            return 1;
+        }
+        a.size = content.size();
+        a.content_hash = asset_pack::hash( content.data(), content.size() );
+        raw_bytes += a.size;
+#ifdef WEBSERVER_ZLIB
+        if( level > 0 && a.size >= 256 && compressible( a.mime ) && gzip_compress( content, level, a.gzip ) )
+        {
+            //节省不到十分之一时不值得让客户端解压
+            if( a.gzip.size() * 10 > a.size * 9 )
+            {
+                a.gzip.clear();
+            }
+        }
+#endif
+        if( ! a.gzip.empty() )
+        {
+            gzip_bytes += a.gzip.size();
+            ++gzip_count;
+        }
+        hashes.push_back( asset_pack::hash( a.url.data(), a.url.size() ) );
+    }
+
+    //URL的64位散列值相同时任何种子都无法把它们分开
+    std::vector< uint64_t > sorted = hashes;
+    std::sort( sorted.begin(), sorted.end() );
+    if( std::adjacent_find( sorted.begin(), sorted.end() ) != sorted.end() )
+    {
+        printf( "two URLs have the same hash\n" );
+        return 1;
+    }
+
+    //平均每个桶4个URL,种子找不到时桶数加倍
+    uint32_t n = assets.size();
+    uint32_t buckets = n / 4 + 1;
+    std::vector< uint32_t > seeds, order;
+    while( ! build_index( hashes, buckets, seeds, order ) )
+    {
+        buckets *= 2;
+    }
+
+    //布局:头部、种子、条目、字符串区,之后每个文件的内容和压缩版本各自从页边界开始
+    pack_header h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, PACK_MAGIC, sizeof( PACK_MAGIC ) );
+    h.count = n;
+    h.buckets = buckets;
+    h.seeds_off = sizeof( pack_header );
+    h.entries_off = align_up( h.seeds_off + ( uint64_t )buckets * sizeof( uint32_t ), 8 );
+    h.strings_off = h.entries_off + ( uint64_t )n * sizeof( pack_entry );
+
+    std::string strings;
+    std::vector< pack_entry > entries( n );
+    for( uint32_t s = 0; s < n; ++s )
+    {
+        const asset& a = assets[ order[ s ] ];
+        pack_entry& e = entries[ s ];
+        memset( &e, 0, sizeof( e ) );
+        e.hash = hashes[ order[ s ] ];
+        e.url_off = strings.size();
+        e.url_len = a.url.size();
+        strings += a.url;
+        e.mime_off = strings.size();
+        e.mime_len = strlen( a.mime );
+        strings += a.mime;
+        char etag[ 17 ];
+        snprintf( etag, sizeof( etag ), "%016llx", ( unsigned long long )a.content_hash );
+        e.etag_off = strings.size();
+        e.etag_len = 16;
+        strings += etag;
+    }
+    h.strings_len = strings.size();
+
+    uint64_t off = align_up( h.strings_off + h.strings_len, PACK_ALIGN );
+    for( uint32_t s = 0; s < n; ++s )
+    {
+        const asset& a = assets[ order[ s ] ];
+        pack_entry& e = entries[ s ];
+        e.body_off = off;
+        e.body_len = a.size;
+        off = align_up( off + a.size, PACK_ALIGN );
+        if( ! a.gzip.empty() )
+        {
+            e.gzip_off = off;
+            e.gzip_len = a.gzip.size();
+            off = align_up( off + a.gzip.size(), PACK_ALIGN );
+        }
+    }
+    h.file_size = off;
+
+    char tmp[ 4096 ];
+    snprintf( tmp, sizeof( tmp ), "%s.tmp.%d", output, ( int )getpid() );
+    int fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if( fd < 0 )
+    {
+        printf( "cannot create %s: %s\n", tmp, strerror( errno ) );
+        return 1;
+    }
+    bool ok = ftruncate( fd, h.file_size ) == 0
+              && write_at( fd, &h, sizeof( h ), 0 )
+              && write_at( fd, seeds.data(), seeds.size() * sizeof( uint32_t ), h.seeds_off )
+              && write_at( fd, entries.data(), entries.size() * sizeof( pack_entry ), h.entries_off )
+              && write_at( fd, strings.data(), strings.size(), h.strings_off );
+
+    //第二遍:写入文件内容,和第一遍读到的不一致时说明打包期间文件被修改了
+    for( uint32_t s = 0; s < n && ok; ++s )
+    {
+        const asset& a = assets[ order[ s ] ];
+        const pack_entry& e = entries[ s ];
+        if( ! read_file( a.path, content ) || content.size() != a.size
+            || asset_pack::hash( content.data(), content.size() ) != a.content_hash )
+        {
+            printf( "%s changed while packing\n", a.path.c_str() );
+            ok = false;
+            break;
+        }
+        ok = write_at( fd, content.data(), content.size(), e.body_off )
+             && ( a.gzip.empty() || write_at( fd, a.gzip.data(), a.gzip.size(), e.gzip_off ) );
+    }
+    ok = ok && fsync( fd ) == 0;
+    close( fd );
+    if( ! ok || rename( tmp, output ) < 0 )
+    {
+        printf( "cannot write %s: %s\n", output, strerror( errno ) );
+        unlink( tmp );
+        return 1;
+    }
+    printf( "%u files, %u buckets, %llu bytes of content, %llu gzip variants (%llu bytes), pack is %llu bytes\n",
+            n, buckets, ( unsigned long long )raw_bytes, ( unsigned long long )gzip_count,
+            ( unsigned long long )gzip_bytes, ( unsigned long long )h.file_size );
+    return 0;
+}
@@ -0,0 +1,621 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+#include "router.h"
+#include "../locker/rcu.h"
+#include "../pack/asset_pack.h"
+#include "../mime/mime.h"
+
+router* router::s_current = NULL;
+
+radix_node::~radix_node()
+{
+    for( size_t i = 0; i < children.size(); ++i )
+    {
+        delete children[ i ];
+    }
+}
+
+route::~route()
+{
+    if( pack )
+    {
+        pack->release();
+    }
+}
+
+vhost::~vhost()
+{
+    for( size_t i = 0; i < routes.size(); ++i )
+    {
+        delete routes[ i ];
+    }
+}
+
+router::~router()
+{
+    for( size_t i = 0; i < m_hosts.size(); ++i )
+    {
+        delete m_hosts[ i ];
+    }
+    delete [] m_slots;
+}
+
+//Host头部的长度:去掉端口号,IPv6地址形如[::1]:80
+static int host_length( const char* host )
+{
+    if( host[ 0 ] == '[' )
+    {
+        const char* end = strchr( host, ']' );
+        return end ? end - host + 1 : strlen( host );
+    }
+    return strcspn( host, ": \t" );
+}
+
+//忽略大小写的FNV-1a散列
+static unsigned int host_hash( const char* host, int len )
+{
+    unsigned int h = 2166136261u;
+    for( int i = 0; i < len; ++i )
+    {
+        h ^= ( unsigned char )tolower( ( unsigned char )host[ i ] );
+        h *= 16777619u;
+    }
+    return h;
+}
+
+//把前缀key插入以root为根的压缩前缀树,必要时分裂已有的边
+static void radix_insert( radix_node* root, const std::string& key, route* rt )
+{
+    radix_node* node = root;
+    size_t pos = 0;
+    while( pos < key.size() )
+    {
+        std::vector< radix_node* >& children = node->children;
+        size_t i = 0;
+        while( i < children.size() && children[ i ]->label[ 0 ] < key[ pos ] )
+        {
+            ++i;
+        }
+
+        //没有以该字符开头的边,直接挂上剩余的部分
+        if( i == children.size() || children[ i ]->label[ 0 ] != key[ pos ] )
+        {
+            radix_node* leaf = new radix_node;
+            leaf->label = key.substr( pos );
+            leaf->rt = rt;
+            children.insert( children.begin() + i, leaf );
+            return;
+        }
+
+        radix_node* child = children[ i ];
+        size_t common = 0;
+        while( common < child->label.size() && pos + common < key.size()
+                && child->label[ common ] == key[ pos + common ] )
+        {
+            ++common;
+        }
+
+        //公共部分比边短,将边分裂为两段
+        if( common < child->label.size() )
+        {
+            radix_node* mid = new radix_node;
+            mid->label = child->label.substr( 0, common );
+            child->label.erase( 0, common );
+            mid->children.push_back( child );
+            children[ i ] = mid;
+            child = mid;
+        }
+
+        node = child;
+        pos += common;
+    }
+
+    if( node->rt )
+    {
+        printf( "duplicate location %s, the later one wins\n", key.c_str() );
+    }
+    node->rt = rt;
+}
+
+//配置文件中一个server块(或全局指令)解析出的内容,在块结束后才能确定location继承的根目录和缓存策略
+struct vhost_spec
+{
+    vhost_spec() : host( NULL ), type_cache( mime::COUNT + 1 ) {}
+
+    vhost* host;
+    std::string doc_root;
+    std::string cache_control;
+    //cache_ext按类型编号设置的Cache-Control,空字符串表示未设置
+    std::vector< std::string > type_cache;
+};
+
+static const std::string& first_set( const std::string& a, const std::string& b )
+{
+    return a.empty() ? b : a;
+}
+
+//逐个类型决定路由的Cache-Control:location上的设置优先于server块,server块优先于全局
+//;同一层中按扩展名的设置优先于cache。结果和Content-Type一起预先生成头部
+static void resolve_cache( route* rt, const vhost_spec& spec, const vhost_spec& global )
+{
+    rt->type_cache.resize( mime::COUNT + 1 );
+    rt->file_headers.resize( mime::COUNT + 1 );
+    for( int t = 0; t <= mime::COUNT; ++t )
+    {
+        const std::string& policy = first_set( first_set( first_set( rt->type_cache[ t ], rt->cache_control ),
+                                                          first_set( spec.type_cache[ t ], spec.cache_control ) ),
+                                               first_set( global.type_cache[ t ], global.cache_control ) );
+        rt->type_cache[ t ] = policy;
+        std::string& headers = rt->file_headers[ t ];
+        headers = "Content-Type: ";
+        headers += mime::type( t );
+        headers += "\r\n";
+        if( ! policy.empty() )
+        {
+            headers += "Cache-Control: " + policy + "\r\n";
+        }
+    }
+    //未知的类型不能按扩展名设置,它的策略就是路由的默认值
+    rt->cache_control = rt->type_cache[ mime::COUNT ];
+}
+
+static bool finish_vhost( vhost_spec& spec, const vhost_spec& global )
+{
+    if( spec.doc_root.empty() )
+    {
+        spec.doc_root = global.doc_root;
+    }
+    if( spec.doc_root.empty() )
+    {
+        printf( "server %s has no root\n", spec.host->names.empty() ? "_" : spec.host->names[ 0 ].c_str() );
+        return false;
+    }
+
+    //根节点上的路由匹配所有URL
+    route* def = new route;
+    def->doc_root = spec.doc_root;
+    def->handler = HANDLER_STATIC;
+    def->lane = LANE_AUTO;
+    spec.host->routes.push_back( def );
+    spec.host->root.rt = def;
+
+    for( size_t i = 0; i < spec.host->routes.size(); ++i )
+    {
+        route* rt = spec.host->routes[ i ];
+        if( rt->doc_root.empty() )
+        {
+            rt->doc_root = spec.doc_root;
+        }
+        resolve_cache( rt, spec, global );
+        if( rt != def )
+        {
+            radix_insert( &spec.host->root, rt->prefix, rt );
+        }
+    }
+    return true;
+}
+
+//把逗号分隔的扩展名列表exts对应的类型的Cache-Control设为policy,扩展名必须在类型表(mime/mime.cpp)中
+static bool set_type_cache( std::vector< std::string >& type_cache, const std::string& exts, const std::string& policy,
+                            int line )
+{
+    type_cache.resize( mime::COUNT + 1 );
+    size_t pos = 0;
+    while( pos <= exts.size() )
+    {
+        size_t comma = exts.find( ',', pos );
+        if( comma == std::string::npos )
+        {
+            comma = exts.size();
+        }
+        if( exts[ pos ] == '.' )
+        {
+            ++pos;
+        }
+        int id = mime::find( exts.data() + pos, comma - pos );
+        if( id < 0 )
+        {
+            printf( "line %d: unknown extension %s\n", line, exts.substr( pos, comma - pos ).c_str() );
+            return false;
+        }
+        type_cache[ id ] = policy;
+        pos = comma + 1;
+    }
+    return true;
+}
+
+//解析location指令: location <prefix> [root=<path>] [cache=<policy>] [cache.<ext>[,<ext>...]=<policy>]
+//[handler=static|metrics|trace|upload|listing] [lane=high|normal|bulk] [pack=<资源包>] [microcache=on|off]
+static route* parse_location( const directive& d )
+{
+    if( d.args.empty() || d.args[ 0 ].empty() || d.args[ 0 ][ 0 ] != '/' )
+    {
+        printf( "line %d: location needs a prefix starting with '/'\n", d.line );
+        return NULL;
+    }
+
+    route* rt = new route;
+    rt->prefix = d.args[ 0 ];
+    rt->handler = HANDLER_STATIC;
+    rt->lane = LANE_AUTO;
+    for( size_t i = 1; i < d.args.size(); ++i )
+    {
+        std::string value;
+        if( parse_option( d.args[ i ], "root", value ) )
+        {
+            rt->doc_root = value;
+        }
+        else if( parse_option( d.args[ i ], "cache", value ) )
+        {
+            rt->cache_control = value;
+        }
+        else if( d.args[ i ].compare( 0, 6, "cache." ) == 0 && d.args[ i ].find( '=' ) != std::string::npos )
+        {
+            size_t eq = d.args[ i ].find( '=' );
+            if( ! set_type_cache( rt->type_cache, d.args[ i ].substr( 6, eq - 6 ), d.args[ i ].substr( eq + 1 ), d.line ) )
+            {
+                delete rt;
+                return NULL;
+            }
+        }
+        else if( parse_option( d.args[ i ], "handler", value ) && value == "static" )
+        {
+            rt->handler = HANDLER_STATIC;
+        }
+        else if( parse_option( d.args[ i ], "handler", value ) && value == "metrics" )
+        {
+            rt->handler = HANDLER_METRICS;
+        }
+        else if( parse_option( d.args[ i ], "handler", value ) && value == "trace" )
+        {
+            rt->handler = HANDLER_TRACE;
+        }
+        else if( parse_option( d.args[ i ], "handler", value ) && value == "upload" )
+        {
+            rt->handler = HANDLER_UPLOAD;
+        }
+        else if( parse_option( d.args[ i ], "handler", value ) && value == "listing" )
+        {
+            rt->handler = HANDLER_LISTING;
+        }
+        else if( parse_option( d.args[ i ], "lane", value ) && ( value == "high" || value == "normal" || value == "bulk" ) )
+        {
+            rt->lane = value == "high" ? LANE_HIGH : value == "normal" ? LANE_NORMAL : LANE_BULK;
+        }
+        else if( parse_option( d.args[ i ], "microcache", value ) && ( value == "on" || value == "off" ) )
+        {
+            rt->microcache = value == "on";
+        }
+        //每次构建路由表都重新打开包,重新加载配置即可换上新生成的包
+        else if( parse_option( d.args[ i ], "pack", value ) && ! rt->pack )
+        {
+            rt->pack = asset_pack::open( value.c_str() );
+            if( ! rt->pack )
+            {
+                delete rt;
+                return NULL;
+            }
+            printf( "location %s: %d assets from %s\n", rt->prefix.c_str(), rt->pack->count(), value.c_str() );
+        }
+        else
+        {
+            printf( "line %d: bad location option %s\n", d.line, d.args[ i ].c_str() );
+            delete rt;
+            return NULL;
+        }
+    }
+    //只有动态生成的响应经过微缓存,静态文件由文件缓存负责
+    if( rt->microcache && ( rt->handler == HANDLER_STATIC || rt->handler == HANDLER_UPLOAD || rt->pack ) )
+    {
+        printf( "line %d: microcache needs handler=metrics, trace or listing\n", d.line );
+        delete rt;
+        return NULL;
+    }
+    return rt;
+}
+
+router* router::build( const config& conf )
+{
+    router* r = new router;
+    vhost_spec global;
+    std::vector< vhost_spec > specs;
+    bool ok = true;
+
+    const std::vector< directive >& ds = conf.directives();
+    for( size_t i = 0; i < ds.size() && ok; ++i )
+    {
+        const directive& d = ds[ i ];
+        vhost_spec* cur = specs.empty() ? NULL : &specs.back();
+        if( d.name == "server" )
+        {
+            vhost_spec spec;
+            spec.host = new vhost;
+            spec.host->names = d.args;
+            specs.push_back( spec );
+        }
+        else if( d.name == "root" || d.name == "cache" )
+        {
+            if( d.args.size() != 1 )
+            {
+                printf( "line %d: %s takes one argument\n", d.line, d.name.c_str() );
+                ok = false;
+                break;
+            }
+            vhost_spec& target = cur ? *cur : global;
+            ( d.name == "root" ? target.doc_root : target.cache_control ) = d.args[ 0 ];
+        }
+        //cache_ext <扩展名列表> <policy>:server块中或全局的按扩展名的Cache-Control
+        else if( d.name == "cache_ext" )
+        {
+            if( d.args.size() != 2 )
+            {
+                printf( "line %d: cache_ext takes an extension list and a policy\n", d.line );
+                ok = false;
+                break;
+            }
+            if( ! set_type_cache( ( cur ? *cur : global ).type_cache, d.args[ 0 ], d.args[ 1 ], d.line ) )
+            {
+                ok = false;
+                break;
+            }
+        }
+        else if( d.name == "location" )
+        {
+            //server块之外的location属于默认虚拟主机
+            if( ! cur )
+            {
+                vhost_spec spec;
+                spec.host = new vhost;
+                specs.push_back( spec );
+                cur = &specs.back();
+            }
+            route* rt = parse_location( d );
+            if( ! rt )
+            {
+                ok = false;
+                break;
+            }
+            cur->host->routes.push_back( rt );
+        }
+    }
+
+    //没有server块时使用全局root作为唯一的虚拟主机
+    if( ok && specs.empty() )
+    {
+        vhost_spec spec;
+        spec.host = new vhost;
+        specs.push_back( spec );
+    }
+
+    for( size_t i = 0; i < specs.size(); ++i )
+    {
+        if( ok )
+        {
+            ok = finish_vhost( specs[ i ], global );
+        }
+        r->m_hosts.push_back( specs[ i ].host );
+    }
+
+    if( ! ok )
+    {
+        delete r;
+        return NULL;
+    }
+    r->build_host_table();
+    return r;
+}
+
+router* router::create_default( const char* doc_root )
+{
+    router* r = new router;
+    vhost_spec spec;
+    spec.host = new vhost;
+    spec.doc_root = doc_root;
+    finish_vhost( spec, spec );
+    r->m_hosts.push_back( spec.host );
+    r->build_host_table();
+    return r;
+}
+
+//开放寻址散列表,槽位数为主机名数量两倍以上的2的幂
+void router::build_host_table()
+{
+    //第一个server块为默认虚拟主机,Host头部缺失或未匹配时使用
+    m_default = m_hosts[ 0 ];
+
+    unsigned int names = 0;
+    for( size_t i = 0; i < m_hosts.size(); ++i )
+    {
+        names += m_hosts[ i ]->names.size();
+    }
+    unsigned int size = 8;
+    while( size < names * 2 )
+    {
+        size <<= 1;
+    }
+
+    m_slots = new host_slot[ size ];
+    memset( m_slots, 0, sizeof( host_slot ) * size );
+    m_slot_mask = size - 1;
+
+    for( size_t i = 0; i < m_hosts.size(); ++i )
+    {
+        for( size_t j = 0; j < m_hosts[ i ]->names.size(); ++j )
+        {
+            const std::string& name = m_hosts[ i ]->names[ j ];
+            int len = host_length( name.c_str() );
+            unsigned int h = host_hash( name.c_str(), len );
+            unsigned int idx = h & m_slot_mask;
+            bool duplicate = false;
+            while( m_slots[ idx ].host )
+            {
+                if( m_slots[ idx ].hash == h && m_slots[ idx ].len == len
+                        && strncasecmp( m_slots[ idx ].name, name.c_str(), len ) == 0 )
+                {
+                    duplicate = true;
+                    break;
+                }
+                idx = ( idx + 1 ) & m_slot_mask;
+            }
+            if( duplicate )
+            {
+                printf( "duplicate server name %s, the first one wins\n", name.c_str() );
+                continue;
+            }
+            m_slots[ idx ].hash = h;
+            m_slots[ idx ].name = name.c_str();
+            m_slots[ idx ].len = len;
+            m_slots[ idx ].host = m_hosts[ i ];
+        }
+    }
+}
+
+const vhost* router::find_vhost( const char* host ) const
+{
+    if( ! host || ! *host )
+    {
+        return m_default;
+    }
+
+    int len = host_length( host );
+    unsigned int h = host_hash( host, len );
+    unsigned int idx = h & m_slot_mask;
+    while( m_slots[ idx ].host )
+    {
+        if( m_slots[ idx ].hash == h && m_slots[ idx ].len == len
+                && strncasecmp( m_slots[ idx ].name, host, len ) == 0 )
+        {
+            return m_slots[ idx ].host;
+        }
+        idx = ( idx + 1 ) & m_slot_mask;
+    }
+    return m_default;
+}
+
+//所有路由中会从文件系统读取文件的doc_root,去掉重复的
+void router::doc_roots( std::vector< std::string >& roots ) const
+{
+    for( size_t i = 0; i < m_hosts.size(); ++i )
+    {
+        const std::vector< route* >& routes = m_hosts[i]->routes;
+        for( size_t j = 0; j < routes.size(); ++j )
+        {
+            const route* rt = routes[j];
+            //资源包路由的GET请求不访问doc_root
+            if( rt->handler == HANDLER_METRICS || rt->handler == HANDLER_TRACE || rt->pack )
+            {
+                continue;
+            }
+            if( std::find( roots.begin(), roots.end(), rt->doc_root ) == roots.end() )
+            {
+                roots.push_back( rt->doc_root );
+            }
+        }
+    }
+}
+
+//沿着前缀树向下走一遍URL,记录途经的最长的一条路由
+const route* router::match( const char* host, const char* url ) const
+{
+    const vhost* vh = find_vhost( host );
+    const radix_node* node = &vh->root;
+    const route* best = node->rt;
+    const char* p = url;
+    while( *p )
+    {
+        const radix_node* next = NULL;
+        for( size_t i = 0; i < node->children.size(); ++i )
+        {
+            char first = node->children[ i ]->label[ 0 ];
+            if( first == *p )
+            {
+                next = node->children[ i ];
+                break;
+            }
+            if( first > *p )
+            {
+                break;
+            }
+        }
+        if( ! next || strncmp( p, next->label.data(), next->label.size() ) != 0 )
+        {
+            break;
+        }
+
+        p += next->label.size();
+        node = next;
+        if( node->rt )
+        {
+            best = node->rt;
+        }
+    }
+    return best;
+}
+
+//按扩展名归入大文件通道的类型:视频、音频、压缩包和磁盘镜像
+static const char* const s_bulk_exts[] =
+{
+    "mp4", "m4v", "mkv", "webm", "mov", "avi", "flv", "ts", "mp3", "flac", "wav", "ogg",
+    "iso", "img", "zip", "gz", "tgz", "bz2", "xz", "7z", "rar", "tar", "bin", NULL
+};
+
+bool router::escapes_root( const char* url )
+{
+    //逐段比较,"/a..b"和"/..."这样的文件名不受影响
+    for( const char* seg = url; *seg; )
+    {
+        while( *seg == '/' )
+        {
+            ++seg;
+        }
+        const char* end = seg;
+        while( *end && *end != '/' )
+        {
+            ++end;
+        }
+        if( end - seg == 2 && seg[0] == '.' && seg[1] == '.' )
+        {
+            return true;
+        }
+        seg = end;
+    }
+    return false;
+}
+
+REQUEST_LANE router::classify( const route* rt, const char* url )
+{
+    if( rt->lane != LANE_AUTO )
+    {
+        return rt->lane;
+    }
+    const char* dot = strrchr( url, '.' );
+    if( ! dot || strchr( dot, '/' ) )
+    {
+        return LANE_NORMAL;
+    }
+    for( int i = 0; s_bulk_exts[ i ]; ++i )
+    {
+        if( strcasecmp( dot + 1, s_bulk_exts[ i ] ) == 0 )
+        {
+            return LANE_BULK;
+        }
+    }
+    return LANE_NORMAL;
+}
+
+const router* router::current()
+{
+    return __atomic_load_n( &s_current, __ATOMIC_ACQUIRE );
+}
+
+void router::publish( router* r )
+{
+    router* old = __atomic_exchange_n( &s_current, r, __ATOMIC_ACQ_REL );
+    if( old )
+    {
+        rcu::synchronize();
+        delete old;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <vector>
+#include "../config/config.h"
+
+class asset_pack;
+
+//路由的处理方式
+//HANDLER_STATIC返回网站根目录下的文件,HANDLER_METRICS返回运行指标,HANDLER_TRACE返回最近的慢请求
+//,HANDLER_UPLOAD在HANDLER_STATIC的基础上还接受POST和PUT,把请求体保存为网站根目录下的文件
+//,HANDLER_LISTING在HANDLER_STATIC的基础上对目录返回文件列表
+enum ROUTE_HANDLER { HANDLER_STATIC = 0, HANDLER_METRICS, HANDLER_TRACE, HANDLER_UPLOAD, HANDLER_LISTING };
+
+//请求在线程池中排队的通道,编号即线程池的通道编号
+//。LANE_AUTO表示按URL的扩展名决定:视频、音频、压缩包等大文件归入LANE_BULK,其余归入LANE_NORMAL
+enum REQUEST_LANE { LANE_AUTO = -1, LANE_HIGH = 0, LANE_NORMAL, LANE_BULK, LANE_COUNT };
+
+//一条路由:URL前缀对应的网站根目录、缓存策略和处理方式
+struct route
+{
+    route() : microcache( false ), pack( NULL ) {}
+    ~route();
+
+    std::string prefix;
+    //网站根目录,目标文件的完整路径为doc_root + URL
+    std::string doc_root;
+    //Cache-Control响应头部的值,为空时不发送该头部。没有按扩展名单独设置的类型使用它
+    std::string cache_control;
+    //按类型编号(见mime/mime.h)的Cache-Control,由location、server块和全局的cache、cache_ext逐级决定,为空时不发送
+    std::vector< std::string > type_cache;
+    //按类型编号预先生成的Content-Type和Cache-Control头部,静态文件的响应直接复制,不必再格式化
+    std::vector< std::string > file_headers;
+    ROUTE_HANDLER handler;
+    REQUEST_LANE lane;
+    //动态生成的响应(metrics、trace和目录列表)经过微缓存,见cache/response_cache.h
+    bool microcache;
+    //不为NULL时GET请求只在这个资源包中查找,不访问doc_root,路由持有包的一个引用
+    asset_pack* pack;
+};
+
+//压缩前缀树(radix trie)的节点,每条边上保存一段URL
+struct radix_node
+{
+    std::string label;
+    //在此节点结束的前缀所对应的路由,可能为NULL
+    route* rt;
+    //按label首字符排序的子节点
+    std::vector< radix_node* > children;
+
+    radix_node() : rt( NULL ) {}
+    ~radix_node();
+};
+
+//虚拟主机,对应配置文件中的一个server块
+struct vhost
+{
+    std::vector< std::string > names;
+    radix_node root;
+    std::vector< route* > routes;
+
+    ~vhost();
+};
+
+//根据Host头部和URL选择路由
+//。路由表在后台构建完成后通过publish整体替换,工作线程在rcu读侧临界区内调用current()和match()
+//,查找过程只遍历一次URL且不分配内存,全程不需要加锁
+class router
+{
+public:
+    ~router();
+
+    //由配置文件构建路由表,配置有误时返回NULL
+    static router* build( const config& conf );
+    //只有一个默认虚拟主机、一条"/"路由的路由表
+    static router* create_default( const char* doc_root );
+
+    //查找host(可为NULL,可带端口)和url对应的路由,总能返回一条路由
+    const route* match( const char* host, const char* url ) const;
+    //url应归入的线程池通道:路由指定了lane时使用它,否则按扩展名判断
+    static REQUEST_LANE classify( const route* rt, const char* url );
+    //url中是否有".."路径段,有时拼接到网站根目录后会指向根目录之外,也就是其他虚拟主机或整个文件系统
+    static bool escapes_root( const char* url );
+    //所有从文件系统返回文件的路由的网站根目录,不重复
+    void doc_roots( std::vector< std::string >& roots ) const;
+
+    //当前生效的路由表,调用者必须处于rcu::read_lock()和rcu::read_unlock()之间
+    static const router* current();
+    //发布新的路由表并在宽限期结束后释放旧的路由表,只能由一个线程调用
+    static void publish( router* r );
+
+private:
+    router() : m_default( NULL ), m_slots( NULL ), m_slot_mask( 0 ) {}
+
+    //虚拟主机散列表的一个槽位
+    struct host_slot
+    {
+        unsigned int hash;
+        const char* name;
+        int len;
+        vhost* host;
+    };
+
+    void build_host_table();
+    const vhost* find_vhost( const char* host ) const;
+
+    std::vector< vhost* > m_hosts;
+    vhost* m_default;
+    host_slot* m_slots;
+    unsigned int m_slot_mask;
+
+    static router* s_current;
+};
+
+#endif
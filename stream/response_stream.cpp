@@ -0,0 +1,204 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "response_stream.h"
+
+//块大小一行的固定长度:16个十六进制位加\r\n。先占位,块的内容生成后再填写,一次fill只产生一个块
+//。collect的块由微缓存的上限决定,可能超过8个十六进制位能表示的大小,因此按size_t的最大值留位
+static const size_t CHUNK_HEAD_LEN = 18;
+
+response_stream::response_stream( stream_producer* producer )
+    : m_producer( producer ), m_sent( 0 ), m_done( false )
+{
+}
+
+response_stream::~response_stream()
+{
+    delete m_producer;
+}
+
+void response_stream::fill()
+{
+    if( m_done )
+    {
+        return;
+    }
+    size_t head = m_buf.size();
+    m_buf.append( CHUNK_HEAD_LEN, '0' );
+    bool more = true;
+    while( more && ! full() )
+    {
+        more = m_producer->produce( *this );
+    }
+
+    size_t len = m_buf.size() - head - CHUNK_HEAD_LEN;
+    if( len == 0 )
+    {
+        //大小为0的块表示响应结束,生产者这次没有生成数据时去掉占位
+        m_buf.resize( head );
+    }
+    else
+    {
+        char line[ CHUNK_HEAD_LEN + 1 ];
+        snprintf( line, sizeof( line ), "%016zx\r\n", len );
+        m_buf.replace( head, CHUNK_HEAD_LEN, line, CHUNK_HEAD_LEN );
+        m_buf.append( "\r\n", 2 );
+    }
+    if( ! more )
+    {
+        m_buf.append( "0\r\n\r\n", 5 );
+        m_done = true;
+    }
+}
+
+bool response_stream::collect( size_t limit )
+{
+    //生产者在队列达到高水位时返回,每次调用后把数据移出队列,下次调用才会继续生成
+    std::string all;
+    bool more = true;
+    while( more && all.size() <= limit )
+    {
+        more = m_producer->produce( *this );
+        all.append( m_buf );
+        m_buf.clear();
+    }
+    m_buf.swap( all );
+    if( ! more && m_buf.size() <= limit )
+    {
+        m_done = true;
+        return true;
+    }
+    char line[ CHUNK_HEAD_LEN + 1 ];
+    snprintf( line, sizeof( line ), "%016zx\r\n", m_buf.size() );
+    m_buf.insert( 0, line, CHUNK_HEAD_LEN );
+    m_buf.append( "\r\n", 2 );
+    if( ! more )
+    {
+        m_buf.append( "0\r\n\r\n", 5 );
+        m_done = true;
+    }
+    return false;
+}
+
+void response_stream::append( const char* data, size_t len )
+{
+    m_buf.append( data, len );
+}
+
+void response_stream::append( const char* str )
+{
+    m_buf.append( str );
+}
+
+void response_stream::consume( size_t n )
+{
+    m_sent += n;
+    if( m_sent == m_buf.size() )
+    {
+        m_buf.clear();
+        m_sent = 0;
+    }
+    else if( m_sent >= HIGH_WATERMARK )
+    {
+        m_buf.erase( 0, m_sent );
+        m_sent = 0;
+    }
+}
+
+dir_listing* dir_listing::create( const char* path, const char* url )
+{
+    DIR* dir = opendir( path );
+    if( ! dir )
+    {
+        return NULL;
+    }
+    dir_listing* listing = new dir_listing;
+    listing->m_dir = dir;
+    listing->m_url = url;
+    if( listing->m_url.empty() || listing->m_url[ listing->m_url.size() - 1 ] != '/' )
+    {
+        listing->m_url += '/';
+    }
+    return listing;
+}
+
+dir_listing::~dir_listing()
+{
+    if( m_dir )
+    {
+        closedir( m_dir );
+    }
+}
+
+//文件名可以包含HTML中的特殊字符
+static void append_escaped( response_stream& out, const char* s )
+{
+    const char* start = s;
+    for( ; *s; ++s )
+    {
+        const char* rep = NULL;
+        switch( *s )
+        {
+            case '&': rep = "&amp;"; break;
+            case '<': rep = "&lt;"; break;
+            case '>': rep = "&gt;"; break;
+            case '"': rep = "&quot;"; break;
+            default: break;
+        }
+        if( rep )
+        {
+            out.append( start, s - start );
+            out.append( rep );
+            start = s + 1;
+        }
+    }
+    out.append( start, s - start );
+}
+
+bool dir_listing::produce( response_stream& out )
+{
+    if( ! m_started )
+    {
+        m_started = true;
+        out.append( "<html><head><title>Index of " );
+        append_escaped( out, m_url.c_str() );
+        out.append( "</title></head><body><h1>Index of " );
+        append_escaped( out, m_url.c_str() );
+        out.append( "</h1><pre>\n" );
+    }
+
+    //每次最多读到队列满,readdir按目录的内部顺序返回,不排序
+    while( ! out.full() )
+    {
+        struct dirent* ent = readdir( m_dir );
+        if( ! ent )
+        {
+            //目录已经读完;读目录出错时响应头部已经发出,也只能这样提前结束列表
+            out.append( "</pre></body></html>\n" );
+            return false;
+        }
+        if( strcmp( ent->d_name, "." ) == 0 )
+        {
+            continue;
+        }
+        struct stat st;
+        if( fstatat( dirfd( m_dir ), ent->d_name, &st, 0 ) < 0 )
+        {
+            continue;
+        }
+        const char* slash = S_ISDIR( st.st_mode ) ? "/" : "";
+        out.append( "<a href=\"" );
+        append_escaped( out, m_url.c_str() );
+        append_escaped( out, ent->d_name );
+        out.append( slash );
+        out.append( "\">" );
+        append_escaped( out, ent->d_name );
+        out.append( slash );
+        char size[ 32 ];
+        snprintf( size, sizeof( size ), "</a> %lld\n", S_ISDIR( st.st_mode ) ? 0LL : ( long long )st.st_size );
+        out.append( size );
+    }
+    return true;
+}
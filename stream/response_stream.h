@@ -0,0 +1,83 @@
+#ifndef RESPONSE_STREAM_H
+#define RESPONSE_STREAM_H
+
+#include <dirent.h>
+#include <stddef.h>
+#include <string>
+
+class response_stream;
+
+//流式响应的数据来源,长度事先未知。produce由工作线程调用,每次向out追加一批数据
+//,out.full()为true时应尽快返回,下次调用时接着生成
+class stream_producer
+{
+public:
+    virtual ~stream_producer() {}
+    //返回false表示数据已经全部生成
+    virtual bool produce( response_stream& out ) = 0;
+};
+
+//以Transfer-Encoding: chunked发送的响应体,排队的字节数有上下两个水位
+//。工作线程调用fill让生产者生成数据直到高水位,生成的数据作为一个块排入队列
+//;反应堆把队列写到socket,发送缓冲区满(EAGAIN)时生产者不会被调用
+//,队列降到低水位以下时再交给工作线程生成下一批,所以每个连接占用的内存不超过高水位加上一次produce的输出
+class response_stream
+{
+public:
+    static const size_t HIGH_WATERMARK = 64 * 1024;
+    static const size_t LOW_WATERMARK = 16 * 1024;
+
+    //接管producer,析构时释放
+    explicit response_stream( stream_producer* producer );
+    ~response_stream();
+
+    //调用生产者直到排队的字节数达到高水位或生产者结束,结束时排入最后一个块
+    void fill();
+    //不分块:调用生产者直到结束,全部数据留在队列中,返回true(微缓存据此生成完整的响应)
+    //。超过limit字节时停止,把已经生成的数据作为第一个块,返回false,之后照常fill
+    bool collect( size_t limit );
+
+    //生产者调用:追加数据
+    void append( const char* data, size_t len );
+    void append( const char* str );
+    bool full() const { return m_buf.size() - m_sent >= HIGH_WATERMARK; }
+
+    //队列中待发送的数据
+    const char* data() const { return m_buf.data() + m_sent; }
+    size_t queued() const { return m_buf.size() - m_sent; }
+    //n个字节已经写到socket
+    void consume( size_t n );
+
+    //生产者还没有结束,队列已低于低水位
+    bool starving() const { return ! m_done && queued() < LOW_WATERMARK; }
+    //最后一个块已经排入队列
+    bool done() const { return m_done; }
+
+private:
+    stream_producer* m_producer;
+    std::string m_buf;
+    //m_buf中已经发送的字节数,超过高水位时把未发送的部分移到开头
+    size_t m_sent;
+    bool m_done;
+};
+
+//目录列表:逐批readdir生成HTML,目录中的文件再多也只占用一个队列的内存
+class dir_listing : public stream_producer
+{
+public:
+    //打开目录path,url为它对应的URL,失败时返回NULL并保留errno
+    static dir_listing* create( const char* path, const char* url );
+    virtual ~dir_listing();
+
+    virtual bool produce( response_stream& out );
+
+private:
+    dir_listing() : m_dir( NULL ), m_started( false ) {}
+
+    DIR* m_dir;
+    //以'/'结尾的URL,列表中的链接都是绝对路径
+    std::string m_url;
+    bool m_started;
+};
+
+#endif
@@ -5,117 +5,554 @@
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
-#include "../lock/locker.h"
+#include <unistd.h>
+#include <vector>
+#include "../locker/locker.h"
+#include "../affinity/affinity.h"
+#include "../metrics/metrics.h"
 
 //线程池类将其定义为模板欸是为了代码复用
+//。线程数在min_threads和max_threads之间自适应调整:控制线程每隔一个调整周期统计请求的平均排队时间
+//和工作线程的利用率,排队时间持续偏高时增加线程,排队时间和利用率持续偏低时退役一个线程
+//。请求按通道(lane)排队,每个通道一个队列,取任务时按权重在非空的通道之间平滑轮转
+//,一批排在前面的慢请求只占用自己通道的份额,不会让其他通道的请求一直等待
 template< typename T >
 class threadpool
 {
 public:
-    //参数thread_number是线程池中线程的数量,max_requests是请求队列中最多允许的、等待处理的请求的数量
-    threadpool( int thread_number = 8, int max_requests = 10000 );
+    //调整周期(毫秒)
+    static const int SIZING_INTERVAL_MS = 200;
+    //平均排队时间超过WAIT_HIGH_US连续GROW_AFTER个周期时扩容,每次增加当前线程数的1/4(至少一个)
+    static const int WAIT_HIGH_US = 2000;
+    static const int GROW_AFTER = 2;
+    //平均排队时间低于WAIT_LOW_US且利用率低于UTIL_LOW_PERCENT连续SHRINK_AFTER个周期时退役一个线程
+    static const int WAIT_LOW_US = 200;
+    static const int UTIL_LOW_PERCENT = 30;
+    static const int SHRINK_AFTER = 25;
+    //空闲的工作线程先自旋等待新任务再休眠,自旋时长在[MIN_SPIN_NS, 最大自旋时长]之间自适应
+    //:自旋期间等到了任务则加倍,否则减半。同时自旋的线程数不超过最大自旋线程数
+    static const int MIN_SPIN_NS = 500;
+    static const int DEFAULT_MAX_SPIN_NS = 50000;
+    static const int DEFAULT_MAX_SPINNERS = 1;
+    //通道数和默认权重,通道的含义由使用者决定
+    static const int LANES = 3;
+    static const int DEFAULT_WEIGHT = 1;
+
+    //min_threads和max_threads是线程数的上下限,两者相等时线程数固定
+    //,max_requests是请求队列中最多允许的、等待处理的请求的数量
+    threadpool( int min_threads = 8, int max_threads = 8, int max_requests = 10000 );
+    //通知所有线程退出并等待它们结束
     ~threadpool();
-    //向请求队列中添加任务
-    bool append( T* request );
+    //向第lane个通道的请求队列中添加任务
+    bool append( T* request, int lane = 0 );
+    //设置各通道的权重,非空的通道按权重的比例轮流出队,权重至少为1
+    void set_weights( const int* weights );
+    //把第i个工作线程绑定到cpus[i % cpus.size()]上,之后新建的线程也按这个规则绑定
+    bool set_cpus( const std::vector< int >& cpus );
+    //设置最大自旋时长(纳秒,0表示不自旋)和同时自旋的最大线程数
+    void set_spin( int max_spin_ns, int max_spinners );
 
 private:
+    //工作线程的状态
+    enum SLOT_STATE { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+
+    //每个工作线程占用一个槽位,线程退役后槽位可以复用
+    struct slot
+    {
+        threadpool* pool;
+        int index;
+        pthread_t thread;
+        SLOT_STATE state;
+    };
+
+    //取任务的结果
+    enum TAKE_RESULT { TAKE_TASK, TAKE_EMPTY, TAKE_RETIRE, TAKE_STOP };
+
+    //队列中的任务及其入队时间,用于统计排队时间
+    struct task
+    {
+        T* request;
+        long long enqueue_ns;
+        int lane;
+    };
+
     //工作线程的函数,它不断从工作队列中取出任务并执行
     static void* worker( void* arg );
-    void run();
+    void run( slot* self );
+    //从队列中取一个任务,或者领取一个退役令牌
+    TAKE_RESULT take( task& t );
+    //是否有需要工作线程醒来处理的事情:任务、退役令牌或者结束
+    bool has_work() const
+    {
+        return __atomic_load_n( &m_pending, __ATOMIC_SEQ_CST ) > 0
+                || __atomic_load_n( &m_retire, __ATOMIC_SEQ_CST ) > 0 || stopping();
+    }
+    //自旋最多spin_ns纳秒等待has_work(),等到时返回true
+    bool spin( int spin_ns );
+    //控制线程的函数,周期性地调整线程数并回收退役的线程
+    static void* manager( void* arg );
+    void manage();
+    //启动一个新的工作线程,调用者持有m_queuelocker
+    bool spawn();
+    //回收已退出的工作线程,调用者持有m_queuelocker
+    void reap();
+    bool stopping() const { return __atomic_load_n( &m_stop, __ATOMIC_ACQUIRE ); }
+    //通知所有线程退出并回收它们,析构函数和构造失败时调用
+    void shutdown();
 
 private:
-    int m_thread_number;//线程池中的线程数
+    int m_min_threads;//线程数下限
+    int m_max_threads;//线程数上限
+    int m_thread_number;//线程池中正在运行的线程数
     int m_max_requests;//请求队列中允许的最大请求数
-    pthread_t* m_threads;//描述线程池的数组,其大小为m_thread_number
-    std::list< T* > m_workqueue;//请求队列
-    locker m_queuelocker;//保护请求队列的互斥锁
-    sem m_queuestat;//是否有任务需要处理
+    slot* m_threads;//描述线程池的数组,其大小为m_max_threads
+    pthread_t m_manager;//控制线程,线程数固定时不创建
+    bool m_has_manager;
+    std::list< task > m_workqueue[ LANES ];//各通道的请求队列
+    int m_queued;//所有通道中的任务数,由m_queuelocker保护
+    int m_weights[ LANES ];//各通道的权重
+    int m_current[ LANES ];//平滑加权轮转中各通道的当前值,由m_queuelocker保护
+    locker m_queuelocker;//保护请求队列和线程槽位的互斥锁
+    parker m_parker;//空闲工作线程的自旋和休眠
+    int m_pending;//队列中的任务数,在m_queuelocker内修改,可以不加锁地读取
+    int m_retire;//等待退役的线程数,在m_queuelocker内修改,可以不加锁地读取
+    int m_max_spin_ns;//最大自旋时长
+    int m_max_spinners;//同时自旋的最大线程数
+    std::vector< int > m_cpus;//工作线程绑定的CPU
     bool m_stop;//是否结束线程
+
+    //当前调整周期内的统计数据
+    long long m_wait_ns;//出队任务的排队时间之和,由m_queuelocker保护
+    long long m_dequeued;//出队的任务数,由m_queuelocker保护
+    long long m_busy_ns;//工作线程处理任务的时间之和,原子地累加
 };
 
 template< typename T >
-threadpool< T >::threadpool( int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
+threadpool< T >::threadpool( int min_threads, int max_threads, int max_requests ) :
+        m_min_threads( min_threads ), m_max_threads( max_threads ), m_thread_number( 0 ),
+        m_max_requests( max_requests ), m_threads( NULL ), m_has_manager( false ), m_queued( 0 ), m_pending( 0 ), m_retire( 0 ),
+        m_max_spin_ns( DEFAULT_MAX_SPIN_NS ), m_max_spinners( DEFAULT_MAX_SPINNERS ),
+        m_stop( false ), m_wait_ns( 0 ), m_dequeued( 0 ), m_busy_ns( 0 )
 {
-    if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
+    if( ( min_threads <= 0 ) || ( max_threads < min_threads ) || ( max_requests <= 0 ) )
     {
         throw std::exception();
     }
 
-    m_threads = new pthread_t[ m_thread_number ];
-    if( ! m_threads )
+    for ( int i = 0; i < LANES; ++i )
     {
-        throw std::exception();
+        m_weights[i] = DEFAULT_WEIGHT;
+        m_current[i] = 0;
     }
 
-    //创建thtead_number个线程,并将它们都设置为脱离线程
-    for ( int i = 0; i < thread_number; ++i )
+    //只有一个CPU时自旋只会和持有任务的线程抢CPU,直接休眠
+    if( sysconf( _SC_NPROCESSORS_ONLN ) <= 1 )
     {
-        printf( "create the %dth thread\n", i );
-        if( pthread_create( m_threads + i, NULL, worker, this ) != 0 )
+        m_max_spin_ns = 0;
+    }
+
+    m_threads = new slot[ m_max_threads ];
+    for ( int i = 0; i < m_max_threads; ++i )
+    {
+        m_threads[i].pool = this;
+        m_threads[i].index = i;
+        m_threads[i].state = SLOT_FREE;
+    }
+
+    //先创建min_threads个工作线程,线程可以退役,所以不再设置为脱离线程,由控制线程或析构函数回收
+    m_queuelocker.lock();
+    for ( int i = 0; i < min_threads; ++i )
+    {
+        if( ! spawn() )
         {
-            delete [] m_threads;
+            m_queuelocker.unlock();
+            shutdown();
             throw std::exception();
         }
-        if( pthread_detach( m_threads[i] ) )
+    }
+    m_queuelocker.unlock();
+
+    metrics::set( POOL_MIN_THREADS, m_min_threads );
+    metrics::set( POOL_MAX_THREADS, m_max_threads );
+
+    if( m_max_threads > m_min_threads )
+    {
+        if( pthread_create( &m_manager, NULL, manager, this ) != 0 )
         {
-            delete [] m_threads;
+            shutdown();
             throw std::exception();
         }
+        m_has_manager = true;
     }
 }
 
 template< typename T >
 threadpool< T >::~threadpool()
 {
+    shutdown();
+}
+
+template< typename T >
+void threadpool< T >::shutdown()
+{
+    __atomic_store_n( &m_stop, true, __ATOMIC_RELEASE );
+    if( m_has_manager )
+    {
+        pthread_join( m_manager, NULL );
+        m_has_manager = false;
+    }
+
+    //唤醒所有工作线程,它们在取任务之前检查m_stop后退出
+    m_parker.unpark_all();
+
+    for ( int i = 0; i < m_max_threads; ++i )
+    {
+        if( m_threads[i].state != SLOT_FREE )
+        {
+            pthread_join( m_threads[i].thread, NULL );
+            m_threads[i].state = SLOT_FREE;
+        }
+    }
     delete [] m_threads;
-    m_stop = true;
+    m_threads = NULL;
+    metrics::set( POOL_THREADS, 0 );
+}
+
+template< typename T >
+bool threadpool< T >::spawn()
+{
+    for ( int i = 0; i < m_max_threads; ++i )
+    {
+        if( m_threads[i].state != SLOT_FREE )
+        {
+            continue;
+        }
+        printf( "create the %dth thread\n", i );
+        //先标记为运行中,线程可能在pthread_create返回之前就退出并标记为SLOT_EXITED
+        m_threads[i].state = SLOT_RUNNING;
+        if( pthread_create( &m_threads[i].thread, NULL, worker, m_threads + i ) != 0 )
+        {
+            m_threads[i].state = SLOT_FREE;
+            return false;
+        }
+        if( ! m_cpus.empty() )
+        {
+            pin_thread( m_threads[i].thread, m_cpus[ i % m_cpus.size() ] );
+        }
+        ++m_thread_number;
+        metrics::set( POOL_THREADS, m_thread_number );
+        return true;
+    }
+    return false;
+}
+
+template< typename T >
+void threadpool< T >::reap()
+{
+    for ( int i = 0; i < m_max_threads; ++i )
+    {
+        if( __atomic_load_n( &m_threads[i].state, __ATOMIC_ACQUIRE ) == SLOT_EXITED )
+        {
+            pthread_join( m_threads[i].thread, NULL );
+            m_threads[i].state = SLOT_FREE;
+        }
+    }
 }
 
 template< typename T >
-bool threadpool< T >::append( T* request )
+bool threadpool< T >::append( T* request, int lane )
 {
+    task t;
+    t.request = request;
+    t.enqueue_ns = monotonic_ns();
+    t.lane = ( lane >= 0 && lane < LANES ) ? lane : 0;
     //操作工作队列时一定要加锁,因为它被所有线程共享
     m_queuelocker.lock();
-    if ( m_workqueue.size() > m_max_requests )
+    if ( m_queued > m_max_requests )
     {
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back( request );
+    m_workqueue[ t.lane ].push_back( t );
+    ++m_queued;
+    __atomic_add_fetch( &m_pending, 1, __ATOMIC_SEQ_CST );
     m_queuelocker.unlock();
-    m_queuestat.post();
+    //有线程在自旋时它会看到这个任务,不需要唤醒;否则只唤醒一个休眠的线程
+    if( m_parker.spinners() > 0 )
+    {
+        metrics::add( POOL_WAKEUPS_SKIPPED, 1 );
+    }
+    else if( m_parker.unpark_one() )
+    {
+        metrics::add( POOL_WAKEUPS, 1 );
+    }
     return true;
 }
 
+template< typename T >
+void threadpool< T >::set_weights( const int* weights )
+{
+    m_queuelocker.lock();
+    for ( int i = 0; i < LANES; ++i )
+    {
+        m_weights[i] = weights[i] > 0 ? weights[i] : 1;
+        m_current[i] = 0;
+    }
+    m_queuelocker.unlock();
+}
+
+template< typename T >
+void threadpool< T >::set_spin( int max_spin_ns, int max_spinners )
+{
+    __atomic_store_n( &m_max_spin_ns, max_spin_ns, __ATOMIC_RELAXED );
+    __atomic_store_n( &m_max_spinners, max_spinners, __ATOMIC_RELAXED );
+}
+
+template< typename T >
+bool threadpool< T >::set_cpus( const std::vector< int >& cpus )
+{
+    bool ok = true;
+    m_queuelocker.lock();
+    m_cpus = cpus;
+    for ( int i = 0; i < m_max_threads && ! cpus.empty(); ++i )
+    {
+        if( m_threads[i].state == SLOT_RUNNING )
+        {
+            ok = pin_thread( m_threads[i].thread, cpus[ i % cpus.size() ] ) && ok;
+        }
+    }
+    m_queuelocker.unlock();
+    return ok;
+}
+
 template< typename T >
 void* threadpool< T >::worker( void* arg )
+{
+    slot* self = ( slot* )arg;
+    self->pool->run( self );
+    return self->pool;//这里返回NULL也可以,因为并没有使用这个返回值
+}
+
+template< typename T >
+typename threadpool< T >::TAKE_RESULT threadpool< T >::take( task& t )
+{
+    if( ! has_work() )
+    {
+        return TAKE_EMPTY;
+    }
+    m_queuelocker.lock();
+    if( stopping() )
+    {
+        m_queuelocker.unlock();
+        return TAKE_STOP;
+    }
+    //拿到退役令牌的线程直接退出
+    if( m_retire > 0 )
+    {
+        __atomic_sub_fetch( &m_retire, 1, __ATOMIC_SEQ_CST );
+        --m_thread_number;
+        metrics::set( POOL_THREADS, m_thread_number );
+        m_queuelocker.unlock();
+        return TAKE_RETIRE;
+    }
+    if ( m_queued == 0 )
+    {
+        m_queuelocker.unlock();
+        return TAKE_EMPTY;
+    }
+    //平滑加权轮转(与nginx的upstream相同):每个非空通道的当前值加上自己的权重,取当前值最大的通道
+    //,它的当前值再减去非空通道的权重之和。权重为8:4:1时13次出队中三个通道依次得到8、4、1次,且交错分布
+    int lane = -1;
+    int total = 0;
+    for ( int i = 0; i < LANES; ++i )
+    {
+        //空的通道不积累额度,重新有任务时从0开始
+        if ( m_workqueue[i].empty() )
+        {
+            m_current[i] = 0;
+            continue;
+        }
+        m_current[i] += m_weights[i];
+        total += m_weights[i];
+        if ( lane < 0 || m_current[i] > m_current[ lane ] )
+        {
+            lane = i;
+        }
+    }
+    m_current[ lane ] -= total;
+    t = m_workqueue[ lane ].front();
+    m_workqueue[ lane ].pop_front();
+    --m_queued;
+    __atomic_sub_fetch( &m_pending, 1, __ATOMIC_SEQ_CST );
+    long long wait_ns = monotonic_ns() - t.enqueue_ns;
+    m_wait_ns += wait_ns;
+    ++m_dequeued;
+    m_queuelocker.unlock();
+    metrics::observe( ( HISTOGRAM_ID )( LANE_HIGH_QUEUE_US + t.lane ), wait_ns / 1000 );
+    return TAKE_TASK;
+}
+
+template< typename T >
+bool threadpool< T >::spin( int spin_ns )
+{
+    long long deadline = monotonic_ns() + spin_ns;
+    while( true )
+    {
+        //每轮询64次才读一次时钟
+        for( int i = 0; i < 64; ++i )
+        {
+            if( has_work() )
+            {
+                return true;
+            }
+            cpu_relax();
+        }
+        if( monotonic_ns() >= deadline )
+        {
+            return false;
+        }
+    }
+}
+
+template< typename T >
+void threadpool< T >::run( slot* self )
+{
+    int spin_ns = __atomic_load_n( &m_max_spin_ns, __ATOMIC_RELAXED );
+    while ( true )
+    {
+        task t;
+        TAKE_RESULT result = take( t );
+        if( result == TAKE_STOP || result == TAKE_RETIRE )
+        {
+            break;
+        }
+        if( result == TAKE_TASK )
+        {
+            //队列中还有任务而没有醒着的线程时,接力唤醒下一个线程,避免任务排在本线程之后
+            if( __atomic_load_n( &m_pending, __ATOMIC_SEQ_CST ) > 0 && m_parker.spinners() == 0
+                    && m_parker.unpark_one() )
+            {
+                metrics::add( POOL_WAKEUPS, 1 );
+            }
+            if ( ! t.request )
+            {
+                continue;
+            }
+            long long start = monotonic_ns();
+            t.request->process();
+            __atomic_add_fetch( &m_busy_ns, monotonic_ns() - start, __ATOMIC_RELAXED );
+            continue;
+        }
+
+        //队列为空:先自旋,再休眠
+        int max_spin_ns = __atomic_load_n( &m_max_spin_ns, __ATOMIC_RELAXED );
+        bool spinning = max_spin_ns > 0
+                && m_parker.try_spin( __atomic_load_n( &m_max_spinners, __ATOMIC_RELAXED ) );
+        if( spinning )
+        {
+            spin_ns = spin_ns < MIN_SPIN_NS ? MIN_SPIN_NS : ( spin_ns > max_spin_ns ? max_spin_ns : spin_ns );
+            if( spin( spin_ns ) )
+            {
+                m_parker.stop_spin();
+                spin_ns *= 2;
+                metrics::add( POOL_SPIN_HITS, 1 );
+                continue;
+            }
+            spin_ns /= 2;
+        }
+
+        //先登记为休眠者再退出自旋状态,通知者看到自旋者为0时一定能看到这个休眠者
+        int seq = m_parker.prepare_park();
+        if( spinning )
+        {
+            m_parker.stop_spin();
+        }
+        if( has_work() )
+        {
+            m_parker.cancel_park();
+            continue;
+        }
+        metrics::add( POOL_PARKS, 1 );
+        m_parker.park( seq );
+    }
+
+    //通知控制线程回收本线程
+    __atomic_store_n( &self->state, SLOT_EXITED, __ATOMIC_RELEASE );
+}
+
+template< typename T >
+void* threadpool< T >::manager( void* arg )
 {
     threadpool* pool = ( threadpool* )arg;
-    pool->run();
-    return pool;//这里返回NULL也可以,因为并没有使用这个返回值
+    pool->manage();
+    return pool;
 }
 
 template< typename T >
-void threadpool< T >::run()
+void threadpool< T >::manage()
 {
-    while ( ! m_stop )
+    int high_rounds = 0;//排队时间连续偏高的周期数
+    int low_rounds = 0;//排队时间和利用率连续偏低的周期数
+    long long last = monotonic_ns();
+    while ( ! stopping() )
     {
-        m_queuestat.wait();
+        usleep( SIZING_INTERVAL_MS * 1000 );
+        long long now = monotonic_ns();
+
         m_queuelocker.lock();
-        if ( m_workqueue.empty() )
+        reap();
+        long long wait_ns = m_wait_ns;
+        long long dequeued = m_dequeued;
+        int depth = m_queued;
+        int threads = m_thread_number - m_retire;
+        m_wait_ns = 0;
+        m_dequeued = 0;
+        m_queuelocker.unlock();
+        long long busy_ns = __atomic_exchange_n( &m_busy_ns, 0, __ATOMIC_RELAXED );
+
+        //队列中还未出队的任务也计入排队时间,避免所有线程都被阻塞时统计不到等待
+        long long avg_wait_us = dequeued ? wait_ns / dequeued / 1000 : 0;
+        if( depth > 0 && avg_wait_us < WAIT_HIGH_US && depth >= threads )
         {
+            avg_wait_us = WAIT_HIGH_US;
+        }
+        int utilization = threads > 0 ? busy_ns * 100 / ( ( now - last ) * threads ) : 0;
+        last = now;
+
+        metrics::set( POOL_QUEUE_DEPTH, depth );
+        metrics::set( POOL_WAIT_US, avg_wait_us );
+        metrics::set( POOL_UTILIZATION, utilization );
+
+        high_rounds = ( avg_wait_us >= WAIT_HIGH_US ) ? high_rounds + 1 : 0;
+        low_rounds = ( avg_wait_us <= WAIT_LOW_US && utilization < UTIL_LOW_PERCENT ) ? low_rounds + 1 : 0;
+
+        if( high_rounds >= GROW_AFTER && threads < m_max_threads )
+        {
+            int grow = threads / 4 > 1 ? threads / 4 : 1;
+            m_queuelocker.lock();
+            int added = 0;
+            while( added < grow && m_thread_number < m_max_threads && spawn() )
+            {
+                ++added;
+            }
             m_queuelocker.unlock();
-            continue;
+            if( added > 0 )
+            {
+                metrics::add( POOL_GROWS, 1 );
+                printf( "threadpool grows to %d threads, average queue wait %lldus\n", threads + added, avg_wait_us );
+            }
+            high_rounds = 0;
         }
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-        if ( ! request )
+        else if( low_rounds >= SHRINK_AFTER && threads > m_min_threads )
         {
-            continue;
+            m_queuelocker.lock();
+            __atomic_add_fetch( &m_retire, 1, __ATOMIC_SEQ_CST );
+            m_queuelocker.unlock();
+            m_parker.unpark_one();
+            metrics::add( POOL_SHRINKS, 1 );
+            printf( "threadpool shrinks to %d threads, utilization %d%%\n", threads - 1, utilization );
+            low_rounds = 0;
         }
-        request->process();
     }
 }
 
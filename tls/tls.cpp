@@ -0,0 +1,277 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include "tls.h"
+#include "../metrics/metrics.h"
+#ifdef WEBSERVER_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+SSL_CTX* tls::s_ctx = NULL;
+
+#ifdef WEBSERVER_TLS
+
+bool tls::configure( const char* cert, const char* key, bool ktls )
+{
+    if( ! cert || ! *cert )
+    {
+        if( s_ctx )
+        {
+            SSL_CTX_free( s_ctx );
+            s_ctx = NULL;
+        }
+        return true;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new( TLS_server_method() );
+    if( ! ctx )
+    {
+        return false;
+    }
+    //私钥可以和证书链放在同一个文件中
+    if( SSL_CTX_use_certificate_chain_file( ctx, cert ) != 1
+        || SSL_CTX_use_PrivateKey_file( ctx, ( key && *key ) ? key : cert, SSL_FILETYPE_PEM ) != 1
+        || SSL_CTX_check_private_key( ctx ) != 1 )
+    {
+        printf( "load tls certificate %s failed\n", cert );
+        ERR_print_errors_fp( stdout );
+        SSL_CTX_free( ctx );
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+    //TLS 1.2下优先选择内核支持的AES-GCM,TLS 1.3的默认顺序已经是AES-GCM优先
+    SSL_CTX_set_cipher_list( ctx, "ECDHE+AESGCM:ECDHE+CHACHA20:HIGH:!aNULL:!MD5" );
+    //SSL_write允许只写出一部分,重试时缓冲区可以移动(writev调整了iovec);空闲连接释放读写缓冲区
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                      | SSL_MODE_RELEASE_BUFFERS );
+    //客户端不发送close_notify直接关闭连接很常见,当作正常关闭
+    SSL_CTX_set_options( ctx, SSL_OP_IGNORE_UNEXPECTED_EOF );
+    if( ktls )
+    {
+        SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS );
+    }
+
+    //已经建立的连接各自持有旧SSL_CTX的引用,不受影响
+    if( s_ctx )
+    {
+        SSL_CTX_free( s_ctx );
+    }
+    s_ctx = ctx;
+    return true;
+}
+
+SSL* tls::create( int sockfd )
+{
+    SSL* ssl = SSL_new( s_ctx );
+    if( ! ssl )
+    {
+        return NULL;
+    }
+    SSL_set_fd( ssl, sockfd );
+    SSL_set_accept_state( ssl );
+    //一个响应由多次SSL_write(或kTLS下的send和sendfile)写出,最后一个不满的报文段会被Nagle算法
+    //推迟到对端对前一个报文段的延迟确认之后,约40ms;TLS记录已经按16KB拼接,不需要Nagle再合并
+    int on = 1;
+    setsockopt( sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+    return ssl;
+}
+
+tls::STATE tls::handshake( SSL* ssl )
+{
+    if( ! ssl )
+    {
+        return TLS_ERROR;
+    }
+    //OpenSSL的错误队列是线程局部的,每次调用前清空,否则SSL_get_error可能返回上一次的错误
+    ERR_clear_error();
+    int ret = SSL_do_handshake( ssl );
+    if( ret == 1 )
+    {
+        metrics::add( TLS_HANDSHAKES, 1 );
+        metrics::add( ktls_send( ssl ) ? TLS_KTLS : TLS_USERSPACE, 1 );
+        return TLS_DONE;
+    }
+    switch( SSL_get_error( ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        default:
+            metrics::add( TLS_HANDSHAKE_FAILURES, 1 );
+            return TLS_ERROR;
+    }
+}
+
+bool tls::ktls_send( SSL* ssl )
+{
+#ifndef OPENSSL_NO_KTLS
+    return BIO_get_ktls_send( SSL_get_wbio( ssl ) );
+#else
+    return false;
+#endif
+}
+
+int tls::pending( SSL* ssl )
+{
+    return SSL_pending( ssl );
+}
+
+int tls::read( SSL* ssl, char* buf, int len )
+{
+    ERR_clear_error();
+    int ret = SSL_read( ssl, buf, len );
+    if( ret > 0 )
+    {
+        return ret;
+    }
+    switch( SSL_get_error( ssl, ret ) )
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            errno = ECONNRESET;
+            return -1;
+    }
+}
+
+//一个TLS记录最多携带的明文
+static const size_t RECORD_SIZE = 16384;
+
+long tls::writev( SSL* ssl, const struct iovec* iov, int count )
+{
+    //响应头部和较小的响应体分别SSL_write会产生两个很小的TLS记录,第二个记录被Nagle算法推迟到对端的延迟确认之后
+    //,所以把小的数据块拼接到一个记录大小的缓冲区中;足够一个记录的数据块直接加密,不再复制
+    char buf[ RECORD_SIZE ];
+    long total = 0;
+    int i = 0;
+    size_t off = 0;
+    while( i < count )
+    {
+        const char* data;
+        size_t len;
+        if( iov[i].iov_len - off >= RECORD_SIZE )
+        {
+            data = ( const char* )iov[i].iov_base + off;
+            len = iov[i].iov_len - off > INT_MAX ? INT_MAX : iov[i].iov_len - off;
+        }
+        else
+        {
+            len = 0;
+            for( int j = i; j < count && len < RECORD_SIZE; ++j )
+            {
+                size_t skip = ( j == i ) ? off : 0;
+                size_t n = std::min( iov[j].iov_len - skip, RECORD_SIZE - len );
+                memcpy( buf + len, ( const char* )iov[j].iov_base + skip, n );
+                len += n;
+            }
+            data = buf;
+        }
+        if( len == 0 )
+        {
+            break;
+        }
+
+        ERR_clear_error();
+        int ret = SSL_write( ssl, data, len );
+        if( ret <= 0 )
+        {
+            int err = SSL_get_error( ssl, ret );
+            if( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ )
+            {
+                //下次从同一位置重试,拼接出的数据和这次相同,满足OpenSSL对重试的要求
+                if( total > 0 )
+                {
+                    return total;
+                }
+                errno = EAGAIN;
+            }
+            else
+            {
+                errno = EPIPE;
+            }
+            return -1;
+        }
+        total += ret;
+        //跳过已经写出的数据
+        size_t done = ret;
+        while( i < count && done >= iov[i].iov_len - off )
+        {
+            done -= iov[i].iov_len - off;
+            off = 0;
+            ++i;
+        }
+        off += done;
+    }
+    return total;
+}
+
+void tls::close( SSL* ssl )
+{
+    if( ssl )
+    {
+        ERR_clear_error();
+        SSL_shutdown( ssl );
+        SSL_free( ssl );
+    }
+}
+
+#else
+
+bool tls::configure( const char* cert, const char* key, bool ktls )
+{
+    if( ! cert || ! *cert )
+    {
+        return true;
+    }
+    printf( "built without WEBSERVER_TLS, tls_cert %s ignored\n", cert );
+    return false;
+}
+
+SSL* tls::create( int sockfd )
+{
+    return NULL;
+}
+
+tls::STATE tls::handshake( SSL* ssl )
+{
+    return TLS_ERROR;
+}
+
+bool tls::ktls_send( SSL* ssl )
+{
+    return false;
+}
+
+int tls::pending( SSL* ssl )
+{
+    return 0;
+}
+
+int tls::read( SSL* ssl, char* buf, int len )
+{
+    errno = ECONNRESET;
+    return -1;
+}
+
+long tls::writev( SSL* ssl, const struct iovec* iov, int count )
+{
+    errno = EPIPE;
+    return -1;
+}
+
+void tls::close( SSL* ssl )
+{
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/uio.h>
+
+//与OpenSSL中的定义相同,使用者不需要包含OpenSSL的头文件
+struct ssl_st;
+typedef struct ssl_st SSL;
+struct ssl_ctx_st;
+typedef struct ssl_ctx_st SSL_CTX;
+
+//HTTPS终结:OpenSSL完成握手,之后由OpenSSL通过setsockopt(SOL_TLS)把会话密钥交给内核(kTLS)
+//。发送方向交给内核后,socket上的writev、send和sendfile写出的都是明文,由内核加密成TLS记录
+//,响应路径和明文连接完全相同;内核不支持(没有tls模块、密码套件不支持)时退回到SSL_write在用户态加密
+//。编译时没有定义WEBSERVER_TLS则configure总是失败,enabled()总是false
+class tls
+{
+public:
+    //握手的结果:完成、需要等待可读、需要等待可写、失败
+    enum STATE { TLS_DONE, TLS_WANT_READ, TLS_WANT_WRITE, TLS_ERROR };
+
+    //加载证书和私钥,此后新的连接都使用TLS;cert为NULL或空时关闭TLS。ktls为false时总是在用户态加密
+    //。失败时保留原来的配置。只能由主线程调用
+    static bool configure( const char* cert, const char* key, bool ktls );
+    static bool enabled() { return s_ctx != NULL; }
+
+    //为新接受的连接创建TLS会话,只能由主线程调用
+    static SSL* create( int sockfd );
+    //继续握手,可由任意线程调用
+    static STATE handshake( SSL* ssl );
+    //握手完成后发送方向是否已经交给内核
+    static bool ktls_send( SSL* ssl );
+
+    //和recv相同:返回读到的明文字节数,0表示对端关闭,-1表示出错,errno为EAGAIN时表示暂时没有数据
+    static int read( SSL* ssl, char* buf, int len );
+    //已经解密、还留在OpenSSL缓冲区中的明文字节数。这些数据已经从socket读出,不会再触发EPOLLIN
+    static int pending( SSL* ssl );
+    //和writev相同,在用户态加密,只在发送方向没有交给内核时使用
+    static long writev( SSL* ssl, const struct iovec* iov, int count );
+    //发送close_notify并释放会话
+    static void close( SSL* ssl );
+
+private:
+    static SSL_CTX* s_ctx;
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+//USDT(SystemTap/DTrace风格的用户态静态探针),编译时定义WEBSERVER_USDT才生效
+//。探针在没有被perf或bpftrace附加时只是一条nop指令,附加后可以在生产环境中观察每个请求的各个阶段,例如:
+//  bpftrace -e 'usdt:./webserver:webserver:request_done { @us = hist(arg1 / 1000); }'
+//未定义WEBSERVER_USDT时所有探针展开为空语句,不需要<sys/sdt.h>
+#ifdef WEBSERVER_USDT
+#include <sys/sdt.h>
+#define WS_PROBE1( name, a ) DTRACE_PROBE1( webserver, name, a )
+#define WS_PROBE2( name, a, b ) DTRACE_PROBE2( webserver, name, a, b )
+#define WS_PROBE3( name, a, b, c ) DTRACE_PROBE3( webserver, name, a, b, c )
+#else
+#define WS_PROBE1( name, a ) do {} while( 0 )
+#define WS_PROBE2( name, a, b ) do {} while( 0 )
+#define WS_PROBE3( name, a, b, c ) do {} while( 0 )
+#endif
+
+//探针列表(参数依次为):
+//  read_start(fd)                      收到一个新请求的第一批数据
+//  read_done(fd, bytes)                本轮读取结束,请求交给线程池
+//  dequeue(fd, queue_ns)               工作线程开始处理,queue_ns为排队时间
+//  parse_done(fd, url)                 请求解析完毕,即将定位资源
+//  resolve_done(fd, code)              do_request结束,code为HTTP_CODE
+//  write_eagain(fd, bytes_left)        写响应时socket发送缓冲区已满
+//  request_done(fd, total_ns, status)  响应的最后一个字节已写出
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+#include "probes.h"
+#include "../metrics/metrics.h"
+
+locker request_tracer::s_lock;
+trace_record* request_tracer::s_ring = NULL;
+int request_tracer::s_capacity = 0;
+long request_tracer::s_next = 0;
+long long request_tracer::s_slow_ns = -1;
+int request_tracer::s_sample = 1;
+long request_tracer::s_slow_seen = 0;
+
+void request_tracer::configure( int slow_us, int sample, int capacity )
+{
+    trace_record* ring = NULL;
+    if( slow_us >= 0 && capacity > 0 )
+    {
+        ring = ( trace_record* )calloc( capacity, sizeof( trace_record ) );
+    }
+
+    s_lock.lock();
+    trace_record* old = s_ring;
+    s_ring = ring;
+    s_capacity = ring ? capacity : 0;
+    s_next = 0;
+    s_slow_ns = ring ? slow_us * 1000LL : -1;
+    s_sample = sample > 0 ? sample : 1;
+    s_slow_seen = 0;
+    s_lock.unlock();
+    free( old );
+}
+
+//两个时间戳之间的微秒数,任一阶段没有发生时为0
+static long long span_us( long long from, long long to )
+{
+    return ( from && to > from ) ? ( to - from ) / 1000 : 0;
+}
+
+void request_tracer::finish( const req_trace& t, long long end_ns, int fd, const char* url, int status, long bytes )
+{
+    long long total_ns = t.read_start ? end_ns - t.read_start : 0;
+    WS_PROBE3( request_done, fd, total_ns, status );
+
+    long long read_us = span_us( t.read_start, t.read_end );
+    long long queue_us = span_us( t.read_end, t.dequeue );
+    long long parse_us = span_us( t.dequeue, t.parsed );
+    long long resolve_us = span_us( t.parsed, t.resolved );
+    long long write_us = span_us( t.write_start, end_ns );
+    metrics::observe( REQ_READ_US, read_us );
+    metrics::observe( REQ_QUEUE_US, queue_us );
+    metrics::observe( REQ_PARSE_US, parse_us );
+    metrics::observe( REQ_RESOLVE_US, resolve_us );
+    metrics::observe( REQ_WRITE_US, write_us );
+    metrics::observe( REQ_TOTAL_US, total_ns / 1000 );
+    metrics::observe( ( HISTOGRAM_ID )( LANE_HIGH_TOTAL_US + t.lane ), total_ns / 1000 );
+    metrics::add( REQUESTS, 1 );
+
+    //阈值未启用或请求不慢时不加锁
+    long long slow_ns = __atomic_load_n( &s_slow_ns, __ATOMIC_RELAXED );
+    if( slow_ns < 0 || total_ns < slow_ns )
+    {
+        return;
+    }
+    metrics::add( SLOW_REQUESTS, 1 );
+
+    s_lock.lock();
+    if( s_ring && ( s_slow_seen++ % s_sample ) == 0 )
+    {
+        trace_record& r = s_ring[ s_next++ % s_capacity ];
+        r.end_ns = end_ns;
+        r.fd = fd;
+        r.status = status;
+        r.bytes = bytes;
+        r.read_us = read_us;
+        r.queue_us = queue_us;
+        r.parse_us = parse_us;
+        r.resolve_us = resolve_us;
+        r.write_us = write_us;
+        r.stall_us = t.stall_ns / 1000;
+        r.eagain = t.eagain;
+        r.total_us = total_ns / 1000;
+        snprintf( r.url, sizeof( r.url ), "%s", url ? url : "-" );
+    }
+    s_lock.unlock();
+}
+
+char* request_tracer::render( int* len )
+{
+    int cap = 256;
+    s_lock.lock();
+    long count = s_next < s_capacity ? s_next : s_capacity;
+    cap += count * ( trace_record::URL_LEN + 320 );
+    char* buf = ( char* )malloc( cap );
+    if( ! buf )
+    {
+        s_lock.unlock();
+        *len = 0;
+        return NULL;
+    }
+
+    int used = snprintf( buf, cap, "# slow requests (>= %lld us, 1 in %d), oldest first\n"
+                         "# age_ms fd status bytes read_us queue_us parse_us resolve_us write_us stall_us eagain total_us url\n",
+                         s_slow_ns < 0 ? -1 : s_slow_ns / 1000, s_sample );
+    long long now = monotonic_ns();
+    for( long i = s_next - count; i < s_next; ++i )
+    {
+        const trace_record& r = s_ring[ i % s_capacity ];
+        used += snprintf( buf + used, cap - used, "%lld %d %d %ld %d %d %d %d %d %d %d %d %s\n",
+                          ( now - r.end_ns ) / 1000000, r.fd, r.status, r.bytes, r.read_us, r.queue_us, r.parse_us,
+                          r.resolve_us, r.write_us, r.stall_us, r.eagain, r.total_us, r.url );
+    }
+    s_lock.unlock();
+    *len = used;
+    return buf;
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "../locker/locker.h"
+
+//一个请求在各阶段的单调时间戳(纳秒),随连接对象保存,0表示该阶段未发生
+struct req_trace
+{
+    long long read_start;//收到请求的第一批数据
+    long long read_end;//最后一次读取结束,随即交给线程池
+    long long dequeue;//工作线程开始处理
+    long long parsed;//解析完毕,进入do_request
+    long long resolved;//do_request结束
+    long long write_start;//第一次写响应
+    long long stall_start;//最近一次写返回EAGAIN的时间,0表示当前没有等待
+    long long stall_ns;//等待EPOLLOUT的总时间
+    int eagain;//写响应时遇到EAGAIN的次数
+    int lane;//请求被归入的线程池通道
+
+    void reset()
+    {
+        read_start = read_end = dequeue = parsed = resolved = write_start = stall_start = stall_ns = 0;
+        eagain = 0;
+        lane = 0;
+    }
+};
+
+//慢请求环形缓冲区中的一条记录,各阶段的耗时单位为微秒
+struct trace_record
+{
+    static const int URL_LEN = 96;
+
+    long long end_ns;
+    int fd;
+    int status;
+    long bytes;
+    int read_us;
+    int queue_us;
+    int parse_us;
+    int resolve_us;
+    int write_us;
+    int stall_us;
+    int eagain;
+    int total_us;
+    char url[ URL_LEN ];
+};
+
+//请求耗时追踪:每个请求结束时把各阶段耗时计入直方图,超过阈值的慢请求按采样率记入环形缓冲区
+//,通过handler=trace的路由查看最近的慢请求
+class request_tracer
+{
+public:
+    //slow_us为慢请求阈值(负数表示不记录),sample表示每sample个慢请求记录一个,capacity为环形缓冲区大小
+    static void configure( int slow_us, int sample, int capacity );
+
+    //一个请求的响应已全部写出
+    static void finish( const req_trace& t, long long end_ns, int fd, const char* url, int status, long bytes );
+
+    //把环形缓冲区中的记录按时间顺序输出到malloc分配的缓冲区中,由调用者free
+    static char* render( int* len );
+
+private:
+    static locker s_lock;
+    static trace_record* s_ring;
+    static int s_capacity;
+    static long s_next;//下一条记录的序号
+    static long long s_slow_ns;
+    static int s_sample;
+    static long s_slow_seen;
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "body.h"
+
+void chunked_decoder::reset()
+{
+    m_state = S_SIZE;
+    m_left = 0;
+    m_digits = 0;
+}
+
+static int hex_value( char c )
+{
+    if( c >= '0' && c <= '9' )
+    {
+        return c - '0';
+    }
+    if( c >= 'a' && c <= 'f' )
+    {
+        return c - 'a' + 10;
+    }
+    if( c >= 'A' && c <= 'F' )
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+chunked_decoder::RESULT chunked_decoder::decode( char* buf, int len, int* consumed, int* out_len )
+{
+    int in = 0;
+    int out = 0;
+    RESULT ret = CHUNK_MORE;
+    while( in < len && ret == CHUNK_MORE )
+    {
+        char c = buf[ in ];
+        switch( m_state )
+        {
+            //块大小,其后可以有以';'开始的块扩展
+            case S_SIZE:
+            {
+                int v = hex_value( c );
+                if( v >= 0 )
+                {
+                    //超过15个有效十六进制位的块大小没有意义,也防止溢出;前导的0不限个数(本服务器的块大小一行是16位)
+                    if( m_left >= ( 1L << 56 ) )
+                    {
+                        ret = CHUNK_ERROR;
+                        break;
+                    }
+                    ++m_digits;
+                    m_left = m_left * 16 + v;
+                }
+                else if( m_digits == 0 )
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                else if( c == ';' || c == ' ' || c == '\t' )
+                {
+                    m_state = S_EXT;
+                }
+                else if( c == '\r' )
+                {
+                    m_state = S_SIZE_LF;
+                }
+                else
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                ++in;
+                break;
+            }
+            case S_EXT:
+            {
+                if( c == '\r' )
+                {
+                    m_state = S_SIZE_LF;
+                }
+                else if( c == '\n' )
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                ++in;
+                break;
+            }
+            //块大小一行结束,大小为0的是最后一个块,其后是尾部头部和空行
+            case S_SIZE_LF:
+            {
+                if( c != '\n' )
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                m_digits = 0;
+                m_state = m_left > 0 ? S_DATA : S_TRAILER;
+                ++in;
+                break;
+            }
+            case S_DATA:
+            {
+                long n = len - in < m_left ? len - in : m_left;
+                memmove( buf + out, buf + in, n );
+                in += n;
+                out += n;
+                m_left -= n;
+                if( m_left == 0 )
+                {
+                    m_state = S_DATA_CR;
+                }
+                break;
+            }
+            case S_DATA_CR:
+            case S_DATA_LF:
+            {
+                if( c != ( m_state == S_DATA_CR ? '\r' : '\n' ) )
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                m_state = ( m_state == S_DATA_CR ) ? S_DATA_LF : S_SIZE;
+                ++in;
+                break;
+            }
+            //尾部头部被忽略,只找到结束的空行
+            case S_TRAILER:
+            {
+                m_state = ( c == '\r' ) ? S_END_LF : S_TRAILER_LINE;
+                ++in;
+                break;
+            }
+            case S_TRAILER_LINE:
+            {
+                if( c == '\n' )
+                {
+                    m_state = S_TRAILER;
+                }
+                ++in;
+                break;
+            }
+            case S_END_LF:
+            {
+                if( c != '\n' )
+                {
+                    ret = CHUNK_ERROR;
+                    break;
+                }
+                ++in;
+                ret = CHUNK_DONE;
+                break;
+            }
+        }
+    }
+    *consumed = in;
+    *out_len = out;
+    return ret;
+}
+
+long body_sink::splice_from( int sockfd, long len )
+{
+    errno = EINVAL;
+    return -1;
+}
+
+file_sink* file_sink::create( const std::string& path )
+{
+    file_sink* sink = new file_sink;
+    sink->m_path = path;
+    sink->m_temp = path + ".upload.XXXXXX";
+    std::string temp = sink->m_temp;
+    sink->m_fd = mkostemp( &temp[ 0 ], O_CLOEXEC );
+    if( sink->m_fd < 0 )
+    {
+        int err = errno;
+        delete sink;
+        errno = err;
+        return NULL;
+    }
+    sink->m_temp = temp;
+    //mkstemp创建的文件只有属主可读,上传完成后要能被静态文件路由读取(要求S_IROTH)
+    fchmod( sink->m_fd, 0644 );
+    if( pipe2( sink->m_pipe, O_CLOEXEC | O_NONBLOCK ) < 0 )
+    {
+        int err = errno;
+        delete sink;
+        errno = err;
+        return NULL;
+    }
+    return sink;
+}
+
+file_sink::~file_sink()
+{
+    if( m_fd >= 0 )
+    {
+        close( m_fd );
+        if( ! m_finished )
+        {
+            unlink( m_temp.c_str() );
+        }
+    }
+    if( m_pipe[ 0 ] >= 0 )
+    {
+        close( m_pipe[ 0 ] );
+        close( m_pipe[ 1 ] );
+    }
+}
+
+bool file_sink::write( const char* data, long len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = ::write( m_fd, data, len );
+        if( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( n <= 0 )
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+long file_sink::splice_from( int sockfd, long len )
+{
+    //socket -> 管道,受管道容量(默认64KB)限制;管道 -> 文件,把这次搬进管道的数据全部写出
+    ssize_t n = splice( sockfd, NULL, m_pipe[ 1 ], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    if( n <= 0 )
+    {
+        return n;
+    }
+    ssize_t left = n;
+    while( left > 0 )
+    {
+        ssize_t m = splice( m_pipe[ 0 ], NULL, m_fd, NULL, left, SPLICE_F_MOVE );
+        if( m < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( m <= 0 )
+        {
+            //管道中留有数据,这个文件已经无法完成,返回EIO让调用者放弃请求
+            errno = EIO;
+            return -1;
+        }
+        left -= m;
+    }
+    return n;
+}
+
+bool file_sink::finish()
+{
+    if( rename( m_temp.c_str(), m_path.c_str() ) < 0 )
+    {
+        return false;
+    }
+    m_finished = true;
+    return true;
+}
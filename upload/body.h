@@ -0,0 +1,79 @@
+#ifndef BODY_H
+#define BODY_H
+
+#include <sys/types.h>
+#include <string>
+
+//Transfer-Encoding: chunked的解码器,逐字节的状态机,数据可以在任意位置被分成多段到达
+class chunked_decoder
+{
+public:
+    //解码结果:还需要更多数据、最后一个块和尾部已经结束、编码有误
+    enum RESULT { CHUNK_MORE, CHUNK_DONE, CHUNK_ERROR };
+
+    chunked_decoder() { reset(); }
+    void reset();
+
+    //解码buf中的len个字节,块的内容原地移到buf开头,长度写入out_len
+    //;consumed为使用的输入字节数,返回CHUNK_DONE时其后的数据不属于这个请求体
+    RESULT decode( char* buf, int len, int* consumed, int* out_len );
+
+private:
+    enum STATE { S_SIZE, S_EXT, S_SIZE_LF, S_DATA, S_DATA_CR, S_DATA_LF, S_TRAILER, S_TRAILER_LINE, S_END_LF };
+
+    STATE m_state;
+    //当前块还没有收到的字节数
+    long m_left;
+    //块大小一行中已经读到的十六进制位数
+    int m_digits;
+};
+
+//请求体的去处。接收方只在把已经收到的数据交给它之后才继续读socket,它处理得慢时TCP接收窗口随之关闭,客户端停止发送
+class body_sink
+{
+public:
+    virtual ~body_sink() {}
+
+    //接收len个字节的请求体,返回false表示出错
+    virtual bool write( const char* data, long len ) = 0;
+    //能否用splice把数据从socket直接搬过来,不经过用户态
+    virtual bool can_splice() const { return false; }
+    //从非阻塞的sockfd搬运最多len个字节,返回值和recv相同
+    virtual long splice_from( int sockfd, long len );
+    //请求体已经完整接收,返回false表示保存失败
+    virtual bool finish() { return true; }
+};
+
+//丢弃请求体,用于带请求体的GET
+class discard_sink : public body_sink
+{
+public:
+    virtual bool write( const char* data, long len ) { return true; }
+};
+
+//把请求体写入文件:先写到同一目录下的临时文件,完整接收后rename为目标文件
+//,上传中断时删除临时文件,其他请求不会读到写了一半的文件
+class file_sink : public body_sink
+{
+public:
+    //在path所在目录中创建临时文件,失败时返回NULL并保留errno
+    static file_sink* create( const std::string& path );
+    virtual ~file_sink();
+
+    virtual bool write( const char* data, long len );
+    virtual bool can_splice() const { return true; }
+    virtual long splice_from( int sockfd, long len );
+    virtual bool finish();
+
+private:
+    file_sink() : m_fd( -1 ), m_finished( false ) { m_pipe[ 0 ] = m_pipe[ 1 ] = -1; }
+
+    std::string m_path;
+    std::string m_temp;
+    int m_fd;
+    //socket到文件的splice需要经过一个管道,每次调用返回前管道总是被清空
+    int m_pipe[ 2 ];
+    bool m_finished;
+};
+
+#endif